@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "block_queue.h"
+#include "disk.h"
+
+#define queue_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Collected request */
+struct block_request {
+	size_t block;
+	size_t count;
+	void *buf;
+	int write;
+};
+
+/* Request queue, collecting requests while plugged */
+struct block_queue {
+	struct block_request *requests;
+	int count;
+	int capacity;
+	/* Number of times the queue is plugged */
+	int plugged;
+	/* Whether a request failed since the queue was plugged */
+	int failed;
+	int policy;
+	/* Buffers of the request being dispatched */
+	struct iovec *iov;
+	int iov_capacity;
+};
+
+/* Default queue, and the one the calling thread is bound to, NULL for the
+ * default one */
+static struct block_queue default_queue = { .policy = BLOCK_SCHED_SORT };
+static __thread struct block_queue *bound_queue;
+
+/* Request queue the calling thread works on */
+static struct block_queue *current_queue(void)
+{
+	return bound_queue ? bound_queue : &default_queue;
+}
+
+static int compare_requests(const void *a, const void *b)
+{
+	const struct block_request *r1 = a, *r2 = b;
+
+	return (r1->block > r2->block) - (r1->block < r2->block);
+}
+
+static int submit(size_t block, size_t count, void *buf, int write)
+{
+	return write ? block_write_range(block, count, buf) :
+		block_read_range(block, count, buf);
+}
+
+/* Dispatch the @count requests from @first, which follow each other on disk,
+ * as a single request */
+static int dispatch_merged(struct block_request *first, int count)
+{
+	struct block_queue *queue = current_queue();
+
+	if (count == 1)
+		return submit(first->block, first->count, first->buf,
+			      first->write);
+
+	if (count > queue->iov_capacity) {
+		struct iovec *iov = realloc(queue->iov, count * sizeof(*iov));
+
+		/* Without memory for the buffers, the requests go one by one */
+		if (!iov) {
+			int ret = 0;
+
+			for (int i = 0; i < count; i++)
+				ret |= submit(first[i].block, first[i].count,
+					      first[i].buf, first[i].write);
+			return ret;
+		}
+		queue->iov = iov;
+		queue->iov_capacity = count;
+	}
+	for (int i = 0; i < count; i++) {
+		queue->iov[i].iov_base = first[i].buf;
+		queue->iov[i].iov_len = first[i].count * BLOCK_SIZE;
+	}
+	return first->write ? block_writev(first->block, queue->iov, count) :
+		block_readv(first->block, queue->iov, count);
+}
+
+/* Dispatch all the collected requests */
+static int dispatch(void)
+{
+	struct block_queue *queue = current_queue();
+	struct block_request *r = queue->requests;
+	int ret = 0, len;
+
+	if (queue->policy == BLOCK_SCHED_SORT)
+		qsort(r, queue->count, sizeof(*r), compare_requests);
+
+	for (int i = 0; i < queue->count; i += len) {
+		/* Merge the requests of the same kind on consecutive blocks */
+		for (len = 1; i + len < queue->count; len++) {
+			struct block_request *prev = &r[i + len - 1];
+
+			if (r[i + len].write != r[i].write ||
+			    r[i + len].block != prev->block + prev->count)
+				break;
+		}
+		if (dispatch_merged(&r[i], len))
+			ret = -1;
+	}
+
+	queue->count = 0;
+	return ret;
+}
+
+static int overlaps(size_t block, size_t count)
+{
+	struct block_queue *queue = current_queue();
+
+	for (int i = 0; i < queue->count; i++) {
+		struct block_request *r = &queue->requests[i];
+
+		if (block < r->block + r->count && r->block < block + count)
+			return 1;
+	}
+	return 0;
+}
+
+static int enqueue(size_t block, size_t count, void *buf, int write)
+{
+	struct block_queue *queue = current_queue();
+	struct block_request *r;
+
+	if (!queue->plugged || queue->policy == BLOCK_SCHED_NONE)
+		return submit(block, count, buf, write);
+
+	/* The requests of a block are dispatched in order */
+	if (overlaps(block, count) && dispatch())
+		queue->failed = 1;
+
+	if (queue->count == queue->capacity) {
+		int capacity = queue->capacity ? queue->capacity * 2 : 64;
+
+		r = realloc(queue->requests, capacity * sizeof(*r));
+		if (!r) {
+			queue_error("out of memory");
+			return submit(block, count, buf, write);
+		}
+		queue->requests = r;
+		queue->capacity = capacity;
+	}
+
+	r = &queue->requests[queue->count++];
+	r->block = block;
+	r->count = count;
+	r->buf = buf;
+	r->write = write;
+	return 0;
+}
+
+struct block_queue *block_queue_new(void)
+{
+	struct block_queue *queue = calloc(1, sizeof(*queue));
+
+	if (!queue) {
+		queue_error("out of memory");
+		return NULL;
+	}
+	queue->policy = BLOCK_SCHED_SORT;
+	return queue;
+}
+
+void block_queue_free(struct block_queue *queue)
+{
+	if (!queue)
+		return;
+	free(queue->requests);
+	free(queue->iov);
+	free(queue);
+}
+
+struct block_queue *block_queue_bind(struct block_queue *queue)
+{
+	struct block_queue *prev = bound_queue;
+
+	bound_queue = queue;
+	return prev;
+}
+
+int block_queue_set_policy(int policy)
+{
+	struct block_queue *queue = current_queue();
+
+	if (policy < BLOCK_SCHED_NONE || policy > BLOCK_SCHED_SORT) {
+		queue_error("invalid policy %d", policy);
+		return -1;
+	}
+	if (queue->plugged) {
+		queue_error("queue plugged");
+		return -1;
+	}
+
+	queue->policy = policy;
+	return 0;
+}
+
+int block_queue_get_policy(void)
+{
+	struct block_queue *queue = current_queue();
+
+	return queue->policy;
+}
+
+void block_queue_plug(void)
+{
+	struct block_queue *queue = current_queue();
+
+	if (!queue->plugged++)
+		queue->failed = 0;
+}
+
+int block_queue_unplug(void)
+{
+	struct block_queue *queue = current_queue();
+
+	if (!queue->plugged) {
+		queue_error("queue not plugged");
+		return -1;
+	}
+	if (--queue->plugged)
+		return 0;
+
+	if (dispatch())
+		queue->failed = 1;
+	return queue->failed ? -1 : 0;
+}
+
+int block_queue_flush(void)
+{
+	struct block_queue *queue = current_queue();
+
+	if (dispatch()) {
+		queue->failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+int block_queue_write(size_t block, size_t count, const void *buf)
+{
+	return enqueue(block, count, (void *)buf, 1);
+}
+
+int block_queue_read(size_t block, size_t count, void *buf)
+{
+	return enqueue(block, count, buf, 0);
+}
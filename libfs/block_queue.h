@@ -0,0 +1,140 @@
+#ifndef _BLOCK_QUEUE_H
+#define _BLOCK_QUEUE_H
+
+#include <stddef.h> /* for size_t definition */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Request queue between the file system and the virtual disk. While the queue
+ * is plugged, the requests given to block_queue_read() and block_queue_write()
+ * are only collected; unplugging it dispatches them according to the
+ * scheduling policy, merging the requests of consecutive blocks into single
+ * vectored requests of block_readv() and block_writev().
+ */
+
+/**
+ * enum block_sched - Scheduling policies of the request queue
+ * @BLOCK_SCHED_NONE: every request is dispatched at once, plugged or not
+ * @BLOCK_SCHED_FIFO: the requests are dispatched in the order they came in,
+ *                    the requests that follow each other on disk merged
+ * @BLOCK_SCHED_SORT: the requests are dispatched by increasing block, all the
+ *                    requests of consecutive blocks merged (default)
+ */
+enum block_sched {
+	BLOCK_SCHED_NONE,
+	BLOCK_SCHED_FIFO,
+	BLOCK_SCHED_SORT,
+};
+
+struct block_queue;
+
+/**
+ * block_queue_new - Create a request queue
+ *
+ * The block_queue_*() functions work on a default queue, or on the one the
+ * calling thread is bound to with block_queue_bind(), so that different
+ * threads can collect requests at the same time.
+ *
+ * Return: an unplugged queue with the default scheduling policy, or NULL if
+ * out of memory.
+ */
+struct block_queue *block_queue_new(void);
+
+/**
+ * block_queue_free - Free a request queue
+ * @queue: Queue created by block_queue_new(), unplugged
+ */
+void block_queue_free(struct block_queue *queue);
+
+/**
+ * block_queue_bind - Bind the calling thread to a request queue
+ * @queue: Queue created by block_queue_new(), or NULL for the default queue
+ *
+ * The block_queue_*() calls of the calling thread work on @queue from now on.
+ *
+ * Return: the queue the thread was bound to, NULL for the default one.
+ */
+struct block_queue *block_queue_bind(struct block_queue *queue);
+
+/**
+ * block_queue_set_policy - Set the scheduling policy of the request queue
+ * @policy: Scheduling policy, one of enum block_sched
+ *
+ * Return: -1 if @policy is invalid or if the queue is plugged. 0 otherwise.
+ */
+int block_queue_set_policy(int policy);
+
+/**
+ * block_queue_get_policy - Get the scheduling policy of the request queue
+ *
+ * Return: the scheduling policy, one of enum block_sched
+ */
+int block_queue_get_policy(void);
+
+/**
+ * block_queue_plug - Plug the request queue
+ *
+ * Collect the requests instead of dispatching them, until the queue is
+ * unplugged as many times as it was plugged.
+ */
+void block_queue_plug(void);
+
+/**
+ * block_queue_unplug - Unplug the request queue
+ *
+ * Dispatch the collected requests once the queue is unplugged as many times as
+ * it was plugged.
+ *
+ * Return: -1 if a request collected since the queue was plugged failed. 0
+ * otherwise.
+ */
+int block_queue_unplug(void);
+
+/**
+ * block_queue_flush - Dispatch the collected requests now
+ *
+ * Dispatch the requests collected so far even if the queue stays plugged, for
+ * the callers that need them done before going on, whoever plugged the queue.
+ *
+ * Return: -1 if one of the requests failed. 0 otherwise.
+ */
+int block_queue_flush(void);
+
+/**
+ * block_queue_write - Queue a write of consecutive blocks
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf in the blocks @block to @block + @count - 1
+ * at once if the queue is not plugged, otherwise once the queue is unplugged:
+ * @buf must not change until then. A request overlapping one collected
+ * already dispatches the queue first, so that the requests of a block are
+ * never reordered.
+ *
+ * Return: -1 if the request was dispatched at once and failed. 0 otherwise.
+ */
+int block_queue_write(size_t block, size_t count, const void *buf);
+
+/**
+ * block_queue_read - Queue a read of consecutive blocks
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the blocks @block to @block + @count - 1 into buffer @buf at once if
+ * the queue is not plugged, otherwise once the queue is unplugged: @buf must
+ * not be used until then.
+ *
+ * Return: -1 if the request was dispatched at once and failed. 0 otherwise.
+ */
+int block_queue_read(size_t block, size_t count, void *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BLOCK_QUEUE_H */
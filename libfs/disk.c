@@ -1,11 +1,19 @@
+#include <ctype.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "fs_stats.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
@@ -13,19 +21,1069 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Huge page size the RAM disks are rounded up to, when available */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Stripe unit of the stripe sets that do not give one, in blocks */
+#define STRIPE_UNIT_DEFAULT 16
+
+/* Number of blocks compared at once when resynchronizing a mirror */
+#define RESYNC_CHUNK 256
+
+/* Suffix of the state file of a mirror replica, which holds its generation */
+#define MIRROR_STATE_SUFFIX ".gen"
+
+/* glibc only defines IOV_MAX with _GNU_SOURCE or _XOPEN_SOURCE */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct disk;
+
+/* Disk backend operations, on @count consecutive blocks from @block, which
+ * are known to be in bounds. The vectored operations, on the consecutive
+ * blocks from @block held by the buffers of @iov, are optional, and so is the
+ * flush of the blocks written to stable storage. */
+struct disk_ops {
+	int (*read)(struct disk *disk, size_t block, size_t count, void *buf);
+	int (*write)(struct disk *disk, size_t block, size_t count,
+		     const void *buf);
+	int (*readv)(struct disk *disk, size_t block, const struct iovec *iov,
+		     int iovcnt);
+	int (*writev)(struct disk *disk, size_t block, const struct iovec *iov,
+		      int iovcnt);
+	int (*sync)(struct disk *disk);
+	void (*close)(struct disk *disk);
+};
+
+/* RAM disk, which lives until it is freed, whether it is open or not */
+struct ram_disk {
+	/* Disk name, including %BLOCK_RAM_PREFIX */
+	char *name;
+	/* Blocks */
+	char *mem;
+	/* Size of the mapping holding the blocks */
+	size_t size;
+	/* Block count */
+	size_t bcount;
+	/* Whether the RAM disk is currently open */
+	int open;
+	struct ram_disk *next;
+};
+
+struct stripe_set;
+
+/* Member image file of a stripe set, with the thread running its part of the
+ * multi-member requests */
+struct stripe_member {
+	struct stripe_set *set;
+	/* File descriptor */
+	int fd;
+	pthread_t thread;
+	/* Part of the current request: the buffers of the consecutive blocks of
+	 * the member from @offset, and the result once done */
+	struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+	int write;
+	int ret;
+	/* Whether the part is yet to be done */
+	int busy;
+};
+
+/* Stripe set: block b lives in stripe unit b / unit, the stripe units going
+ * to the members in turn */
+struct stripe_set {
+	struct stripe_member *members;
+	int count;
+	/* Stripe unit, in blocks */
+	size_t unit;
+	/* Protects the requests of the members, and signals their changes */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	/* Serializes the requests, whose parts share the member state */
+	pthread_mutex_t io_lock;
+};
+
+/* Replica of a mirror */
+struct mirror_member {
+	/* File descriptor */
+	int fd;
+	/* Path of the state file, and the generation it held at open */
+	char *state;
+	uint64_t gen;
+	/* Whether the replica failed, and is left out until resynchronized */
+	int failed;
+	/* Number of reads in progress on the replica */
+	unsigned int inflight;
+	/* Block following the last read of the replica */
+	size_t next;
+};
+
+/* Mirror: every block lives in all the replicas. The replicas in use share
+ * a generation, which moves on whenever one is left out, so that the ones
+ * left out fall behind for good, even across opens */
+struct mirror_set {
+	struct mirror_member *members;
+	int count;
+	uint64_t gen;
+};
+
 /* Disk instance description */
 struct disk {
+	/* Backend operations, NULL if no disk is open */
+	const struct disk_ops *ops;
 	/* File descriptor */
 	int fd;
+	/* RAM disk */
+	struct ram_disk *ram;
+	/* Stripe set */
+	struct stripe_set *stripe;
+	/* Mirror */
+	struct mirror_set *mirror;
 	/* Block count */
 	size_t bcount;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Default virtual disk (invalid until opened), and the one the calling thread
+ * is bound to, NULL for the default one */
+static struct disk default_disk = { .fd = INVALID_FD };
+static __thread struct disk *bound_disk;
+
+/* All the RAM disks, and the lock protecting the list and their open flags
+ * from the threads working on different disks */
+static struct ram_disk *ram_disks;
+static pthread_mutex_t ram_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Virtual disk the calling thread works on */
+static struct disk *current_disk(void)
+{
+	return bound_disk ? bound_disk : &default_disk;
+}
+
+static int file_read(struct disk *d, size_t block, size_t count, void *buf)
+{
+	/* Perform the actual read from the disk image, at the specified block
+	 * number (without moving the shared file offset) */
+	if (pread(d->fd, buf, count * BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pread");
+		return -1;
+	}
+	return 0;
+}
+
+static int file_write(struct disk *d, size_t block, size_t count,
+		      const void *buf)
+{
+	/* Perform the actual write into the disk image, at the specified block
+	 * number (without moving the shared file offset) */
+	if (pwrite(d->fd, buf, count * BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pwrite");
+		return -1;
+	}
+	return 0;
+}
+
+/* Read or write the buffers of @iov from @offset of file @fd, with as few
+ * system calls as possible */
+static int io_vec(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		  int write)
+{
+	ssize_t ret;
+	int n;
+
+	while (iovcnt) {
+		n = (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt;
+		ret = write ? pwritev(fd, iov, n, offset) :
+			preadv(fd, iov, n, offset);
+		if (ret < 0) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		for (int i = 0; i < n; i++)
+			offset += iov[i].iov_len;
+		iov += n;
+		iovcnt -= n;
+	}
+	return 0;
+}
+
+static int file_readv(struct disk *d, size_t block, const struct iovec *iov,
+		      int iovcnt)
+{
+	return io_vec(d->fd, iov, iovcnt, block * BLOCK_SIZE, 0);
+}
+
+static int file_writev(struct disk *d, size_t block, const struct iovec *iov,
+		       int iovcnt)
+{
+	return io_vec(d->fd, iov, iovcnt, block * BLOCK_SIZE, 1);
+}
+
+static int file_sync(struct disk *d)
+{
+	if (fdatasync(d->fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+	return 0;
+}
+
+static void file_close(struct disk *d)
+{
+	close(d->fd);
+	d->fd = INVALID_FD;
+}
+
+static const struct disk_ops file_ops = {
+	.read = file_read,
+	.write = file_write,
+	.readv = file_readv,
+	.writev = file_writev,
+	.sync = file_sync,
+	.close = file_close,
+};
+
+static int ram_read(struct disk *d, size_t block, size_t count, void *buf)
+{
+	memcpy(buf, d->ram->mem + block * BLOCK_SIZE, count * BLOCK_SIZE);
+	return 0;
+}
+
+static int ram_write(struct disk *d, size_t block, size_t count,
+		     const void *buf)
+{
+	memcpy(d->ram->mem + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+	return 0;
+}
+
+static void ram_close(struct disk *d)
+{
+	pthread_mutex_lock(&ram_lock);
+	d->ram->open = 0;
+	pthread_mutex_unlock(&ram_lock);
+	d->ram = NULL;
+}
+
+static const struct disk_ops ram_ops = {
+	.read = ram_read,
+	.write = ram_write,
+	.close = ram_close,
+};
+
+/* Run the part of a request of a stripe set member */
+static int member_io(struct stripe_member *m)
+{
+	return io_vec(m->fd, m->iov, m->iovcnt, m->offset, m->write);
+}
+
+static void *member_thread(void *arg)
+{
+	struct stripe_member *m = arg;
+	struct stripe_set *set = m->set;
+	int ret;
+
+	pthread_mutex_lock(&set->lock);
+	while (1) {
+		while (!m->busy && !set->stop)
+			pthread_cond_wait(&set->cond, &set->lock);
+		if (set->stop)
+			break;
+		pthread_mutex_unlock(&set->lock);
+		ret = member_io(m);
+		pthread_mutex_lock(&set->lock);
+		m->ret = ret;
+		m->busy = 0;
+		pthread_cond_broadcast(&set->cond);
+	}
+	pthread_mutex_unlock(&set->lock);
+	return NULL;
+}
+
+/* Split a request into the consecutive blocks of each member, and run the
+ * parts of all the members at once */
+static int stripe_io(struct disk *d, size_t block, size_t count, void *buf,
+		     int write)
+{
+	struct stripe_set *set = d->stripe;
+	size_t unit = set->unit, end = block + count, b, len;
+	/* a member gets at most one piece more than its share of stripe units */
+	int max = count / unit / set->count + 2, first = -1, ret = 0;
+	struct iovec *iov = malloc(set->count * max * sizeof(*iov));
+
+	if (!iov) {
+		block_error("out of memory");
+		return -1;
+	}
+	pthread_mutex_lock(&set->io_lock);
+	for (int i = 0; i < set->count; i++) {
+		set->members[i].iov = iov + i * max;
+		set->members[i].iovcnt = 0;
+		set->members[i].write = write;
+	}
+
+	/* the pieces of a member follow each other in its image file */
+	for (b = block; b < end; b += len) {
+		size_t stripe = b / unit;
+		struct stripe_member *m = &set->members[stripe % set->count];
+
+		len = unit - b % unit;
+		if (len > end - b)
+			len = end - b;
+		if (!m->iovcnt)
+			m->offset = ((stripe / set->count) * unit + b % unit) *
+				BLOCK_SIZE;
+		m->iov[m->iovcnt].iov_base = (char *)buf + (b - block) *
+			BLOCK_SIZE;
+		m->iov[m->iovcnt].iov_len = len * BLOCK_SIZE;
+		m->iovcnt++;
+	}
+
+	/* the calling thread runs the part of the first member itself */
+	pthread_mutex_lock(&set->lock);
+	for (int i = 0; i < set->count; i++) {
+		if (!set->members[i].iovcnt)
+			continue;
+		if (first == -1)
+			first = i;
+		else
+			set->members[i].busy = 1;
+	}
+	pthread_cond_broadcast(&set->cond);
+	pthread_mutex_unlock(&set->lock);
+
+	ret = member_io(&set->members[first]);
+
+	pthread_mutex_lock(&set->lock);
+	for (int i = first + 1; i < set->count; i++) {
+		while (set->members[i].busy)
+			pthread_cond_wait(&set->cond, &set->lock);
+		if (set->members[i].iovcnt && set->members[i].ret)
+			ret = -1;
+	}
+	pthread_mutex_unlock(&set->lock);
+	pthread_mutex_unlock(&set->io_lock);
+
+	free(iov);
+	return ret;
+}
+
+static int stripe_read(struct disk *d, size_t block, size_t count, void *buf)
+{
+	return stripe_io(d, block, count, buf, 0);
+}
+
+static int stripe_write(struct disk *d, size_t block, size_t count,
+			const void *buf)
+{
+	return stripe_io(d, block, count, (void *)buf, 1);
+}
+
+static int stripe_sync(struct disk *d)
+{
+	struct stripe_set *set = d->stripe;
+	int ret = 0;
+
+	for (int i = 0; i < set->count; i++) {
+		if (fdatasync(set->members[i].fd)) {
+			perror("fdatasync");
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/* Stop the threads of the first @threads members but the first one, which
+ * has none, and release the stripe set */
+static void free_stripe(struct stripe_set *set, int threads)
+{
+	pthread_mutex_lock(&set->lock);
+	set->stop = 1;
+	pthread_cond_broadcast(&set->cond);
+	pthread_mutex_unlock(&set->lock);
+	for (int i = 0; i < set->count; i++) {
+		if (i && i < threads)
+			pthread_join(set->members[i].thread, NULL);
+		if (set->members[i].fd != INVALID_FD)
+			close(set->members[i].fd);
+	}
+	pthread_mutex_destroy(&set->lock);
+	pthread_cond_destroy(&set->cond);
+	pthread_mutex_destroy(&set->io_lock);
+	free(set->members);
+	free(set);
+}
+
+static void stripe_close(struct disk *d)
+{
+	free_stripe(d->stripe, d->stripe->count);
+	d->stripe = NULL;
+}
+
+static const struct disk_ops stripe_ops = {
+	.read = stripe_read,
+	.write = stripe_write,
+	.sync = stripe_sync,
+	.close = stripe_close,
+};
+
+static int is_stripe(const char *diskname)
+{
+	return !strncmp(diskname, BLOCK_STRIPE_PREFIX,
+			strlen(BLOCK_STRIPE_PREFIX));
+}
+
+/* Parse the comma-separated image files @p of the members of virtual disk
+ * @diskname, which are returned as a NULL-terminated array, to be freed with
+ * free_paths() */
+static char **parse_paths(const char *diskname, const char *p)
+{
+	char *names, **paths;
+	int count = 1;
+
+	names = strdup(p);
+	for (const char *c = p; *c; c++)
+		count += (*c == ',');
+	/* the names are kept past the end of the array */
+	paths = calloc(count + 2, sizeof(*paths));
+	if (!names || !paths) {
+		block_error("out of memory");
+		free(names);
+		free(paths);
+		return NULL;
+	}
+	paths[count + 1] = names;
+	count = 0;
+	for (char *name = strtok(names, ","); name; name = strtok(NULL, ","))
+		paths[count++] = name;
+	if (!count) {
+		block_error("no member image files in '%s'", diskname);
+		free(names);
+		free(paths);
+		return NULL;
+	}
+	return paths;
+}
+
+/* Parse the stripe unit and the member image files of stripe set @diskname */
+static char **parse_stripe(const char *diskname, size_t *unit)
+{
+	const char *p = diskname + strlen(BLOCK_STRIPE_PREFIX);
+
+	*unit = STRIPE_UNIT_DEFAULT;
+	if (isdigit(*p)) {
+		char *end;
+
+		*unit = strtoul(p, &end, 10);
+		if (*end != ':' || !*unit) {
+			block_error("invalid stripe unit in '%s'", diskname);
+			return NULL;
+		}
+		p = end + 1;
+	}
+
+	return parse_paths(diskname, p);
+}
+
+static void free_paths(char **paths)
+{
+	char **p = paths;
+
+	while (*p)
+		p++;
+	/* strtok() may have found fewer names than there are commas */
+	while (!*p)
+		p++;
+	free(*p);
+	free(paths);
+}
+
+/* Number of the blocks of a stripe set of @bcount blocks held by member @i */
+static size_t member_bcount(size_t bcount, size_t unit, int count, int i)
+{
+	size_t row = unit * count;
+	size_t rest = bcount % row;
+
+	if (rest <= i * unit)
+		rest = 0;
+	else if (rest - i * unit > unit)
+		rest = unit;
+	else
+		rest -= i * unit;
+	return bcount / row * unit + rest;
+}
+
+static int create_stripe(const char *diskname, size_t bcount)
+{
+	size_t unit;
+	char **paths = parse_stripe(diskname, &unit);
+	int count = 0, ret = 0, fd;
+
+	if (!paths)
+		return -1;
+	while (paths[count])
+		count++;
+
+	/* Every member is a sparse file holding its share of the blocks */
+	for (int i = 0; i < count && !ret; i++) {
+		if ((fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror("open");
+			ret = -1;
+			break;
+		}
+		if (ftruncate(fd, member_bcount(bcount, unit, count, i) *
+			      BLOCK_SIZE)) {
+			perror("ftruncate");
+			ret = -1;
+		}
+		close(fd);
+	}
+
+	free_paths(paths);
+	return ret;
+}
+
+static int open_stripe(const char *diskname)
+{
+	struct disk *disk = current_disk();
+	struct stripe_set *set;
+	struct stat st;
+	size_t unit, bcount = 0;
+	char **paths = parse_stripe(diskname, &unit);
+	int count = 0, threads = 0;
+
+	if (!paths)
+		return -1;
+	while (paths[count])
+		count++;
+
+	set = calloc(1, sizeof(*set));
+	if (set)
+		set->members = calloc(count, sizeof(*set->members));
+	if (!set || !set->members) {
+		block_error("out of memory");
+		free(set);
+		free_paths(paths);
+		return -1;
+	}
+	set->count = count;
+	set->unit = unit;
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_cond_init(&set->cond, NULL);
+	pthread_mutex_init(&set->io_lock, NULL);
+	for (int i = 0; i < count; i++) {
+		set->members[i].set = set;
+		set->members[i].fd = INVALID_FD;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if ((set->members[i].fd = open(paths[i], O_RDWR, 0644)) < 0) {
+			perror("open");
+			goto error;
+		}
+		if (fstat(set->members[i].fd, &st)) {
+			perror("fstat");
+			goto error;
+		}
+		if (st.st_size % BLOCK_SIZE != 0) {
+			block_error("size '%zu' is not multiple of '%d'",
+				    st.st_size, BLOCK_SIZE);
+			goto error;
+		}
+		bcount += st.st_size / BLOCK_SIZE;
+	}
+
+	/* The members should hold their shares of the blocks of the set */
+	for (int i = 0; i < count; i++) {
+		fstat(set->members[i].fd, &st);
+		if (st.st_size / BLOCK_SIZE !=
+		    member_bcount(bcount, unit, count, i)) {
+			block_error("'%s' does not belong to '%s'", paths[i],
+				    diskname);
+			goto error;
+		}
+	}
+
+	for (threads = 1; threads < count; threads++) {
+		if (pthread_create(&set->members[threads].thread, NULL,
+				   member_thread, &set->members[threads])) {
+			block_error("cannot create thread");
+			goto error;
+		}
+	}
+
+	free_paths(paths);
+	disk->stripe = set;
+	disk->bcount = bcount;
+	disk->ops = &stripe_ops;
+
+	return 0;
+
+error:
+	free_stripe(set, threads);
+	free_paths(paths);
+	return -1;
+}
+
+/* Pick the replica to read @block from: the least busy one, and among them the
+ * one whose last read ended closest to @block, so that each replica serves a
+ * region of the disk of its own */
+static struct mirror_member *pick_replica(struct mirror_set *set, size_t block)
+{
+	struct mirror_member *best = NULL;
+	size_t dist, best_dist = 0;
+	unsigned int inflight;
+
+	for (int i = 0; i < set->count; i++) {
+		struct mirror_member *m = &set->members[i];
+
+		if (m->failed)
+			continue;
+		inflight = __atomic_load_n(&m->inflight, __ATOMIC_RELAXED);
+		dist = (block > m->next) ? block - m->next : m->next - block;
+		if (!best || inflight < best->inflight ||
+		    (inflight == best->inflight && dist < best_dist)) {
+			best = m;
+			best_dist = dist;
+		}
+	}
+	return best;
+}
+
+/* Path of the state file of replica @path */
+static char *state_path(const char *path)
+{
+	char *state = malloc(strlen(path) + sizeof(MIRROR_STATE_SUFFIX));
+
+	if (state)
+		sprintf(state, "%s%s", path, MIRROR_STATE_SUFFIX);
+	return state;
+}
+
+/* Generation of replica @path, 0 if it has no state file yet */
+static uint64_t read_gen(const char *path)
+{
+	char *state = state_path(path);
+	uint64_t gen = 0;
+	int fd;
+
+	if (state && (fd = open(state, O_RDONLY)) >= 0) {
+		if (pread(fd, &gen, sizeof(gen), 0) != sizeof(gen))
+			gen = 0;
+		close(fd);
+	}
+	free(state);
+	return gen;
+}
+
+/* Store generation @gen in state file @state, on stable storage */
+static int write_gen(const char *state, uint64_t gen)
+{
+	int fd, ret = 0;
+
+	if ((fd = open(state, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(state);
+		return -1;
+	}
+	if (pwrite(fd, &gen, sizeof(gen), 0) != sizeof(gen) ||
+	    fdatasync(fd)) {
+		perror(state);
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
+/* Move the replicas still in use to the next generation */
+static void advance_gen(struct mirror_set *set)
+{
+	uint64_t gen = __atomic_add_fetch(&set->gen, 1, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < set->count; i++) {
+		if (!set->members[i].failed)
+			write_gen(set->members[i].state, gen);
+	}
+}
+
+/* Leave out replica @m, which stays out at the next opens until it is
+ * resynchronized */
+static void fail_replica(struct mirror_set *set, struct mirror_member *m)
+{
+	block_error("replica %d failed, left out until resynchronized",
+		    (int)(m - set->members));
+	m->failed = 1;
+	advance_gen(set);
+}
+
+static int mirror_read(struct disk *d, size_t block, size_t count, void *buf)
+{
+	struct mirror_set *set = d->mirror;
+	struct mirror_member *m;
+	ssize_t ret;
+
+	/* A replica failing the read hands it over to the next one */
+	while ((m = pick_replica(set, block))) {
+		__atomic_add_fetch(&m->inflight, 1, __ATOMIC_RELAXED);
+		ret = pread(m->fd, buf, count * BLOCK_SIZE, block * BLOCK_SIZE);
+		__atomic_sub_fetch(&m->inflight, 1, __ATOMIC_RELAXED);
+		if (ret >= 0) {
+			m->next = block + count;
+			return 0;
+		}
+		perror("pread");
+		fail_replica(set, m);
+	}
+
+	block_error("no replica left");
+	return -1;
+}
+
+static int mirror_write(struct disk *d, size_t block, size_t count,
+			const void *buf)
+{
+	struct mirror_set *set = d->mirror;
+	int written = 0;
+
+	for (int i = 0; i < set->count; i++) {
+		struct mirror_member *m = &set->members[i];
+
+		if (m->failed)
+			continue;
+		if (pwrite(m->fd, buf, count * BLOCK_SIZE,
+			   block * BLOCK_SIZE) < 0) {
+			perror("pwrite");
+			fail_replica(set, m);
+			continue;
+		}
+		written++;
+	}
+
+	if (!written) {
+		block_error("no replica left");
+		return -1;
+	}
+	return 0;
+}
+
+static int mirror_sync(struct disk *d)
+{
+	struct mirror_set *set = d->mirror;
+	int synced = 0;
+
+	for (int i = 0; i < set->count; i++) {
+		struct mirror_member *m = &set->members[i];
+
+		if (m->failed)
+			continue;
+		if (fdatasync(m->fd)) {
+			perror("fdatasync");
+			fail_replica(set, m);
+			continue;
+		}
+		synced++;
+	}
+
+	if (!synced) {
+		block_error("no replica left");
+		return -1;
+	}
+	return 0;
+}
+
+static void free_mirror(struct mirror_set *set)
+{
+	for (int i = 0; i < set->count; i++) {
+		if (set->members[i].fd != INVALID_FD)
+			close(set->members[i].fd);
+		free(set->members[i].state);
+	}
+	free(set->members);
+	free(set);
+}
+
+static void mirror_close(struct disk *d)
+{
+	free_mirror(d->mirror);
+	d->mirror = NULL;
+}
+
+static const struct disk_ops mirror_ops = {
+	.read = mirror_read,
+	.write = mirror_write,
+	.sync = mirror_sync,
+	.close = mirror_close,
+};
+
+static int is_mirror(const char *diskname)
+{
+	return !strncmp(diskname, BLOCK_MIRROR_PREFIX,
+			strlen(BLOCK_MIRROR_PREFIX));
+}
+
+static char **parse_mirror(const char *diskname)
+{
+	return parse_paths(diskname, diskname + strlen(BLOCK_MIRROR_PREFIX));
+}
+
+static int create_mirror(const char *diskname, size_t bcount)
+{
+	char **paths = parse_mirror(diskname);
+	int ret = 0, fd;
+
+	if (!paths)
+		return -1;
+
+	/* Every replica is a sparse file holding all the blocks, and starts
+	 * over from the first generation */
+	for (int i = 0; paths[i]; i++) {
+		char *state = state_path(paths[i]);
+
+		if ((fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror("open");
+			free(state);
+			ret = -1;
+			break;
+		}
+		if (ftruncate(fd, bcount * BLOCK_SIZE)) {
+			perror("ftruncate");
+			ret = -1;
+		}
+		close(fd);
+		if (!ret && (!state || write_gen(state, 0)))
+			ret = -1;
+		free(state);
+		if (ret)
+			break;
+	}
+
+	free_paths(paths);
+	return ret;
+}
+
+static int open_mirror(const char *diskname)
+{
+	struct disk *disk = current_disk();
+	struct mirror_set *set;
+	struct stat st;
+	size_t bcount = 0;
+	char **paths = parse_mirror(diskname);
+	int count = 0, healthy = 0, lost = 0;
+
+	if (!paths)
+		return -1;
+	while (paths[count])
+		count++;
+
+	set = calloc(1, sizeof(*set));
+	if (set)
+		set->members = calloc(count, sizeof(*set->members));
+	if (!set || !set->members) {
+		block_error("out of memory");
+		free(set);
+		free_paths(paths);
+		return -1;
+	}
+	set->count = count;
+	for (int i = 0; i < count; i++) {
+		set->members[i].fd = INVALID_FD;
+		if (!(set->members[i].state = state_path(paths[i]))) {
+			block_error("out of memory");
+			goto error;
+		}
+	}
+
+	/* The mirror opens degraded without the replicas that cannot be
+	 * opened, but the other replicas must agree on the size of the disk */
+	for (int i = 0; i < count; i++) {
+		struct mirror_member *m = &set->members[i];
+
+		if ((m->fd = open(paths[i], O_RDWR, 0644)) < 0 ||
+		    fstat(m->fd, &st)) {
+			perror(paths[i]);
+			block_error("replica %d left out until resynchronized",
+				    i);
+			m->failed = 1;
+			lost++;
+			continue;
+		}
+		if (st.st_size % BLOCK_SIZE != 0 ||
+		    (healthy && (size_t)st.st_size / BLOCK_SIZE != bcount)) {
+			block_error("'%s' does not belong to '%s'", paths[i],
+				    diskname);
+			goto error;
+		}
+		bcount = st.st_size / BLOCK_SIZE;
+		healthy++;
+		m->gen = read_gen(paths[i]);
+		if (m->gen > set->gen)
+			set->gen = m->gen;
+	}
+	if (!healthy) {
+		block_error("no replica left");
+		goto error;
+	}
+	/* The replicas that missed writes are left out as well */
+	for (int i = 0; i < count; i++) {
+		struct mirror_member *m = &set->members[i];
+
+		if (!m->failed && m->gen < set->gen) {
+			block_error("replica %d is out of date, left out until "
+				    "resynchronized", i);
+			m->failed = 1;
+		}
+	}
+	if (lost)
+		advance_gen(set);
+
+	free_paths(paths);
+	disk->mirror = set;
+	disk->bcount = bcount;
+	disk->ops = &mirror_ops;
+
+	return 0;
+
+error:
+	free_mirror(set);
+	free_paths(paths);
+	return -1;
+}
+
+static int is_ram(const char *diskname)
+{
+	return !strncmp(diskname, BLOCK_RAM_PREFIX, strlen(BLOCK_RAM_PREFIX));
+}
+
+static struct ram_disk *find_ram(const char *diskname)
+{
+	struct ram_disk *ram;
+
+	for (ram = ram_disks; ram; ram = ram->next) {
+		if (!strcmp(ram->name, diskname))
+			return ram;
+	}
+	return NULL;
+}
+
+static void unlink_ram(struct ram_disk *ram)
+{
+	struct ram_disk **p;
+
+	for (p = &ram_disks; *p != ram; p = &(*p)->next)
+		;
+	*p = ram->next;
+	munmap(ram->mem, ram->size);
+	free(ram->name);
+	free(ram);
+}
+
+/* Create RAM disk @diskname, replacing the one of the same name if any */
+static struct ram_disk *create_ram(const char *diskname, size_t bcount)
+{
+	struct ram_disk *ram = find_ram(diskname);
+
+	if (ram && ram->open) {
+		block_error("RAM disk '%s' is open", diskname);
+		return NULL;
+	}
+	if (ram)
+		unlink_ram(ram);
+
+	ram = calloc(1, sizeof(*ram));
+	if (!ram || !(ram->name = strdup(diskname))) {
+		block_error("out of memory");
+		free(ram);
+		return NULL;
+	}
+	/* Huge pages if the system has some to spare, otherwise regular pages
+	 * the kernel may still back with transparent huge pages. Either way,
+	 * the blocks read as zeroes. */
+	ram->size = (bcount * BLOCK_SIZE + HUGE_PAGE_SIZE - 1) /
+		HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	ram->mem = mmap(NULL, ram->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ram->mem == MAP_FAILED) {
+		ram->mem = mmap(NULL, ram->size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ram->mem != MAP_FAILED)
+			madvise(ram->mem, ram->size, MADV_HUGEPAGE);
+	}
+	if (ram->mem == MAP_FAILED) {
+		perror("mmap");
+		free(ram->name);
+		free(ram);
+		return NULL;
+	}
+	ram->bcount = bcount;
+	ram->next = ram_disks;
+	ram_disks = ram;
+	return ram;
+}
+
+int block_disk_create(const char *diskname, size_t bcount)
+{
+	int fd;
+
+	if (!diskname || !bcount) {
+		block_error("invalid file diskname or block count");
+		return -1;
+	}
+
+	if (is_ram(diskname)) {
+		pthread_mutex_lock(&ram_lock);
+		fd = create_ram(diskname, bcount) ? 0 : -1;
+		pthread_mutex_unlock(&ram_lock);
+		return fd;
+	}
+	if (is_stripe(diskname))
+		return create_stripe(diskname, bcount);
+	if (is_mirror(diskname))
+		return create_mirror(diskname, bcount);
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Let the file be sparse, unwritten blocks read as zeroes */
+	if (ftruncate(fd, bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static int open_ram(struct disk *disk, const char *diskname)
+{
+	struct ram_disk *ram;
+
+	pthread_mutex_lock(&ram_lock);
+	ram = find_ram(diskname);
+	if (!ram || ram->open) {
+		if (ram)
+			block_error("RAM disk '%s' is open", diskname);
+		else
+			block_error("no RAM disk '%s'", diskname);
+		pthread_mutex_unlock(&ram_lock);
+		return -1;
+	}
+	ram->open = 1;
+	pthread_mutex_unlock(&ram_lock);
+
+	disk->ram = ram;
+	disk->bcount = ram->bcount;
+	disk->ops = &ram_ops;
+
+	return 0;
+}
 
 int block_disk_open(const char *diskname)
 {
+	struct disk *disk = current_disk();
 	int fd;
 	struct stat st;
 
@@ -34,11 +1092,18 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
+	if (disk->ops) {
 		block_error("disk already open");
 		return -1;
 	}
 
+	if (is_ram(diskname))
+		return open_ram(disk, diskname);
+	if (is_stripe(diskname))
+		return open_stripe(diskname);
+	if (is_mirror(diskname))
+		return open_mirror(diskname);
+
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
@@ -56,89 +1121,481 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk->fd = fd;
+	disk->bcount = st.st_size / BLOCK_SIZE;
+	disk->ops = &file_ops;
 
 	return 0;
 }
 
+struct disk *block_disk_new(void)
+{
+	struct disk *disk = calloc(1, sizeof(*disk));
+
+	if (!disk) {
+		block_error("out of memory");
+		return NULL;
+	}
+	disk->fd = INVALID_FD;
+	return disk;
+}
+
+void block_disk_free(struct disk *disk)
+{
+	if (!disk)
+		return;
+	if (disk->ops)
+		disk->ops->close(disk);
+	free(disk);
+}
+
+struct disk *block_disk_bind(struct disk *disk)
+{
+	struct disk *prev = bound_disk;
+
+	bound_disk = disk;
+	return prev;
+}
+
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	struct disk *disk = current_disk();
+
+	if (!disk->ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	disk->ops->close(disk);
 
-	disk.fd = INVALID_FD;
+	disk->ops = NULL;
 
 	return 0;
 }
 
+int block_disk_sync(void)
+{
+	struct disk *disk = current_disk();
+
+	if (!disk->ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* RAM disks have nothing to flush */
+	if (disk->ops->sync && disk->ops->sync(disk))
+		return -1;
+
+	STATS_DISK_SYNC();
+	return 0;
+}
+
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	struct disk *disk = current_disk();
+
+	if (!disk->ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return disk->bcount;
 }
 
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	return block_write_range(block, 1, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_read_range(block, 1, buf);
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	struct disk *disk = current_disk();
+
+	if (!disk->ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block + count > disk->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block + count - 1, disk->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (disk->ops->write(disk, block, count, buf))
+		return -1;
+
+	STATS_BLOCK_WRITE(count);
+	return 0;
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	struct disk *disk = current_disk();
+
+	if (!disk->ops) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block + count > disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block + count - 1, disk->bcount);
 		return -1;
 	}
 
+	if (disk->ops->read(disk, block, count, buf))
+		return -1;
+
+	STATS_BLOCK_READ(count);
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Number of blocks held by the buffers of @iov, or 0 if a buffer does not hold
+ * whole blocks */
+static size_t iov_blocks(const struct iovec *iov, int iovcnt)
 {
-	if (disk.fd == INVALID_FD) {
+	size_t count = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (!iov[i].iov_len || iov[i].iov_len % BLOCK_SIZE)
+			return 0;
+		count += iov[i].iov_len / BLOCK_SIZE;
+	}
+	return count;
+}
+
+/* Check vectored request @iov from @block, and return its number of blocks */
+static size_t check_vec(size_t block, const struct iovec *iov, int iovcnt)
+{
+	struct disk *disk = current_disk();
+	size_t count;
+
+	if (!disk->ops) {
 		block_error("no disk currently open");
-		return -1;
+		return 0;
 	}
 
-	if (block >= disk.bcount) {
+	if (!iov || iovcnt <= 0 || !(count = iov_blocks(iov, iovcnt))) {
+		block_error("invalid buffers");
+		return 0;
+	}
+
+	if (block + count > disk->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block + count - 1, disk->bcount);
+		return 0;
+	}
+	return count;
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	struct disk *disk = current_disk();
+	size_t count = check_vec(block, iov, iovcnt);
+
+	if (!count)
 		return -1;
+
+	/* The backends without vectored writes get a request per buffer */
+	if (disk->ops->writev) {
+		if (disk->ops->writev(disk, block, iov, iovcnt))
+			return -1;
+	} else {
+		for (int i = 0; i < iovcnt; i++) {
+			if (disk->ops->write(disk, block,
+					    iov[i].iov_len / BLOCK_SIZE,
+					    iov[i].iov_base))
+				return -1;
+			block += iov[i].iov_len / BLOCK_SIZE;
+		}
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	STATS_BLOCK_WRITE(count);
+	return 0;
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	struct disk *disk = current_disk();
+	size_t count = check_vec(block, iov, iovcnt);
+
+	if (!count)
 		return -1;
+
+	if (disk->ops->readv) {
+		if (disk->ops->readv(disk, block, iov, iovcnt))
+			return -1;
+	} else {
+		for (int i = 0; i < iovcnt; i++) {
+			if (disk->ops->read(disk, block,
+					   iov[i].iov_len / BLOCK_SIZE,
+					   iov[i].iov_base))
+				return -1;
+			block += iov[i].iov_len / BLOCK_SIZE;
+		}
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	STATS_BLOCK_READ(count);
+	return 0;
+}
+
+int block_ram_disk_load(const char *diskname, const char *filename)
+{
+	struct ram_disk *ram;
+	struct stat st;
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	if (!diskname || !filename || !is_ram(diskname)) {
+		block_error("invalid RAM disk or file name");
 		return -1;
 	}
 
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st) || !st.st_size || st.st_size % BLOCK_SIZE != 0) {
+		block_error("'%s' is not a disk image", filename);
+		close(fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ram_lock);
+	ram = create_ram(diskname, st.st_size / BLOCK_SIZE);
+	if (!ram) {
+		pthread_mutex_unlock(&ram_lock);
+		close(fd);
+		return -1;
+	}
+
+	while (done < st.st_size) {
+		ret = pread(fd, ram->mem + done, st.st_size - done, done);
+		if (ret <= 0) {
+			perror("pread");
+			unlink_ram(ram);
+			pthread_mutex_unlock(&ram_lock);
+			close(fd);
+			return -1;
+		}
+		done += ret;
+	}
+
+	pthread_mutex_unlock(&ram_lock);
+	close(fd);
+
 	return 0;
 }
 
+int block_ram_disk_save(const char *diskname, const char *filename)
+{
+	struct ram_disk *ram;
+	size_t size, done = 0;
+	ssize_t ret;
+	int fd;
+
+	if (!diskname || !filename) {
+		block_error("no such RAM disk");
+		return -1;
+	}
+
+	pthread_mutex_lock(&ram_lock);
+	if (!(ram = find_ram(diskname))) {
+		block_error("no such RAM disk");
+		pthread_mutex_unlock(&ram_lock);
+		return -1;
+	}
+
+	if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		pthread_mutex_unlock(&ram_lock);
+		return -1;
+	}
+
+	size = ram->bcount * BLOCK_SIZE;
+	while (done < size) {
+		ret = pwrite(fd, ram->mem + done, size - done, done);
+		if (ret <= 0) {
+			perror("pwrite");
+			pthread_mutex_unlock(&ram_lock);
+			close(fd);
+			return -1;
+		}
+		done += ret;
+	}
+
+	pthread_mutex_unlock(&ram_lock);
+	return close(fd) ? -1 : 0;
+}
+
+int block_ram_disk_free(const char *diskname)
+{
+	struct ram_disk *ram = NULL;
+	int ret = -1;
+
+	pthread_mutex_lock(&ram_lock);
+	if (!diskname || !(ram = find_ram(diskname))) {
+		block_error("no such RAM disk");
+	} else if (ram->open) {
+		block_error("RAM disk '%s' is open", diskname);
+	} else {
+		unlink_ram(ram);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ram_lock);
+
+	return ret;
+}
+
+int block_disk_remove(const char *diskname)
+{
+	size_t unit;
+	char **paths;
+	int ret = 0;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (is_ram(diskname))
+		return block_ram_disk_free(diskname);
+
+	if (!is_stripe(diskname) && !is_mirror(diskname))
+		return unlink(diskname) ? -1 : 0;
+
+	paths = is_stripe(diskname) ? parse_stripe(diskname, &unit) :
+		parse_mirror(diskname);
+	if (!paths)
+		return -1;
+	for (int i = 0; paths[i]; i++) {
+		if (unlink(paths[i]))
+			ret = -1;
+		if (is_mirror(diskname)) {
+			char *state = state_path(paths[i]);
+
+			if (state)
+				unlink(state);
+			free(state);
+		}
+	}
+	free_paths(paths);
+
+	return ret;
+}
+
+/* Copy the blocks of @src that differ into @dst, of @bcount blocks */
+static int resync_replica(int src, int dst, size_t bcount, char *sbuf,
+			  char *dbuf)
+{
+	size_t len, copied = 0;
+
+	if (ftruncate(dst, bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		return -1;
+	}
+	for (size_t b = 0; b < bcount; b += len) {
+		len = bcount - b;
+		if (len > RESYNC_CHUNK)
+			len = RESYNC_CHUNK;
+		if (pread(src, sbuf, len * BLOCK_SIZE, b * BLOCK_SIZE) < 0 ||
+		    pread(dst, dbuf, len * BLOCK_SIZE, b * BLOCK_SIZE) < 0) {
+			perror("pread");
+			return -1;
+		}
+		for (size_t i = 0; i < len; i++) {
+			if (!memcmp(sbuf + i * BLOCK_SIZE, dbuf + i * BLOCK_SIZE,
+				    BLOCK_SIZE))
+				continue;
+			if (pwrite(dst, sbuf + i * BLOCK_SIZE, BLOCK_SIZE,
+				   (b + i) * BLOCK_SIZE) < 0) {
+				perror("pwrite");
+				return -1;
+			}
+			copied++;
+		}
+	}
+	if (fdatasync(dst)) {
+		perror("fdatasync");
+		return -1;
+	}
+	return copied;
+}
+
+int block_mirror_resync(const char *diskname)
+{
+	struct stat st;
+	char **paths, *sbuf, *dbuf, *state;
+	int src = -1, from = -1, fd, dst, copied, total = 0;
+	uint64_t gen = 0, g;
+
+	if (!diskname || !is_mirror(diskname)) {
+		block_error("invalid mirror diskname");
+		return -1;
+	}
+	if (!(paths = parse_mirror(diskname)))
+		return -1;
+
+	/* The blocks come from the replica of the latest generation */
+	for (int i = 0; paths[i]; i++) {
+		if ((fd = open(paths[i], O_RDONLY)) < 0)
+			continue;
+		g = read_gen(paths[i]);
+		if (src >= 0 && g <= gen) {
+			close(fd);
+			continue;
+		}
+		if (src >= 0)
+			close(src);
+		src = fd;
+		from = i;
+		gen = g;
+	}
+	if (src < 0 || fstat(src, &st)) {
+		block_error("no replica of '%s' can be read", diskname);
+		if (src >= 0)
+			close(src);
+		free_paths(paths);
+		return -1;
+	}
+	sbuf = malloc(RESYNC_CHUNK * BLOCK_SIZE);
+	dbuf = malloc(RESYNC_CHUNK * BLOCK_SIZE);
+	if (!sbuf || !dbuf) {
+		block_error("out of memory");
+		total = -1;
+	}
+
+	/* A lost replica is recreated from scratch, and each one joins the
+	 * generation of the source once up to date */
+	for (int i = 0; paths[i] && total >= 0; i++) {
+		if (i == from)
+			continue;
+		if ((dst = open(paths[i], O_RDWR | O_CREAT, 0644)) < 0) {
+			perror(paths[i]);
+			total = -1;
+			break;
+		}
+		copied = resync_replica(src, dst, st.st_size / BLOCK_SIZE, sbuf,
+					dbuf);
+		total = (copied < 0) ? -1 : total + copied;
+		close(dst);
+		state = state_path(paths[i]);
+		if (total >= 0 && (!state || write_gen(state, gen)))
+			total = -1;
+		free(state);
+	}
+
+	close(src);
+	free(sbuf);
+	free(dbuf);
+	free_paths(paths);
+	return total;
+}
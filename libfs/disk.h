@@ -2,10 +2,72 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/**
+ * Prefix of the names of the virtual disks held in memory (RAM disks) rather
+ * than in a file, such as "mem:scratch"
+ */
+#define BLOCK_RAM_PREFIX "mem:"
+
+/**
+ * Prefix of the names of the virtual disks striped over several image files,
+ * such as "stripe:a.img,b.img" or "stripe:64:a.img,b.img" for a stripe unit of
+ * 64 blocks (16 by default)
+ */
+#define BLOCK_STRIPE_PREFIX "stripe:"
+
+/**
+ * Prefix of the names of the virtual disks mirrored over several image files,
+ * such as "mirror:a.img,b.img"
+ */
+#define BLOCK_MIRROR_PREFIX "mirror:"
+
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks
+ *
+ * Create the virtual disk file @diskname with room for @bcount blocks, or
+ * truncate it to that size if it already exists. All the blocks of the new
+ * virtual disk file read as zeroes. The file is not opened.
+ *
+ * If @diskname starts with %BLOCK_RAM_PREFIX, the virtual disk is a RAM disk
+ * instead, whose blocks are kept in (huge pages of) memory, and which replaces
+ * the RAM disk of the same name if any. A RAM disk lives until it is freed
+ * with block_ram_disk_free() or the program exits, whether it is open or not.
+ *
+ * If @diskname starts with %BLOCK_STRIPE_PREFIX, the virtual disk is a stripe
+ * set instead: its blocks are spread over the image files listed in @diskname,
+ * a stripe unit of consecutive blocks in each image file in turn, and the
+ * image files are created (or truncated) with their share of the blocks. A
+ * request for blocks of several image files reads or writes them all in
+ * parallel, so with image files on different devices, large requests get the
+ * combined bandwidth of the devices.
+ *
+ * If @diskname starts with %BLOCK_MIRROR_PREFIX, the virtual disk is a mirror:
+ * every block is written to all the image files listed in @diskname, its
+ * replicas, which are created (or truncated) with all the blocks. Each read
+ * goes to a single replica, the least busy one and then the one whose last
+ * read ended closest to the block, so concurrent or scattered reads spread
+ * over the replicas. A replica failing a request is left out of the mirror
+ * until it is resynchronized with block_mirror_resync(), the other replicas
+ * serving the request instead. Each replica has a state file, named after it
+ * with the suffix ".gen", which records its generation: the replicas left out
+ * fall behind the others, and stay out when the mirror is opened again.
+ *
+ * Return: -1 if @diskname is invalid, if @bcount is 0, or if the virtual disk
+ * file cannot be created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -15,10 +77,58 @@
  * block_write().
  *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
- * or is already open. 0 otherwise.
+ * or is already open, if there is no RAM disk named @diskname, if the image
+ * files of stripe set @diskname do not form one, or if the replicas of mirror
+ * @diskname differ in size or none of them can be opened. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_remove - Remove virtual disk
+ * @diskname: Name of the virtual disk
+ *
+ * Remove the virtual disk file @diskname, the image files of stripe set or
+ * mirror @diskname, or free RAM disk @diskname.
+ *
+ * Return: -1 if @diskname is invalid, or if the virtual disk cannot be
+ * removed. 0 otherwise.
+ */
+int block_disk_remove(const char *diskname);
+
+struct disk;
+
+/**
+ * block_disk_new - Create a virtual disk handle
+ *
+ * The block_*() functions work on one virtual disk at a time: a default one,
+ * or the one the calling thread is bound to with block_disk_bind(). A handle
+ * is a virtual disk of its own, so that different threads can work on
+ * different virtual disks at the same time.
+ *
+ * Return: a handle with no virtual disk open, or NULL if out of memory.
+ */
+struct disk *block_disk_new(void);
+
+/**
+ * block_disk_free - Free a virtual disk handle
+ * @disk: Handle created by block_disk_new()
+ *
+ * The virtual disk of @disk, if any, is closed first. No thread may be bound
+ * to @disk any more.
+ */
+void block_disk_free(struct disk *disk);
+
+/**
+ * block_disk_bind - Bind the calling thread to a virtual disk handle
+ * @disk: Handle created by block_disk_new(), or NULL for the default virtual
+ *        disk
+ *
+ * The block_*() calls of the calling thread work on @disk from now on.
+ *
+ * Return: the handle the thread was bound to, NULL for the default one.
+ */
+struct disk *block_disk_bind(struct disk *disk);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +136,18 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Flush virtual disk to stable storage
+ *
+ * Wait until the blocks written to the currently open virtual disk so far are
+ * on stable storage, so that they survive a crash. A mirror flushes all its
+ * replicas left, a stripe set all its members.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the flush fails.
+ * 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -60,5 +182,117 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, in a single request.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, in a single request.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_writev - Write consecutive blocks to disk from several buffers
+ * @block: Index of the first block to write to
+ * @iov: Buffers to write in the blocks, each one holding whole blocks
+ * @iovcnt: Number of buffers
+ *
+ * Write the content of the @iovcnt buffers of @iov, in order, in the virtual
+ * disk's blocks starting at @block, in a single request.
+ *
+ * Return: -1 if a buffer does not hold whole blocks, if any of the blocks is
+ * out of bounds or inaccessible, or if the writing operation fails. 0
+ * otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks from disk into several buffers
+ * @block: Index of the first block to read from
+ * @iov: Buffers to be filled with content of blocks, each one holding whole
+ *       blocks
+ * @iovcnt: Number of buffers
+ *
+ * Read the content of virtual disk's blocks starting at @block into the
+ * @iovcnt buffers of @iov, in order, in a single request.
+ *
+ * Return: -1 if a buffer does not hold whole blocks, if any of the blocks is
+ * out of bounds or inaccessible, or if the reading operation fails. 0
+ * otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_ram_disk_load - Load a RAM disk from a disk image
+ * @diskname: Name of the RAM disk, starting with %BLOCK_RAM_PREFIX
+ * @filename: Name of the virtual disk file
+ *
+ * Create the RAM disk @diskname, or replace it if it already exists, as a copy
+ * of the virtual disk file @filename.
+ *
+ * Return: -1 if @diskname is not the name of a RAM disk or is open, if
+ * @filename cannot be read or is not a disk image. 0 otherwise.
+ */
+int block_ram_disk_load(const char *diskname, const char *filename);
+
+/**
+ * block_ram_disk_save - Save a RAM disk into a disk image
+ * @diskname: Name of the RAM disk
+ * @filename: Name of the virtual disk file
+ *
+ * Create the virtual disk file @filename, or truncate it if it already exists,
+ * as a copy of the RAM disk @diskname, which can be open.
+ *
+ * Return: -1 if there is no RAM disk named @diskname, or if @filename cannot
+ * be written. 0 otherwise.
+ */
+int block_ram_disk_save(const char *diskname, const char *filename);
+
+/**
+ * block_ram_disk_free - Free a RAM disk
+ * @diskname: Name of the RAM disk
+ *
+ * Return: -1 if there is no RAM disk named @diskname, or if it is open. 0
+ * otherwise.
+ */
+int block_ram_disk_free(const char *diskname);
+
+/**
+ * block_mirror_resync - Resynchronize the replicas of a mirror
+ * @diskname: Name of the mirror, which must not be open
+ *
+ * Bring the replicas of mirror @diskname up to date with the replica of the
+ * latest generation, by copying the blocks that differ only. A replica that
+ * is missing is recreated. A replica left out of the mirror, because it could
+ * not be opened or after a failure, stays out until it is resynchronized.
+ *
+ * Return: -1 if @diskname is not a mirror, or if a replica cannot be read or
+ * written, otherwise the number of blocks copied.
+ */
+int block_mirror_resync(const char *diskname);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _DISK_H */
 
@@ -1,50 +1,99 @@
+#define _GNU_SOURCE /* for F_OFD_SETLK */
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "block_queue.h"
 #include "disk.h"
 #include "fs.h"
+#include "fs_layout.h"
+#include "fs_stats.h"
 
-#define FAT_EOC 0xFFFF
-
-/* super block data structure */
-struct superblock{
-    char signature[8];
-    uint16_t virtual_disk_amount;
-    uint16_t root_index;
-    uint16_t data_start_index;
-    uint16_t data_amount;
-    uint8_t FAT_amount;
-    uint8_t padding[4079];
-}__attribute__((packed));
+/* tails longer than half a block are not worth packing */
+#define FRAG_PACK_MAX (fs->block_size / 2)
 
-typedef struct superblock* superblock_t;
+/* number of blocks of the virtual disk making a block of the file system */
+#define DISK_BLOCKS (fs->block_size / BLOCK_SIZE)
 
-/* root directory data structure */
-struct rootdir{
-    char filename[16];
-    uint32_t file_size;
-    uint16_t first_index;
-    uint8_t padding[10];
-}__attribute__((packed));
+/* maximum amount of written data waiting in memory for its blocks */
+#define PENDING_MAX (4 * 1024 * 1024)
+
+/* maximum number of data blocks moved at once by the defragmenter */
+#define DEFRAG_CHUNK 256
 
-typedef struct rootdir* rootdir_t;
+/* the metadata changes are committed to the journal once JOURNAL_BATCH
+ * operations were made, or JOURNAL_COMMIT_MSECS went by since the first one */
+#define JOURNAL_BATCH 256
+#define JOURNAL_COMMIT_MSECS 1000
+
+/* default period of the background flusher */
+#define SYNC_PERIOD_MSECS 1000
+
+/* size of the journal, on disks large enough for it */
+#define JOURNAL_SIZE (1024 * 1024)
+
+/* size of the header of the segment of a shared mount, the metadata follows */
+#define SHARED_HEADER_SIZE ((sizeof(struct fs_shared) + 63) & ~(size_t)63)
 
 /* open file table data structure
  * @filename: corresponding file name
  * @open_count: the number of opening times of the file
  * @root_index: the root directory index of this file
+ * @pending: data written past the blocks allocated to the file, kept in memory
+ *           until the blocks get allocated (delayed allocation)
+ * @pending_start: the file offset of the first byte of @pending
+ * @pending_size: the number of bytes in @pending
+ * @pending_spare: whether a free block is reserved along with the ones of
+ *                 @pending for the extent block the file needs once it spans
+ *                 more than one extent
+ * @map: the extents of the data blocks of the file, whatever the on-disk layout
+ * @map_count: the number of extents in @map
+ * @map_partial: whether @map only holds the last extents of the file, the
+ *               first ones are then looked up in the FAT chain when needed
+ * @durability: the durability of the file (enum fs_durability), or -1 for the
+ *              one of the file system
+ * @written: whether the file was written to since it was opened
  */
 struct open_file{
     char filename[16];
     uint8_t open_count;
     uint8_t root_index;
+    void* pending;
+    uint32_t pending_start;
+    uint32_t pending_size;
+    uint8_t pending_spare;
+    struct map_extent* map;
+    int map_count;
+    uint8_t map_partial;
+    int8_t durability;
+    uint8_t written;
 }__attribute__((packed));
 
 typedef struct open_file* open_file_t;
 
+/* block map extent data structure
+ * @block: the number of the first block of the extent within the file
+ * @start: the first data block of the extent
+ * @length: the number of data blocks in the extent
+ */
+struct map_extent{
+    uint32_t block;
+    uint16_t start;
+    uint16_t length;
+};
+
+typedef struct map_extent* map_extent_t;
+
 /* file descriptor table data structure
  * @open_file_index: the cooresponding open file table's index
  * @offset: the offset of this specific file
@@ -56,40 +105,227 @@ struct descriptor{
 
 typedef struct descriptor* descriptor_t;
 
-/* different types of block
- * @First: the latter part of the block, containing the end of the block
- * @Middle: the whole block
- * @Last: the former part of the block, containing the beginning of the block
- * @Short: only middle part of the block, neither containing the beginning nor the end of the block
+/* in-memory allocation state of a fragment block
+ * @index: the data block index of the fragment block
+ * @used: bitmap of the allocated units
+ */
+struct frag_block{
+    uint16_t index;
+    uint64_t used;
+};
+
+typedef struct frag_block* frag_block_t;
+
+/* the part of a file system that the processes mounting it with
+ * fs_mount_shared_r() share, at the start of a shared memory segment: the
+ * super block, the root directory and the FAT follow it, then with the journal
+ * their copies as of the last commit
+ * @lock: the lock the operations of all the processes run under, robust to
+ *        the death of its owner
+ * @users: the number of processes the file system is mounted by
+ * @generation: bumped by the operations that changed the file system, so that
+ *              the other processes rebuild what they derive from it
+ * @open_count: the number of processes each file is open in
+ * @journal_next, @journal_seq: where the next journal transaction goes
+ */
+struct fs_shared{
+    pthread_mutex_t lock;
+    int users;
+    uint64_t generation;
+    uint16_t open_count[FS_FILE_MAX_COUNT];
+    size_t journal_next;
+    uint32_t journal_seq;
+};
+
+/* a file system, along with the virtual disk and the request queue it works on
+ * @disk, @queue: the virtual disk and the request queue, NULL for the default
+ *                ones
+ */
+struct fs{
+    struct disk* disk;
+    struct block_queue* queue;
+    /* the next file system, all of them listed from @default_fs */
+    struct fs* next;
+    rootdir_t root;
+    superblock_t super_block;
+    uint16_t* FAT;
+    uint8_t mounted;
+    descriptor_t descriptor_table;
+    open_file_t file_table;
+    frag_block_t frag_table;
+    int frag_count;
+    /* the last fragment block accessed, shared by all the small files it holds */
+    void* frag_cache;
+    uint16_t frag_cache_index;
+    /* total amount of pending data, and free blocks reserved to hold it */
+    size_t pending_total;
+    int reserved_blocks;
+    /* the snapshot table, and the number of snapshots keeping each data block */
+    snapshot_t snapshots;
+    uint8_t* snap_refs;
+    /* whether a snapshot is mounted, in which case nothing can be modified */
+    uint8_t read_only;
+    /* the blocks written during the current changed-block tracking epoch, one
+     * bit per block of the virtual disk, or NULL if changed blocks are not
+     * tracked */
+    uint8_t* changed_map;
+    /* the size of the blocks of the file system */
+    size_t block_size;
+    /* with the journal: the FAT, the root directory and the super block as of
+     * the last commit (NULL without the journal), the buffer transactions are
+     * built in, the offset of the next one in the journal in blocks of the
+     * virtual disk and its sequence number, and the operations made since the
+     * last commit */
+    uint16_t* journal_fat;
+    rootdir_t journal_root;
+    superblock_t journal_super;
+    void* journal_buf;
+    size_t journal_next;
+    uint32_t journal_seq;
+    int journal_ops;
+    struct timespec journal_begin;
+    /* the public operations run one at a time under @lock; the metadata or
+     * the pending data changed since the background flusher last ran */
+    pthread_mutex_t lock;
+    uint8_t sync_dirty;
+    /* the durability of the mounted file system (enum fs_durability), and the
+     * period of the background flusher */
+    int durability;
+    unsigned int sync_period;
+    /* the background flusher, under @sync_lock: the flushes requested and
+     * done, counted in tickets, and the number of flushes that failed */
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_request_cond;
+    pthread_cond_t sync_done_cond;
+    pthread_t flusher;
+    uint8_t flusher_running;
+    uint8_t flusher_stopping;
+    uint64_t sync_requested;
+    uint64_t sync_done;
+    uint64_t sync_errors;
+    /* whether the flusher flushes periodically, and whether it is flushing
+     * the disk without @lock held */
+    uint8_t sync_periodic;
+    uint8_t flushing;
+    /* with a shared mount: the shared part of the file system, the name and
+     * the size of its segment, the disk file the mounts are locked on, the
+     * generation this process is up to date with, and whether the current
+     * operation changed the file system */
+    struct fs_shared* shared;
+    char shared_name[40];
+    size_t shared_size;
+    int shared_fd;
+    uint64_t shared_generation;
+    uint8_t shared_dirty;
+};
+
+/* the file system of the calls without a handle */
+struct fs default_fs = {
+    .block_size = BLOCK_SIZE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .durability = FS_DURABLE_NONE,
+    .sync_period = SYNC_PERIOD_MSECS,
+    .sync_lock = PTHREAD_MUTEX_INITIALIZER,
+    .sync_request_cond = PTHREAD_COND_INITIALIZER,
+    .sync_done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* the file system the calling thread works on, set by the public operations */
+__thread struct fs* fs = &default_fs;
+/* protects the list of all the file systems */
+pthread_mutex_t fs_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a flush requested from the background flusher
+ * @handle: the file system flushed
+ * @seq: the ticket of the flush, 0 if there is nothing to wait for
+ * @errors: the number of flushes that failed when it was requested
  */
-enum block_type{
-    First,
-    Middle,
-    Last,
-    Short
+struct sync_ticket{
+    struct fs* handle;
+    uint64_t seq;
+    uint64_t errors;
 };
 
-rootdir_t root = NULL;
-superblock_t super_block = NULL;
-uint16_t* FAT = NULL;
-uint8_t mounted = 0;
-descriptor_t descriptor_table = NULL;
-open_file_t file_table = NULL;
+/* the file system, virtual disk and request queue the calling thread worked
+ * on before a public operation, restored once it returns */
+struct fs_scope{
+    struct fs* fs;
+    struct disk* disk;
+    struct block_queue* queue;
+};
+
+/* the lock of the processes sharing a mount, taken along with the one of the
+ * file system, see the shared mounts below */
+void lock_shared(void);
+void unlock_shared(void);
+
+struct fs_scope enter_fs(struct fs *handle)
+{
+    struct fs_scope scope = { fs, block_disk_bind(handle->disk), block_queue_bind(handle->queue) };
+    fs = handle;
+    pthread_mutex_lock(&fs->lock);
+    lock_shared();
+    return scope;
+}
+
+void leave_fs(struct fs_scope *scope)
+{
+    unlock_shared();
+    pthread_mutex_unlock(&fs->lock);
+    fs = scope->fs;
+    block_disk_bind(scope->disk);
+    block_queue_bind(scope->queue);
+}
+
+/* work on file system @handle, holding its lock, until the end of the
+ * enclosing scope */
+#define FS_LOCKED(handle) \
+    struct fs_scope fs_scope __attribute__((cleanup(leave_fs))) = enter_fs(handle)
+
+/* read or write @count consecutive blocks of the file system from block
+ * @block, directly or through the request queue */
+int read_blocks(size_t block, size_t count, void *buf)
+{
+    return block_read_range(block * DISK_BLOCKS, count * DISK_BLOCKS, buf);
+}
+
+int write_blocks(size_t block, size_t count, const void *buf)
+{
+    return block_write_range(block * DISK_BLOCKS, count * DISK_BLOCKS, buf);
+}
+
+int queue_read_blocks(size_t block, size_t count, void *buf)
+{
+    return block_queue_read(block * DISK_BLOCKS, count * DISK_BLOCKS, buf);
+}
+
+int queue_write_blocks(size_t block, size_t count, const void *buf)
+{
+    return block_queue_write(block * DISK_BLOCKS, count * DISK_BLOCKS, buf);
+}
 
 /* error checking whether the super block read from the disk is validate */
 int error_check(void)
 {
-    if(strncmp(super_block->signature, "ECS150FS", 8))
+    if(strncmp(fs->super_block->signature, "ECS150FS", 8))
+        return -1;
+    fs->block_size = fs_block_size(fs->super_block);
+    if(fs->super_block->virtual_disk_amount * DISK_BLOCKS != block_disk_count())
+        return -1;
+    if(fs->super_block->root_index != fs->super_block->FAT_amount + 1)
+        return -1;
+    if(fs->super_block->data_start_index != fs->super_block->root_index + 1)
         return -1;
-    if(super_block->virtual_disk_amount != block_disk_count())
+    if(fs->super_block->data_amount != fs->super_block->virtual_disk_amount - fs->super_block->FAT_amount - 2)
         return -1;
-    if(super_block->root_index != super_block->FAT_amount + 1)
+    if(fs->super_block->FAT_amount != (((2 *fs->super_block->data_amount) + fs->block_size - 1) / fs->block_size))
         return -1;
-    if(super_block->data_start_index != super_block->root_index + 1)
+    if(fs->super_block->snapshot_index >= fs->super_block->data_amount)
         return -1;
-    if(super_block->data_amount != block_disk_count() - super_block->FAT_amount - 2)
+    if(fs->super_block->changed_index >= fs->super_block->data_amount)
         return -1;
-    if(super_block->FAT_amount != (((2 *super_block->data_amount) + BLOCK_SIZE - 1) / BLOCK_SIZE))
+    if((fs->super_block->features & FS_FEATURE_JOURNAL) &&
+       (!fs->super_block->journal_index || (fs->super_block->journal_index + fs->super_block->journal_blocks > fs->super_block->data_amount)))
         return -1;
     return 0;
 }
@@ -98,26 +334,67 @@ int error_check(void)
 int descriptor_check(void)
 {
     for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-        if(descriptor_table[i].open_file_index != -1)
+        if(fs->descriptor_table[i].open_file_index != -1)
             return -1;
     }
     return 0;
 }
 
+void free_metadata(void)
+{
+    free(fs->FAT);
+    free(fs->root);
+    free(fs->super_block);
+    free(fs->journal_fat);
+    free(fs->journal_root);
+    free(fs->journal_super);
+    fs->FAT = NULL;
+    fs->root = NULL;
+    fs->super_block = NULL;
+}
+
 void release_space(void)
 {
-    free(FAT);
-    free(root);
-    free(descriptor_table);
-    free(file_table);
-    free(super_block);
+    /* the metadata of a shared mount lives in its segment */
+    if(!fs->shared)
+        free_metadata();
+    free(fs->descriptor_table);
+    free(fs->file_table);
+    free(fs->frag_table);
+    free(fs->frag_cache);
+    free(fs->snapshots);
+    free(fs->snap_refs);
+    free(fs->changed_map);
+    free(fs->journal_buf);
+    /* the next mount, or a mount that fails half way, starts from scratch */
+    fs->descriptor_table = NULL;
+    fs->file_table = NULL;
+    fs->frag_table = NULL;
+    fs->frag_cache = NULL;
+    fs->snapshots = NULL;
+    fs->snap_refs = NULL;
+    fs->changed_map = NULL;
+    /* the journal may be gone with the next file system */
+    fs->journal_fat = NULL;
+    fs->journal_root = NULL;
+    fs->journal_super = NULL;
+    fs->journal_buf = NULL;
+}
+
+/* undo a mount that failed once the virtual disk was opened: close the disk
+ * and release what was loaded so far */
+int abort_mount(void)
+{
+    block_disk_close();
+    release_space();
+    return -1;
 }
 
 /* find whether the specific file is open */
 int file_is_open(const char *filename)
 {
     for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-        if(!strcmp(file_table[i].filename, filename))
+        if(!strcmp(fs->file_table[i].filename, filename))
             return i;
     }
     return -1;
@@ -126,16 +403,24 @@ int file_is_open(const char *filename)
 /* reset the entry of open file table based on giving */
 void reset_file(int index, const char* filename, uint8_t open_count, uint8_t root_index)
 {
-    strcpy(file_table[index].filename, filename);
-    file_table[index].open_count = open_count;
-    file_table[index].root_index = root_index;
+    strcpy(fs->file_table[index].filename, filename);
+    fs->file_table[index].open_count = open_count;
+    fs->file_table[index].root_index = root_index;
+    fs->file_table[index].pending = NULL;
+    fs->file_table[index].pending_size = 0;
+    fs->file_table[index].pending_spare = 0;
+    fs->file_table[index].map = NULL;
+    fs->file_table[index].map_count = 0;
+    fs->file_table[index].map_partial = 0;
+    fs->file_table[index].durability = -1;
+    fs->file_table[index].written = 0;
 }
 
 /* reset the entry of file descriptor table based on giving */
 void reset_descriptor(int index, uint32_t offset, int8_t open_file_index)
 {
-    descriptor_table[index].offset = offset;
-    descriptor_table[index].open_file_index = open_file_index;
+    fs->descriptor_table[index].offset = offset;
+    fs->descriptor_table[index].open_file_index = open_file_index;
 }
 
 void initialize_descriptor_table(void)
@@ -146,92 +431,681 @@ void initialize_descriptor_table(void)
     }
 }
 
-int fs_mount(const char *diskname)
+int fragments_enabled(void)
 {
-    super_block = (superblock_t)malloc(sizeof(struct superblock));
-    
-    /* error checking: virtual disk file @diskname cannot be opened */
-    if(block_disk_open(diskname))
+    return fs->super_block->features & FS_FEATURE_FRAGMENTS;
+}
+
+/* bitmap of the fragment units covering @size bytes from byte @offset */
+uint64_t frag_mask(uint32_t offset, uint32_t size)
+{
+    int units = (size + FRAG_UNIT_SIZE(fs->block_size) - 1) / FRAG_UNIT_SIZE(fs->block_size);
+    uint64_t mask = (units >= FRAG_UNITS) ? ~0ULL : ((1ULL << units) - 1);
+    return mask << (offset / FRAG_UNIT_SIZE(fs->block_size));
+}
+
+/* byte offset of the tail of @dir within its fragment block */
+uint32_t frag_offset(rootdir_t dir)
+{
+    return (uint32_t)dir->frag_offset * FRAG_OFFSET_UNIT(fs->block_size);
+}
+
+/* find the fragment table entry of data block @index */
+frag_block_t get_frag(uint16_t index)
+{
+    for(int i = 0; i < fs->frag_count; i++){
+        if(fs->frag_table[i].index == index)
+            return &fs->frag_table[i];
+    }
+    return NULL;
+}
+
+/* mark the fragment units of the tail of root directory entry @root_index as used */
+void mark_frag(int root_index)
+{
+    rootdir_t dir = &fs->root[root_index];
+    frag_block_t frag = get_frag(dir->frag_index);
+    if(!frag){
+        frag = &fs->frag_table[fs->frag_count++];
+        frag->index = dir->frag_index;
+        frag->used = 0;
+    }
+    frag->used |= frag_mask(frag_offset(dir), dir->file_size % fs->block_size);
+}
+
+/* release the fragment units of the tail of root directory entry @root_index,
+ * and the fragment block itself once no tail lives in it anymore */
+void release_frag(int root_index)
+{
+    rootdir_t dir = &fs->root[root_index];
+    frag_block_t frag = get_frag(dir->frag_index);
+    frag->used &= ~frag_mask(frag_offset(dir), dir->file_size % fs->block_size);
+    if(!frag->used){
+        fs->FAT[frag->index] = 0;
+        if(fs->frag_cache_index == frag->index)
+            fs->frag_cache_index = 0;
+        *frag = fs->frag_table[--fs->frag_count];
+    }
+    dir->frag_index = 0;
+    dir->frag_offset = 0;
+}
+
+/* find room for a tail of @size bytes in an existing fragment block */
+int alloc_frag(uint32_t size, uint32_t *offset)
+{
+    int units = (size + FRAG_UNIT_SIZE(fs->block_size) - 1) / FRAG_UNIT_SIZE(fs->block_size);
+    for(int i = 0; i < fs->frag_count; i++){
+        /* a fragment block kept by a snapshot cannot be written to anymore */
+        if(fs->snap_refs[fs->frag_table[i].index])
+            continue;
+        for(int unit = 0; unit + units <= FRAG_UNITS; unit++){
+            if(!(fs->frag_table[i].used & frag_mask(unit * FRAG_UNIT_SIZE(fs->block_size), size))){
+                *offset = unit * FRAG_UNIT_SIZE(fs->block_size);
+                return fs->frag_table[i].index;
+            }
+        }
+    }
+    return -1;
+}
+
+/* load fragment block @index into the fragment cache */
+int load_frag(uint16_t index)
+{
+    if(fs->frag_cache_index == index)
+        return 0;
+    if(read_blocks(fs->super_block->data_start_index + index, 1, fs->frag_cache))
+        return -1;
+    fs->frag_cache_index = index;
+    return 0;
+}
+
+/* rebuild the allocation state of the fragment blocks from the tails */
+void load_frags(void)
+{
+    fs->frag_count = 0;
+    fs->frag_cache_index = 0;
+    if(!fragments_enabled())
+        return;
+    for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+        if(fs->root[i].filename[0] != '\0' && fs->root[i].frag_index)
+            mark_frag(i);
+    }
+}
+
+/* read the copy of the FAT kept by a snapshot into @fat; its blocks follow
+ * the copy of the root directory in the FAT chain of the snapshot */
+int read_snapshot_fat(snapshot_t snap, uint16_t *fat)
+{
+    uint16_t block = snap->first_index;
+    for(int i = 0; i <= fs->super_block->FAT_amount; i++){
+        /* error checking: the chain of the snapshot is broken */
+        if(!block || (block >= fs->super_block->data_amount))
+            return -1;
+        if(i && read_blocks(fs->super_block->data_start_index + block, 1, fat + (i - 1) * FAT_PER_BLOCK(fs->block_size)))
+            return -1;
+        block = fs->FAT[block];
+    }
+    return 0;
+}
+
+/* add @delta to the reference counts of the data blocks kept by a snapshot */
+int count_snapshot_refs(snapshot_t snap, int delta)
+{
+    uint16_t* fat = malloc(fs->block_size * fs->super_block->FAT_amount);
+    int ret = read_snapshot_fat(snap, fat);
+    for(int i = 1; !ret && (i < fs->super_block->data_amount); i++){
+        if(fat[i])
+            fs->snap_refs[i] += delta;
+    }
+    free(fat);
+    return ret;
+}
+
+/* read the snapshot table, and count the snapshots keeping each data block */
+int load_snapshots(void)
+{
+    if(!fs->super_block->snapshot_index)
+        return 0;
+    if(read_blocks(fs->super_block->data_start_index + fs->super_block->snapshot_index, 1, fs->snapshots))
+        return -1;
+    for(int i = 0; i < FS_SNAPSHOT_MAX; i++){
+        if(fs->snapshots[i].name[0] && count_snapshot_refs(&fs->snapshots[i], 1))
+            return -1;
+    }
+    return 0;
+}
+
+/* whether data block @index is free: neither used by the file system nor kept
+ * by a snapshot */
+int block_is_free(int index)
+{
+    return !fs->FAT[index] && !fs->snap_refs[index];
+}
+
+/* whether free data block @index can be allocated: a block freed since the
+ * last journal commit cannot be until the next one, since replaying the
+ * journal after a crash would bring its former use back */
+int block_is_allocatable(int index)
+{
+    return block_is_free(index) && (!fs->journal_fat || !fs->journal_fat[index]);
+}
+
+/* whether data block @index must be replaced rather than overwritten: it is
+ * kept by a snapshot, or by the metadata of the last journal commit */
+int block_is_shared(int index)
+{
+    return fs->snap_refs[index] || (fs->journal_fat && fs->journal_fat[index]);
+}
+
+/* find the snapshot named @name */
+int get_snapshot(const char *name)
+{
+    for(int i = 0; i < FS_SNAPSHOT_MAX; i++){
+        if(fs->snapshots[i].name[0] && !strcmp(fs->snapshots[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+/* number of data blocks holding the changed-block bitmap */
+int changed_blocks_num(void)
+{
+    return (fs->super_block->virtual_disk_amount + CHANGED_PER_BLOCK(fs->block_size) - 1) / CHANGED_PER_BLOCK(fs->block_size);
+}
+
+/* record @count blocks from block @block as changed, when tracking */
+void mark_changed(size_t block, size_t count)
+{
+    if(!fs->changed_map)
+        return;
+    for(size_t i = block; i < block + count; i++)
+        fs->changed_map[i / 8] |= 1 << (i % 8);
+}
+
+/* write a block, or consecutive blocks, that fs.c changed: all the writes of a
+ * mounted file system but the metadata go through these */
+int write_block(size_t block, const void *buf)
+{
+    mark_changed(block, 1);
+    return write_blocks(block, 1, buf);
+}
+
+int write_block_range(size_t block, size_t count, const void *buf)
+{
+    mark_changed(block, count);
+    return write_blocks(block, count, buf);
+}
+
+/* same as write_block_range(), through the request queue: @buf must stay
+ * unchanged until the queue is unplugged */
+int queue_block_range(size_t block, size_t count, const void *buf)
+{
+    mark_changed(block, count);
+    return queue_write_blocks(block, count, buf);
+}
+
+/* read the changed-block bitmap, whose blocks are chained in the FAT */
+int load_changed(void)
+{
+    if(!fs->super_block->changed_index)
+        return 0;
+    fs->changed_map = malloc(changed_blocks_num() * fs->block_size);
+    uint16_t block = fs->super_block->changed_index;
+    for(int i = 0; i < changed_blocks_num(); i++){
+        /* error checking: the chain of the bitmap is broken */
+        if(!block || (block >= fs->super_block->data_amount))
+            return -1;
+        if(read_blocks(fs->super_block->data_start_index + block, 1, fs->changed_map + i * fs->block_size))
+            return -1;
+        block = fs->FAT[block];
+    }
+    return 0;
+}
+
+/* write the changed-block bitmap back to disk, its own blocks included */
+int write_changed(void)
+{
+    /* the bitmap is not loaded yet while the journal gets replayed */
+    if(!fs->changed_map)
+        return 0;
+    uint16_t block = fs->super_block->changed_index;
+    for(int i = 0; block && (i < changed_blocks_num()); i++, block = fs->FAT[block])
+        mark_changed(fs->super_block->data_start_index + block, 1);
+    block = fs->super_block->changed_index;
+    for(int i = 0; block && (i < changed_blocks_num()); i++, block = fs->FAT[block]){
+        if(queue_write_blocks(fs->super_block->data_start_index + block, 1, fs->changed_map + i * fs->block_size))
+            return -1;
+    }
+    return 0;
+}
+
+/* number of blocks of the journal of a file system of @data_blk_count data
+ * blocks: room for two of its largest transactions at least, and for
+ * JOURNAL_SIZE bytes if that takes at most a sixteenth of the disk */
+size_t journal_size(size_t data_blk_count)
+{
+    size_t min = (2 * JOURNAL_TXN_MAX(data_blk_count) + fs->block_size - 1) / fs->block_size;
+    size_t preferred = JOURNAL_SIZE / fs->block_size;
+    if(preferred > data_blk_count / 16)
+        preferred = data_blk_count / 16;
+    return (preferred > min) ? preferred : min;
+}
+
+/* root directory entry @index as it is committed: the size of an open file
+ * leaves its pending data out, which has no data blocks yet */
+void journal_entry(int index, rootdir_t entry)
+{
+    *entry = fs->root[index];
+    for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+        open_file_t file = &fs->file_table[i];
+        if(file->pending_size && (file->root_index == index) && (entry->file_size > file->pending_start))
+            entry->file_size = file->pending_start;
+    }
+}
+
+/* write the metadata as of the last commit back to its home blocks, so that
+ * the journal can be reused from its beginning; the super block only moves on
+ * past the journaled transactions once the rest is on stable storage */
+int journal_checkpoint(void)
+{
+    mark_changed(0, fs->super_block->data_start_index);
+    block_queue_plug();
+    int ret = write_changed() ||
+              queue_write_blocks(1, fs->super_block->FAT_amount, fs->journal_fat) ||
+              queue_write_blocks(fs->super_block->root_index, 1, fs->journal_root);
+    /* a caller may hold the queue plugged: the writes must be done before the
+     * flush, and before the committed copies change */
+    if(block_queue_unplug() || block_queue_flush() || ret || block_disk_sync())
+        return -1;
+    fs->journal_super->journal_seq = fs->journal_seq;
+    fs->super_block->journal_seq = fs->journal_seq;
+    if(block_write(0, fs->journal_super) || block_disk_sync())
         return -1;
-    if(block_read(0, super_block))
+    fs->journal_next = 0;
+    STATS_JOURNAL_CHECKPOINT();
+    return 0;
+}
+
+/* commit the metadata changes made since the last commit to the journal, as
+ * a single transaction whose records are found by comparing the metadata
+ * with its committed copy, and flush the disk once: the data blocks written
+ * by the operations reach stable storage along with the transaction */
+int journal_commit(void)
+{
+    if(!fs->journal_fat || fs->read_only)
+        return 0;
+    fs->journal_ops = 0;
+    
+    struct journal_header* header = fs->journal_buf;
+    struct journal_fat* fat = (struct journal_fat*)(header + 1);
+    memset(header, 0, sizeof(struct journal_header));
+    for(int i = 0; i < fs->super_block->data_amount; i += 64){
+        int n = (fs->super_block->data_amount - i < 64) ? fs->super_block->data_amount - i : 64;
+        if(!memcmp(fs->FAT + i, fs->journal_fat + i, n * sizeof(uint16_t)))
+            continue;
+        for(int j = i; j < i + n; j++){
+            if(fs->FAT[j] != fs->journal_fat[j]){
+                fat[header->fat_count].index = j;
+                fat[header->fat_count++].value = fs->FAT[j];
+            }
+        }
+    }
+    struct journal_dir* dir = (struct journal_dir*)(fat + header->fat_count);
+    for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+        struct rootdir entry;
+        journal_entry(i, &entry);
+        if(memcmp(&entry, &fs->journal_root[i], sizeof(struct rootdir))){
+            dir[header->dir_count].index = i;
+            dir[header->dir_count++].entry = entry;
+        }
+    }
+    header->snapshot_index = fs->super_block->snapshot_index;
+    header->changed_index = fs->super_block->changed_index;
+    header->changed_epoch = fs->super_block->changed_epoch;
+    if(!header->fat_count && !header->dir_count &&
+       (header->snapshot_index == fs->journal_super->snapshot_index) &&
+       (header->changed_index == fs->journal_super->changed_index) &&
+       (header->changed_epoch == fs->journal_super->changed_epoch))
+        return 0;
+    
+    /* a transaction never outgrows an empty journal */
+    header->length = header->fat_count * sizeof(struct journal_fat) + header->dir_count * sizeof(struct journal_dir);
+    size_t size = sizeof(struct journal_header) + header->length;
+    size_t count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if((fs->journal_next + count > fs->super_block->journal_blocks * DISK_BLOCKS) && journal_checkpoint())
         return -1;
-    /* error checking: no valid file system can be located */
-    if(error_check())
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->seq = fs->journal_seq;
+    memset((char*)fs->journal_buf + size, 0, count * BLOCK_SIZE - size);
+    header->checksum = journal_checksum(header, size);
+    
+    size_t first = fs->super_block->data_start_index + fs->super_block->journal_index;
+    mark_changed(first + fs->journal_next / DISK_BLOCKS, (fs->journal_next % DISK_BLOCKS + count + DISK_BLOCKS - 1) / DISK_BLOCKS);
+    block_queue_plug();
+    int ret = write_changed() ||
+              block_queue_write(first * DISK_BLOCKS + fs->journal_next, count, fs->journal_buf);
+    /* the transaction buffer is reused by the next commit */
+    if(block_queue_unplug() || block_queue_flush() || ret || block_disk_sync())
         return -1;
     
-    FAT = (uint16_t*)malloc(BLOCK_SIZE * (super_block->FAT_amount) * sizeof(uint16_t));
-    root = (rootdir_t)malloc(FS_FILE_MAX_COUNT * sizeof(struct rootdir));
-    descriptor_table = (descriptor_t)malloc(FS_OPEN_MAX_COUNT * sizeof(struct descriptor));
-    file_table = (open_file_t)malloc(FS_OPEN_MAX_COUNT * sizeof(struct open_file));
+    /* the transaction is on stable storage, the committed copy follows */
+    for(int i = 0; i < header->fat_count; i++)
+        fs->journal_fat[fat[i].index] = fat[i].value;
+    for(int i = 0; i < header->dir_count; i++)
+        fs->journal_root[dir[i].index] = dir[i].entry;
+    fs->journal_super->snapshot_index = header->snapshot_index;
+    fs->journal_super->changed_index = header->changed_index;
+    fs->journal_super->changed_epoch = header->changed_epoch;
+    fs->journal_next += count;
+    fs->journal_seq++;
+    STATS_JOURNAL_COMMIT();
+    return 0;
+}
+
+/* commit the journal if fewer than @block_num free data blocks can be
+ * allocated, so that the ones freed since the last commit can be too; called
+ * before an operation starts changing the metadata, which is then consistent */
+void journal_reclaim(int block_num)
+{
+    if(!fs->journal_fat || (block_num <= 0))
+        return;
+    int allocatable = 0;
+    for(int i = 0; (i < fs->super_block->data_amount) && (allocatable < block_num); i++)
+        allocatable += block_is_allocatable(i);
+    if(allocatable < block_num)
+        journal_commit();
+}
+
+/* whether the journal holds a valid transaction numbered @seq at @header,
+ * within @size bytes */
+int journal_valid(struct journal_header *header, size_t size, uint32_t seq)
+{
+    if(memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) || (header->seq != seq))
+        return 0;
+    if((header->length > size - sizeof(struct journal_header)) ||
+       (header->length != header->fat_count * sizeof(struct journal_fat) + header->dir_count * sizeof(struct journal_dir)))
+        return 0;
+    uint32_t checksum = header->checksum;
+    header->checksum = 0;
+    int valid = (journal_checksum(header, sizeof(struct journal_header) + header->length) == checksum);
+    header->checksum = checksum;
+    if(!valid || (header->snapshot_index >= fs->super_block->data_amount) || (header->changed_index >= fs->super_block->data_amount))
+        return 0;
     
-    for(int i = 1; i <= super_block->FAT_amount; i++){
-        if(block_read(i, (FAT + ((i - 1) * BLOCK_SIZE))))
-            return -1;
+    struct journal_fat* fat = (struct journal_fat*)(header + 1);
+    struct journal_dir* dir = (struct journal_dir*)(fat + header->fat_count);
+    for(int i = 0; i < header->fat_count; i++){
+        if(fat[i].index >= fs->super_block->data_amount)
+            return 0;
+    }
+    for(int i = 0; i < header->dir_count; i++){
+        if(dir[i].index >= FS_FILE_MAX_COUNT)
+            return 0;
+    }
+    return 1;
+}
+
+/* replay the transactions committed to the journal since the last checkpoint
+ * over the metadata read from its home blocks, then write it back there */
+int journal_load(void)
+{
+    fs->journal_fat = NULL;
+    if(!(fs->super_block->features & FS_FEATURE_JOURNAL))
+        return 0;
+    size_t size = fs->super_block->journal_blocks * fs->block_size;
+    fs->journal_buf = malloc(size);
+    if(read_blocks(fs->super_block->data_start_index + fs->super_block->journal_index, fs->super_block->journal_blocks, fs->journal_buf))
+        return -1;
+    
+    fs->journal_seq = fs->super_block->journal_seq;
+    for(size_t offset = 0; offset + sizeof(struct journal_header) <= size; fs->journal_seq++){
+        struct journal_header* header = fs->journal_buf + offset;
+        if(!journal_valid(header, size - offset, fs->journal_seq))
+            break;
+        struct journal_fat* fat = (struct journal_fat*)(header + 1);
+        struct journal_dir* dir = (struct journal_dir*)(fat + header->fat_count);
+        for(int i = 0; i < header->fat_count; i++)
+            fs->FAT[fat[i].index] = fat[i].value;
+        for(int i = 0; i < header->dir_count; i++)
+            fs->root[dir[i].index] = dir[i].entry;
+        fs->super_block->snapshot_index = header->snapshot_index;
+        fs->super_block->changed_index = header->changed_index;
+        fs->super_block->changed_epoch = header->changed_epoch;
+        offset += (sizeof(struct journal_header) + header->length + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
     }
-    if(block_read(super_block->root_index, root))
+    
+    fs->journal_fat = malloc(fs->block_size * fs->super_block->FAT_amount);
+    fs->journal_root = malloc(fs->block_size);
+    fs->journal_super = malloc(sizeof(struct superblock));
+    memcpy(fs->journal_fat, fs->FAT, fs->block_size * fs->super_block->FAT_amount);
+    memcpy(fs->journal_root, fs->root, fs->block_size);
+    memcpy(fs->journal_super, fs->super_block, sizeof(struct superblock));
+    fs->journal_next = 0;
+    fs->journal_ops = 0;
+    if((fs->journal_seq != fs->super_block->journal_seq) && journal_checkpoint())
+        return -1;
+    return 0;
+}
+
+/* build the state of a mounted file system that is not part of its metadata,
+ * once the metadata is loaded */
+int load_state(void)
+{
+    fs->descriptor_table = (descriptor_t)malloc(FS_OPEN_MAX_COUNT * sizeof(struct descriptor));
+    fs->file_table = (open_file_t)malloc(FS_OPEN_MAX_COUNT * sizeof(struct open_file));
+    fs->frag_table = (frag_block_t)malloc(FS_FILE_MAX_COUNT * sizeof(struct frag_block));
+    fs->frag_cache = malloc(fs->block_size);
+    fs->pending_total = 0;
+    fs->reserved_blocks = 0;
+    
+    load_frags();
+    fs->snapshots = calloc(1, fs->block_size);
+    fs->snap_refs = calloc(fs->super_block->data_amount, sizeof(uint8_t));
+    fs->read_only = 0;
+    if(load_snapshots())
+        return -1;
+    fs->changed_map = NULL;
+    if(load_changed())
         return -1;
     
     initialize_descriptor_table();
-    mounted = 1;
+    fs->durability = FS_DURABLE_NONE;
+    fs->mounted = 1;
     return 0;
 }
 
-int fs_umount(void)
+int do_mount(const char *diskname)
+{
+    /* error checking: virtual disk file @diskname cannot be opened */
+    if(block_disk_open(diskname))
+        return -1;
+    /* error checking: no valid file system can be located; the super block
+     * is the first block of the virtual disk, whatever the block size */
+    fs->super_block = (superblock_t)malloc(sizeof(struct superblock));
+    if(block_read(0, fs->super_block) || error_check())
+        return abort_mount();
+    
+    fs->FAT = (uint16_t*)malloc(fs->block_size * fs->super_block->FAT_amount);
+    fs->root = (rootdir_t)calloc(1, fs->block_size);
+    
+    /* the FAT and the root directory follow each other on disk, they are
+     * read with a single request */
+    block_queue_plug();
+    queue_read_blocks(1, fs->super_block->FAT_amount, fs->FAT);
+    queue_read_blocks(fs->super_block->root_index, 1, fs->root);
+    /* error checking: the metadata cannot be read, the journal cannot be
+     * replayed, or the snapshots or the changed blocks cannot be loaded */
+    if(block_queue_unplug() || journal_load() || load_state())
+        return abort_mount();
+    return 0;
+}
+
+/* write the super block, the FAT and the root directory back to disk */
+int write_metadata(void)
+{
+    /* the snapshots and the changed-block tracking get there this way */
+    fs->shared_dirty = 1;
+    /* with the journal, the metadata goes through it first */
+    if(fs->journal_fat)
+        return (journal_commit() || journal_checkpoint()) ? -1 : 0;
+    /* the metadata is part of every epoch, marked before the bitmap is saved */
+    mark_changed(0, fs->super_block->data_start_index);
+    /* the super block, the FAT and the root directory follow each other on
+     * disk, they are written with a single request */
+    block_queue_plug();
+    int ret = write_changed() ||
+              block_queue_write(0, 1, fs->super_block) ||
+              queue_write_blocks(1, fs->super_block->FAT_amount, fs->FAT) ||
+              queue_write_blocks(fs->super_block->root_index, 1, fs->root);
+    if(block_queue_unplug() || ret)
+        return -1;
+    return 0;
+}
+
+int do_umount(void)
 {
     /* error checking: no underlying virtual disk was opened */
-    if(!mounted)
+    if(!fs->mounted)
         return -1;
     /* error checking: there are still open file descriptors */
     if(descriptor_check())
         return -1;
     
-    /* write back to disk */
-    if(block_write(0, super_block))
-        return -1;
-    for(int i = 1; i <= super_block->FAT_amount; i++){
-        if(block_write(i, (FAT + ((i - 1) * BLOCK_SIZE))))
-            return -1;
-    }
-    if(block_write(super_block->root_index, root))
+    /* write back to disk, a snapshot is left untouched */
+    if(!fs->read_only && write_metadata())
         return -1;
     
+    /* the background flusher may still be flushing the disk */
+    pthread_mutex_lock(&fs->sync_lock);
+    while(fs->flushing)
+        pthread_cond_wait(&fs->sync_done_cond, &fs->sync_lock);
+    pthread_mutex_unlock(&fs->sync_lock);
     /* error checking: the virtual disk cannot be closed */
     if(block_disk_close())
         return -1;
-    mounted = 0;
+    fs->mounted = 0;
+    fs->read_only = 0;
     release_space();
     return 0;
 }
 
+int do_mount_snapshot(const char *diskname, const char *name)
+{
+    if(!name || do_mount(diskname))
+        return -1;
+    /* nothing gets written back to the disk from now on */
+    fs->read_only = 1;
+    
+    int index = get_snapshot(name);
+    uint16_t* fat = malloc(fs->block_size * fs->super_block->FAT_amount);
+    int ret = (index == -1) || read_snapshot_fat(&fs->snapshots[index], fat) ||
+              read_blocks(fs->super_block->data_start_index + fs->snapshots[index].first_index, 1, fs->root);
+    if(ret){
+        free(fat);
+        do_umount();
+        return -1;
+    }
+    memcpy(fs->FAT, fat, fs->block_size * fs->super_block->FAT_amount);
+    free(fat);
+    load_frags();
+    return 0;
+}
+
+int do_format(const char *diskname, size_t data_blk_count, unsigned int features)
+{
+    /* error checking: a file system is currently mounted */
+    if(fs->mounted)
+        return -1;
+    /* error checking: @data_blk_count is out of range */
+    fs->block_size = FS_FEATURES_BLOCK_SIZE(features);
+    size_t FAT_amount = (2 * data_blk_count + fs->block_size - 1) / fs->block_size;
+    if(!data_blk_count || data_blk_count + FAT_amount + 2 > UINT16_MAX)
+        return -1;
+    /* error checking: no room for the journal and some data */
+    size_t journal_blocks = (features & FS_FEATURE_JOURNAL) ? journal_size(data_blk_count) : 0;
+    if(journal_blocks && (journal_blocks + 1 >= data_blk_count))
+        return -1;
+    
+    if(block_disk_create(diskname, (data_blk_count + FAT_amount + 2) * DISK_BLOCKS))
+        return -1;
+    if(block_disk_open(diskname))
+        return -1;
+    
+    struct superblock* sb = calloc(1, sizeof(struct superblock));
+    memcpy(sb->signature, "ECS150FS", 8);
+    sb->virtual_disk_amount = data_blk_count + FAT_amount + 2;
+    sb->FAT_amount = FAT_amount;
+    sb->root_index = FAT_amount + 1;
+    sb->data_start_index = FAT_amount + 2;
+    sb->data_amount = data_blk_count;
+    sb->features = features;
+    /* the journal follows the reserved data block */
+    if(journal_blocks){
+        sb->journal_index = 1;
+        sb->journal_blocks = journal_blocks;
+        sb->journal_seq = 1;
+    }
+    int ret = block_write(0, sb);
+    
+    /* the first data block is reserved, the journal chained after it, the
+     * rest of the FAT and the root directory are empty */
+    uint16_t* blk = calloc(1, fs->block_size);
+    blk[0] = FAT_EOC;
+    for(int i = 1; i <= journal_blocks; i++)
+        blk[i] = (i < journal_blocks) ? i + 1 : FAT_EOC;
+    for(int i = 1; i <= FAT_amount && !ret; i++){
+        ret = write_blocks(i, 1, blk);
+        memset(blk, 0, fs->block_size);
+    }
+    if(!ret)
+        ret = write_blocks(sb->root_index, 1, blk);
+    /* a journal left by a former file system must not be replayed */
+    if(!ret && journal_blocks)
+        ret = write_blocks(sb->data_start_index + sb->journal_index, 1, blk);
+    
+    free(blk);
+    free(sb);
+    if(block_disk_close())
+        return -1;
+    return ret;
+}
+
 int get_empty_block_num(void){
     int empty_fat = 0;
-    for(int i = 0; i < super_block->data_amount; i++){
-        if(FAT[i] == 0)
+    for(int i = 0; i < fs->super_block->data_amount; i++){
+        if(block_is_free(i))
             empty_fat++;
     }
+    STATS_ALLOC_SCAN(fs->super_block->data_amount);
     return empty_fat;
 }
 
 int get_empty_dir_num(void){
     int empty_dir = 0;
     for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-        if(!strcmp(root[i].filename, "\0"))
+        if(!strcmp(fs->root[i].filename, "\0"))
             empty_dir++;
     }
     return empty_dir;
 }
 
 int get_empty_block(void){
-    for(int i = 0; i < super_block->data_amount; i++){
-        if(FAT[i] == 0)
+    /* the blocks reserved for pending data cannot be handed out */
+    if(fs->reserved_blocks && (get_empty_block_num() <= fs->reserved_blocks))
+        return -1;
+    for(int i = 0; i < fs->super_block->data_amount; i++){
+        if(block_is_allocatable(i)){
+            STATS_ALLOC_SCAN(i + 1);
             return i;
+        }
     }
+    STATS_ALLOC_SCAN(fs->super_block->data_amount);
     return -1;
 }
 
 int get_empty_fd(void){
     for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-        if(descriptor_table[i].open_file_index == -1)
+        if(fs->descriptor_table[i].open_file_index == -1)
             return i;
     }
     return -1;
@@ -239,7 +1113,7 @@ int get_empty_fd(void){
 
 int get_empty_open_file(void){
     for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-        if(!strcmp(file_table[i].filename, "\0"))
+        if(!strcmp(fs->file_table[i].filename, "\0"))
             return i;
     }
     return -1;
@@ -248,25 +1122,31 @@ int get_empty_open_file(void){
 int get_dir(const char *filename)
 {
     for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-        if(strcmp(root[i].filename, filename) == 0)
+        if(strcmp(fs->root[i].filename, filename) == 0)
             return i;
     }
     return -1;
 }
 
-int fs_info(void)
+int fs_info_r(fs_t handle)
 {
+    FS_LOCKED(handle);
     /* error checking: no underlying virtual disk was opened */
-    if(!mounted)
+    if(!fs->mounted)
         return -1;
     printf("FS Info:\n");
-    printf("total_blk_count=%d\n", super_block->virtual_disk_amount);
-    printf("fat_blk_count=%d\n", super_block->FAT_amount);
-    printf("rdir_blk=%d\n", super_block->root_index);
-    printf("data_blk=%d\n", super_block->data_start_index);
-    printf("data_blk_count=%d\n", super_block->data_amount);
-    printf("fat_free_ratio=%d/%d\n", get_empty_block_num(), super_block->data_amount);
+    printf("total_blk_count=%d\n", fs->super_block->virtual_disk_amount);
+    printf("fat_blk_count=%d\n", fs->super_block->FAT_amount);
+    printf("rdir_blk=%d\n", fs->super_block->root_index);
+    printf("data_blk=%d\n", fs->super_block->data_start_index);
+    printf("data_blk_count=%d\n", fs->super_block->data_amount);
+    printf("fat_free_ratio=%d/%d\n", get_empty_block_num(), fs->super_block->data_amount);
     printf("rdir_free_ratio=%d/%d\n", get_empty_dir_num(), FS_FILE_MAX_COUNT);
+    /* the reference tools only know blocks of BLOCK_SIZE bytes */
+    if(fs->block_size != BLOCK_SIZE)
+        printf("blk_size=%zu\n", fs->block_size);
+    if(fs->journal_fat)
+        printf("journal_blk_count=%d\n", fs->super_block->journal_blocks);
     return 0;
 }
 
@@ -274,7 +1154,7 @@ int fs_info(void)
 int check_file(const char *filename)
 {
     int f_len = 0;
-    if(!mounted)
+    if(!fs->mounted)
         return -1;
     if(strcmp(filename, "\0") == 0)
         return -1;
@@ -289,89 +1169,378 @@ int check_file(const char *filename)
 
 void free_FAT(uint16_t index)
 {
+    if(index == FAT_EOC)
+        return;
     uint16_t next_index = FAT_EOC;
-    while(FAT[index] != FAT_EOC){
-        next_index = FAT[index];
-        FAT[index] = 0;
+    while(fs->FAT[index] != FAT_EOC){
+        next_index = fs->FAT[index];
+        fs->FAT[index] = 0;
         index = next_index;
     }
-    FAT[index] = 0;
+    fs->FAT[index] = 0;
 }
 
-int fs_create(const char *filename)
+int extents_enabled(void)
 {
-    /* error checking:  @filename is invalid, @filename is too long */
-    if(check_file(filename))
-        return -1;
-    /* error checking: the root directory already contains %FS_FILE_MAX_COUNT files */
+    return fs->super_block->features & FS_FEATURE_EXTENTS;
+}
+
+/* number of data blocks in the block map of an open file */
+uint32_t map_blocks(open_file_t file)
+{
+    if(!file->map_count)
+        return 0;
+    return file->map[file->map_count - 1].block + file->map[file->map_count - 1].length;
+}
+
+/* last data block in the block map of an open file */
+uint16_t map_last(open_file_t file)
+{
+    if(!file->map_count)
+        return FAT_EOC;
+    return file->map[file->map_count - 1].start + file->map[file->map_count - 1].length - 1;
+}
+
+/* point the root directory entry of an open file at its last data block, along
+ * with the check of the FAT layout */
+void set_last_index(open_file_t file)
+{
+    rootdir_t dir = &fs->root[file->root_index];
+    dir->last_index = map_last(file);
+    if(!extents_enabled())
+        dir->last_check = last_index_check(dir->first_index, dir->last_index, map_blocks(file));
+}
+
+/* add @length consecutive data blocks from @start at the end of the block map */
+void map_append(open_file_t file, uint16_t start, uint16_t length)
+{
+    map_extent_t last = file->map_count ? &file->map[file->map_count - 1] : NULL;
+    if(last && (map_last(file) + 1 == start) && (last->length + length <= UINT16_MAX)){
+        last->length += length;
+        return;
+    }
+    /* grow the map by doubling its size */
+    if(!(file->map_count & (file->map_count - 1)))
+        file->map = realloc(file->map, (file->map_count ? 2 * file->map_count : 1) * sizeof(struct map_extent));
+    file->map[file->map_count].block = map_blocks(file);
+    file->map[file->map_count].start = start;
+    file->map[file->map_count].length = length;
+    file->map_count++;
+}
+
+/* build the whole block map of an open file from its FAT chain */
+void map_load_chain(open_file_t file)
+{
+    STATS_FAT_WALK_BEGIN(start);
+    free(file->map);
+    file->map = NULL;
+    file->map_count = 0;
+    file->map_partial = 0;
+    for(uint16_t i = fs->root[file->root_index].first_index; i != FAT_EOC; i = fs->FAT[i])
+        map_append(file, i, 1);
+    set_last_index(file);
+    STATS_FAT_WALK_END(start, map_blocks(file));
+}
+
+/* find the data block holding block @block of an open file, and the number of
+ * consecutive data blocks of the file from there in @run */
+int map_lookup(open_file_t file, uint32_t block, int *run)
+{
+    if(file->map_partial && (block < file->map[0].block))
+        map_load_chain(file);
+    int low = 0, high = file->map_count - 1;
+    while(low <= high){
+        int mid = (low + high) / 2;
+        map_extent_t ext = &file->map[mid];
+        if(block < ext->block){
+            high = mid - 1;
+        } else if(block >= ext->block + ext->length){
+            low = mid + 1;
+        } else {
+            *run = ext->length - (block - ext->block);
+            return ext->start + (block - ext->block);
+        }
+    }
+    return FAT_EOC;
+}
+
+/* read the extents of root directory entry @root_index into @extents, which
+ * can hold EXTENT_MAX(block_size) extents, and return their number */
+int load_extents(int root_index, struct extent *extents)
+{
+    rootdir_t dir = &fs->root[root_index];
+    int count = 0;
+    if(dir->first_index == FAT_EOC)
+        return 0;
+    extents[count].start = dir->first_index;
+    extents[count].length = dir->extent_len;
+    count++;
+    if(dir->extent_block){
+        if(read_blocks(fs->super_block->data_start_index + dir->extent_block, 1, &extents[1]))
+            return -1;
+        while((count < EXTENT_MAX(fs->block_size)) && extents[count].length)
+            count++;
+    }
+    return count;
+}
+
+/* build the block map of an open file from its FAT chain or its extents */
+int map_load(int open_file_index)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    rootdir_t dir = &fs->root[file->root_index];
+    
+    if(!extents_enabled()){
+        /* with a valid tail pointer, the FAT chain only gets walked once a
+         * block before the last one is needed, so appending stays cheap; a
+         * pointer whose check does not match may be left over from a deleted
+         * file whose entry the reference tools reused */
+        uint32_t block_num = (dir->file_size + fs->block_size - 1) / fs->block_size;
+        if(dir->frag_index)
+            block_num = dir->file_size / fs->block_size;
+        uint16_t last = dir->last_index;
+        if((block_num > 1) && last && (last < fs->super_block->data_amount) && (fs->FAT[last] == FAT_EOC) &&
+           (dir->last_check == last_index_check(dir->first_index, last, block_num))){
+            map_append(file, last, 1);
+            file->map[0].block = block_num - 1;
+            file->map_partial = 1;
+        } else {
+            map_load_chain(file);
+        }
+        return 0;
+    }
+    struct extent* extents = malloc(EXTENT_MAX(fs->block_size) * sizeof(struct extent));
+    int count = load_extents(file->root_index, extents);
+    for(int i = 0; i < count; i++)
+        map_append(file, extents[i].start, extents[i].length);
+    free(extents);
+    return (count < 0) ? -1 : 0;
+}
+
+/* write the block map of an open file back to its extents, the FAT chain is
+ * kept up to date as the map changes */
+int map_store(int open_file_index)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    rootdir_t dir = &fs->root[file->root_index];
+    if(!extents_enabled())
+        return 0;
+    
+    if(file->map_count <= 1){
+        dir->first_index = file->map_count ? file->map[0].start : FAT_EOC;
+        dir->extent_len = file->map_count ? file->map[0].length : 0;
+        if(dir->extent_block)
+            fs->FAT[dir->extent_block] = 0;
+        dir->extent_block = 0;
+        return 0;
+    }
+    /* error checking: the file is too fragmented for its extent block */
+    if(file->map_count > EXTENT_MAX(fs->block_size))
+        return -1;
+    /* an extent block kept by a snapshot or by the last journal commit is
+     * replaced rather than overwritten; on failure the entry is left as is */
+    if(!dir->extent_block || block_is_shared(dir->extent_block)){
+        int block = get_empty_block();
+        if(block == -1)
+            return -1;
+        if(dir->extent_block)
+            fs->FAT[dir->extent_block] = 0;
+        fs->FAT[block] = FAT_EOC;
+        dir->extent_block = block;
+    }
+    dir->first_index = file->map[0].start;
+    dir->extent_len = file->map[0].length;
+    
+    struct extent* extents = calloc(1, fs->block_size);
+    for(int i = 1; i < file->map_count; i++){
+        extents[i - 1].start = file->map[i].start;
+        extents[i - 1].length = file->map[i].length;
+    }
+    int ret = write_block(fs->super_block->data_start_index + dir->extent_block, extents);
+    free(extents);
+    return ret;
+}
+
+/* whether an open file would need a new extent block to hold more extents;
+ * with the journal, a commit made in the meantime to reclaim the freed blocks
+ * keeps the current one, which then gets replaced as well */
+int need_extent_block(open_file_t file)
+{
+    uint16_t block = fs->root[file->root_index].extent_block;
+    return extents_enabled() && (!block || fs->journal_fat || block_is_shared(block));
+}
+
+/* whether @block_num data blocks can be allocated for an open file, along
+ * with the extent block it may need, without using the reserved blocks */
+int have_room(open_file_t file, int block_num)
+{
+    block_num += need_extent_block(file);
+    journal_reclaim(block_num);
+    return get_empty_block_num() - fs->reserved_blocks >= block_num;
+}
+
+/* add @length consecutive data blocks from @start at the end of an open file */
+void link_blocks(int open_file_index, uint16_t start, uint16_t length)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    rootdir_t dir = &fs->root[file->root_index];
+    
+    /* with the extent layout, the FAT only tells which blocks are in use */
+    for(int i = start; i < start + length; i++)
+        fs->FAT[i] = (!extents_enabled() && (i + 1 < start + length)) ? i + 1 : FAT_EOC;
+    if(!extents_enabled()){
+        if(file->map_count)
+            fs->FAT[map_last(file)] = start;
+        else
+            dir->first_index = start;
+    }
+    map_append(file, start, length);
+    set_last_index(file);
+}
+
+/* free the data blocks of an open file from its block @block_num on */
+void map_truncate(int open_file_index, uint32_t block_num)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    rootdir_t dir = &fs->root[file->root_index];
+    
+    /* the block before @block_num must be known to end the chain there */
+    if(file->map_partial && (block_num <= file->map[0].block))
+        map_load_chain(file);
+    while(file->map_count){
+        map_extent_t last = &file->map[file->map_count - 1];
+        if(last->block + last->length <= block_num)
+            break;
+        uint16_t keep = (last->block >= block_num) ? 0 : block_num - last->block;
+        for(int i = last->start + keep; i < last->start + last->length; i++)
+            fs->FAT[i] = 0;
+        last->length = keep;
+        if(!keep)
+            file->map_count--;
+    }
+    if(!extents_enabled()){
+        if(file->map_count)
+            fs->FAT[map_last(file)] = FAT_EOC;
+        else
+            dir->first_index = FAT_EOC;
+    }
+    set_last_index(file);
+}
+
+/* free all the data blocks of root directory entry @root_index */
+void free_blocks(int root_index)
+{
+    rootdir_t dir = &fs->root[root_index];
+    if(!extents_enabled()){
+        free_FAT(dir->first_index);
+        return;
+    }
+    struct extent* extents = malloc(EXTENT_MAX(fs->block_size) * sizeof(struct extent));
+    int count = load_extents(root_index, extents);
+    for(int i = 0; i < count; i++){
+        for(int j = extents[i].start; j < extents[i].start + extents[i].length; j++)
+            fs->FAT[j] = 0;
+    }
+    if(dir->extent_block)
+        fs->FAT[dir->extent_block] = 0;
+    free(extents);
+}
+
+int do_create(const char *filename)
+{
+    /* error checking:  @filename is invalid, @filename is too long */
+    if(check_file(filename) || fs->read_only)
+        return -1;
+    /* error checking: the root directory already contains %FS_FILE_MAX_COUNT files */
     if(get_empty_dir_num() <= 0)
         return -1;
     /* error checking: a file named @filename already exists */
     if(get_dir(filename) != -1)
         return -1;
     
-    /* find first empty data block and root directory spot */
-    int empty_blk = get_empty_block();
-    if(empty_blk == -1)
-        return -1;
+    /* find first empty root directory spot, data blocks are only allocated
+     * once the file is written to */
     int empty_dir = get_dir("\0");
     
-    strcpy(root[empty_dir].filename, filename);
-    root[empty_dir].file_size = 0;
-    root[empty_dir].first_index = empty_blk;
-    FAT[empty_blk] = FAT_EOC;
+    strcpy(fs->root[empty_dir].filename, filename);
+    fs->root[empty_dir].file_size = 0;
+    fs->root[empty_dir].first_index = FAT_EOC;
+    fs->root[empty_dir].frag_index = 0;
+    fs->root[empty_dir].frag_offset = 0;
+    fs->root[empty_dir].extent_len = 0;
+    fs->root[empty_dir].extent_block = 0;
+    fs->root[empty_dir].last_index = FAT_EOC;
     return 0;
 }
 
-int fs_delete(const char *filename)
+int do_delete(const char *filename)
 {
     /* error checking: @filename is invalid */
-    if(check_file(filename))
+    if(check_file(filename) || fs->read_only)
         return -1;
     /* error checking: no file named @filename to delete */
     if(get_dir(filename) == -1)
         return -1;
-    /* error checking: file @filename is currently open */
-    if(file_is_open(filename) != -1)
-        return -1;
+    /* error checking: file @filename is currently open, by this process or
+     * by another one sharing the mount */
     int file_dir = get_dir(filename);
-    strcpy(root[file_dir].filename, "\0");
-    free_FAT(root[file_dir].first_index);
+    if((file_is_open(filename) != -1) || (fs->shared && fs->shared->open_count[file_dir]))
+        return -1;
+    strcpy(fs->root[file_dir].filename, "\0");
+    free_blocks(file_dir);
+    if(fs->root[file_dir].frag_index)
+        release_frag(file_dir);
     return 0;
 }
 
-int fs_ls(void)
+int fs_ls_r(fs_t handle)
 {
+    FS_LOCKED(handle);
     /* error checking: no underlying virtual disk was opened */
-    if(!mounted)
+    if(!fs->mounted)
         return -1;
     
     printf("FS LS:\n");
     for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-        if(strcmp(root[i].filename,"\0") != 0){
-            printf("file: %s, size: %d, ", root[i].filename, root[i].file_size);
-            printf("data_blk: %d\n", root[i].first_index);
+        if(strcmp(fs->root[i].filename,"\0") != 0){
+            printf("file: %s, size: %d, ", fs->root[i].filename, fs->root[i].file_size);
+            printf("data_blk: %d\n", fs->root[i].first_index);
         }
     }
     return 0;
 }
 
+int fs_list_r(fs_t handle, char filenames[][FS_FILENAME_LEN])
+{
+    FS_LOCKED(handle);
+    /* error checking: no underlying virtual disk was opened */
+    if(!fs->mounted)
+        return -1;
+    
+    int count = 0;
+    for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+        if(fs->root[i].filename[0])
+            strcpy(filenames[count++], (char*)fs->root[i].filename);
+    }
+    return count;
+}
+
 /* check the validaty of fd */
 int check_fd(int fd)
 {
-    if(!mounted)
+    if(!fs->mounted)
         return -1;
     if((fd >= FS_OPEN_MAX_COUNT) || (fd < 0))
         return -1;
-    int open_file_index = descriptor_table[fd].open_file_index;
+    int open_file_index = fs->descriptor_table[fd].open_file_index;
     if((open_file_index >= FS_OPEN_MAX_COUNT) || (open_file_index < 0))
         return -1;
-    if(!strcmp(file_table[open_file_index].filename, "\0"))
+    if(!strcmp(fs->file_table[open_file_index].filename, "\0"))
         return -1;
     return open_file_index;
 }
 
-int fs_open(const char *filename)
+int do_open(const char *filename)
 {
     /* error checking: @filename is invalid */
     if(check_file(filename))
@@ -386,14 +1555,21 @@ int fs_open(const char *filename)
         return -1;
     if(open_file_index != -1){
         /* if the file is already opened before, set a new file descriptor */
-        file_table[open_file_index].open_count++;
+        fs->file_table[open_file_index].open_count++;
         reset_descriptor(fd, 0, open_file_index);
     } else {
         /* if the file is not opened before, set new open file entry and descriptor */
         open_file_index = get_empty_open_file();
         if(open_file_index != -1){
             reset_file(open_file_index, filename, 1, get_dir(filename));
+            if(map_load(open_file_index)){
+                free(fs->file_table[open_file_index].map);
+                reset_file(open_file_index, "\0", 0, FS_FILE_MAX_COUNT);
+                return -1;
+            }
             reset_descriptor(fd, 0, open_file_index);
+            if(fs->shared)
+                fs->shared->open_count[fs->file_table[open_file_index].root_index]++;
         } else {
             return -1;
         }
@@ -401,7 +1577,529 @@ int fs_open(const char *filename)
     return fd;
 }
 
-int fs_close(int fd)
+/* move the tail of a file that is being closed from its last data block into
+ * a shared fragment block */
+void pack_file(int open_file_index)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    int root_index = file->root_index;
+    rootdir_t dir = &fs->root[root_index];
+    uint32_t tail = dir->file_size % fs->block_size;
+    if(!fragments_enabled() || dir->frag_index || !tail || tail > FRAG_PACK_MAX)
+        return;
+    int run;
+    int block = map_lookup(file, dir->file_size / fs->block_size, &run);
+    if(block == FAT_EOC)
+        return;
+    /* packing is skipped rather than leaving the extents half updated */
+    if((file->map_count > 1) && need_extent_block(file) && !have_room(file, 1))
+        return;
+    
+    uint32_t offset;
+    int frag = alloc_frag(tail, &offset);
+    if(frag == -1){
+        /* no fragment block has room left: the tail block becomes one, the
+         * tail already sits at its beginning */
+        map_truncate(open_file_index, dir->file_size / fs->block_size);
+        fs->FAT[block] = FAT_EOC;
+        frag = block;
+        offset = 0;
+    } else {
+        void* buf = malloc(fs->block_size);
+        int ret = read_blocks(fs->super_block->data_start_index + block, 1, buf) ||
+                  load_frag(frag);
+        if(!ret){
+            memcpy(fs->frag_cache + offset, buf, tail);
+            ret = write_block(fs->super_block->data_start_index + frag, fs->frag_cache);
+        }
+        free(buf);
+        if(ret){
+            fs->frag_cache_index = 0;
+            return;
+        }
+        map_truncate(open_file_index, dir->file_size / fs->block_size);
+    }
+    
+    map_store(open_file_index);
+    dir->frag_index = frag;
+    dir->frag_offset = offset / FRAG_OFFSET_UNIT(fs->block_size);
+    mark_frag(root_index);
+}
+
+/* move the tail of a file back from its fragment block to a data block at the
+ * end of the file, so that it can be written to */
+int unpack_file(int open_file_index)
+{
+    int root_index = fs->file_table[open_file_index].root_index;
+    rootdir_t dir = &fs->root[root_index];
+    uint32_t tail = dir->file_size % fs->block_size;
+    if(load_frag(dir->frag_index))
+        return -1;
+    
+    void* buf = calloc(1, fs->block_size);
+    memcpy(buf, fs->frag_cache + frag_offset(dir), tail);
+    
+    /* a commit reclaiming the freed blocks may keep the fragment block, so
+     * it comes first */
+    open_file_t file = &fs->file_table[open_file_index];
+    int extent = file->map_count && need_extent_block(file);
+    journal_reclaim(1 + extent);
+    /* if the tail is alone in its fragment block, keep that block */
+    frag_block_t frag = get_frag(dir->frag_index);
+    int alone = (frag->used == frag_mask(frag_offset(dir), tail)) && !block_is_shared(dir->frag_index);
+    /* error checking: no room for the block, or for the extent block the
+     * file may need along with it */
+    if(get_empty_block_num() - fs->reserved_blocks < !alone + extent){
+        free(buf);
+        return -1;
+    }
+    int block = alone ? dir->frag_index : get_empty_block();
+    if((block == -1) || write_block(fs->super_block->data_start_index + block, buf)){
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    
+    if(alone){
+        fs->frag_cache_index = 0;
+        *frag = fs->frag_table[--fs->frag_count];
+        dir->frag_index = 0;
+        dir->frag_offset = 0;
+    } else {
+        release_frag(root_index);
+    }
+    link_blocks(open_file_index, block, 1);
+    return map_store(open_file_index);
+}
+
+/* find a run of free blocks of length @block_num, or the longest one if there
+ * is none, and store its length in @run; a run starting at block @hint is
+ * preferred so that files grow contiguously */
+int find_free_run(int hint, int block_num, int *run)
+{
+    int best = -1, best_run = 0;
+    int start = -1;
+    
+    if((hint < fs->super_block->data_amount) && block_is_allocatable(hint)){
+        for(*run = 0; (*run < block_num) && (hint + *run < fs->super_block->data_amount); (*run)++){
+            if(!block_is_allocatable(hint + *run))
+                break;
+        }
+        STATS_ALLOC_SCAN(*run + 1);
+        return hint;
+    }
+    for(int i = 0; i <= fs->super_block->data_amount; i++){
+        if((i < fs->super_block->data_amount) && block_is_allocatable(i)){
+            if(start == -1)
+                start = i;
+            if(i - start + 1 == block_num){
+                STATS_ALLOC_SCAN(i + 1);
+                *run = block_num;
+                return start;
+            }
+        } else if(start != -1){
+            if(i - start > best_run){
+                best = start;
+                best_run = i - start;
+            }
+            start = -1;
+        }
+    }
+    STATS_ALLOC_SCAN(fs->super_block->data_amount);
+    *run = best_run;
+    return best;
+}
+
+/* allocate @block_num data blocks at the end of an open file, in as few
+ * contiguous runs as possible */
+int alloc_blocks(int open_file_index, int block_num)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    int run;
+    
+    if(get_empty_block_num() < block_num)
+        return -1;
+    journal_reclaim(block_num + need_extent_block(file));
+    uint32_t old_blocks = map_blocks(file);
+    while(block_num > 0){
+        uint16_t last = map_last(file);
+        int start = find_free_run((last == FAT_EOC) ? 0 : last + 1, block_num, &run);
+        if(!run)
+            break;
+        link_blocks(open_file_index, start, run);
+        block_num -= run;
+    }
+    /* error checking: no room left for all the blocks or for a new extent
+     * block, the file goes back to the blocks it had */
+    if(block_num || map_store(open_file_index)){
+        map_truncate(open_file_index, old_blocks);
+        map_store(open_file_index);
+        return -1;
+    }
+    return 0;
+}
+
+/* number of bytes of the file that are backed by allocated data blocks */
+size_t get_capacity(int open_file_index)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    if(file->pending_size)
+        return file->pending_start;
+    return (size_t)map_blocks(file) * fs->block_size;
+}
+
+/* allocate the blocks of the pending data of an open file and write it */
+int flush_file(int open_file_index)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    if(!file->pending_size)
+        return 0;
+    int block_num = (file->pending_size + fs->block_size - 1) / fs->block_size;
+    uint32_t first_block = map_blocks(file);
+    int ret = 0;
+    
+    /* the whole pending data is placed at once, right after the last block
+     * of the file if possible, and written with one request per run */
+    fs->reserved_blocks -= block_num + file->pending_spare;
+    if(alloc_blocks(open_file_index, block_num)){
+        /* the pending data is lost, the file ends where its blocks do */
+        rootdir_t dir = &fs->root[file->root_index];
+        if(dir->file_size > file->pending_start)
+            dir->file_size = file->pending_start;
+        ret = -1;
+    } else {
+        for(int i = 0; i < block_num; ){
+            int run;
+            int block = map_lookup(file, first_block + i, &run);
+            if(run > block_num - i)
+                run = block_num - i;
+            if(write_block_range(fs->super_block->data_start_index + block, run, file->pending + (size_t)i * fs->block_size))
+                ret = -1;
+            i += run;
+        }
+    }
+    
+    fs->pending_total -= file->pending_size;
+    free(file->pending);
+    file->pending = NULL;
+    file->pending_size = 0;
+    file->pending_spare = 0;
+    return ret;
+}
+
+/* flush the pending data of every open file */
+int flush_all(void)
+{
+    int ret = 0;
+    for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+        if(flush_file(i))
+            ret = -1;
+    }
+    return ret;
+}
+
+int do_sync(void)
+{
+    /* error checking: no underlying virtual disk was opened */
+    if(!fs->mounted)
+        return -1;
+    /* a snapshot has nothing to write back */
+    if(fs->read_only)
+        return 0;
+    int ret = flush_all();
+    if(fs->journal_fat ? journal_commit() : write_metadata())
+        ret = -1;
+    return ret;
+}
+
+/* count the data blocks of root directory entry @root_index in @blocks, and
+ * the runs of consecutive data blocks they form in @runs */
+int count_runs(int root_index, size_t *blocks, size_t *runs)
+{
+    rootdir_t dir = &fs->root[root_index];
+    *blocks = 0;
+    *runs = 0;
+    if(!extents_enabled()){
+        uint16_t prev = FAT_EOC;
+        for(uint16_t i = dir->first_index; (i != FAT_EOC) && (*blocks < fs->super_block->data_amount); i = fs->FAT[i]){
+            if((prev == FAT_EOC) || (i != prev + 1))
+                (*runs)++;
+            (*blocks)++;
+            prev = i;
+        }
+        return 0;
+    }
+    struct extent* extents = malloc(EXTENT_MAX(fs->block_size) * sizeof(struct extent));
+    int count = load_extents(root_index, extents);
+    for(int i = 0; i < count; i++){
+        if(!i || (extents[i].start != extents[i - 1].start + extents[i - 1].length))
+            (*runs)++;
+        *blocks += extents[i].length;
+    }
+    free(extents);
+    return (count < 0) ? -1 : 0;
+}
+
+int fs_frag_info_r(fs_t handle, const char *filename, struct fs_frag_info *info)
+{
+    FS_LOCKED(handle);
+    /* error checking: no underlying virtual disk was opened */
+    if(!fs->mounted || !info)
+        return -1;
+    int only = -1;
+    if(filename){
+        /* error checking: @filename is invalid, or there is no such file */
+        if(check_file(filename))
+            return -1;
+        only = get_dir(filename);
+        if(only == -1)
+            return -1;
+    }
+    
+    memset(info, 0, sizeof(struct fs_frag_info));
+    for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+        size_t blocks, runs;
+        if(!fs->root[i].filename[0] || ((only != -1) && (i != only)))
+            continue;
+        if(count_runs(i, &blocks, &runs))
+            return -1;
+        info->files++;
+        if(runs > 1)
+            info->fragmented_files++;
+        info->blocks += blocks;
+        info->extents += runs;
+    }
+    
+    /* data block 0 is reserved, so free runs are looked for from block 1 */
+    size_t run = 0;
+    for(int i = 1; i <= fs->super_block->data_amount; i++){
+        if((i < fs->super_block->data_amount) && block_is_free(i)){
+            if(!run++)
+                info->free_extents++;
+            info->free_blocks++;
+        } else {
+            if(run > info->largest_free_extent)
+                info->largest_free_extent = run;
+            run = 0;
+        }
+    }
+    return 0;
+}
+
+/* rebuild the block map of an open file so that its blocks @block to
+ * @block + @length - 1, which belong to a single extent, start at data block
+ * @dest instead */
+void map_move(open_file_t file, uint32_t block, uint16_t dest, uint16_t length)
+{
+    map_extent_t old = file->map;
+    int count = file->map_count;
+    file->map = NULL;
+    file->map_count = 0;
+    for(int i = 0; i < count; i++){
+        map_extent_t ext = &old[i];
+        if((block >= ext->block + ext->length) || (block + length <= ext->block)){
+            map_append(file, ext->start, ext->length);
+            continue;
+        }
+        uint16_t head = block - ext->block;
+        if(head)
+            map_append(file, ext->start, head);
+        map_append(file, dest, length);
+        if(head + length < ext->length)
+            map_append(file, ext->start + head + length, ext->length - head - length);
+    }
+    free(old);
+}
+
+/* write the FAT chain or the extents of an open file back from its block map */
+int map_relink(int open_file_index)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    rootdir_t dir = &fs->root[file->root_index];
+    if(!extents_enabled()){
+        for(int i = 0; i < file->map_count; i++){
+            map_extent_t ext = &file->map[i];
+            for(int j = ext->start; j + 1 < ext->start + ext->length; j++)
+                fs->FAT[j] = j + 1;
+            fs->FAT[ext->start + ext->length - 1] = (i + 1 < file->map_count) ? file->map[i + 1].start : FAT_EOC;
+        }
+        dir->first_index = file->map_count ? file->map[0].start : FAT_EOC;
+    }
+    set_last_index(file);
+    return map_store(open_file_index);
+}
+
+/* move @length data blocks of an open file, from its block @block on, to the
+ * free data blocks starting at @dest; the data is copied before the FAT and
+ * the block map get changed, so the old blocks are only released once their
+ * content is safe */
+int move_blocks(int open_file_index, uint32_t block, uint16_t dest, uint16_t length)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    int run;
+    int src = map_lookup(file, block, &run);
+    if((src == FAT_EOC) || (run < length))
+        return -1;
+    
+    void* buf = malloc((size_t)length * fs->block_size);
+    int ret = read_blocks(fs->super_block->data_start_index + src, length, buf) ||
+              write_block_range(fs->super_block->data_start_index + dest, length, buf);
+    free(buf);
+    if(ret)
+        return -1;
+    
+    for(int i = 0; i < length; i++){
+        fs->FAT[dest + i] = FAT_EOC;
+        fs->FAT[src + i] = 0;
+    }
+    map_move(file, block, dest, length);
+    if(!map_relink(open_file_index))
+        return 0;
+    /* error checking: no room for a new extent block, the blocks stay */
+    for(int i = 0; i < length; i++){
+        fs->FAT[dest + i] = 0;
+        fs->FAT[src + i] = FAT_EOC;
+    }
+    map_move(file, block, src, length);
+    map_relink(open_file_index);
+    return -1;
+}
+
+/* make an open file more contiguous by moving at most @budget of its data
+ * blocks, and return the number of blocks moved */
+int defrag_file(int open_file_index, size_t budget)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    if(file->map_partial)
+        map_load_chain(file);
+    if(file->map_count <= 1)
+        return 0;
+    if(budget > DEFRAG_CHUNK)
+        budget = DEFRAG_CHUNK;
+    journal_reclaim(need_extent_block(file));
+    
+    /* grow an extent over the free blocks right after it, with the blocks
+     * of the extent that follows it */
+    for(int i = 1; i < file->map_count; i++){
+        map_extent_t prev = &file->map[i - 1];
+        int dest = prev->start + prev->length;
+        int length = 0;
+        while((length < file->map[i].length) && (length < budget) &&
+              (dest + length < fs->super_block->data_amount) && block_is_allocatable(dest + length))
+            length++;
+        /* the blocks reserved for pending data cannot be used, even briefly,
+         * and the extent block may have to be replaced; the moved blocks
+         * count as still in use, as a snapshot or the journal may keep them */
+        int available = get_empty_block_num() - fs->reserved_blocks - need_extent_block(file);
+        if(length > available)
+            length = available;
+        if(length > 0){
+            /* the new extent block must be allocatable besides @dest */
+            journal_reclaim(length + need_extent_block(file));
+            return move_blocks(open_file_index, file->map[i].block, dest, length) ? -1 : length;
+        }
+    }
+    
+    /* otherwise start moving the file to a free run that can hold all of it,
+     * its other extents then follow by growing the first one */
+    uint32_t block_num = map_blocks(file);
+    int run;
+    int start = find_free_run(fs->super_block->data_amount, block_num, &run);
+    if((start == -1) || (run < block_num) || (get_empty_block_num() - fs->reserved_blocks - need_extent_block(file) < block_num))
+        return 0;
+    int length = (file->map[0].length < budget) ? file->map[0].length : budget;
+    /* splitting the first extent must not overflow the extent block */
+    if(extents_enabled() && (file->map_count >= EXTENT_MAX(fs->block_size)))
+        length = file->map[0].length;
+    journal_reclaim(length + need_extent_block(file));
+    return move_blocks(open_file_index, 0, start, length) ? -1 : length;
+}
+
+/* milliseconds elapsed since @begin */
+long elapsed_msecs(struct timespec *begin)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) * 1000 + (now.tv_nsec - begin->tv_nsec) / 1000000;
+}
+
+int do_defrag(size_t max_blocks, unsigned int max_msecs)
+{
+    /* error checking: no underlying virtual disk was opened */
+    if(!fs->mounted || fs->read_only)
+        return -1;
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    
+    size_t moved = 0;
+    int progress = 1;
+    /* a pass only makes progress if it leaves the files in fewer extents
+     * overall; moving their blocks between free runs, along with their
+     * extent blocks, does not count */
+    while(progress){
+        int before = 0, after = 0;
+        for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+            if(!fs->root[i].filename[0])
+                continue;
+            if((max_blocks && (moved >= max_blocks)) || (max_msecs && (elapsed_msecs(&begin) >= max_msecs)))
+                return moved;
+            
+            /* files that are not open get a temporary open file entry, so
+             * that they can be handled through their block map as well */
+            int open_file_index = file_is_open(fs->root[i].filename);
+            int temporary = (open_file_index == -1);
+            int ret = 0;
+            if(temporary){
+                open_file_index = get_empty_open_file();
+                if(open_file_index == -1)
+                    continue;
+                reset_file(open_file_index, fs->root[i].filename, 0, i);
+                ret = map_load(open_file_index);
+            }
+            open_file_t file = &fs->file_table[open_file_index];
+            if(!ret && file->map_partial)
+                map_load_chain(file);
+            
+            /* the file is worked on until it stops getting into fewer
+             * extents, or as many of its blocks as it holds were moved
+             * without that */
+            int best = file->map_count;
+            size_t wasted = 0;
+            before += file->map_count;
+            while(!ret){
+                if((max_blocks && (moved >= max_blocks)) || (max_msecs && (elapsed_msecs(&begin) >= max_msecs)))
+                    break;
+                ret = defrag_file(open_file_index, max_blocks ? max_blocks - moved : SIZE_MAX);
+                if(ret <= 0)
+                    break;
+                /* the moved blocks only get released on disk along with the
+                 * metadata that no longer points to them */
+                if(write_metadata()){
+                    ret = -1;
+                    break;
+                }
+                moved += ret;
+                if(file->map_count < best){
+                    best = file->map_count;
+                    wasted = 0;
+                } else if((wasted += ret) > map_blocks(file))
+                    break;
+                ret = 0;
+            }
+            after += file->map_count;
+            if(temporary){
+                free(file->map);
+                reset_file(open_file_index, "\0", 0, FS_FILE_MAX_COUNT);
+            }
+            if(ret == -1)
+                return -1;
+        }
+        progress = (after < before);
+    }
+    return moved;
+}
+
+int do_close(int fd)
 {
     /* error checking: file descriptor @fd is invalid */
     int open_file_index = check_fd(fd);
@@ -409,25 +2107,49 @@ int fs_close(int fd)
         return -1;
     reset_descriptor(fd, 0, -1);
     /* if there is no opening descriptor of this file, delete the open file entry */
-    if((--file_table[open_file_index].open_count) <= 0)
+    int ret = 0;
+    if((--fs->file_table[open_file_index].open_count) <= 0){
+        ret = flush_file(open_file_index);
+        /* the file stays as is while other processes have it open */
+        int last = !fs->shared || (fs->shared->open_count[fs->file_table[open_file_index].root_index] == 1);
+        /* release the preallocated blocks that were not written to; the
+         * extents left only need a block of their own if there are several */
+        open_file_t file = &fs->file_table[open_file_index];
+        rootdir_t dir = &fs->root[file->root_index];
+        uint32_t keep = (dir->file_size + fs->block_size - 1) / fs->block_size;
+        int extent_count = 0;
+        for(int i = 0; i < file->map_count; i++)
+            extent_count += (file->map[i].block < keep);
+        if(!fs->read_only && last && !dir->frag_index && (map_blocks(file) > keep) &&
+           ((extent_count <= 1) || have_room(file, 0))){
+            map_truncate(open_file_index, keep);
+            if(map_store(open_file_index))
+                ret = -1;
+        }
+        if(!fs->read_only && last)
+            pack_file(open_file_index);
+        if(fs->shared)
+            fs->shared->open_count[fs->file_table[open_file_index].root_index]--;
+        free(fs->file_table[open_file_index].map);
         reset_file(open_file_index, "\0", 0, FS_FILE_MAX_COUNT);
-    return 0;
+    }
+    return ret;
 }
 
-int fs_stat(int fd)
+int do_stat(int fd)
 {
     /* error checking: file descriptor @fd is invalid */
     int open_file_index = check_fd(fd);
     if (open_file_index == -1)
         return -1;
-    int root_index = file_table[open_file_index].root_index;
-    return root[root_index].file_size;
+    int root_index = fs->file_table[open_file_index].root_index;
+    return fs->root[root_index].file_size;
 }
 
 /* check whether the offset is validate */
 int check_offset(int fd, size_t offset)
 {
-    int file_size = fs_stat(fd);
+    int file_size = do_stat(fd);
     if(file_size < 0)
         return -1;
     if((offset < 0) || (offset > file_size))
@@ -435,7 +2157,7 @@ int check_offset(int fd, size_t offset)
     return 0;
 }
 
-int fs_lseek(int fd, size_t offset)
+int do_lseek(int fd, size_t offset)
 {
     /* error checking: file descriptor @fd is invalid */
     if (check_fd(fd) == -1)
@@ -444,198 +2166,369 @@ int fs_lseek(int fd, size_t offset)
     if(check_offset(fd, offset))
         return -1;
     
-    descriptor_table[fd].offset = offset;
+    fs->descriptor_table[fd].offset = offset;
     return 0;
 }
 
-int get_block_index_by_offset(int fd, size_t offset)
+/* root directory entry of the file opened by @fd */
+rootdir_t get_fd_dir(int fd)
 {
-    int fd_index = descriptor_table[fd].open_file_index;
-    int root_index = file_table[fd_index].root_index;
-    int block_index = root[root_index].first_index;
-    size_t block_num = offset / BLOCK_SIZE;
-    while(block_num > 0){
-        block_index = FAT[block_index];
-        block_num--;
-    }
-    return block_index;
+    int fd_index = fs->descriptor_table[fd].open_file_index;
+    return &fs->root[fs->file_table[fd_index].root_index];
 }
 
 /* update file size and offset after writing */
 void update_size(int fd, size_t count){
-    int file_size = fs_stat(fd);
-    int fd_index = descriptor_table[fd].open_file_index;
-    int root_index = file_table[fd_index].root_index;
-    size_t offset = descriptor_table[fd].offset;
+    int file_size = do_stat(fd);
+    rootdir_t dir = get_fd_dir(fd);
+    size_t offset = fs->descriptor_table[fd].offset;
     
     if(offset + count > file_size)
-        root[root_index].file_size = offset + count;
-    descriptor_table[fd].offset += count;
+        dir->file_size = offset + count;
+    fs->descriptor_table[fd].offset += count;
 }
 
-/* allocate new data block for the file if there isn't enough space for writing */
-int allocate_new_block(int fd, size_t written_size)
+/* read @read_size bytes from byte @offset of block @blk_index into buffer */
+int read_by_blk(int blk_index, void *buf, size_t offset, size_t read_size)
 {
-    int fd_index = descriptor_table[fd].open_file_index;
-    int root_index = file_table[fd_index].root_index;
-    int block_index = root[root_index].first_index;
-    size_t offset = descriptor_table[fd].offset;
-    size_t new_block_num = (offset + written_size - 1) / BLOCK_SIZE;
-    int new_block_index;
+    /* a whole block can be read directly into the buffer */
+    if(read_size == fs->block_size)
+        return read_blocks(blk_index, 1, buf);
     
-    while(new_block_num > 0){
-        if(FAT[block_index] == FAT_EOC){
-            new_block_index = get_empty_block();
-            if(new_block_index == -1)
-                return -1;
-            FAT[block_index] = new_block_index;
-            FAT[new_block_index] = FAT_EOC;
-        } else {
-            new_block_index = FAT[block_index];
-        }
-        block_index = new_block_index;
-        new_block_num--;
-    }
-    return 0;
+    void* my_buf = malloc(fs->block_size);
+    int ret = read_blocks(blk_index, 1, my_buf);
+    if(!ret)
+        memcpy(buf, my_buf + offset, read_size);
+    free(my_buf);
+    return ret;
 }
 
-void read_by_blk(int blk_index, void *buf, size_t read_size, enum block_type type, int fd)
+/* read @read_size bytes from byte @offset of the consecutive blocks starting
+ * at block @blk_index into buffer */
+int read_run(int blk_index, void *buf, size_t offset, size_t read_size)
 {
-    void* my_buf = malloc(BLOCK_SIZE);
-    block_read(blk_index, my_buf);
-    switch(type){
-        /* read the latter part of block into buffer*/
-        case First:
-            memcpy(buf, my_buf + BLOCK_SIZE - read_size, read_size);
-            break;
-        /* read the whole block into buffer*/
-        case Middle:
-            memcpy(buf, my_buf, BLOCK_SIZE);
-            break;
-        /* read the former part of block into buffer*/
-        case Last:
-            memcpy(buf, my_buf, read_size);
-            break;
-        /* read only middle part of block into buffer*/
-        case Short:
-            memcpy(buf, my_buf + descriptor_table[fd].offset % BLOCK_SIZE, read_size);
-            break;
+    /* a partial first block goes through a bounce buffer */
+    if(offset || (read_size < fs->block_size)){
+        size_t size = fs->block_size - offset;
+        if(size > read_size)
+            size = read_size;
+        if(read_by_blk(blk_index, buf, offset, size))
+            return -1;
+        blk_index++;
+        buf += size;
+        read_size -= size;
     }
-    free(my_buf);
+    /* whole blocks are read directly into the buffer with a single request,
+     * queued until the whole read is */
+    if(read_size >= fs->block_size){
+        size_t count = read_size / fs->block_size;
+        if(queue_read_blocks(blk_index, count, buf))
+            return -1;
+        blk_index += count;
+        buf += count * fs->block_size;
+        read_size -= count * fs->block_size;
+    }
+    if(read_size)
+        return read_by_blk(blk_index, buf, 0, read_size);
+    return 0;
 }
 
 size_t read_blks(int fd, void *buf, size_t read_size)
 {
-    size_t data_amount = read_size;
-    int first_block_amount = BLOCK_SIZE - (descriptor_table[fd].offset % BLOCK_SIZE);
-    int current_block = get_block_index_by_offset(fd, descriptor_table[fd].offset);
-    void* buf_index = buf;
+    rootdir_t dir = get_fd_dir(fd);
+    open_file_t file = &fs->file_table[fs->descriptor_table[fd].open_file_index];
+    size_t offset = fs->descriptor_table[fd].offset;
+    size_t data_amount = 0;
     
-    /* if the reading data is among a block and not reach the end of the block */
-    if(read_size <= first_block_amount){
-        read_by_blk(super_block->data_start_index + current_block, buf_index, read_size, Short, fd);
-        descriptor_table[fd].offset += read_size;
-        return read_size;
-    /* if the reading data is across multiple blocks */
-    } else {
-        /* read the former part of block */
-        read_by_blk(super_block->data_start_index + current_block, buf_index, first_block_amount, First, fd);
-        current_block = FAT[current_block];
-        buf_index += first_block_amount;
-        data_amount -= first_block_amount;
-        /* read the whole blocks */
-        while(data_amount > BLOCK_SIZE){
-            read_by_blk(super_block->data_start_index + current_block, buf_index, BLOCK_SIZE, Middle, fd);
-            current_block = FAT[current_block];
-            buf_index += BLOCK_SIZE;
-            data_amount -= BLOCK_SIZE;
-        }
-        /* read the remaining part of block */
-        read_by_blk(super_block->data_start_index + current_block, buf_index, data_amount, Last, fd);
-        descriptor_table[fd].offset += read_size;
-        return read_size;
+    /* the runs of the file are read by increasing block once all queued, the
+     * ones next to each other on disk with a single request */
+    block_queue_plug();
+    while(data_amount < read_size){
+        size_t blk_offset = offset % fs->block_size;
+        size_t size = read_size - data_amount;
+        int run;
+        int block = map_lookup(file, offset / fs->block_size, &run);
+        
+        if(file->pending_size && (offset >= file->pending_start)){
+            /* the data is still pending in memory */
+            memcpy(buf + data_amount, file->pending + offset - file->pending_start, size);
+        } else if(dir->frag_index && (offset / fs->block_size == dir->file_size / fs->block_size)){
+            /* the tail of the file is packed in a fragment block */
+            if(size > fs->block_size - blk_offset)
+                size = fs->block_size - blk_offset;
+            if(load_frag(dir->frag_index))
+                break;
+            memcpy(buf + data_amount, fs->frag_cache + frag_offset(dir) + blk_offset, size);
+        } else {
+            /* read up to the end of the run of consecutive blocks */
+            if(block == FAT_EOC)
+                break;
+            if(size > (size_t)run * fs->block_size - blk_offset)
+                size = (size_t)run * fs->block_size - blk_offset;
+            if(read_run(fs->super_block->data_start_index + block, buf + data_amount, blk_offset, size))
+                break;
+        }
+        data_amount += size;
+        offset += size;
     }
+    if(block_queue_unplug())
+        return 0;
+    fs->descriptor_table[fd].offset = offset;
+    return data_amount;
 }
 
-void write_by_blk(int blk_index, void *buf, size_t write_size, enum block_type type, int fd)
+/* write @write_size bytes from buffer at byte @offset of block @blk_index */
+int write_by_blk(int blk_index, void *buf, size_t offset, size_t write_size)
 {
-    void* my_buf = malloc(BLOCK_SIZE);
-    block_read(blk_index, my_buf);
-    switch(type){
-        /* read the latter part of block into buffer*/
-        case First:
-            memcpy(my_buf + BLOCK_SIZE - write_size, buf, write_size);
-            break;
-        /* read the whole block into buffer*/
-        case Middle:
-            memcpy(my_buf, buf, BLOCK_SIZE);
-            break;
-        /* read the former part of block into buffer*/
-        case Last:
-            memcpy(my_buf, buf, write_size);
-            break;
-        /* read only middle part of block into buffer*/
-        case Short:
-            memcpy(my_buf + descriptor_table[fd].offset % BLOCK_SIZE, buf, write_size);
-            break;
+    /* a whole block is overwritten, there is nothing to preserve */
+    if(write_size == fs->block_size)
+        return write_block(blk_index, buf);
+    
+    void* my_buf = malloc(fs->block_size);
+    int ret = read_blocks(blk_index, 1, my_buf);
+    if(!ret){
+        memcpy(my_buf + offset, buf, write_size);
+        ret = write_block(blk_index, my_buf);
     }
-    block_write(blk_index, my_buf);
     free(my_buf);
+    return ret;
 }
 
-size_t write_blks(int fd, void *buf, size_t write_size)
+/* write @write_size bytes from buffer at byte @offset of the consecutive blocks
+ * starting at block @blk_index */
+int write_run(int blk_index, void *buf, size_t offset, size_t write_size)
 {
-    size_t data_amount = write_size;
-    int first_block_amount = BLOCK_SIZE - (descriptor_table[fd].offset % BLOCK_SIZE);
-    int current_block = get_block_index_by_offset(fd, descriptor_table[fd].offset);
-    void* buf_index = buf;
-    
-    /* if the written part is among a block and not reach the end of the block */
-    if(write_size <= first_block_amount){
-        write_by_blk(super_block->data_start_index + current_block, buf_index, write_size, Short, fd);
-        update_size(fd, write_size);
-        return write_size;
-    /* if the writing data is across multiple blocks */
-    } else {
-        /* write the former part of block */
-        write_by_blk(super_block->data_start_index + current_block, buf_index, first_block_amount, First, fd);
-        current_block = FAT[current_block];
-        buf_index += first_block_amount;
-        data_amount -= first_block_amount;
-        /* write the whole blocks */
-        while(data_amount > BLOCK_SIZE){
-            /* if the underlying disk runs out of space, write as many bytes as possible */
-            if(current_block == FAT_EOC){
-                update_size(fd, write_size - data_amount);
-                return write_size - data_amount;
-            }
-            write_by_blk(super_block->data_start_index + current_block, buf_index, BLOCK_SIZE, Middle, fd);
-            current_block = FAT[current_block];
-            buf_index += BLOCK_SIZE;
-            data_amount -= BLOCK_SIZE;
+    /* a partial first block is read, modified and written back */
+    if(offset || (write_size < fs->block_size)){
+        size_t size = fs->block_size - offset;
+        if(size > write_size)
+            size = write_size;
+        if(write_by_blk(blk_index, buf, offset, size))
+            return -1;
+        blk_index++;
+        buf += size;
+        write_size -= size;
+    }
+    /* whole blocks are written directly from the buffer with a single
+     * request, queued until the whole write is */
+    if(write_size >= fs->block_size){
+        size_t count = write_size / fs->block_size;
+        if(queue_block_range(blk_index, count, buf))
+            return -1;
+        blk_index += count;
+        buf += count * fs->block_size;
+        write_size -= count * fs->block_size;
+    }
+    if(write_size)
+        return write_by_blk(blk_index, buf, 0, write_size);
+    return 0;
+}
+
+/* give an open file copies of its blocks @block to @block + @count - 1 that
+ * are kept by a snapshot, so that they can be written to without changing the
+ * snapshot */
+int unshare_blocks(int open_file_index, uint32_t block, int count)
+{
+    open_file_t file = &fs->file_table[open_file_index];
+    while(count > 0){
+        int run;
+        int start = map_lookup(file, block, &run);
+        if(start == FAT_EOC)
+            return -1;
+        if(run > count)
+            run = count;
+        int length = 0;
+        while((length < run) && !fs->snap_refs[start + length])
+            length++;
+        if(!length){
+            while((length < run) && fs->snap_refs[start + length])
+                length++;
+            /* the blocks reserved for pending data cannot be used */
+            int available = get_empty_block_num() - fs->reserved_blocks - need_extent_block(file);
+            if(length > available)
+                length = available;
+            if(length <= 0)
+                return -1;
+            journal_reclaim(length + need_extent_block(file));
+            int dest = find_free_run(fs->super_block->data_amount, length, &length);
+            if((dest == -1) || !length)
+                return -1;
+            if(file->map_partial)
+                map_load_chain(file);
+            if(move_blocks(open_file_index, block, dest, length))
+                return -1;
         }
-        /* write the remaining part of block */
-        write_by_blk(super_block->data_start_index + current_block, buf_index, data_amount, Last, fd);
-        update_size(fd, write_size);
-        return write_size;
+        block += length;
+        count -= length;
     }
+    return 0;
 }
 
+size_t write_blks(int fd, void *buf, size_t write_size)
+{
+    open_file_t file = &fs->file_table[fs->descriptor_table[fd].open_file_index];
+    size_t offset = fs->descriptor_table[fd].offset;
+    size_t data_amount = 0;
+    
+    /* the runs of the file are written by increasing block once all queued */
+    block_queue_plug();
+    while(data_amount < write_size){
+        size_t blk_offset = offset % fs->block_size;
+        size_t size = write_size - data_amount;
+        int run;
+        int block = map_lookup(file, offset / fs->block_size, &run);
+        
+        /* if the underlying disk runs out of space, write as many bytes as possible */
+        if(block == FAT_EOC)
+            break;
+        /* write up to the end of the run of consecutive blocks */
+        if(size > (size_t)run * fs->block_size - blk_offset)
+            size = (size_t)run * fs->block_size - blk_offset;
+        /* the blocks kept by a snapshot are copied before being written to */
+        if(fs->super_block->snapshot_index){
+            if(unshare_blocks(fs->descriptor_table[fd].open_file_index, offset / fs->block_size, (blk_offset + size + fs->block_size - 1) / fs->block_size))
+                break;
+            block = map_lookup(file, offset / fs->block_size, &run);
+            if(size > (size_t)run * fs->block_size - blk_offset)
+                size = (size_t)run * fs->block_size - blk_offset;
+        }
+        if(write_run(fs->super_block->data_start_index + block, buf + data_amount, blk_offset, size))
+            break;
+        data_amount += size;
+        offset += size;
+    }
+    if(block_queue_unplug())
+        data_amount = 0;
+    update_size(fd, data_amount);
+    return data_amount;
+}
 
-int fs_write(int fd, void *buf, size_t count)
+/* keep the data written past the allocated blocks of a file in memory, as long
+ * as free blocks can be reserved for it */
+size_t write_pending(int fd, void *buf, size_t write_size, size_t capacity)
+{
+    open_file_t file = &fs->file_table[fs->descriptor_table[fd].open_file_index];
+    int spare = 0;
+    if(!file->pending_size){
+        file->pending_start = capacity;
+        spare = need_extent_block(file);
+    }
+    size_t offset = fs->descriptor_table[fd].offset - file->pending_start;
+    size_t end = offset + write_size;
+    
+    /* never keep more than PENDING_MAX bytes in memory */
+    if((end > file->pending_size) && (end - file->pending_size > PENDING_MAX - fs->pending_total))
+        end = file->pending_size + PENDING_MAX - fs->pending_total;
+    /* if the underlying disk runs out of space, write as many bytes as possible */
+    int reserved = (file->pending_size + fs->block_size - 1) / fs->block_size;
+    int block_num = (end + fs->block_size - 1) / fs->block_size;
+    if(block_num > reserved){
+        int available = get_empty_block_num() - fs->reserved_blocks - spare;
+        if(available < 0)
+            available = 0;
+        if(block_num - reserved > available){
+            block_num = reserved + available;
+            if(end > (size_t)block_num * fs->block_size)
+                end = (size_t)block_num * fs->block_size;
+        }
+    }
+    if(end <= offset)
+        return 0;
+    
+    if(block_num > reserved){
+        file->pending = realloc(file->pending, (size_t)block_num * fs->block_size);
+        memset(file->pending + reserved * fs->block_size, 0, (size_t)(block_num - reserved) * fs->block_size);
+        fs->reserved_blocks += block_num - reserved + spare;
+        /* the spare is only reserved along with the first pending block */
+        if(spare)
+            file->pending_spare = spare;
+    }
+    memcpy(file->pending + offset, buf, end - offset);
+    if(end > file->pending_size){
+        fs->pending_total += end - file->pending_size;
+        file->pending_size = end;
+    }
+    update_size(fd, end - offset);
+    return end - offset;
+}
+
+
+int do_write(int fd, void *buf, size_t count)
 {
     /* error checking: file descriptor @fd is invalid */
     int open_file_index = check_fd(fd);
-    if (open_file_index == -1)
+    if ((open_file_index == -1) || fs->read_only)
         return -1;
     
-    allocate_new_block(fd, count);
-    return write_blks(fd, buf, count);
+    /* a packed tail goes back to a block of its own before being written to */
+    rootdir_t dir = get_fd_dir(fd);
+    if(dir->frag_index && unpack_file(open_file_index))
+        return 0;
+    
+    size_t written = 0;
+    while(written < count){
+        size_t capacity = get_capacity(open_file_index);
+        size_t size = count - written;
+        
+        /* the part of the file backed by allocated blocks is written in place */
+        if(fs->descriptor_table[fd].offset < capacity){
+            if(size > capacity - fs->descriptor_table[fd].offset)
+                size = capacity - fs->descriptor_table[fd].offset;
+            size_t done = write_blks(fd, buf + written, size);
+            written += done;
+            if(done < size)
+                break;
+            continue;
+        }
+        
+        /* the rest only gets its blocks once flushed */
+        size = write_pending(fd, buf + written, size, capacity);
+        written += size;
+        if(fs->pending_total >= PENDING_MAX){
+            if(flush_all())
+                break;
+        } else if(!size){
+            break;
+        }
+    }
+    return written;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int do_append(int fd, void *buf, size_t count)
+{
+    /* error checking: file descriptor @fd is invalid */
+    if(check_fd(fd) == -1)
+        return -1;
+    
+    fs->descriptor_table[fd].offset = do_stat(fd);
+    return do_write(fd, buf, count);
+}
+
+int do_preallocate(int fd, size_t size)
+{
+    /* error checking: file descriptor @fd is invalid */
+    int open_file_index = check_fd(fd);
+    if ((open_file_index == -1) || fs->read_only)
+        return -1;
+    
+    /* the pending data and a packed tail get their blocks first, so that the
+     * preallocated ones follow them */
+    rootdir_t dir = get_fd_dir(fd);
+    if((dir->frag_index && unpack_file(open_file_index)) || flush_file(open_file_index))
+        return -1;
+    size_t block_num = (size + fs->block_size - 1) / fs->block_size;
+    size_t allocated = map_blocks(&fs->file_table[open_file_index]);
+    if(block_num <= allocated)
+        return 0;
+    /* error checking: the underlying disk does not have enough free space */
+    if(block_num - allocated + need_extent_block(&fs->file_table[open_file_index]) > (size_t)(get_empty_block_num() - fs->reserved_blocks))
+        return -1;
+    return alloc_blocks(open_file_index, block_num - allocated);
+}
+
+int do_read(int fd, void *buf, size_t count)
 {
-    int file_size = fs_stat(fd);
+    int file_size = do_stat(fd);
     /* error checking: file descriptor @fd is invalid */
     int open_file_index = check_fd(fd);
     if (open_file_index == -1)
@@ -643,21 +2536,1209 @@ int fs_read(int fd, void *buf, size_t count)
     
     int read_size = 0;
     /* if the offset is larger than the file size, nothing can be read */
-    if(descriptor_table[fd].offset >= file_size){
+    if(fs->descriptor_table[fd].offset >= file_size){
         return read_size;
     }
     /* if the part of reading data is within file, reading size is just the count */
-    else if(descriptor_table[fd].offset + count <= file_size){
+    else if(fs->descriptor_table[fd].offset + count <= file_size){
         read_size = count;
     }
     /* if the part of reading data is beyond file, only can read the remaining of file from offset */
     else{
-        read_size = file_size - descriptor_table[fd].offset;
+        read_size = file_size - fs->descriptor_table[fd].offset;
     }
     return read_blks(fd, buf, read_size);
 }
 
+int fs_snapshot_list_r(fs_t handle, char names[][FS_FILENAME_LEN])
+{
+    FS_LOCKED(handle);
+    /* error checking: no underlying virtual disk was opened */
+    if(!fs->mounted)
+        return -1;
+    
+    int count = 0;
+    for(int i = 0; i < FS_SNAPSHOT_MAX; i++){
+        if(fs->snapshots[i].name[0])
+            strcpy(names[count++], fs->snapshots[i].name);
+    }
+    return count;
+}
+
+int do_snapshot(const char *name)
+{
+    /* error checking: @name is invalid, or a snapshot is mounted */
+    if(check_file(name) || fs->read_only)
+        return -1;
+    /* error checking: a snapshot named @name already exists, or there are
+     * already %FS_SNAPSHOT_MAX snapshots */
+    if(get_snapshot(name) != -1)
+        return -1;
+    int index = 0;
+    while((index < FS_SNAPSHOT_MAX) && fs->snapshots[index].name[0])
+        index++;
+    if(index == FS_SNAPSHOT_MAX)
+        return -1;
+    /* the data pending in memory belongs to the snapshot */
+    if(flush_all())
+        return -1;
+    /* error checking: no room for the copies of the metadata, besides the
+     * blocks reserved for pending data */
+    int block_num = fs->super_block->FAT_amount + 1 + !fs->super_block->snapshot_index;
+    journal_reclaim(block_num);
+    if(get_empty_block_num() - fs->reserved_blocks < block_num)
+        return -1;
+    /* the blocks are all taken before anything else changes, and given back
+     * if some cannot be, as the journal may still keep freed blocks */
+    int* blocks = malloc(block_num * sizeof(int));
+    for(int i = 0; i < block_num; i++){
+        blocks[i] = get_empty_block();
+        if(blocks[i] == -1){
+            while(i--)
+                fs->FAT[blocks[i]] = 0;
+            free(blocks);
+            return -1;
+        }
+        fs->FAT[blocks[i]] = FAT_EOC;
+    }
+    
+    /* the snapshot table is zeroed on disk before the super block points to it */
+    int ret = 0;
+    if(!fs->super_block->snapshot_index){
+        int table = blocks[block_num - 1];
+        fs->super_block->snapshot_index = table;
+        ret = write_block(fs->super_block->data_start_index + table, fs->snapshots);
+    }
+    snapshot_t snap = &fs->snapshots[index];
+    snap->first_index = blocks[0];
+    for(int i = 1; i <= fs->super_block->FAT_amount; i++)
+        fs->FAT[blocks[i - 1]] = blocks[i];
+    free(blocks);
+    strcpy(snap->name, name);
+    snap->created = time(NULL);
+    
+    /* the copy of the FAT leaves out the blocks of the snapshots themselves
+     * and of the other metadata, which are not shared */
+    uint16_t* fat = malloc(fs->block_size * fs->super_block->FAT_amount);
+    memcpy(fat, fs->FAT, fs->block_size * fs->super_block->FAT_amount);
+    fat[fs->super_block->snapshot_index] = 0;
+    uint16_t changed = fs->super_block->changed_index;
+    for(int i = 0; changed && (i < changed_blocks_num()); i++, changed = fs->FAT[changed])
+        fat[changed] = 0;
+    for(int i = 0; fs->journal_fat && (i < fs->super_block->journal_blocks); i++)
+        fat[fs->super_block->journal_index + i] = 0;
+    for(int i = 0; i < FS_SNAPSHOT_MAX; i++){
+        if(!fs->snapshots[i].name[0])
+            continue;
+        for(uint16_t block = fs->snapshots[i].first_index; block != FAT_EOC; block = fs->FAT[block])
+            fat[block] = 0;
+    }
+    
+    /* the copies are written first, then the metadata that allocates their
+     * blocks, and the snapshot table last */
+    int block = snap->first_index;
+    ret = ret || write_block(fs->super_block->data_start_index + block, fs->root);
+    for(int i = 0; i < fs->super_block->FAT_amount && !ret; i++){
+        block = fs->FAT[block];
+        ret = write_block(fs->super_block->data_start_index + block, fat + i * FAT_PER_BLOCK(fs->block_size));
+    }
+    ret = ret || write_metadata() ||
+          write_block(fs->super_block->data_start_index + fs->super_block->snapshot_index, fs->snapshots);
+    for(int i = 1; i < fs->super_block->data_amount; i++){
+        if(fat[i])
+            fs->snap_refs[i]++;
+    }
+    free(fat);
+    return ret ? -1 : 0;
+}
+
+int do_snapshot_delete(const char *name)
+{
+    /* error checking: @name is invalid, or a snapshot is mounted */
+    if(check_file(name) || fs->read_only)
+        return -1;
+    /* error checking: there is no snapshot named @name */
+    int index = get_snapshot(name);
+    if(index == -1)
+        return -1;
+    
+    snapshot_t snap = &fs->snapshots[index];
+    if(count_snapshot_refs(snap, -1))
+        return -1;
+    free_FAT(snap->first_index);
+    memset(snap, 0, sizeof(struct snapshot));
+    
+    /* the snapshot table goes away along with the last snapshot */
+    int ret = 0, remaining = 0;
+    for(int i = 0; i < FS_SNAPSHOT_MAX; i++)
+        remaining += !!fs->snapshots[i].name[0];
+    if(!remaining){
+        fs->FAT[fs->super_block->snapshot_index] = 0;
+        fs->super_block->snapshot_index = 0;
+    } else {
+        ret = write_block(fs->super_block->data_start_index + fs->super_block->snapshot_index, fs->snapshots);
+    }
+    return (ret || write_metadata()) ? -1 : 0;
+}
+
+/* set the bits of the blocks of the virtual disk making block @block of the
+ * file system in @bitmap */
+void set_disk_blocks(uint8_t *bitmap, size_t block)
+{
+    for(size_t i = block * DISK_BLOCKS; i < (block + 1) * DISK_BLOCKS; i++)
+        bitmap[i / 8] |= 1 << (i % 8);
+}
+
+int fs_used_blocks_r(fs_t handle, uint8_t *bitmap)
+{
+    FS_LOCKED(handle);
+    /* error checking: no underlying virtual disk was opened, a snapshot is
+     * mounted, or @bitmap is NULL */
+    if(!fs->mounted || fs->read_only || !bitmap)
+        return -1;
+    
+    /* the metadata, and the data blocks in use or kept by a snapshot, but
+     * never the reserved data block 0 */
+    int used = 0;
+    memset(bitmap, 0, (fs->super_block->virtual_disk_amount * DISK_BLOCKS + 7) / 8);
+    for(int i = 0; i < fs->super_block->virtual_disk_amount; i++){
+        int index = i - fs->super_block->data_start_index;
+        if((index >= 0) && (!index || block_is_free(index)))
+            continue;
+        set_disk_blocks(bitmap, i);
+        used += DISK_BLOCKS;
+    }
+    return used;
+}
+
+int fs_changes_start_r(fs_t handle)
+{
+    FS_LOCKED(handle);
+    /* error checking: no underlying virtual disk was opened, or a snapshot
+     * is mounted */
+    if(!fs->mounted || fs->read_only)
+        return -1;
+    
+    int block_num = changed_blocks_num();
+    if(fs->super_block->changed_index){
+        memset(fs->changed_map, 0, block_num * fs->block_size);
+    } else {
+        /* error checking: no room for the bitmap */
+        if(get_empty_block_num() - fs->reserved_blocks < block_num)
+            return -1;
+        journal_reclaim(block_num);
+        int prev = FAT_EOC;
+        for(int i = 0; i < block_num; i++){
+            int block = get_empty_block();
+            fs->FAT[block] = FAT_EOC;
+            if(prev == FAT_EOC)
+                fs->super_block->changed_index = block;
+            else
+                fs->FAT[prev] = block;
+            prev = block;
+        }
+        fs->changed_map = calloc(block_num, fs->block_size);
+    }
+    fs->super_block->changed_epoch++;
+    return write_metadata() ? -1 : (int)fs->super_block->changed_epoch;
+}
+
+int fs_changes_stop_r(fs_t handle)
+{
+    FS_LOCKED(handle);
+    /* error checking: no underlying virtual disk was opened, a snapshot is
+     * mounted, or changed blocks are not tracked */
+    if(!fs->mounted || fs->read_only || !fs->changed_map)
+        return -1;
+    
+    /* the blocks written from now on belong to no epoch, so the next one
+     * cannot follow the current one */
+    free_FAT(fs->super_block->changed_index);
+    fs->super_block->changed_index = 0;
+    fs->super_block->changed_epoch++;
+    free(fs->changed_map);
+    fs->changed_map = NULL;
+    return write_metadata();
+}
+
+int fs_changes_get_r(fs_t handle, uint8_t *bitmap)
+{
+    FS_LOCKED(handle);
+    /* error checking: no underlying virtual disk was opened, or changed
+     * blocks are not tracked */
+    if(!fs->mounted || !fs->changed_map)
+        return -1;
+    if(bitmap && (fs->block_size == BLOCK_SIZE)){
+        memcpy(bitmap, fs->changed_map, (fs->super_block->virtual_disk_amount + 7) / 8);
+    } else if(bitmap){
+        memset(bitmap, 0, (fs->super_block->virtual_disk_amount * DISK_BLOCKS + 7) / 8);
+        for(int i = 0; i < fs->super_block->virtual_disk_amount; i++){
+            if(fs->changed_map[i / 8] & (1 << (i % 8)))
+                set_disk_blocks(bitmap, i);
+        }
+    }
+    return fs->super_block->changed_epoch;
+}
+
+/* count an operation that may have changed the file system, which returned
+ * @ret: the background flusher then has something to flush, and the changes
+ * are committed to the journal once JOURNAL_BATCH operations were made or
+ * JOURNAL_COMMIT_MSECS went by since the first one, so that a single flush of
+ * the disk covers them all; fs_sync() reports the commits that fail */
+int modify_op(int ret)
+{
+    if(!fs->mounted || fs->read_only)
+        return ret;
+    /* with a shared mount, the pending data is written before the other
+     * processes get to see the file: they know nothing of the blocks
+     * reserved for it */
+    if(fs->shared){
+        fs->shared_dirty = 1;
+        if(flush_all())
+            ret = -1;
+    }
+    if(ret == -1)
+        return ret;
+    fs->sync_dirty = 1;
+    if(!fs->journal_fat)
+        return ret;
+    if(!fs->journal_ops++)
+        clock_gettime(CLOCK_MONOTONIC, &fs->journal_begin);
+    if((fs->journal_ops >= JOURNAL_BATCH) || (elapsed_msecs(&fs->journal_begin) >= JOURNAL_COMMIT_MSECS))
+        journal_commit();
+    return ret;
+}
+
+/* durability of open file @open_file_index */
+int file_durability(int open_file_index)
+{
+    int mode = fs->file_table[open_file_index].durability;
+    return (mode == -1) ? fs->durability : mode;
+}
+
+/* whether the changes made to some files are to be flushed periodically */
+int periodic_durability(void)
+{
+    if(!fs->mounted || fs->read_only)
+        return 0;
+    if(fs->durability == FS_DURABLE_PERIODIC)
+        return 1;
+    for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+        if(fs->file_table[i].open_count && (fs->file_table[i].durability == FS_DURABLE_PERIODIC))
+            return 1;
+    }
+    return 0;
+}
+
+/* write the pending data and the metadata back, then flush the disk: without
+ * the journal, the flush is left to the caller once the file system lock is
+ * released, and @flushing is set for fs_umount() to wait on it; with the
+ * journal, the commit flushes the disk itself. Return in @target the last
+ * ticket covered: the operations that took it were all made by then. The
+ * periodic flushes only happen if there is something to flush. */
+int flush_round(uint64_t *target)
+{
+    pthread_mutex_lock(&fs->lock);
+    lock_shared();
+    pthread_mutex_lock(&fs->sync_lock);
+    *target = fs->sync_requested;
+    int requested = (fs->sync_requested > fs->sync_done);
+    pthread_mutex_unlock(&fs->sync_lock);
+    
+    int ret = 0, flush = 0;
+    if(fs->mounted && !fs->read_only && (requested || (fs->sync_dirty && periodic_durability()))){
+        fs->sync_dirty = 0;
+        ret = do_sync();
+        if(ret)
+            fs->sync_dirty = 1;
+        if(!fs->journal_fat){
+            pthread_mutex_lock(&fs->sync_lock);
+            fs->flushing = flush = 1;
+            pthread_mutex_unlock(&fs->sync_lock);
+        }
+    }
+    unlock_shared();
+    pthread_mutex_unlock(&fs->lock);
+    
+    if(flush && block_disk_sync())
+        ret = -1;
+    return ret;
+}
+
+/* the background flusher: flushes the disk whenever requested, with a single
+ * flush for all the requests made in the meantime, and every sync period if
+ * some changes are to be flushed periodically */
+void* flusher_main(void *arg)
+{
+    /* the flusher works on its file system for good */
+    fs = arg;
+    block_disk_bind(fs->disk);
+    block_queue_bind(fs->queue);
+    /* the flushes are made on behalf of fs_sync() and of the durable writes */
+    STATS_CHARGE(FS_OP_SYNC);
+    pthread_mutex_lock(&fs->sync_lock);
+    for(;;){
+        if(fs->sync_done == fs->sync_requested){
+            if(fs->flusher_stopping)
+                break;
+            if(fs->sync_periodic){
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += fs->sync_period / 1000;
+                deadline.tv_nsec += (long)(fs->sync_period % 1000) * 1000000;
+                if(deadline.tv_nsec >= 1000000000){
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                if(!pthread_cond_timedwait(&fs->sync_request_cond, &fs->sync_lock, &deadline))
+                    continue;
+            } else {
+                pthread_cond_wait(&fs->sync_request_cond, &fs->sync_lock);
+                continue;
+            }
+        }
+        pthread_mutex_unlock(&fs->sync_lock);
+        uint64_t target;
+        int ret = flush_round(&target);
+        pthread_mutex_lock(&fs->sync_lock);
+        fs->flushing = 0;
+        if(ret)
+            fs->sync_errors++;
+        if(target > fs->sync_done)
+            fs->sync_done = target;
+        pthread_cond_broadcast(&fs->sync_done_cond);
+    }
+    pthread_mutex_unlock(&fs->sync_lock);
+    return NULL;
+}
+
+/* a forked child has no flushers, and the locks are reset in case another
+ * thread held them */
+void flusher_atfork_child(void)
+{
+    pthread_mutex_init(&fs_list_lock, NULL);
+    for(struct fs* handle = &default_fs; handle; handle = handle->next){
+        pthread_mutex_init(&handle->lock, NULL);
+        pthread_mutex_init(&handle->sync_lock, NULL);
+        pthread_cond_init(&handle->sync_request_cond, NULL);
+        pthread_cond_init(&handle->sync_done_cond, NULL);
+        handle->flusher_running = 0;
+        handle->flushing = 0;
+        handle->sync_done = handle->sync_requested;
+    }
+}
+
+void register_atfork(void)
+{
+    pthread_atfork(NULL, NULL, flusher_atfork_child);
+}
+
+/* start the background flusher if it is not running yet */
+int start_flusher(void)
+{
+    if(fs->flusher_running)
+        return 0;
+    /* the file systems of different threads may start theirs at once */
+    static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+    pthread_once(&atfork_once, register_atfork);
+    if(pthread_create(&fs->flusher, NULL, flusher_main, fs))
+        return -1;
+    fs->flusher_running = 1;
+    return 0;
+}
+
+/* stop the background flusher of file system @handle, once it is done with
+ * the flushes requested */
+void stop_flusher(struct fs *handle)
+{
+    if(!handle->flusher_running)
+        return;
+    pthread_mutex_lock(&handle->sync_lock);
+    handle->flusher_stopping = 1;
+    pthread_cond_signal(&handle->sync_request_cond);
+    pthread_mutex_unlock(&handle->sync_lock);
+    pthread_join(handle->flusher, NULL);
+    handle->flusher_running = 0;
+    handle->flusher_stopping = 0;
+}
+
+/* tell the background flusher whether to flush periodically, starting it if
+ * needed; the flusher lives on once started, waiting for requests, until its
+ * file system handle is released */
+void update_flusher(void)
+{
+    int periodic = periodic_durability();
+    if(periodic)
+        start_flusher();
+    pthread_mutex_lock(&fs->sync_lock);
+    fs->sync_periodic = periodic;
+    pthread_cond_signal(&fs->sync_request_cond);
+    pthread_mutex_unlock(&fs->sync_lock);
+}
 
+/* request a flush of the changes made so far from the background flusher,
+ * and fill @ticket to wait on it */
+int request_sync(struct sync_ticket *ticket)
+{
+    ticket->handle = fs;
+    ticket->seq = 0;
+    if(!fs->mounted || fs->read_only)
+        return 0;
+    if(start_flusher())
+        return -1;
+    pthread_mutex_lock(&fs->sync_lock);
+    ticket->seq = ++fs->sync_requested;
+    ticket->errors = fs->sync_errors;
+    pthread_cond_signal(&fs->sync_request_cond);
+    pthread_mutex_unlock(&fs->sync_lock);
+    return 0;
+}
+
+/* wait for the flush of @ticket, without the lock of its file system held;
+ * -1 if a flush failed since it was requested */
+int wait_sync(struct sync_ticket *ticket)
+{
+    struct fs* handle = ticket->handle;
+    if(!ticket->seq)
+        return 0;
+    pthread_mutex_lock(&handle->sync_lock);
+    while(handle->sync_done < ticket->seq)
+        pthread_cond_wait(&handle->sync_done_cond, &handle->sync_lock);
+    int ret = (handle->sync_errors != ticket->errors) ? -1 : 0;
+    pthread_mutex_unlock(&handle->sync_lock);
+    return ret;
+}
+
+/* account for @ret bytes written through file descriptor @fd, and request the
+ * flush that makes them durable if its file is written durably */
+int written_op(int fd, int ret, struct sync_ticket *ticket)
+{
+    ticket->handle = fs;
+    ticket->seq = 0;
+    if(ret <= 0)
+        return ret;
+    int open_file_index = fs->descriptor_table[fd].open_file_index;
+    fs->file_table[open_file_index].written = 1;
+    if((file_durability(open_file_index) == FS_DURABLE_WRITE) && request_sync(ticket))
+        return -1;
+    return ret;
+}
+
+int do_set_durability(int fd, int mode)
+{
+    /* error checking: no underlying virtual disk was opened, or a snapshot
+     * is mounted */
+    if(!fs->mounted || fs->read_only)
+        return -1;
+    /* error checking: invalid mode, only a file can follow the file system */
+    if((mode < ((fd == -1) ? FS_DURABLE_NONE : -1)) || (mode > FS_DURABLE_WRITE))
+        return -1;
+    if(fd == -1){
+        fs->durability = mode;
+    } else {
+        /* error checking: file descriptor @fd is invalid */
+        int open_file_index = check_fd(fd);
+        if(open_file_index == -1)
+            return -1;
+        fs->file_table[open_file_index].durability = mode;
+    }
+    if(periodic_durability() && start_flusher())
+        return -1;
+    update_flusher();
+    return 0;
+}
+
+/* shared mounts: the processes mounting a disk file with fs_mount_shared_r()
+ * keep its super block, root directory and FAT (and their copies as of the
+ * last journal commit) in a shared memory segment named after the file, and
+ * run their operations one at a time under the lock of the segment. Each
+ * process keeps its own descriptors, and rebuilds what it derives from the
+ * metadata once another process changed it; the data goes through the page
+ * cache of the disk file. Open file description locks on the disk file
+ * serialize the mounts (byte 0), and tell whether some process still has the
+ * file system mounted (byte 1): if none has, a segment left by processes that
+ * died is discarded. */
+
+int lock_disk_file(int fd, int byte, short type, int wait)
+{
+    struct flock lock = { .l_type = type, .l_whence = SEEK_SET, .l_start = byte, .l_len = 1 };
+    return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+}
+
+/* size of the metadata in the segment, its copy for the journal excluded */
+size_t shared_meta_size(void)
+{
+    return sizeof(struct superblock) + fs->block_size * (1 + fs->super_block->FAT_amount);
+}
+
+/* point the metadata of the file system at the segment */
+void map_shared(void)
+{
+    uint8_t* meta = (uint8_t*)fs->shared + SHARED_HEADER_SIZE;
+    fs->super_block = (superblock_t)meta;
+    size_t size = shared_meta_size();
+    fs->root = (rootdir_t)(meta + sizeof(struct superblock));
+    fs->FAT = (uint16_t*)(meta + sizeof(struct superblock) + fs->block_size);
+    if(!(fs->super_block->features & FS_FEATURE_JOURNAL))
+        return;
+    fs->journal_super = (superblock_t)(meta + size);
+    fs->journal_root = (rootdir_t)(meta + size + sizeof(struct superblock));
+    fs->journal_fat = (uint16_t*)(meta + size + sizeof(struct superblock) + fs->block_size);
+}
 
+/* rebuild what this process derives from the metadata, after another process
+ * changed it */
+int refresh_shared(void)
+{
+    int ret = 0;
+    load_frags();
+    /* the snapshots are only counted again if their table changed */
+    snapshot_t table = calloc(1, fs->block_size);
+    if(fs->super_block->snapshot_index &&
+       read_blocks(fs->super_block->data_start_index + fs->super_block->snapshot_index, 1, table)){
+        ret = -1;
+    } else if(memcmp(table, fs->snapshots, fs->block_size)){
+        memset(fs->snapshots, 0, fs->block_size);
+        memset(fs->snap_refs, 0, fs->super_block->data_amount);
+        if(load_snapshots())
+            ret = -1;
+    }
+    free(table);
+    free(fs->changed_map);
+    fs->changed_map = NULL;
+    if(load_changed())
+        ret = -1;
+    for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+        open_file_t file = &fs->file_table[i];
+        if(!file->open_count)
+            continue;
+        free(file->map);
+        file->map = NULL;
+        file->map_count = 0;
+        file->map_partial = 0;
+        if(map_load(i))
+            ret = -1;
+    }
+    return ret;
+}
 
+void lock_shared(void)
+{
+    if(!fs->shared)
+        return;
+    /* a process died holding the lock, its last operation is left as is */
+    if(pthread_mutex_lock(&fs->shared->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&fs->shared->lock);
+    fs->journal_next = fs->shared->journal_next;
+    fs->journal_seq = fs->shared->journal_seq;
+    /* on failure, the next operation tries again */
+    if(fs->mounted && (fs->shared_generation != fs->shared->generation) && !refresh_shared())
+        fs->shared_generation = fs->shared->generation;
+}
 
+void unlock_shared(void)
+{
+    struct fs_shared* shared = fs->shared;
+    if(!shared)
+        return;
+    if(fs->shared_dirty){
+        /* the other processes read the changed blocks back from the disk */
+        if(fs->mounted)
+            write_changed();
+        fs->shared_generation = ++shared->generation;
+        fs->shared_dirty = 0;
+    }
+    shared->journal_next = fs->journal_next;
+    shared->journal_seq = fs->journal_seq;
+    if(fs->mounted){
+        pthread_mutex_unlock(&shared->lock);
+        return;
+    }
+    /* unmounted: the last process removes the segment */
+    if(!--shared->users)
+        shm_unlink(fs->shared_name);
+    pthread_mutex_unlock(&shared->lock);
+    munmap(shared, fs->shared_size);
+    close(fs->shared_fd);
+    fs->shared = NULL;
+}
+
+/* mount the file system from the disk, and move its metadata to a new
+ * segment, locked */
+int create_shared(const char *diskname)
+{
+    if(do_mount(diskname))
+        return -1;
+    size_t meta_size = shared_meta_size();
+    size_t size = SHARED_HEADER_SIZE + (fs->journal_fat ? 2 : 1) * meta_size;
+    void* segment = MAP_FAILED;
+    int fd = shm_open(fs->shared_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if((fd != -1) && !ftruncate(fd, size))
+        segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(fd != -1)
+        close(fd);
+    if(segment == MAP_FAILED){
+        if(fd != -1)
+            shm_unlink(fs->shared_name);
+        do_umount();
+        return -1;
+    }
+    
+    struct fs_shared* shared = segment;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_lock(&shared->lock);
+    shared->users = 1;
+    
+    uint8_t* meta = (uint8_t*)segment + SHARED_HEADER_SIZE;
+    for(int i = 0; i < (fs->journal_fat ? 2 : 1); i++, meta += meta_size){
+        memcpy(meta, i ? fs->journal_super : fs->super_block, sizeof(struct superblock));
+        memcpy(meta + sizeof(struct superblock), i ? fs->journal_root : fs->root, fs->block_size);
+        memcpy(meta + sizeof(struct superblock) + fs->block_size, i ? fs->journal_fat : fs->FAT,
+               fs->block_size * fs->super_block->FAT_amount);
+    }
+    free_metadata();
+    fs->shared = shared;
+    fs->shared_size = size;
+    fs->shared_generation = 0;
+    map_shared();
+    return 0;
+}
+
+/* map the segment of the processes that have the file system mounted, and
+ * build the state of this process from it, locked; return 1 if the last of
+ * them unmounted it meanwhile */
+int join_shared(const char *diskname)
+{
+    int fd = shm_open(fs->shared_name, O_RDWR, 0);
+    if(fd == -1)
+        return (errno == ENOENT) ? 1 : -1;
+    struct stat st;
+    void* segment = MAP_FAILED;
+    if(!fstat(fd, &st) && (st.st_size >= SHARED_HEADER_SIZE))
+        segment = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(segment == MAP_FAILED)
+        return -1;
+    fs->shared = segment;
+    fs->shared_size = st.st_size;
+    lock_shared();
+    
+    int ret = fs->shared->users ? 0 : 1;
+    if(!ret && block_disk_open(diskname))
+        ret = -1;
+    if(!ret){
+        fs->super_block = (superblock_t)((uint8_t*)segment + SHARED_HEADER_SIZE);
+        if(error_check() || (fs->shared_size < SHARED_HEADER_SIZE + shared_meta_size())){
+            block_disk_close();
+            ret = -1;
+        }
+    }
+    if(!ret){
+        map_shared();
+        if(fs->journal_fat)
+            fs->journal_buf = malloc(fs->super_block->journal_blocks * fs->block_size);
+        fs->journal_ops = 0;
+        if(load_state())
+            ret = abort_mount();
+    }
+    if(ret){
+        pthread_mutex_unlock(&fs->shared->lock);
+        munmap(segment, fs->shared_size);
+        fs->shared = NULL;
+        return ret;
+    }
+    fs->shared->users++;
+    fs->shared_generation = fs->shared->generation;
+    return 0;
+}
+
+int do_mount_shared(const char *diskname)
+{
+    /* error checking: @diskname is not a file other processes can open */
+    struct stat st;
+    if(stat(diskname, &st) || !S_ISREG(st.st_mode))
+        return -1;
+    snprintf(fs->shared_name, sizeof(fs->shared_name), "/libfs-%lx-%lx", (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+    fs->shared_fd = open(diskname, O_RDWR);
+    /* error checking: the mounts of the disk cannot be serialized */
+    if((fs->shared_fd == -1) || lock_disk_file(fs->shared_fd, 0, F_WRLCK, 1)){
+        if(fs->shared_fd != -1)
+            close(fs->shared_fd);
+        return -1;
+    }
+    
+    int ret = 1;
+    while(ret == 1){
+        if(!lock_disk_file(fs->shared_fd, 1, F_WRLCK, 0)){
+            /* no other process has it mounted */
+            shm_unlink(fs->shared_name);
+            ret = create_shared(diskname);
+        } else {
+            ret = join_shared(diskname);
+        }
+    }
+    /* the file system stays mounted as long as this lock is held */
+    if(!ret && lock_disk_file(fs->shared_fd, 1, F_RDLCK, 0))
+        ret = -1;
+    lock_disk_file(fs->shared_fd, 0, F_UNLCK, 0);
+    if(ret){
+        lock_disk_file(fs->shared_fd, 1, F_UNLCK, 0);
+        close(fs->shared_fd);
+    }
+    return ret;
+}
+
+/* create a file system handle, with a virtual disk and a request queue of its
+ * own, and add it to the list of all the file systems */
+struct fs* new_fs(void)
+{
+    struct fs* handle = calloc(1, sizeof(struct fs));
+    if(!handle)
+        return NULL;
+    handle->disk = block_disk_new();
+    handle->queue = block_queue_new();
+    if(!handle->disk || !handle->queue){
+        block_disk_free(handle->disk);
+        block_queue_free(handle->queue);
+        free(handle);
+        return NULL;
+    }
+    handle->block_size = BLOCK_SIZE;
+    handle->durability = FS_DURABLE_NONE;
+    handle->sync_period = SYNC_PERIOD_MSECS;
+    pthread_mutex_init(&handle->lock, NULL);
+    pthread_mutex_init(&handle->sync_lock, NULL);
+    pthread_cond_init(&handle->sync_request_cond, NULL);
+    pthread_cond_init(&handle->sync_done_cond, NULL);
+    
+    pthread_mutex_lock(&fs_list_lock);
+    handle->next = default_fs.next;
+    default_fs.next = handle;
+    pthread_mutex_unlock(&fs_list_lock);
+    return handle;
+}
+
+/* release file system handle @handle, unmounted */
+void free_fs(struct fs *handle)
+{
+    stop_flusher(handle);
+    pthread_mutex_lock(&fs_list_lock);
+    struct fs* prev = &default_fs;
+    while(prev->next != handle)
+        prev = prev->next;
+    prev->next = handle->next;
+    pthread_mutex_unlock(&fs_list_lock);
+    
+    block_disk_free(handle->disk);
+    block_queue_free(handle->queue);
+    pthread_mutex_destroy(&handle->lock);
+    pthread_mutex_destroy(&handle->sync_lock);
+    pthread_cond_destroy(&handle->sync_request_cond);
+    pthread_cond_destroy(&handle->sync_done_cond);
+    free(handle);
+}
+
+/* the public operations: each call is accounted in the statistics, and
+ * recorded along with its arguments when tracing */
+
+int fs_format(const char *diskname, size_t data_blk_count, unsigned int features)
+{
+    STATS_OP(FS_OP_FORMAT);
+    TRACE_ARGS(-1, diskname, data_blk_count, features);
+    FS_LOCKED(&default_fs);
+    STATS_RETURN(do_format(diskname, data_blk_count, features));
+}
+
+int mount_fs(struct fs *handle, const char *diskname)
+{
+    STATS_OP(FS_OP_MOUNT);
+    FS_LOCKED(handle);
+    int ret = do_mount(diskname);
+    /* the geometry of the disk lets a fresh one be formatted for replaying */
+    TRACE_ARGS(-1, diskname, ret ? 0 : fs->super_block->data_amount, ret ? 0 : fs->super_block->features);
+    STATS_RETURN(ret);
+}
+
+int mount_snapshot_fs(struct fs *handle, const char *diskname, const char *name)
+{
+    STATS_OP(FS_OP_MOUNT);
+    FS_LOCKED(handle);
+    int ret = do_mount_snapshot(diskname, name);
+    /* replayed as the mount of a disk of the same geometry */
+    TRACE_ARGS(-1, diskname, ret ? 0 : fs->super_block->data_amount, ret ? 0 : fs->super_block->features);
+    STATS_RETURN(ret);
+}
+
+fs_t fs_mount_r(const char *diskname)
+{
+    struct fs* handle = new_fs();
+    if(handle && mount_fs(handle, diskname)){
+        free_fs(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+int mount_shared_fs(struct fs *handle, const char *diskname)
+{
+    STATS_OP(FS_OP_MOUNT);
+    FS_LOCKED(handle);
+    int ret = do_mount_shared(diskname);
+    /* replayed as the mount of a disk of the same geometry */
+    TRACE_ARGS(-1, diskname, ret ? 0 : fs->super_block->data_amount, ret ? 0 : fs->super_block->features);
+    STATS_RETURN(ret);
+}
+
+fs_t fs_mount_shared_r(const char *diskname)
+{
+    struct fs* handle = new_fs();
+    if(handle && mount_shared_fs(handle, diskname)){
+        free_fs(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+fs_t fs_mount_snapshot_r(const char *diskname, const char *name)
+{
+    struct fs* handle = new_fs();
+    if(handle && mount_snapshot_fs(handle, diskname, name)){
+        free_fs(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+int umount_fs(struct fs *handle)
+{
+    STATS_OP(FS_OP_UMOUNT);
+    FS_LOCKED(handle);
+    int ret = do_umount();
+    update_flusher();
+    STATS_RETURN(ret);
+}
+
+int fs_umount_r(fs_t handle)
+{
+    /* error checking: invalid handle */
+    if(!handle || (handle == &default_fs) || umount_fs(handle))
+        return -1;
+    free_fs(handle);
+    return 0;
+}
+
+/* the calls that wait on the background flusher release the file system lock
+ * first, so that the calls of other threads can go on and share the flush */
+
+int fs_sync_r(fs_t handle)
+{
+    STATS_OP(FS_OP_SYNC);
+    struct sync_ticket ticket;
+    int ret;
+    {
+        FS_LOCKED(handle);
+        /* error checking: no underlying virtual disk was opened */
+        ret = fs->mounted ? request_sync(&ticket) : -1;
+    }
+    STATS_RETURN((ret || wait_sync(&ticket)) ? -1 : 0);
+}
+
+int fs_set_durability_r(fs_t handle, int fd, int mode)
+{
+    FS_LOCKED(handle);
+    return do_set_durability(fd, mode);
+}
+
+int fs_set_sync_period_r(fs_t handle, unsigned int msecs)
+{
+    if(!msecs)
+        return -1;
+    pthread_mutex_lock(&handle->sync_lock);
+    handle->sync_period = msecs;
+    pthread_cond_signal(&handle->sync_request_cond);
+    pthread_mutex_unlock(&handle->sync_lock);
+    return 0;
+}
+
+int fs_create_r(fs_t handle, const char *filename)
+{
+    STATS_OP(FS_OP_CREATE);
+    TRACE_ARGS(-1, filename, 0, 0);
+    FS_LOCKED(handle);
+    STATS_RETURN(modify_op(do_create(filename)));
+}
+
+int fs_delete_r(fs_t handle, const char *filename)
+{
+    STATS_OP(FS_OP_DELETE);
+    TRACE_ARGS(-1, filename, 0, 0);
+    FS_LOCKED(handle);
+    STATS_RETURN(modify_op(do_delete(filename)));
+}
+
+int fs_open_r(fs_t handle, const char *filename)
+{
+    STATS_OP(FS_OP_OPEN);
+    FS_LOCKED(handle);
+    int fd = do_open(filename);
+    /* the size of the file lets it be recreated for replaying */
+    TRACE_ARGS(-1, filename, (fd == -1) ? 0 : do_stat(fd), 0);
+    STATS_RETURN(fd);
+}
+
+int fs_close_r(fs_t handle, int fd)
+{
+    STATS_OP(FS_OP_CLOSE);
+    TRACE_ARGS(fd, NULL, 0, 0);
+    struct sync_ticket ticket = { NULL, 0, 0 };
+    int ret;
+    {
+        FS_LOCKED(handle);
+        int open_file_index = check_fd(fd);
+        int durable = (open_file_index != -1) && fs->file_table[open_file_index].written &&
+                      (file_durability(open_file_index) == FS_DURABLE_CLOSE);
+        ret = modify_op(do_close(fd));
+        if(!ret && durable){
+            fs->file_table[open_file_index].written = 0;
+            ret = request_sync(&ticket);
+        }
+        update_flusher();
+    }
+    STATS_RETURN((ret || wait_sync(&ticket)) ? -1 : 0);
+}
+
+int fs_stat_r(fs_t handle, int fd)
+{
+    STATS_OP(FS_OP_STAT);
+    TRACE_ARGS(fd, NULL, 0, 0);
+    FS_LOCKED(handle);
+    STATS_RETURN(do_stat(fd));
+}
+
+int fs_lseek_r(fs_t handle, int fd, size_t offset)
+{
+    STATS_OP(FS_OP_LSEEK);
+    TRACE_ARGS(fd, NULL, offset, 0);
+    FS_LOCKED(handle);
+    STATS_RETURN(do_lseek(fd, offset));
+}
+
+int fs_read_r(fs_t handle, int fd, void *buf, size_t count)
+{
+    STATS_OP(FS_OP_READ);
+    TRACE_ARGS(fd, NULL, count, 0);
+    FS_LOCKED(handle);
+    int ret = do_read(fd, buf, count);
+    if(ret > 0)
+        STATS_BYTES(ret);
+    STATS_RETURN(ret);
+}
+
+int fs_write_r(fs_t handle, int fd, void *buf, size_t count)
+{
+    STATS_OP(FS_OP_WRITE);
+    TRACE_ARGS(fd, NULL, count, 0);
+    struct sync_ticket ticket;
+    int ret;
+    {
+        FS_LOCKED(handle);
+        ret = written_op(fd, modify_op(do_write(fd, buf, count)), &ticket);
+    }
+    if(ret > 0)
+        STATS_BYTES(ret);
+    STATS_RETURN(wait_sync(&ticket) ? -1 : ret);
+}
+
+int fs_append_r(fs_t handle, int fd, void *buf, size_t count)
+{
+    STATS_OP(FS_OP_APPEND);
+    TRACE_ARGS(fd, NULL, count, 0);
+    struct sync_ticket ticket;
+    int ret;
+    {
+        FS_LOCKED(handle);
+        ret = written_op(fd, modify_op(do_append(fd, buf, count)), &ticket);
+    }
+    if(ret > 0)
+        STATS_BYTES(ret);
+    STATS_RETURN(wait_sync(&ticket) ? -1 : ret);
+}
+
+int fs_preallocate_r(fs_t handle, int fd, size_t size)
+{
+    STATS_OP(FS_OP_PREALLOCATE);
+    TRACE_ARGS(fd, NULL, size, 0);
+    FS_LOCKED(handle);
+    STATS_RETURN(modify_op(do_preallocate(fd, size)));
+}
+
+int fs_defrag_r(fs_t handle, size_t max_blocks, unsigned int max_msecs)
+{
+    STATS_OP(FS_OP_DEFRAG);
+    TRACE_ARGS(-1, NULL, max_blocks, max_msecs);
+    FS_LOCKED(handle);
+    STATS_RETURN(modify_op(do_defrag(max_blocks, max_msecs)));
+}
+
+int fs_snapshot_r(fs_t handle, const char *name)
+{
+    STATS_OP(FS_OP_SNAPSHOT);
+    TRACE_ARGS(-1, name, 0, 0);
+    FS_LOCKED(handle);
+    STATS_RETURN(do_snapshot(name));
+}
+
+int fs_snapshot_delete_r(fs_t handle, const char *name)
+{
+    STATS_OP(FS_OP_SNAPSHOT_DELETE);
+    TRACE_ARGS(-1, name, 0, 0);
+    FS_LOCKED(handle);
+    STATS_RETURN(do_snapshot_delete(name));
+}
+
+/* the calls without a handle work on the default file system */
+
+int fs_mount(const char *diskname)
+{
+    return mount_fs(&default_fs, diskname);
+}
+
+int fs_mount_snapshot(const char *diskname, const char *name)
+{
+    return mount_snapshot_fs(&default_fs, diskname, name);
+}
+
+int fs_umount(void)
+{
+    return umount_fs(&default_fs);
+}
+
+int fs_info(void)
+{
+    return fs_info_r(&default_fs);
+}
+
+int fs_sync(void)
+{
+    return fs_sync_r(&default_fs);
+}
+
+int fs_set_durability(int fd, int mode)
+{
+    return fs_set_durability_r(&default_fs, fd, mode);
+}
+
+int fs_set_sync_period(unsigned int msecs)
+{
+    return fs_set_sync_period_r(&default_fs, msecs);
+}
+
+int fs_frag_info(const char *filename, struct fs_frag_info *info)
+{
+    return fs_frag_info_r(&default_fs, filename, info);
+}
+
+int fs_defrag(size_t max_blocks, unsigned int max_msecs)
+{
+    return fs_defrag_r(&default_fs, max_blocks, max_msecs);
+}
+
+int fs_snapshot(const char *name)
+{
+    return fs_snapshot_r(&default_fs, name);
+}
+
+int fs_snapshot_delete(const char *name)
+{
+    return fs_snapshot_delete_r(&default_fs, name);
+}
+
+int fs_snapshot_list(char names[][FS_FILENAME_LEN])
+{
+    return fs_snapshot_list_r(&default_fs, names);
+}
+
+int fs_used_blocks(uint8_t *bitmap)
+{
+    return fs_used_blocks_r(&default_fs, bitmap);
+}
+
+int fs_changes_start(void)
+{
+    return fs_changes_start_r(&default_fs);
+}
+
+int fs_changes_stop(void)
+{
+    return fs_changes_stop_r(&default_fs);
+}
+
+int fs_changes_get(uint8_t *bitmap)
+{
+    return fs_changes_get_r(&default_fs, bitmap);
+}
+
+int fs_create(const char *filename)
+{
+    return fs_create_r(&default_fs, filename);
+}
+
+int fs_delete(const char *filename)
+{
+    return fs_delete_r(&default_fs, filename);
+}
+
+int fs_ls(void)
+{
+    return fs_ls_r(&default_fs);
+}
+
+int fs_list(char filenames[][FS_FILENAME_LEN])
+{
+    return fs_list_r(&default_fs, filenames);
+}
+
+int fs_open(const char *filename)
+{
+    return fs_open_r(&default_fs, filename);
+}
+
+int fs_close(int fd)
+{
+    return fs_close_r(&default_fs, fd);
+}
+
+int fs_stat(int fd)
+{
+    return fs_stat_r(&default_fs, fd);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+    return fs_lseek_r(&default_fs, fd, offset);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+    return fs_write_r(&default_fs, fd, buf, count);
+}
+
+int fs_append(int fd, void *buf, size_t count)
+{
+    return fs_append_r(&default_fs, fd, buf, count);
+}
+
+int fs_preallocate(int fd, size_t size)
+{
+    return fs_preallocate_r(&default_fs, fd, size);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+    return fs_read_r(&default_fs, fd, buf, count);
+}
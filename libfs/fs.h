@@ -2,6 +2,11 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint64_t definition */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +17,72 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of snapshots of a file system */
+#define FS_SNAPSHOT_MAX 16
+
+/** Pack small files and the tails of larger files into shared fragment blocks */
+#define FS_FEATURE_FRAGMENTS 0x1
+
+/** Describe files with extents of consecutive blocks instead of FAT chains */
+#define FS_FEATURE_EXTENTS 0x2
+
+/** Commit the metadata changes to a journal, replayed when mounting */
+#define FS_FEATURE_JOURNAL 0x4
+
+/** Largest block size of a file system */
+#define FS_BLOCK_SIZE_MAX (1024 * 1024)
+
+/**
+ * FS_FEATURE_BLOCK_SIZE - Block size of a file system, as a feature
+ * @size: Block size in bytes, a multiple of 4096 up to %FS_BLOCK_SIZE_MAX
+ */
+#define FS_FEATURE_BLOCK_SIZE(size) ((((unsigned int)(size) / 4096) - 1) << 16)
+
+/** Block size of a file system formatted with @features */
+#define FS_FEATURES_BLOCK_SIZE(features) \
+	(((((features) >> 16) & 0xff) + 1) * 4096)
+
+/**
+ * fs_format - Create a new file system
+ * @diskname: Name of the virtual disk file
+ * @data_blk_count: Number of data blocks
+ * @features: Bitmask of optional on-disk features (%FS_FEATURE_*)
+ *
+ * Create the virtual disk file @diskname, or truncate it if it already exists,
+ * and write an empty file system with @data_blk_count data blocks into it.
+ * Images formatted without any feature have the exact same layout as the ones
+ * created by the reference tools. A @diskname starting with "mem:" formats a
+ * RAM disk, kept in memory until the program exits, which can then be mounted
+ * under the same name (see block_disk_create()).
+ *
+ * With %FS_FEATURE_FRAGMENTS, the tail of a file that does not fill a whole
+ * data block is moved into a fragment block shared with other small tails
+ * once the file is closed, instead of using a data block of its own.
+ *
+ * With %FS_FEATURE_EXTENTS, the data blocks of a file are described by a list
+ * of extents (first block and length) kept in its root directory entry and,
+ * past the first extent, in an extent block. The FAT then only tells which
+ * data blocks are in use.
+ *
+ * With FS_FEATURE_BLOCK_SIZE(@size), the blocks of the file system, data
+ * blocks included, are made of @size bytes instead of 4096. Larger blocks
+ * make the FAT smaller and the files shorter in blocks, for the images of
+ * large files; the disk then holds @data_blk_count blocks of @size bytes.
+ *
+ * With %FS_FEATURE_JOURNAL, some of the data blocks hold a journal, to which
+ * the changes of the FAT and of the root directory are committed as they are
+ * made, instead of being written back only by fs_umount(). Each commit groups
+ * the operations made since the previous one, up to a second's worth of them,
+ * and costs a single flush of the disk; fs_mount() replays the committed
+ * transactions, so that a crash loses at most the operations made since the
+ * last commit and leaves the metadata consistent.
+ *
+ * Return: -1 if a file system is currently mounted, if @data_blk_count is 0 or
+ * too large (or too small to hold the journal), or if the virtual disk file
+ * cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blk_count, unsigned int features);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,6 +96,21 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_snapshot - Mount a snapshot of a file system
+ * @diskname: Name of the virtual disk file
+ * @name: Snapshot name
+ *
+ * Open the virtual disk file @diskname and mount, read-only, the file system
+ * as it was when snapshot @name was taken with fs_snapshot(). Files can be
+ * opened and read as usual, but all the operations that would modify the file
+ * system fail. The snapshot is unmounted with fs_umount().
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, or if it has no snapshot named @name. 0 otherwise.
+ */
+int fs_mount_snapshot(const char *diskname, const char *name);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -45,6 +131,368 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_sync - Synchronize file system with disk
+ *
+ * Data written past the end of a file is kept in memory until the file is
+ * closed, so that its data blocks can be allocated all at once. Allocate the
+ * blocks of all the data still pending in memory and write it, then write the
+ * metadata of the currently mounted file system back to disk. With the journal
+ * (see fs_format()), the metadata is committed to the journal instead, and the
+ * disk flushed so that it survives a crash.
+ *
+ * The disk is flushed by a background thread, once for all the threads
+ * waiting on it at the time (see fs_set_durability()).
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if writing to the
+ * virtual disk fails. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * enum fs_durability - When the changes made to a file reach stable storage
+ * @FS_DURABLE_NONE: when the file system is synced or unmounted (default)
+ * @FS_DURABLE_CLOSE: by the time fs_close() returns, if the file was written to
+ *                    through any of its descriptors since it was opened
+ * @FS_DURABLE_PERIODIC: within a sync period, see fs_set_sync_period()
+ * @FS_DURABLE_WRITE: by the time fs_write() or fs_append() returns
+ */
+enum fs_durability {
+	FS_DURABLE_NONE,
+	FS_DURABLE_CLOSE,
+	FS_DURABLE_PERIODIC,
+	FS_DURABLE_WRITE,
+};
+
+/**
+ * fs_set_durability - Set when the changes made to files reach stable storage
+ * @fd: File descriptor of the file, or -1 for the whole file system
+ * @mode: Durability, one of enum fs_durability, or -1 with @fd for the file to
+ *        follow the file system again
+ *
+ * Set the durability of the file opened as @fd, for as long as it stays open,
+ * or the durability of the files of the mounted file system that have none of
+ * their own, for as long as it stays mounted.
+ *
+ * The disk is flushed by a background thread: the calls that wait on it, from
+ * any number of threads, share a single flush of the disk along with a single
+ * write of the metadata (or a single journal commit, see fs_format()). The
+ * calls to libfs can be made from several threads, they are serialized
+ * internally but none holds the others off while it waits on the disk flush.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if a snapshot is
+ * mounted, if @fd is invalid, or if @mode is invalid. 0 otherwise.
+ */
+int fs_set_durability(int fd, int mode);
+
+/**
+ * fs_set_sync_period - Set the sync period of the background flusher
+ * @msecs: Period in milliseconds, 1000 by default
+ *
+ * Set how often the changes made to the files with %FS_DURABLE_PERIODIC
+ * durability reach stable storage.
+ *
+ * Return: -1 if @msecs is 0. 0 otherwise.
+ */
+int fs_set_sync_period(unsigned int msecs);
+
+/**
+ * struct fs_frag_info - Fragmentation report
+ * @files: Number of files reported on
+ * @fragmented_files: Number of these files whose data blocks are not contiguous
+ * @blocks: Number of data blocks holding the data of these files
+ * @extents: Number of runs of consecutive data blocks holding that data
+ * @free_blocks: Number of free data blocks in the file system
+ * @free_extents: Number of runs of consecutive free data blocks
+ * @largest_free_extent: Number of data blocks in the longest free run
+ *
+ * Reading a file sequentially costs one seek per run of consecutive data
+ * blocks, so the closer @extents is to the number of non-empty files, the less
+ * fragmented the files are. Tails kept in fragment blocks are not counted.
+ */
+struct fs_frag_info {
+	size_t files;
+	size_t fragmented_files;
+	size_t blocks;
+	size_t extents;
+	size_t free_blocks;
+	size_t free_extents;
+	size_t largest_free_extent;
+};
+
+/**
+ * fs_frag_info - Report fragmentation
+ * @filename: File name, or NULL for the whole file system
+ * @info: Report to be filled
+ *
+ * Fill @info with the fragmentation of the file named @filename, or of all the
+ * files of the mounted file system if @filename is NULL. The free space fields
+ * always describe the whole file system.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @info is NULL, if
+ * @filename is invalid or if there is no file named @filename. 0 otherwise.
+ */
+int fs_frag_info(const char *filename, struct fs_frag_info *info);
+
+/**
+ * fs_defrag - Defragment the file system
+ * @max_blocks: Maximum number of data blocks to move, 0 for no limit
+ * @max_msecs: Maximum duration in milliseconds, 0 for no limit
+ *
+ * Move the data blocks of the files of the mounted file system, including the
+ * ones that are currently open, so that each file is stored in as few runs of
+ * consecutive data blocks as possible. A run is grown over the free blocks that
+ * follow it, and a file is moved to a free run large enough to hold it when
+ * none of its runs can grow. Data blocks are copied before the metadata that
+ * points to them is updated and written back to disk, so that an interrupted
+ * defragmentation leaves a consistent file system.
+ *
+ * The work stops once @max_blocks data blocks have been moved or @max_msecs
+ * have elapsed, and carries on at the next call, so that defragmenting can be
+ * done a bit at a time while the file system is in use.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if accessing the
+ * virtual disk fails. Otherwise return the number of data blocks moved, which
+ * is 0 once no file can be made more contiguous.
+ */
+int fs_defrag(size_t max_blocks, unsigned int max_msecs);
+
+/**
+ * fs_snapshot - Take a snapshot of the file system
+ * @name: Snapshot name
+ *
+ * Freeze the current state of the mounted file system, including the data
+ * still pending in memory for the open files, into a read-only snapshot named
+ * @name, which can later be mounted with fs_mount_snapshot(). Only the root
+ * directory and the FAT are copied, so the cost does not depend on the amount
+ * of data: the data blocks are shared with the snapshot, and copied the first
+ * time they get written to afterwards. The data blocks of the files deleted or
+ * rewritten since are only released once no snapshot keeps them.
+ *
+ * Snapshots are only known to libfs: the reference tools see the data blocks
+ * kept by snapshots alone as free.
+ *
+ * Return: -1 if no underlying virtual disk was opened or a snapshot is
+ * mounted, if @name is invalid or too long, if a snapshot named @name already
+ * exists or there are already %FS_SNAPSHOT_MAX of them, if the underlying disk
+ * does not have enough free space left for the copies, or if accessing the
+ * virtual disk fails. 0 otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Snapshot name
+ *
+ * Delete snapshot @name of the mounted file system, and release the data
+ * blocks that only it kept.
+ *
+ * Return: -1 if no underlying virtual disk was opened or a snapshot is
+ * mounted, if there is no snapshot named @name, or if accessing the virtual
+ * disk fails. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_snapshot_list - Get the names of the snapshots
+ * @names: Array of %FS_SNAPSHOT_MAX snapshot names to be filled
+ *
+ * Return: -1 if no underlying virtual disk was opened. Otherwise return the
+ * number of snapshot names filled.
+ */
+int fs_snapshot_list(char names[][FS_FILENAME_LEN]);
+
+/**
+ * fs_used_blocks - Get the blocks in use
+ * @bitmap: Bitmap to be filled
+ *
+ * Fill @bitmap with the blocks of the virtual disk that hold something: the
+ * metadata (super block, FAT and root directory), and the data blocks in use
+ * by the mounted file system or kept by one of its snapshots. Bit i % 8 of
+ * byte i / 8 is set if block i is in use, and @bitmap must hold one bit per
+ * block of the virtual disk. The other blocks can be left out of a copy of the
+ * disk, where they read as zeroes. The data still pending in memory is not
+ * written yet, fs_sync() writes it first.
+ *
+ * Return: -1 if no underlying virtual disk was opened or a snapshot is
+ * mounted, or if @bitmap is NULL. Otherwise return the number of blocks in
+ * use.
+ */
+int fs_used_blocks(uint8_t *bitmap);
+
+/**
+ * fs_changes_start - Start a new changed-block tracking epoch
+ *
+ * Start tracking the blocks of the virtual disk written by libfs, if not done
+ * yet, and forget the ones written so far: a new epoch begins. The bitmap of
+ * the blocks written during the epoch is kept on disk along with the metadata,
+ * so that tracking carries on across mounts until fs_changes_stop(). The
+ * metadata blocks (super block, FAT and root directory) count as written in
+ * every epoch.
+ *
+ * An incremental backup then only needs to copy the blocks written since the
+ * previous backup, which started the current epoch. The reference tools do
+ * not track the blocks they write.
+ *
+ * Return: -1 if no underlying virtual disk was opened or a snapshot is
+ * mounted, if the underlying disk does not have enough free space left for
+ * the bitmap, or if writing to the virtual disk fails. Otherwise return the
+ * number of the new epoch.
+ */
+int fs_changes_start(void);
+
+/**
+ * fs_changes_stop - Stop tracking changed blocks
+ *
+ * Stop tracking the blocks written, and release the bitmap. The epoch moves on
+ * all the same, so that an epoch started later does not follow the current
+ * one.
+ *
+ * Return: -1 if no underlying virtual disk was opened or a snapshot is
+ * mounted, if changed blocks are not tracked, or if writing to the virtual
+ * disk fails. 0 otherwise.
+ */
+int fs_changes_stop(void);
+
+/**
+ * fs_changes_get - Get the blocks changed during the current epoch
+ * @bitmap: Bitmap to be filled, or NULL
+ *
+ * Fill @bitmap with the blocks of the virtual disk written since the current
+ * epoch started: bit i % 8 of byte i / 8 is set if block i was written. It
+ * must hold one bit per block of the virtual disk. The data still pending in
+ * memory is not written yet, fs_sync() writes it first.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if changed blocks
+ * are not tracked. Otherwise return the number of the current epoch.
+ */
+int fs_changes_get(uint8_t *bitmap);
+
+/** Operations counted by fs_get_stats() */
+enum fs_op {
+	FS_OP_FORMAT,
+	FS_OP_MOUNT,
+	FS_OP_UMOUNT,
+	FS_OP_SYNC,
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_READ,
+	FS_OP_WRITE,
+	FS_OP_APPEND,
+	FS_OP_DEFRAG,
+	FS_OP_PREALLOCATE,
+	FS_OP_SNAPSHOT,
+	FS_OP_SNAPSHOT_DELETE,
+	FS_OP_COUNT
+};
+
+/**
+ * Number of buckets of the latency histograms. Bucket 0 counts latencies of 0
+ * ns, bucket i latencies from 2^(i-1) ns up to 2^i ns excluded, and the last
+ * bucket also counts all the longer ones.
+ */
+#define FS_STATS_BUCKETS 32
+
+/**
+ * struct fs_op_stats - Statistics of one operation
+ * @calls: Number of calls, calls made from within another operation (such as
+ *         fs_write() from fs_append()) are accounted to that operation
+ * @bytes: Number of bytes read or written
+ * @block_reads: Number of blocks read from the virtual disk
+ * @block_writes: Number of blocks written to the virtual disk
+ * @io_requests: Number of read or write requests made to the virtual disk,
+ *               each one for one or more consecutive blocks
+ * @latency: Histogram of the durations of the calls
+ */
+struct fs_op_stats {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t block_reads;
+	uint64_t block_writes;
+	uint64_t io_requests;
+	uint64_t latency[FS_STATS_BUCKETS];
+};
+
+/**
+ * struct fs_stats - Statistics of libfs
+ * @ops: Statistics of each operation, indexed by %FS_OP_*
+ * @alloc_scans: Number of scans of the FAT looking for free data blocks
+ * @alloc_scan_entries: Number of FAT entries looked at by these scans
+ * @fat_walks: Number of FAT chains walked to build the block map of a file
+ * @fat_walk_blocks: Number of data blocks found by these walks
+ * @fat_walk_latency: Histogram of the durations of these walks
+ * @journal_commits: Number of transactions committed to the journal
+ * @journal_checkpoints: Number of times the metadata was written back to its
+ *                       home blocks so that the journal could be reused
+ * @disk_syncs: Number of flushes of the virtual disk to stable storage
+ */
+struct fs_stats {
+	struct fs_op_stats ops[FS_OP_COUNT];
+	uint64_t alloc_scans;
+	uint64_t alloc_scan_entries;
+	uint64_t fat_walks;
+	uint64_t fat_walk_blocks;
+	uint64_t fat_walk_latency[FS_STATS_BUCKETS];
+	uint64_t journal_commits;
+	uint64_t journal_checkpoints;
+	uint64_t disk_syncs;
+};
+
+/**
+ * fs_get_stats - Get statistics
+ * @stats: Statistics to be filled
+ *
+ * Fill @stats with the statistics gathered since the program started or since
+ * the last call to fs_reset_stats(), whatever the file systems mounted in the
+ * meantime. The counters are updated with relaxed atomic operations, so they
+ * are cheap to maintain but a copy taken while other threads run operations is
+ * not a consistent snapshot. Building libfs with `make STATS=0` removes the
+ * counters altogether.
+ *
+ * Return: -1 if @stats is NULL or if libfs was built without statistics. 0
+ * otherwise.
+ */
+int fs_get_stats(struct fs_stats *stats);
+
+/**
+ * fs_reset_stats - Reset statistics
+ *
+ * Set all the counters reported by fs_get_stats() back to 0.
+ */
+void fs_reset_stats(void);
+
+/**
+ * fs_trace_start - Start recording a trace
+ * @tracename: Name of the trace file
+ *
+ * Create the trace file @tracename, or truncate it if it already exists, and
+ * record every following call to a fs_*() operation counted by fs_get_stats()
+ * into it: the operation, its arguments (but not the data read or written),
+ * the value it returned, when it started and how long it took. The trace can
+ * then be replayed with fs_replay.x.
+ *
+ * Programs can also be traced from their start, without being changed, by
+ * setting the environment variable FS_TRACE to the name of the trace file.
+ *
+ * Return: -1 if a trace is already being recorded, if the trace file cannot be
+ * created or if libfs was built without statistics. 0 otherwise.
+ */
+int fs_trace_start(const char *tracename);
+
+/**
+ * fs_trace_stop - Stop recording a trace
+ *
+ * Stop recording the current trace and close its trace file.
+ *
+ * Return: -1 if no trace is being recorded, or if the trace file cannot be
+ * written. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -81,6 +529,18 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_list - Get the names of the files on file system
+ * @filenames: Array of %FS_FILE_MAX_COUNT file names to be filled
+ *
+ * Fill @filenames with the names of the files located in the root directory,
+ * in the order of their root directory entries.
+ *
+ * Return: -1 if no underlying virtual disk was opened. Otherwise return the
+ * number of file names filled.
+ */
+int fs_list(char filenames[][FS_FILENAME_LEN]);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -103,10 +563,11 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. Closing the last file descriptor of a file writes
+ * the data still pending in memory for it.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if the pending data of the file cannot be written. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -128,7 +589,7 @@ int fs_stat(int fd);
  *
  * Set the file offset (used for read and write operations) associated with file
  * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
+ * fs_lseek(fd, fs_stat(fd)), or use fs_append().
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open), or if @offset is out of bounds (beyond the end of the file). 0
@@ -157,6 +618,44 @@ int fs_lseek(int fd, size_t offset);
  */
 int fs_write(int fd, void *buf, size_t count);
 
+/**
+ * fs_append - Append to a file
+ * @fd: File descriptor
+ * @buf: Data buffer to append to the file
+ * @count: Number of bytes of data to be appended
+ *
+ * Attempt to write @count bytes of data from buffer pointer by @buf at the end
+ * of the file referenced by file descriptor @fd, whatever the current file
+ * offset of @fd. The data goes right after the last data block of the file,
+ * which is recorded in its root directory entry, so that the cost of appending
+ * does not depend on the size of the file. The file offset of the file
+ * descriptor is then set to the end of the file.
+ *
+ * As with fs_write(), the number of appended bytes can be smaller than @count
+ * if the underlying disk runs out of space.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually appended.
+ */
+int fs_append(int fd, void *buf, size_t count);
+
+/**
+ * fs_preallocate - Preallocate space for a file
+ * @fd: File descriptor
+ * @size: Expected size of the file, in bytes
+ *
+ * Allocate right away the data blocks the file referenced by file descriptor
+ * @fd needs to hold @size bytes, as one run of consecutive data blocks if the
+ * free space allows it, rather than as the file grows. The size of the file is
+ * left unchanged: later writes fill the preallocated blocks in place, and the
+ * ones past the end of the file are released when the file is last closed.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if the underlying disk does not have enough free space left, or if
+ * accessing the virtual disk fails. 0 otherwise.
+ */
+int fs_preallocate(int fd, size_t size);
+
 /**
  * fs_read - Read from a file
  * @fd: File descriptor
@@ -177,4 +676,103 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/*
+ * Handles
+ *
+ * The functions above work on a single default file system for the whole
+ * process. The functions below work on the file system of a handle instead,
+ * each one with its virtual disk of its own, so that a process can mount
+ * several file systems at once and serve them from different threads: the
+ * calls on different handles run in parallel, the calls on the same handle one
+ * at a time. Apart from the handle, fs_xxx_r() behaves like fs_xxx(). The
+ * statistics and the trace are shared by all the file systems.
+ */
+
+/** Handle of a mounted file system */
+typedef struct fs* fs_t;
+
+/**
+ * fs_mount_r - Mount a file system on a new handle
+ * @diskname: Name of the virtual disk file
+ *
+ * Like fs_mount(), but the file system gets a virtual disk of its own, so that
+ * it can be mounted along with other file systems. The same virtual disk must
+ * not be mounted twice at a time, which is refused for a RAM disk.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. Otherwise return the handle of the file system.
+ */
+fs_t fs_mount_r(const char *diskname);
+
+/**
+ * fs_mount_snapshot_r - Mount a snapshot of a file system on a new handle
+ * @diskname: Name of the virtual disk file
+ * @name: Snapshot name
+ *
+ * Return: NULL if fs_mount_snapshot() would fail. Otherwise return the handle
+ * of the snapshot.
+ */
+fs_t fs_mount_snapshot_r(const char *diskname, const char *name);
+
+/**
+ * fs_mount_shared_r - Mount a file system shared with other processes
+ * @diskname: Name of the virtual disk file
+ *
+ * Like fs_mount_r(), but the file system can be mounted this way by several
+ * processes at once, which share its metadata in shared memory and run their
+ * operations one at a time. The changes made by a process are seen by the
+ * others as soon as the operation that made them returns: the data written
+ * is not kept in memory for later. A file open in a process cannot be deleted
+ * by another one. The metadata is written back by each process unmounting the
+ * file system, and the shared memory is released by the last one.
+ *
+ * Return: NULL if @diskname is not a regular file, or if fs_mount_r() would
+ * fail. Otherwise return the handle of the file system.
+ */
+fs_t fs_mount_shared_r(const char *diskname);
+
+/**
+ * fs_umount_r - Unmount the file system of a handle
+ * @fs: Handle returned by fs_mount_r(), fs_mount_snapshot_r() or
+ *      fs_mount_shared_r()
+ *
+ * Unmount the file system of @fs, close its virtual disk and release @fs,
+ * which cannot be used afterwards.
+ *
+ * Return: -1 if @fs is invalid, if the virtual disk cannot be closed, or if
+ * there are still open file descriptors, in which case @fs stays mounted. 0
+ * otherwise.
+ */
+int fs_umount_r(fs_t fs);
+
+int fs_info_r(fs_t fs);
+int fs_sync_r(fs_t fs);
+int fs_set_durability_r(fs_t fs, int fd, int mode);
+int fs_set_sync_period_r(fs_t fs, unsigned int msecs);
+int fs_frag_info_r(fs_t fs, const char *filename, struct fs_frag_info *info);
+int fs_defrag_r(fs_t fs, size_t max_blocks, unsigned int max_msecs);
+int fs_snapshot_r(fs_t fs, const char *name);
+int fs_snapshot_delete_r(fs_t fs, const char *name);
+int fs_snapshot_list_r(fs_t fs, char names[][FS_FILENAME_LEN]);
+int fs_used_blocks_r(fs_t fs, uint8_t *bitmap);
+int fs_changes_start_r(fs_t fs);
+int fs_changes_stop_r(fs_t fs);
+int fs_changes_get_r(fs_t fs, uint8_t *bitmap);
+int fs_create_r(fs_t fs, const char *filename);
+int fs_delete_r(fs_t fs, const char *filename);
+int fs_ls_r(fs_t fs);
+int fs_list_r(fs_t fs, char filenames[][FS_FILENAME_LEN]);
+int fs_open_r(fs_t fs, const char *filename);
+int fs_close_r(fs_t fs, int fd);
+int fs_stat_r(fs_t fs, int fd);
+int fs_lseek_r(fs_t fs, int fd, size_t offset);
+int fs_write_r(fs_t fs, int fd, void *buf, size_t count);
+int fs_append_r(fs_t fs, int fd, void *buf, size_t count);
+int fs_preallocate_r(fs_t fs, int fd, size_t size);
+int fs_read_r(fs_t fs, int fd, void *buf, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _FS_H */
@@ -0,0 +1,403 @@
+#ifndef _FS_HPP
+#define _FS_HPP
+
+/*
+ * C++ interface of libfs, header only: a Mount owns a handle of the file
+ * system (see fs_mount_r()) and unmounts it when it goes out of scope, a File
+ * owns a file descriptor of a mounted file system and closes it likewise.
+ * Every call is an inline forward to the fs_xxx_r() function of the same
+ * name: the data goes straight between the storage of the caller and the file
+ * system, without any copy or heap allocation along the way. The calls that
+ * fail throw libfs::error, except the ones of the destructors.
+ *
+ * Requires C++20, for std::span.
+ */
+
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "fs.h"
+
+namespace libfs {
+
+/** Failure of a call to libfs, named after the function that failed */
+class error : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/** Type whose objects can be stored in a file as their bytes */
+template <class T>
+concept record = std::is_trivially_copyable_v<T> && !std::is_const_v<T>;
+
+namespace detail {
+
+/* kept out of line of the callers, so that the common path stays small */
+[[noreturn, gnu::noinline, gnu::cold]] inline void fail(const char *what)
+{
+	throw error(what);
+}
+
+inline int check(int ret, const char *what)
+{
+	if (ret < 0) [[unlikely]]
+		fail(what);
+	return ret;
+}
+
+} /* namespace detail */
+
+/**
+ * class File - Open file of a mounted file system
+ *
+ * Move-only owner of a file descriptor, closed by the destructor if still
+ * open. The File must not outlive the Mount that opened it. Once closed or
+ * moved from, or if default-constructed, its calls throw libfs::error.
+ */
+class File {
+public:
+	File() noexcept = default;
+	File(const File &) = delete;
+	File &operator=(const File &) = delete;
+
+	File(File &&other) noexcept
+		: fs_(other.fs_), fd_(std::exchange(other.fd_, -1))
+	{
+	}
+
+	File &operator=(File &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			fs_ = other.fs_;
+			fd_ = std::exchange(other.fd_, -1);
+		}
+		return *this;
+	}
+
+	~File()
+	{
+		reset();
+	}
+
+	/** Whether the File holds an open file descriptor */
+	explicit operator bool() const noexcept
+	{
+		return fd_ >= 0;
+	}
+
+	int fd() const noexcept
+	{
+		return fd_;
+	}
+
+	/** The handle of the file system of the file */
+	fs_t handle() const noexcept
+	{
+		return fs_;
+	}
+
+	/**
+	 * close - Close the file, see fs_close()
+	 *
+	 * Unlike the destructor, reports the failure of the flush the
+	 * durability of the file may call for.
+	 */
+	void close()
+	{
+		fs_t fs = opened("fs_close");
+
+		detail::check(fs_close_r(fs, std::exchange(fd_, -1)), "fs_close");
+	}
+
+	/** size - Size of the file in bytes, see fs_stat() */
+	std::size_t size() const
+	{
+		return detail::check(fs_stat_r(opened("fs_stat"), fd_), "fs_stat");
+	}
+
+	/** seek - Set the file offset, see fs_lseek() */
+	void seek(std::size_t offset)
+	{
+		detail::check(fs_lseek_r(opened("fs_lseek"), fd_, offset), "fs_lseek");
+	}
+
+	/**
+	 * read - Read from the file at the file offset, see fs_read()
+	 * @buf: Storage filled with the data
+	 *
+	 * Return: the number of bytes read, smaller than the size of @buf at
+	 * the end of the file.
+	 */
+	std::size_t read(std::span<std::byte> buf)
+	{
+		return detail::check(fs_read_r(opened("fs_read"), fd_, buf.data(), buf.size()), "fs_read");
+	}
+
+	/**
+	 * write - Write to the file at the file offset, see fs_write()
+	 * @buf: Data to write
+	 *
+	 * Return: the number of bytes written, smaller than the size of @buf
+	 * if the disk is full.
+	 */
+	std::size_t write(std::span<const std::byte> buf)
+	{
+		/* fs_write() does not modify the data */
+		return detail::check(fs_write_r(opened("fs_write"), fd_, const_cast<std::byte *>(buf.data()), buf.size()), "fs_write");
+	}
+
+	/** append - Write at the end of the file, see fs_append() */
+	std::size_t append(std::span<const std::byte> buf)
+	{
+		return detail::check(fs_append_r(opened("fs_append"), fd_, const_cast<std::byte *>(buf.data()), buf.size()), "fs_append");
+	}
+
+	/** preallocate - Reserve data blocks, see fs_preallocate() */
+	void preallocate(std::size_t size)
+	{
+		detail::check(fs_preallocate_r(opened("fs_preallocate"), fd_, size), "fs_preallocate");
+	}
+
+	/** set_durability - See fs_set_durability(), -1 follows the Mount */
+	void set_durability(int mode)
+	{
+		detail::check(fs_set_durability_r(opened("fs_set_durability"), fd_, mode), "fs_set_durability");
+	}
+
+	/**
+	 * read_records - Read records stored as their bytes
+	 * @out: Storage filled with the records, directly
+	 *
+	 * Return: the number of records read, smaller than the size of @out
+	 * at the end of the file. A record cut short by the end of the file
+	 * throws libfs::error.
+	 */
+	template <record T, std::size_t N>
+	std::size_t read_records(std::span<T, N> out)
+	{
+		std::size_t bytes = read(std::as_writable_bytes(out));
+
+		if (bytes % sizeof(T)) [[unlikely]]
+			detail::fail("read_records: truncated record");
+		return bytes / sizeof(T);
+	}
+
+	/**
+	 * read_record - Read a single record
+	 * @out: Record filled with the data
+	 *
+	 * Return: false at the end of the file, true otherwise.
+	 */
+	template <record T>
+	bool read_record(T &out)
+	{
+		return read_records(std::span<T, 1>(&out, 1));
+	}
+
+	/**
+	 * write_records - Write records as their bytes at the file offset
+	 * @records: Records to write
+	 *
+	 * Return: the number of records written. A record cut short because
+	 * the disk is full throws libfs::error.
+	 */
+	template <class T, std::size_t N>
+		requires record<std::remove_const_t<T>>
+	std::size_t write_records(std::span<T, N> records)
+	{
+		std::size_t bytes = write(std::as_bytes(records));
+
+		if (bytes % sizeof(T)) [[unlikely]]
+			detail::fail("write_records: truncated record");
+		return bytes / sizeof(T);
+	}
+
+	template <record T>
+	bool write_record(const T &value)
+	{
+		return write_records(std::span<const T, 1>(&value, 1));
+	}
+
+private:
+	friend class Mount;
+
+	File(fs_t fs, int fd) noexcept : fs_(fs), fd_(fd)
+	{
+	}
+
+	void reset() noexcept
+	{
+		if (fd_ >= 0)
+			fs_close_r(fs_, std::exchange(fd_, -1));
+	}
+
+	/* the handle of the file system, unless the File is not open */
+	fs_t opened(const char *what) const
+	{
+		if (fd_ < 0) [[unlikely]]
+			detail::fail(what);
+		return fs_;
+	}
+
+	fs_t fs_ = nullptr;
+	int fd_ = -1;
+};
+
+/**
+ * class Mount - Mounted file system
+ *
+ * Move-only owner of a file system handle, unmounted by the destructor if
+ * still mounted. The files opened from it must be closed by then, or the file
+ * system stays mounted. Once unmounted or moved from, its calls throw
+ * libfs::error.
+ */
+class Mount {
+public:
+	/** Mount the file system of virtual disk @diskname, see fs_mount_r() */
+	explicit Mount(const char *diskname) : fs_(fs_mount_r(diskname))
+	{
+		if (!fs_)
+			detail::fail("fs_mount");
+	}
+
+	/** Mount snapshot @name, read only, see fs_mount_snapshot_r() */
+	static Mount snapshot(const char *diskname, const char *name)
+	{
+		fs_t fs = fs_mount_snapshot_r(diskname, name);
+
+		if (!fs)
+			detail::fail("fs_mount_snapshot");
+		return Mount(fs);
+	}
+
+	/** Mount a file system along with other processes, see
+	 * fs_mount_shared_r() */
+	static Mount shared(const char *diskname)
+	{
+		fs_t fs = fs_mount_shared_r(diskname);
+
+		if (!fs)
+			detail::fail("fs_mount_shared");
+		return Mount(fs);
+	}
+
+	Mount(const Mount &) = delete;
+	Mount &operator=(const Mount &) = delete;
+
+	Mount(Mount &&other) noexcept : fs_(std::exchange(other.fs_, nullptr))
+	{
+	}
+
+	Mount &operator=(Mount &&other) noexcept
+	{
+		if (this != &other) {
+			if (fs_)
+				fs_umount_r(fs_);
+			fs_ = std::exchange(other.fs_, nullptr);
+		}
+		return *this;
+	}
+
+	~Mount()
+	{
+		if (fs_)
+			fs_umount_r(fs_);
+	}
+
+	/** The handle, for the fs_xxx_r() calls not wrapped here */
+	fs_t handle() const noexcept
+	{
+		return fs_;
+	}
+
+	/**
+	 * umount - Unmount the file system, see fs_umount_r()
+	 *
+	 * Unlike the destructor, reports the failure, in which case the file
+	 * system stays mounted.
+	 */
+	void umount()
+	{
+		detail::check(fs_umount_r(mounted("fs_umount")), "fs_umount");
+		fs_ = nullptr;
+	}
+
+	void create(const char *filename)
+	{
+		detail::check(fs_create_r(mounted("fs_create"), filename), "fs_create");
+	}
+
+	/** remove - Delete a file, see fs_delete() */
+	void remove(const char *filename)
+	{
+		detail::check(fs_delete_r(mounted("fs_delete"), filename), "fs_delete");
+	}
+
+	File open(const char *filename)
+	{
+		return File(fs_, detail::check(fs_open_r(mounted("fs_open"), filename), "fs_open"));
+	}
+
+	void sync()
+	{
+		detail::check(fs_sync_r(mounted("fs_sync")), "fs_sync");
+	}
+
+	void set_durability(int mode)
+	{
+		detail::check(fs_set_durability_r(mounted("fs_set_durability"), -1, mode), "fs_set_durability");
+	}
+
+	void set_sync_period(unsigned int msecs)
+	{
+		detail::check(fs_set_sync_period_r(mounted("fs_set_sync_period"), msecs), "fs_set_sync_period");
+	}
+
+	void snapshot(const char *name)
+	{
+		detail::check(fs_snapshot_r(mounted("fs_snapshot"), name), "fs_snapshot");
+	}
+
+	void snapshot_delete(const char *name)
+	{
+		detail::check(fs_snapshot_delete_r(mounted("fs_snapshot_delete"), name), "fs_snapshot_delete");
+	}
+
+	/** defrag - See fs_defrag(), return the number of blocks moved */
+	std::size_t defrag(std::size_t max_blocks, unsigned int max_msecs)
+	{
+		return detail::check(fs_defrag_r(mounted("fs_defrag"), max_blocks, max_msecs), "fs_defrag");
+	}
+
+	/** frag_info - See fs_frag_info(), @filename NULL for all the files */
+	struct fs_frag_info frag_info(const char *filename = nullptr) const
+	{
+		struct fs_frag_info info;
+
+		detail::check(fs_frag_info_r(mounted("fs_frag_info"), filename, &info), "fs_frag_info");
+		return info;
+	}
+
+private:
+	explicit Mount(fs_t fs) noexcept : fs_(fs)
+	{
+	}
+
+	/* the handle, unless the file system was unmounted or moved away */
+	fs_t mounted(const char *what) const
+	{
+		if (!fs_) [[unlikely]]
+			detail::fail(what);
+		return fs_;
+	}
+
+	fs_t fs_;
+};
+
+} /* namespace libfs */
+
+#endif /* _FS_HPP */
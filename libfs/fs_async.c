@@ -0,0 +1,252 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "fs_async.h"
+
+enum{
+    AIO_READ,
+    AIO_WRITE,
+};
+
+/* a queue of asynchronous requests
+ * @lock: protects everything below but the worker threads
+ * @cond: signaled when a request was submitted or completed, or when the
+ *        workers are to stop
+ * @head, @tail: the requests submitted but not started, in submission order
+ * @running: the request each worker is running, or NULL
+ * @done_head, @done_tail: the requests completed but not reaped
+ * @efd: readable while @done_head is not empty
+ * @stopping: whether the workers exit once there is nothing left to run
+ */
+struct fs_aio_queue{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t* workers;
+    unsigned int count;
+    struct fs_aio* head;
+    struct fs_aio* tail;
+    struct fs_aio** running;
+    struct fs_aio* done_head;
+    struct fs_aio* done_tail;
+    int efd;
+    uint8_t stopping;
+};
+
+/* the worker running a request on the file descriptor of @req, if any */
+static int fd_busy(struct fs_aio_queue *queue, struct fs_aio *req)
+{
+    for(unsigned int i = 0; i < queue->count; i++){
+        struct fs_aio* other = queue->running[i];
+        if(other && (other->fs == req->fs) && (other->fd == req->fd))
+            return 1;
+    }
+    return 0;
+}
+
+/* take the first request whose file descriptor is not in use: the later
+ * requests on a busy file descriptor wait behind the earlier ones */
+static struct fs_aio* take_request(struct fs_aio_queue *queue)
+{
+    struct fs_aio* prev = NULL;
+    for(struct fs_aio* req = queue->head; req; prev = req, req = req->next){
+        if(fd_busy(queue, req))
+            continue;
+        if(prev)
+            prev->next = req->next;
+        else
+            queue->head = req->next;
+        if(queue->tail == req)
+            queue->tail = prev;
+        req->next = NULL;
+        return req;
+    }
+    return NULL;
+}
+
+static int run_request(struct fs_aio *req)
+{
+    if(req->fs){
+        if(fs_lseek_r(req->fs, req->fd, req->offset))
+            return -1;
+        if(req->op == AIO_READ)
+            return fs_read_r(req->fs, req->fd, req->buf, req->count);
+        return fs_write_r(req->fs, req->fd, req->buf, req->count);
+    }
+    if(fs_lseek(req->fd, req->offset))
+        return -1;
+    if(req->op == AIO_READ)
+        return fs_read(req->fd, req->buf, req->count);
+    return fs_write(req->fd, req->buf, req->count);
+}
+
+struct worker_arg{
+    struct fs_aio_queue* queue;
+    unsigned int index;
+};
+
+static void* worker_main(void *arg)
+{
+    struct fs_aio_queue* queue = ((struct worker_arg*)arg)->queue;
+    unsigned int index = ((struct worker_arg*)arg)->index;
+    free(arg);
+
+    pthread_mutex_lock(&queue->lock);
+    for(;;){
+        struct fs_aio* req = take_request(queue);
+        if(!req){
+            if(queue->stopping && !queue->head)
+                break;
+            pthread_cond_wait(&queue->cond, &queue->lock);
+            continue;
+        }
+        queue->running[index] = req;
+        pthread_mutex_unlock(&queue->lock);
+
+        req->ret = run_request(req);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->running[index] = NULL;
+        /* the next request on the file descriptor may go */
+        pthread_cond_broadcast(&queue->cond);
+        /* @req belongs to its caller again once completed */
+        void (*done)(struct fs_aio*) = req->done;
+        if(done){
+            pthread_mutex_unlock(&queue->lock);
+            done(req);
+            pthread_mutex_lock(&queue->lock);
+            continue;
+        }
+        if(queue->done_tail)
+            queue->done_tail->next = req;
+        else
+            queue->done_head = req;
+        queue->done_tail = req;
+        eventfd_write(queue->efd, 1);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/* stop the workers once they ran all the requests, and release @queue */
+static void stop_workers(struct fs_aio_queue *queue, unsigned int started)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    for(unsigned int i = 0; i < started; i++)
+        pthread_join(queue->workers[i], NULL);
+
+    close(queue->efd);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue->workers);
+    free(queue->running);
+    free(queue);
+}
+
+fs_aio_queue_t fs_aio_queue_new(unsigned int workers)
+{
+    /* error checking: no worker to run the requests */
+    if(!workers)
+        return NULL;
+    struct fs_aio_queue* queue = calloc(1, sizeof(struct fs_aio_queue));
+    if(!queue)
+        return NULL;
+    queue->workers = calloc(workers, sizeof(pthread_t));
+    queue->running = calloc(workers, sizeof(struct fs_aio*));
+    queue->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(!queue->workers || !queue->running || (queue->efd == -1)){
+        if(queue->efd != -1)
+            close(queue->efd);
+        free(queue->workers);
+        free(queue->running);
+        free(queue);
+        return NULL;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    queue->count = workers;
+
+    for(unsigned int i = 0; i < workers; i++){
+        struct worker_arg* arg = malloc(sizeof(struct worker_arg));
+        if(arg){
+            arg->queue = queue;
+            arg->index = i;
+        }
+        if(!arg || pthread_create(&queue->workers[i], NULL, worker_main, arg)){
+            free(arg);
+            stop_workers(queue, i);
+            return NULL;
+        }
+    }
+    return queue;
+}
+
+int fs_aio_queue_free(fs_aio_queue_t queue)
+{
+    /* error checking: invalid queue */
+    if(!queue)
+        return -1;
+    stop_workers(queue, queue->count);
+    return 0;
+}
+
+int fs_aio_queue_fd(fs_aio_queue_t queue)
+{
+    return queue ? queue->efd : -1;
+}
+
+static int submit(fs_aio_queue_t queue, struct fs_aio *req, int op)
+{
+    /* error checking: invalid queue or request */
+    if(!queue || !req || (!req->buf && req->count))
+        return -1;
+    req->op = op;
+    req->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->tail)
+        queue->tail->next = req;
+    else
+        queue->head = req;
+    queue->tail = req;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+int fs_read_async(fs_aio_queue_t queue, struct fs_aio *req)
+{
+    return submit(queue, req, AIO_READ);
+}
+
+int fs_write_async(fs_aio_queue_t queue, struct fs_aio *req)
+{
+    return submit(queue, req, AIO_WRITE);
+}
+
+int fs_aio_reap(fs_aio_queue_t queue, struct fs_aio **reqs, int max)
+{
+    /* error checking: invalid queue */
+    if(!queue)
+        return -1;
+    int count = 0;
+    pthread_mutex_lock(&queue->lock);
+    while(queue->done_head && (count < max)){
+        reqs[count++] = queue->done_head;
+        queue->done_head = queue->done_head->next;
+    }
+    if(!queue->done_head){
+        queue->done_tail = NULL;
+        /* the completions are added under the lock, the counter goes back
+         * to 0 along with the list (if it is not 0 already) */
+        eventfd_t value;
+        eventfd_read(queue->efd, &value);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
@@ -0,0 +1,126 @@
+#ifndef _FS_ASYNC_H
+#define _FS_ASYNC_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "fs.h" /* for fs_t definition */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Asynchronous reads and writes. fs_read_async() and fs_write_async() hand a
+ * request over to the worker threads of a queue and return at once, so that a
+ * single thread can keep many operations in flight. Once a worker ran it, the
+ * request completes either through its callback, called from the worker, or
+ * by joining the completions of the queue: its eventfd is then readable, for
+ * an event loop to poll, until fs_aio_reap() collected them all.
+ *
+ * The requests belong to the caller, the queue allocates nothing once created.
+ * The requests on the same file descriptor run one at a time, in the order
+ * they were submitted; the other ones run in parallel, as far as the file
+ * systems they work on allow (see fs_mount_r()).
+ */
+
+/** Queue of asynchronous requests, along with its worker threads */
+typedef struct fs_aio_queue* fs_aio_queue_t;
+
+/**
+ * struct fs_aio - Asynchronous read or write request
+ * @fs: Handle of the file system, or NULL for the default one
+ * @fd: File descriptor
+ * @buf: Data buffer to read into or to write from, left alone by the caller
+ *       until the request completed
+ * @count: Number of bytes to read or write
+ * @offset: File offset to read from or write at; the file offset of @fd ends
+ *          up after the data, as with fs_lseek() followed by fs_read() or
+ *          fs_write()
+ * @done: Called from a worker thread once the request completed, or NULL for
+ *        the request to join the completions of the queue
+ * @data: Left to the caller, for @done
+ * @ret: Once the request completed, what fs_read() or fs_write() returned, or
+ *       -1 if @offset is out of bounds
+ * @op, @next: Private to the queue
+ */
+struct fs_aio {
+	fs_t fs;
+	int fd;
+	void *buf;
+	size_t count;
+	size_t offset;
+	void (*done)(struct fs_aio *req);
+	void *data;
+	int ret;
+	int op;
+	struct fs_aio *next;
+};
+
+/**
+ * fs_aio_queue_new - Create a queue of asynchronous requests
+ * @workers: Number of worker threads running the requests
+ *
+ * Return: NULL if @workers is 0, or if the queue cannot be created. Otherwise
+ * return the queue.
+ */
+fs_aio_queue_t fs_aio_queue_new(unsigned int workers);
+
+/**
+ * fs_aio_queue_free - Release a queue of asynchronous requests
+ * @queue: Queue
+ *
+ * Wait for the requests submitted to @queue to complete, then release it. The
+ * completions that were not reaped are dropped.
+ *
+ * Return: -1 if @queue is invalid. 0 otherwise.
+ */
+int fs_aio_queue_free(fs_aio_queue_t queue);
+
+/**
+ * fs_aio_queue_fd - Get the eventfd of a queue
+ * @queue: Queue
+ *
+ * Return: -1 if @queue is invalid. Otherwise return a non-blocking eventfd,
+ * readable as long as some completions of @queue are waiting to be reaped.
+ */
+int fs_aio_queue_fd(fs_aio_queue_t queue);
+
+/**
+ * fs_read_async - Read from a file asynchronously
+ * @queue: Queue
+ * @req: Request, filled by the caller but for its private fields
+ *
+ * Return: -1 if @queue or @req is invalid, in which case @req will not
+ * complete. 0 otherwise.
+ */
+int fs_read_async(fs_aio_queue_t queue, struct fs_aio *req);
+
+/**
+ * fs_write_async - Write to a file asynchronously
+ * @queue: Queue
+ * @req: Request, filled by the caller but for its private fields
+ *
+ * Return: -1 if @queue or @req is invalid, in which case @req will not
+ * complete. 0 otherwise.
+ */
+int fs_write_async(fs_aio_queue_t queue, struct fs_aio *req);
+
+/**
+ * fs_aio_reap - Collect the completed requests of a queue
+ * @queue: Queue
+ * @reqs: Array filled with the completed requests, in completion order
+ * @max: Size of @reqs
+ *
+ * Collect the requests without a callback that completed, without waiting for
+ * any. The eventfd of @queue is reset once they were all collected.
+ *
+ * Return: -1 if @queue is invalid. Otherwise return the number of requests
+ * stored in @reqs.
+ */
+int fs_aio_reap(fs_aio_queue_t queue, struct fs_aio **reqs, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FS_ASYNC_H */
@@ -0,0 +1,159 @@
+#ifndef _FS_ASYNC_HPP
+#define _FS_ASYNC_HPP
+
+/*
+ * C++ interface of the asynchronous requests of libfs (see fs_async.h),
+ * header only: an AioQueue owns a queue and its workers, and its read() and
+ * write() calls return awaitables for C++20 coroutines. The request lives in
+ * the frame of the awaiting coroutine, the queue allocates nothing for it.
+ *
+ * The coroutine is resumed from the worker thread that ran the request, like
+ * any completion callback: it can submit further requests from there, but
+ * must not release the queue.
+ */
+
+#include <coroutine>
+#include <cstddef>
+#include <span>
+#include <utility>
+
+#include "fs.hpp"
+#include "fs_async.h"
+
+namespace libfs {
+
+/**
+ * class AioRequest - Awaitable of an asynchronous request
+ *
+ * Awaiting it submits the request and suspends the coroutine until the
+ * request completed. The result is the number of bytes read or written, as
+ * File::read() or File::write() return it; a failure throws libfs::error.
+ */
+class AioRequest {
+public:
+	using submit_fn = int (*)(fs_aio_queue_t, struct fs_aio *);
+
+	AioRequest(fs_aio_queue_t queue, submit_fn submit, const char *what,
+		   const File &file, void *buf, std::size_t count,
+		   std::size_t offset) noexcept
+		: queue_(queue), submit_(submit), what_(what)
+	{
+		req_.fs = file.handle();
+		req_.fd = file.fd();
+		req_.buf = buf;
+		req_.count = count;
+		req_.offset = offset;
+		req_.done = complete;
+		req_.data = this;
+	}
+
+	AioRequest(const AioRequest &) = delete;
+	AioRequest &operator=(const AioRequest &) = delete;
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> coroutine) noexcept
+	{
+		coroutine_ = coroutine;
+		/* the coroutine may be resumed, and the request gone, as soon
+		 * as it is submitted */
+		if (submit_(queue_, &req_)) {
+			req_.ret = -1;
+			return false;
+		}
+		return true;
+	}
+
+	std::size_t await_resume() const
+	{
+		return detail::check(req_.ret, what_);
+	}
+
+private:
+	static void complete(struct fs_aio *req)
+	{
+		static_cast<AioRequest *>(req->data)->coroutine_.resume();
+	}
+
+	struct fs_aio req_ = {};
+	fs_aio_queue_t queue_;
+	submit_fn submit_;
+	const char *what_;
+	std::coroutine_handle<> coroutine_;
+};
+
+/**
+ * class AioQueue - Queue of asynchronous requests
+ *
+ * Move-only owner of a queue, released by the destructor once all its
+ * requests completed.
+ */
+class AioQueue {
+public:
+	/** Create a queue with @workers worker threads */
+	explicit AioQueue(unsigned int workers)
+		: queue_(fs_aio_queue_new(workers))
+	{
+		if (!queue_)
+			detail::fail("fs_aio_queue_new");
+	}
+
+	AioQueue(const AioQueue &) = delete;
+	AioQueue &operator=(const AioQueue &) = delete;
+
+	AioQueue(AioQueue &&other) noexcept
+		: queue_(std::exchange(other.queue_, nullptr))
+	{
+	}
+
+	AioQueue &operator=(AioQueue &&other) noexcept
+	{
+		if (this != &other) {
+			if (queue_)
+				fs_aio_queue_free(queue_);
+			queue_ = std::exchange(other.queue_, nullptr);
+		}
+		return *this;
+	}
+
+	~AioQueue()
+	{
+		if (queue_)
+			fs_aio_queue_free(queue_);
+	}
+
+	/** The queue, for the fs_xxx_async() calls with a callback, and for
+	 * fs_aio_queue_fd() and fs_aio_reap() */
+	fs_aio_queue_t get() const noexcept
+	{
+		return queue_;
+	}
+
+	/** read - Read from @file at @offset, see fs_read_async() */
+	AioRequest read(const File &file, std::span<std::byte> buf,
+			std::size_t offset) const noexcept
+	{
+		return AioRequest(queue_, fs_read_async, "fs_read_async", file,
+				  buf.data(), buf.size(), offset);
+	}
+
+	/** write - Write to @file at @offset, see fs_write_async() */
+	AioRequest write(const File &file, std::span<const std::byte> buf,
+			 std::size_t offset) const noexcept
+	{
+		/* fs_write() does not modify the data */
+		return AioRequest(queue_, fs_write_async, "fs_write_async", file,
+				  const_cast<std::byte *>(buf.data()), buf.size(),
+				  offset);
+	}
+
+private:
+	fs_aio_queue_t queue_;
+};
+
+} /* namespace libfs */
+
+#endif /* _FS_ASYNC_HPP */
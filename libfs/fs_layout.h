@@ -0,0 +1,194 @@
+#ifndef _FS_LAYOUT_H
+#define _FS_LAYOUT_H
+
+/*
+ * On-disk layout of ECS150FS: the super block (block 0), the FAT blocks, the
+ * root directory block and the data blocks, in this order. The blocks of the
+ * file system are made of fs_block_size() bytes, a multiple of the size of
+ * the blocks of the virtual disk: the super block and the root directory only
+ * use the first BLOCK_SIZE bytes of theirs.
+ */
+
+#include <stdint.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define FAT_EOC 0xFFFF
+
+/* block size of the file system of super block @sb */
+#define fs_block_size(sb) FS_FEATURES_BLOCK_SIZE((sb)->features)
+
+/* number of FAT entries held by one FAT block of @bs bytes */
+#define FAT_PER_BLOCK(bs) ((bs) / sizeof(uint16_t))
+
+/* fragment blocks are divided into FRAG_UNITS allocation units; the offsets of
+ * the tails are kept in units of @bs / BLOCK_SIZE bytes, so that they fit in
+ * 16 bits whatever the block size */
+#define FRAG_UNITS 64
+#define FRAG_UNIT_SIZE(bs) ((bs) / FRAG_UNITS)
+#define FRAG_OFFSET_UNIT(bs) ((bs) / BLOCK_SIZE)
+
+/* extent blocks list the extents of a file past its first one */
+#define EXTENT_PER_BLOCK(bs) ((bs) / sizeof(struct extent))
+#define EXTENT_MAX(bs) (EXTENT_PER_BLOCK(bs) + 1)
+
+/* changed-block bitmaps have one bit per block of the file system */
+#define CHANGED_PER_BLOCK(bs) ((bs) * 8)
+
+/* super block data structure
+ * @features: the %FS_FEATURE_* bits, and the block size of the file system
+ * @snapshot_index: the data block holding the snapshot table, or 0 if there
+ *                  is no snapshot
+ * @changed_epoch: the number of the current changed-block tracking epoch,
+ *                 which also moves on when tracking stops
+ * @changed_index: the first data block of the bitmap of the blocks written
+ *                 during the current epoch, chained in the FAT to the other
+ *                 ones, or 0 if changed blocks are not tracked
+ * @journal_index: with the journal, the first of its data blocks, which
+ *                 follow each other and are chained in the FAT
+ * @journal_blocks: with the journal, the number of its data blocks
+ * @journal_seq: with the journal, the sequence number of the transaction at
+ *               its beginning, the first one to replay
+ */
+struct superblock{
+    char signature[8];
+    uint16_t virtual_disk_amount;
+    uint16_t root_index;
+    uint16_t data_start_index;
+    uint16_t data_amount;
+    uint8_t FAT_amount;
+    uint32_t features;
+    uint16_t snapshot_index;
+    uint32_t changed_epoch;
+    uint16_t changed_index;
+    uint16_t journal_index;
+    uint16_t journal_blocks;
+    uint32_t journal_seq;
+    uint8_t padding[4059];
+}__attribute__((packed));
+
+typedef struct superblock* superblock_t;
+
+/* extent data structure, a run of consecutive data blocks */
+struct extent{
+    uint16_t start;
+    uint16_t length;
+}__attribute__((packed));
+
+/* root directory data structure
+ * @first_index: the first data block of the file; with the extent layout, the
+ *               start of the first extent of the file
+ * @frag_index: the fragment block holding the tail of the file, or 0 if the
+ *              tail is the last block of the FAT chain (data block 0 is never
+ *              allocated to files)
+ * @frag_offset: the offset of the tail within the fragment block, in units of
+ *               FRAG_OFFSET_UNIT() bytes
+ * @extent_len: with the extent layout, the length of the first extent
+ * @last_check: with the FAT layout, last_index_check() of the entry; the
+ *              reference tools reuse the entries of deleted files without
+ *              clearing @last_index, which is only trusted if this matches
+ * @extent_block: with the extent layout, the extent block listing the other
+ *                extents of the file (terminated by an empty extent), or 0
+ * @last_index: the last data block of the file, or 0 if unknown
+ */
+struct rootdir{
+    char filename[16];
+    uint32_t file_size;
+    uint16_t first_index;
+    uint16_t frag_index;
+    uint16_t frag_offset;
+    union{
+        uint16_t extent_len;
+        uint16_t last_check;
+    };
+    uint16_t extent_block;
+    uint16_t last_index;
+}__attribute__((packed));
+
+typedef struct rootdir* rootdir_t;
+
+/* snapshot table entry data structure, the snapshot table block holds
+ * FS_SNAPSHOT_MAX of them
+ * @name: the snapshot name, empty for an unused entry
+ * @created: the creation time of the snapshot, in seconds since the Epoch
+ * @first_index: the first data block of the snapshot, which holds its copy of
+ *               the root directory; it is chained in the FAT to the FAT_amount
+ *               data blocks holding its copy of the FAT
+ */
+struct snapshot{
+    char name[16];
+    uint64_t created;
+    uint16_t first_index;
+    uint8_t padding[6];
+}__attribute__((packed));
+
+typedef struct snapshot* snapshot_t;
+
+/* the journal holds the transactions committed since the metadata was last
+ * written back to its home blocks, one after the other; each transaction
+ * starts on a block of the virtual disk with a journal header, followed by
+ * its FAT records and then by its root directory records */
+#define JOURNAL_MAGIC "ECS150JR"
+
+/* journal header data structure
+ * @seq: the sequence number of the transaction, one more than the previous one
+ * @checksum: journal_checksum() of the header, with @checksum set to 0, and of
+ *            the records, which tells a transaction whose write was torn
+ * @length: the size of the records, in bytes
+ * @fat_count: the number of FAT records
+ * @dir_count: the number of root directory records
+ * @snapshot_index, @changed_index, @changed_epoch: the fields of the super
+ *                                                  block as of the transaction
+ */
+struct journal_header{
+    char magic[8];
+    uint32_t seq;
+    uint32_t checksum;
+    uint32_t length;
+    uint16_t fat_count;
+    uint16_t dir_count;
+    uint16_t snapshot_index;
+    uint16_t changed_index;
+    uint32_t changed_epoch;
+}__attribute__((packed));
+
+/* journal FAT record, the new value of FAT entry @index */
+struct journal_fat{
+    uint16_t index;
+    uint16_t value;
+}__attribute__((packed));
+
+/* journal root directory record, the new root directory entry @index */
+struct journal_dir{
+    uint16_t index;
+    struct rootdir entry;
+}__attribute__((packed));
+
+/* size of the largest transaction of a file system of @data_amount data
+ * blocks, changing every FAT entry and root directory entry */
+#define JOURNAL_TXN_MAX(data_amount) (sizeof(struct journal_header) +          \
+    (data_amount) * sizeof(struct journal_fat) +                               \
+    FS_FILE_MAX_COUNT * sizeof(struct journal_dir))
+
+/* FNV-1a hash of @size bytes from @buf */
+static inline uint32_t journal_checksum(const void *buf, size_t size)
+{
+    const uint8_t* p = buf;
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+/* check of the last data block @last of a file on the FAT layout, from its
+ * first data block @first and its number of data blocks @blocks, which the
+ * reference tools rewrite along with the entry */
+static inline uint16_t last_index_check(uint16_t first, uint16_t last, uint32_t blocks)
+{
+    uint32_t fields[3] = { first, last, blocks };
+    uint32_t hash = journal_checksum(fields, sizeof(fields));
+    return (uint16_t)(hash ^ (hash >> 16));
+}
+
+#endif /* _FS_LAYOUT_H */
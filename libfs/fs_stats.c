@@ -0,0 +1,184 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "fs_stats.h"
+#include "fs_trace.h"
+
+#ifndef FS_NO_STATS
+
+struct fs_stats stats;
+/* the operation running on this thread, nested calls are not counted apart */
+__thread int stats_current = -1;
+
+/* trace being recorded, records are written under @trace_lock */
+FILE* trace_file = NULL;
+uint64_t trace_start = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* count a latency of @elapsed nanoseconds in @histogram */
+void stats_latency(uint64_t *histogram, uint64_t elapsed)
+{
+    int bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+    if(bucket >= FS_STATS_BUCKETS)
+        bucket = FS_STATS_BUCKETS - 1;
+    __atomic_fetch_add(&histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+struct stats_scope stats_begin(int op)
+{
+    struct stats_scope scope = { .op = -1, .fd = -1 };
+    if(stats_current != -1)
+        return scope;
+    stats_current = op;
+    scope.op = op;
+    scope.start = stats_now();
+    return scope;
+}
+
+/* append the record of the operation of @scope, which ended at @end, to the
+ * trace */
+void trace_write(struct stats_scope *scope, uint64_t end)
+{
+    struct trace_record record;
+    size_t name_len = scope->name ? strlen(scope->name) : 0;
+    if(name_len > UINT8_MAX)
+        name_len = UINT8_MAX;
+
+    record.duration = (end - scope->start > UINT32_MAX) ? UINT32_MAX : end - scope->start;
+    record.ret = scope->ret;
+    record.arg = scope->arg;
+    record.arg2 = scope->arg2;
+    record.fd = scope->fd;
+    record.op = scope->op;
+    record.name_len = name_len;
+
+    pthread_mutex_lock(&trace_lock);
+    if(trace_file){
+        record.start = (scope->start > trace_start) ? scope->start - trace_start : 0;
+        fwrite(&record, sizeof(record), 1, trace_file);
+        fwrite(scope->name, 1, name_len, trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void stats_end(struct stats_scope *scope)
+{
+    if(scope->op == -1)
+        return;
+    uint64_t end = stats_now();
+    STATS_ADD(ops[scope->op].calls, 1);
+    stats_latency(stats.ops[scope->op].latency, end - scope->start);
+    if(__atomic_load_n(&trace_file, __ATOMIC_RELAXED))
+        trace_write(scope, end);
+    stats_current = -1;
+}
+
+int fs_get_stats(struct fs_stats *out)
+{
+    if(!out)
+        return -1;
+    /* the counters are all 64-bit, each one is read atomically */
+    uint64_t* src = (uint64_t*)&stats;
+    uint64_t* dst = (uint64_t*)out;
+    for(size_t i = 0; i < sizeof(struct fs_stats) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    return 0;
+}
+
+void fs_reset_stats(void)
+{
+    uint64_t* counters = (uint64_t*)&stats;
+    for(size_t i = 0; i < sizeof(struct fs_stats) / sizeof(uint64_t); i++)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+}
+
+int fs_trace_start(const char *tracename)
+{
+    if(!tracename)
+        return -1;
+    /* the file of a trace already active is left alone */
+    pthread_mutex_lock(&trace_lock);
+    if(trace_file){
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    FILE* file = fopen(tracename, "wb");
+    if(!file){
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    /* records are small, they are written out in large chunks */
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    struct trace_header header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.start = stats_now();
+    if(fwrite(&header, sizeof(header), 1, file) != 1){
+        pthread_mutex_unlock(&trace_lock);
+        fclose(file);
+        return -1;
+    }
+    trace_start = header.start;
+    __atomic_store_n(&trace_file, file, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+int fs_trace_stop(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    FILE* file = trace_file;
+    __atomic_store_n(&trace_file, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+    if(!file)
+        return -1;
+    return fclose(file) ? -1 : 0;
+}
+
+void trace_exit(void)
+{
+    fs_trace_stop();
+}
+
+/* programs can be traced without being changed, by naming the trace file in
+ * the FS_TRACE environment variable */
+__attribute__((constructor)) void trace_init(void)
+{
+    const char* tracename = getenv("FS_TRACE");
+    if(tracename && !fs_trace_start(tracename))
+        atexit(trace_exit);
+}
+
+#else
+
+int fs_get_stats(struct fs_stats *out)
+{
+    return -1;
+}
+
+void fs_reset_stats(void)
+{
+}
+
+int fs_trace_start(const char *tracename)
+{
+    return -1;
+}
+
+int fs_trace_stop(void)
+{
+    return -1;
+}
+
+#endif /* FS_NO_STATS */
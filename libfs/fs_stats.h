@@ -0,0 +1,110 @@
+#ifndef _FS_STATS_H
+#define _FS_STATS_H
+
+/*
+ * Counters behind fs_get_stats() and the trace of fs_trace_start(). The
+ * fs_*() functions open a scope with STATS_OP() and everything accounted until
+ * they return, block I/Os included, is charged to that operation; the scope
+ * then gets written to the trace along with the arguments given by
+ * TRACE_ARGS() and the value returned with STATS_RETURN(). Building with
+ * -DFS_NO_STATS turns all these macros into no-ops.
+ */
+
+#include <stdint.h>
+
+#include "fs.h"
+
+#ifndef FS_NO_STATS
+
+/* scope of the fs_*() operation running on the calling thread
+ * @op: the operation, or -1 for a call nested in another operation
+ * @start: the time the operation started at, in nanoseconds
+ * @ret: the value returned by the operation
+ * @fd, @name, @arg, @arg2: the arguments of the operation to be traced
+ */
+struct stats_scope{
+    int op;
+    uint64_t start;
+    int ret;
+    int fd;
+    const char* name;
+    uint64_t arg;
+    uint32_t arg2;
+};
+
+extern struct fs_stats stats;
+extern __thread int stats_current;
+
+uint64_t stats_now(void);
+struct stats_scope stats_begin(int op);
+void stats_end(struct stats_scope *scope);
+void stats_latency(uint64_t *histogram, uint64_t elapsed);
+
+#define STATS_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+/* add @n to counter @field of the current operation */
+#define STATS_OP_ADD(field, n)                                  \
+do {                                                            \
+    if(stats_current != -1)                                     \
+        STATS_ADD(ops[stats_current].field, (n));               \
+} while (0)
+
+#define STATS_OP(op) \
+    struct stats_scope stats_scope __attribute__((cleanup(stats_end))) = stats_begin(op)
+#define STATS_RETURN(x) return (stats_scope.ret = (x))
+#define TRACE_ARGS(fd_, name_, arg_, arg2_)                     \
+do {                                                            \
+    stats_scope.fd = (fd_);                                     \
+    stats_scope.name = (name_);                                 \
+    stats_scope.arg = (arg_);                                   \
+    stats_scope.arg2 = (arg2_);                                 \
+} while (0)
+/* charge everything accounted on the calling thread to @op, for a thread
+ * working on behalf of the callers of @op */
+#define STATS_CHARGE(op) (stats_current = (op))
+#define STATS_BYTES(n) STATS_OP_ADD(bytes, (n))
+#define STATS_BLOCK_READ(n)                                     \
+do {                                                            \
+    STATS_OP_ADD(block_reads, (n));                             \
+    STATS_OP_ADD(io_requests, 1);                               \
+} while (0)
+#define STATS_BLOCK_WRITE(n)                                    \
+do {                                                            \
+    STATS_OP_ADD(block_writes, (n));                            \
+    STATS_OP_ADD(io_requests, 1);                               \
+} while (0)
+#define STATS_ALLOC_SCAN(entries)                               \
+do {                                                            \
+    STATS_ADD(alloc_scans, 1);                                  \
+    STATS_ADD(alloc_scan_entries, (entries));                   \
+} while (0)
+#define STATS_JOURNAL_COMMIT() STATS_ADD(journal_commits, 1)
+#define STATS_JOURNAL_CHECKPOINT() STATS_ADD(journal_checkpoints, 1)
+#define STATS_DISK_SYNC() STATS_ADD(disk_syncs, 1)
+#define STATS_FAT_WALK_BEGIN(var) uint64_t var = stats_now()
+#define STATS_FAT_WALK_END(var, blocks)                         \
+do {                                                            \
+    STATS_ADD(fat_walks, 1);                                    \
+    STATS_ADD(fat_walk_blocks, (blocks));                       \
+    stats_latency(stats.fat_walk_latency, stats_now() - var);   \
+} while (0)
+
+#else
+
+#define STATS_OP(op) do {} while (0)
+#define STATS_RETURN(x) return (x)
+#define TRACE_ARGS(fd_, name_, arg_, arg2_) do {} while (0)
+#define STATS_CHARGE(op) do {} while (0)
+#define STATS_BYTES(n) do {} while (0)
+#define STATS_BLOCK_READ(n) do {} while (0)
+#define STATS_BLOCK_WRITE(n) do {} while (0)
+#define STATS_ALLOC_SCAN(entries) do {} while (0)
+#define STATS_JOURNAL_COMMIT() do {} while (0)
+#define STATS_JOURNAL_CHECKPOINT() do {} while (0)
+#define STATS_DISK_SYNC() do {} while (0)
+#define STATS_FAT_WALK_BEGIN(var) do {} while (0)
+#define STATS_FAT_WALK_END(var, blocks) do {} while (0)
+
+#endif /* FS_NO_STATS */
+
+#endif /* _FS_STATS_H */
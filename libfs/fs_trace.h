@@ -0,0 +1,46 @@
+#ifndef _FS_TRACE_H
+#define _FS_TRACE_H
+
+/*
+ * Format of the traces written by fs_trace_start(): a header, then one record
+ * per call to a fs_*() operation, in the order the calls returned. A record is
+ * followed by the @name_len bytes of its file or disk name, if any.
+ */
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "FSTRACE1"
+
+/* trace header
+ * @magic: %TRACE_MAGIC
+ * @start: CLOCK_MONOTONIC time the trace started at, in nanoseconds
+ */
+struct trace_header{
+    char magic[8];
+    uint64_t start;
+}__attribute__((packed));
+
+/* trace record
+ * @start: the time the call started at, in nanoseconds since the trace start
+ * @duration: the duration of the call in nanoseconds, saturated
+ * @ret: the value returned by the call
+ * @arg: the size (data blocks to format, bytes to read or write), offset or
+ *       block budget argument of the call; for fs_mount() and fs_open(), the
+ *       number of data blocks of the disk and the size of the file
+ * @arg2: the features to format with (fs_mount() included) or time budget
+ * @fd: the file descriptor argument of the call, -1 if none
+ * @op: the operation (%FS_OP_*)
+ * @name_len: the length of the name following the record
+ */
+struct trace_record{
+    uint64_t start;
+    uint32_t duration;
+    int32_t ret;
+    uint64_t arg;
+    uint32_t arg2;
+    int16_t fd;
+    uint8_t op;
+    uint8_t name_len;
+}__attribute__((packed));
+
+#endif /* _FS_TRACE_H */
@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "fsd_client.h"
+#include "fsd_proto.h"
+
+/* requests are gathered in a buffer of this size before being sent */
+#define SEND_BUFFER_SIZE (64 * 1024)
+
+static int send_all(int sock, const void *buf, size_t len)
+{
+    while(len){
+        ssize_t ret = send(sock, buf, len, MSG_NOSIGNAL);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return -1;
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int recv_all(int sock, void *buf, size_t len)
+{
+    while(len){
+        ssize_t ret = recv(sock, buf, len, 0);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return -1;
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* payload of request @req, and its length in @len */
+static const void* request_payload(struct fsd_request *req, size_t *len)
+{
+    switch(req->op){
+    case FS_OP_CREATE:
+    case FS_OP_DELETE:
+    case FS_OP_OPEN:
+        *len = req->filename ? strlen(req->filename) : 0;
+        return req->filename;
+    case FS_OP_WRITE:
+    case FS_OP_APPEND:
+        *len = req->count;
+        return req->buf;
+    default:
+        *len = 0;
+        return NULL;
+    }
+}
+
+int fsd_connect(const char *sockpath)
+{
+    struct sockaddr_un addr;
+    if(!sockpath || strlen(sockpath) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockpath);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0)
+        return -1;
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr))){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int fsd_disconnect(int conn)
+{
+    return close(conn) ? -1 : 0;
+}
+
+int fsd_submit(int conn, struct fsd_request *reqs, size_t count)
+{
+    char* out = malloc(SEND_BUFFER_SIZE);
+    size_t out_len = 0;
+    int ret = 0;
+
+    /* small requests are sent together, large payloads on their own */
+    for(size_t i = 0; i < count && !ret; i++){
+        struct fsd_request_header header;
+        size_t len;
+        const void* payload = request_payload(&reqs[i], &len);
+        if(len > FSD_MAX_PAYLOAD || (reqs[i].op == FS_OP_READ && reqs[i].count > FSD_MAX_PAYLOAD)){
+            ret = -1;
+            break;
+        }
+        header.len = len;
+        header.id = i;
+        header.op = reqs[i].op;
+        header.reserved = 0;
+        header.fd = reqs[i].fd;
+        header.arg = reqs[i].count;
+
+        if(out_len + sizeof(header) + len > SEND_BUFFER_SIZE){
+            ret = send_all(conn, out, out_len);
+            out_len = 0;
+        }
+        if(sizeof(header) + len > SEND_BUFFER_SIZE){
+            ret = ret || send_all(conn, &header, sizeof(header)) || send_all(conn, payload, len);
+            continue;
+        }
+        memcpy(out + out_len, &header, sizeof(header));
+        memcpy(out + out_len + sizeof(header), payload, len);
+        out_len += sizeof(header) + len;
+    }
+    if(!ret && out_len)
+        ret = send_all(conn, out, out_len);
+    free(out);
+    if(ret)
+        return -1;
+
+    /* the responses come back in the order of the requests */
+    for(size_t i = 0; i < count; i++){
+        struct fsd_response_header header;
+        if(recv_all(conn, &header, sizeof(header)) || header.id != i)
+            return -1;
+        reqs[i].ret = header.ret;
+        if(header.len > reqs[i].count)
+            return -1;
+        if(header.len && recv_all(conn, reqs[i].buf, header.len))
+            return -1;
+    }
+    return 0;
+}
+
+static int submit_one(int conn, int op, int fd, const char *filename, void *buf, size_t count)
+{
+    struct fsd_request req = {
+        .op = op,
+        .fd = fd,
+        .filename = filename,
+        .buf = buf,
+        .count = count,
+    };
+    if(fsd_submit(conn, &req, 1))
+        return -1;
+    return req.ret;
+}
+
+int fsd_create(int conn, const char *filename)
+{
+    return submit_one(conn, FS_OP_CREATE, -1, filename, NULL, 0);
+}
+
+int fsd_delete(int conn, const char *filename)
+{
+    return submit_one(conn, FS_OP_DELETE, -1, filename, NULL, 0);
+}
+
+int fsd_open(int conn, const char *filename)
+{
+    return submit_one(conn, FS_OP_OPEN, -1, filename, NULL, 0);
+}
+
+int fsd_close(int conn, int fd)
+{
+    return submit_one(conn, FS_OP_CLOSE, fd, NULL, NULL, 0);
+}
+
+int fsd_stat(int conn, int fd)
+{
+    return submit_one(conn, FS_OP_STAT, fd, NULL, NULL, 0);
+}
+
+int fsd_lseek(int conn, int fd, size_t offset)
+{
+    return submit_one(conn, FS_OP_LSEEK, fd, NULL, NULL, offset);
+}
+
+int fsd_read(int conn, int fd, void *buf, size_t count)
+{
+    return submit_one(conn, FS_OP_READ, fd, NULL, buf, count);
+}
+
+int fsd_write(int conn, int fd, void *buf, size_t count)
+{
+    return submit_one(conn, FS_OP_WRITE, fd, NULL, buf, count);
+}
+
+int fsd_append(int conn, int fd, void *buf, size_t count)
+{
+    return submit_one(conn, FS_OP_APPEND, fd, NULL, buf, count);
+}
+
+int fsd_sync(int conn)
+{
+    return submit_one(conn, FS_OP_SYNC, -1, NULL, NULL, 0);
+}
@@ -0,0 +1,79 @@
+#ifndef _FSD_CLIENT_H
+#define _FSD_CLIENT_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * struct fsd_request - Request to a file system server
+ * @op: Operation (%FS_OP_CREATE, %FS_OP_DELETE, %FS_OP_OPEN, %FS_OP_CLOSE,
+ *      %FS_OP_STAT, %FS_OP_LSEEK, %FS_OP_READ, %FS_OP_WRITE, %FS_OP_APPEND or
+ *      %FS_OP_SYNC)
+ * @fd: File descriptor, for the operations on an open file
+ * @filename: File name, for %FS_OP_CREATE, %FS_OP_DELETE and %FS_OP_OPEN
+ * @buf: Data buffer to read into or to write from
+ * @count: Number of bytes to read or write, or offset for %FS_OP_LSEEK
+ * @ret: Filled with the value returned by the operation, as the fs_*()
+ *       function of the same name would return it
+ */
+struct fsd_request {
+	int op;
+	int fd;
+	const char *filename;
+	void *buf;
+	size_t count;
+	int ret;
+};
+
+/**
+ * fsd_connect - Connect to a file system server
+ * @sockpath: Path of the Unix socket the server listens on
+ *
+ * Connect to the fsd server listening on @sockpath, which serves the file
+ * system it has mounted to all its clients. File descriptors returned by
+ * fsd_open() are only valid on the connection that opened them, and are
+ * closed by the server when the connection is.
+ *
+ * Return: -1 if the server cannot be reached. Otherwise return the connection,
+ * to be given to the other fsd_*() functions.
+ */
+int fsd_connect(const char *sockpath);
+
+/**
+ * fsd_disconnect - Disconnect from a file system server
+ * @conn: Connection
+ *
+ * Return: -1 if @conn cannot be closed. 0 otherwise.
+ */
+int fsd_disconnect(int conn);
+
+/**
+ * fsd_submit - Submit requests to a file system server
+ * @conn: Connection
+ * @reqs: Array of requests
+ * @count: Number of requests in @reqs
+ *
+ * Send all the requests of @reqs at once, then wait for all their responses,
+ * so that a batch of operations only costs one round trip to the server. The
+ * server runs them in order, and fills the @ret field of each request.
+ *
+ * Return: -1 if the server cannot be reached or if a request is invalid, in
+ * which case some of the requests may have been run. 0 otherwise.
+ */
+int fsd_submit(int conn, struct fsd_request *reqs, size_t count);
+
+/*
+ * The following functions submit a single request, and return what the fs_*()
+ * function of the same name returns, or -1 if the server cannot be reached.
+ */
+int fsd_create(int conn, const char *filename);
+int fsd_delete(int conn, const char *filename);
+int fsd_open(int conn, const char *filename);
+int fsd_close(int conn, int fd);
+int fsd_stat(int conn, int fd);
+int fsd_lseek(int conn, int fd, size_t offset);
+int fsd_read(int conn, int fd, void *buf, size_t count);
+int fsd_write(int conn, int fd, void *buf, size_t count);
+int fsd_append(int conn, int fd, void *buf, size_t count);
+int fsd_sync(int conn);
+
+#endif /* _FSD_CLIENT_H */
@@ -0,0 +1,45 @@
+#ifndef _FSD_PROTO_H
+#define _FSD_PROTO_H
+
+/*
+ * Protocol between fsd and its clients over a Unix stream socket. A client
+ * sends requests, each one a header followed by @len bytes of payload (the
+ * file name, or the data to write), and may send many of them without waiting
+ * for their responses. The server answers the requests of a connection in the
+ * order they were sent, each response a header followed by @len bytes of
+ * payload (the data read).
+ */
+
+#include <stdint.h>
+
+/* largest payload of a request or a response */
+#define FSD_MAX_PAYLOAD (16 * 1024 * 1024)
+
+/* request header
+ * @len: the number of bytes of payload following the header
+ * @id: an identifier chosen by the client, echoed in the response
+ * @op: the operation (%FS_OP_*), the file system operations only
+ * @fd: the file descriptor argument, -1 if none
+ * @arg: the number of bytes to read, write or append, or the offset to seek to
+ */
+struct fsd_request_header{
+    uint32_t len;
+    uint32_t id;
+    uint8_t op;
+    uint8_t reserved;
+    int16_t fd;
+    uint64_t arg;
+}__attribute__((packed));
+
+/* response header
+ * @len: the number of bytes of payload following the header
+ * @id: the identifier of the request
+ * @ret: the value returned by the operation
+ */
+struct fsd_response_header{
+    uint32_t len;
+    uint32_t id;
+    int32_t ret;
+}__attribute__((packed));
+
+#endif /* _FSD_PROTO_H */
@@ -0,0 +1,220 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+#include <fs_layout.h>
+
+/*
+ * fs_backup - Back up a virtual disk incrementally, or restore it.
+ *
+ * Backing up a disk writes the blocks written since its previous backup, as
+ * recorded by the changed-block tracking of libfs, and the metadata into an
+ * archive, then starts a new tracking epoch for the next backup. The cost of a
+ * backup thus depends on how much the disk changed, not on its size. The first
+ * backup of a disk whose changed blocks are not tracked yet, or a backup made
+ * with -f, holds all the blocks in use of the disk instead.
+ *
+ * Restoring a disk applies a full backup and the incremental backups made
+ * after it, in order. An incremental backup only applies to the disk as of the
+ * backup made right before it.
+ */
+
+#define backup_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	backup_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define ARCHIVE_MAGIC "ECS150BK"
+
+/* Archive header, followed by a bitmap of the blocks held (bit i % 8 of byte
+ * i / 8 for block i) and by the content of these blocks, in order
+ * @full: whether all the blocks in use of the disk are held
+ * @epoch: the changed-block tracking epoch of the disk when backed up, whose
+ *         changes are held by an incremental backup
+ * @block_count: the number of blocks of the disk
+ */
+struct archive_header {
+	char magic[8];
+	uint32_t full;
+	uint32_t epoch;
+	uint32_t block_count;
+	uint32_t padding;
+};
+
+static int is_set(uint8_t *bitmap, size_t block)
+{
+	return (bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+static void backup(const char *diskname, const char *archive, int full)
+{
+	struct archive_header header;
+	struct superblock sb;
+	uint8_t *bitmap;
+	char *buf;
+	FILE *f;
+	size_t count, held = 0;
+	int epoch;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	/* the pending data and the metadata go to disk first */
+	if (fs_sync())
+		die("Cannot sync diskname");
+
+	count = block_disk_count();
+	bitmap = calloc(1, (count + 7) / 8);
+	buf = malloc(BLOCK_SIZE);
+	if (!bitmap || !buf)
+		die("out of memory");
+	epoch = fs_changes_get(bitmap);
+	/* a full backup leaves out the free blocks, which read as zeroes once
+	 * restored */
+	if (full || epoch < 0) {
+		full = 1;
+		if (fs_used_blocks(bitmap) < 0)
+			die("Cannot find the blocks in use");
+	}
+	if (block_read(0, &sb))
+		die("Cannot read super block");
+
+	memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+	header.full = full;
+	header.epoch = sb.changed_epoch;
+	header.block_count = count;
+	header.padding = 0;
+
+	f = fopen(archive, "w");
+	if (!f)
+		die("Cannot create archive %s", archive);
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+	    fwrite(bitmap, (count + 7) / 8, 1, f) != 1)
+		die("Cannot write archive %s", archive);
+	for (size_t i = 0; i < count; i++) {
+		if (!is_set(bitmap, i))
+			continue;
+		if (block_read(i, buf))
+			die("Cannot read block %zu", i);
+		if (fwrite(buf, BLOCK_SIZE, 1, f) != 1)
+			die("Cannot write archive %s", archive);
+		held++;
+	}
+	if (fclose(f))
+		die("Cannot write archive %s", archive);
+
+	/* the archive is safe, the next backup starts from here */
+	epoch = fs_changes_start();
+	if (epoch < 0)
+		die("Cannot start a new epoch");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Backed up %zu/%zu blocks (%s backup), next epoch %d\n", held,
+	       count, full ? "full" : "incremental", epoch);
+	free(bitmap);
+	free(buf);
+}
+
+static void restore(const char *diskname, const char *archive)
+{
+	struct archive_header header;
+	struct superblock sb;
+	uint8_t *bitmap;
+	char *buf;
+	FILE *f;
+	size_t held = 0;
+
+	f = fopen(archive, "r");
+	if (!f)
+		die("Cannot open archive %s", archive);
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)))
+		die("Not a backup archive: %s", archive);
+
+	/* a full backup recreates the disk */
+	if (header.full && block_disk_create(diskname, header.block_count))
+		die("Cannot create diskname");
+	if (block_disk_open(diskname))
+		die("Cannot open diskname");
+	if (block_disk_count() != header.block_count)
+		die("%s: the disk has %d blocks instead of %u", archive,
+		    block_disk_count(), header.block_count);
+	if (!header.full) {
+		if (block_read(0, &sb))
+			die("Cannot read super block");
+		if (sb.changed_epoch + 1 != header.epoch)
+			die("%s: backup of epoch %u does not follow the disk "
+			    "(epoch %u)", archive, header.epoch,
+			    sb.changed_epoch);
+	}
+
+	bitmap = malloc((header.block_count + 7) / 8);
+	buf = malloc(BLOCK_SIZE);
+	if (!bitmap || !buf)
+		die("out of memory");
+	if (fread(bitmap, (header.block_count + 7) / 8, 1, f) != 1)
+		die("Cannot read archive %s", archive);
+	for (size_t i = 0; i < header.block_count; i++) {
+		if (!is_set(bitmap, i))
+			continue;
+		if (fread(buf, BLOCK_SIZE, 1, f) != 1)
+			die("Cannot read archive %s", archive);
+		if (block_write(i, buf))
+			die("Cannot write block %zu", i);
+		held++;
+	}
+	if (block_disk_close())
+		die("Cannot close diskname");
+	fclose(f);
+
+	printf("Restored %zu blocks from %s (%s backup of epoch %u)\n", held,
+	       archive, header.full ? "full" : "incremental", header.epoch);
+	free(bitmap);
+	free(buf);
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-f] <diskname> <archive>\n", program);
+	fprintf(stderr, "       %s -r <diskname> <archive>...\n", program);
+	fprintf(stderr, "\t-f\tback up all the blocks in use of the disk\n");
+	fprintf(stderr, "\t-r\trestore the disk from a full backup and the "
+		"incremental ones that follow it\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, full = 0, restoring = 0;
+
+	while ((opt = getopt(argc, argv, "fr")) != -1) {
+		switch (opt) {
+		case 'f':
+			full = 1;
+			break;
+		case 'r':
+			restoring = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind > argc - 2 || (!restoring && optind != argc - 2))
+		usage(argv[0]);
+
+	if (!restoring) {
+		backup(argv[optind], argv[optind + 1], full);
+		return 0;
+	}
+	for (int i = optind + 1; i < argc; i++)
+		restore(argv[optind], argv[i]);
+	return 0;
+}
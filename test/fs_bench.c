@@ -0,0 +1,445 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <block_queue.h>
+#include <disk.h>
+#include <fs.h>
+
+/*
+ * fs_bench - Measure the performance of libfs on a scratch virtual disk:
+ * sequential and random reads and writes at several I/O sizes, small file
+ * create/delete storms, open/close and mount/umount rates, and filling the
+ * whole disk.
+ *
+ * The scratch disk can be a RAM disk, which leaves the cost of the kernel I/O
+ * out of the measures.
+ *
+ * Every benchmark starts from a freshly formatted disk and reports its
+ * throughput and the p50/p99/p999 latency of its operations, as JSON (default)
+ * or CSV, so that runs can be compared over time.
+ */
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define KIB 1024
+
+/* I/O sizes of the read and write benchmarks */
+static const size_t io_sizes[] = { 512, 4 * KIB, 64 * KIB, 1024 * KIB };
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+static char *diskname;
+static size_t data_blocks = 8192;
+static size_t file_size = 8192 * KIB;
+static unsigned int features;
+static int csv;
+static const char *only;
+
+/* Latencies of the operations of the benchmark being run, in nanoseconds */
+static uint64_t *lat;
+static size_t lat_count, lat_max;
+
+static int results;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(uint64_t start)
+{
+	if (lat_count == lat_max) {
+		lat_max = lat_max ? 2 * lat_max : 4096;
+		lat = realloc(lat, lat_max * sizeof(*lat));
+		if (!lat)
+			die("out of memory");
+	}
+	lat[lat_count++] = now_ns() - start;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of the recorded latencies, in microseconds */
+static double percentile(double p)
+{
+	size_t rank;
+
+	if (!lat_count)
+		return 0;
+	rank = (size_t)(p * lat_count + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > lat_count)
+		rank = lat_count;
+	return lat[rank - 1] / 1000.0;
+}
+
+/* Print the result of a benchmark that did the recorded operations and moved
+ * @bytes bytes of data in @elapsed nanoseconds */
+static void report(const char *name, size_t io_size, size_t bytes,
+		   uint64_t elapsed)
+{
+	double secs = elapsed / 1e9;
+	double mib_s = secs > 0 ? bytes / secs / (KIB * KIB) : 0;
+	double ops_s = secs > 0 ? lat_count / secs : 0;
+
+	qsort(lat, lat_count, sizeof(*lat), cmp_u64);
+	if (csv) {
+		if (!results)
+			printf("name,io_size,ops,bytes,seconds,mib_per_s,"
+			       "ops_per_s,p50_us,p99_us,p999_us\n");
+		printf("%s,%zu,%zu,%zu,%.6f,%.2f,%.1f,%.2f,%.2f,%.2f\n",
+		       name, io_size, lat_count, bytes, secs, mib_s, ops_s,
+		       percentile(0.50), percentile(0.99), percentile(0.999));
+	} else {
+		printf("%s\n  {\"name\": \"%s\", \"io_size\": %zu, \"ops\": %zu, "
+		       "\"bytes\": %zu, \"seconds\": %.6f, \"mib_per_s\": %.2f, "
+		       "\"ops_per_s\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+		       "\"p999_us\": %.2f}",
+		       results ? "," : "[", name, io_size, lat_count, bytes,
+		       secs, mib_s, ops_s, percentile(0.50), percentile(0.99),
+		       percentile(0.999));
+	}
+	results++;
+	lat_count = 0;
+}
+
+static void format_and_mount(void)
+{
+	if (fs_format(diskname, data_blocks, features))
+		die("Cannot format %s", diskname);
+	if (fs_mount(diskname))
+		die("Cannot mount %s", diskname);
+}
+
+static void umount_disk(void)
+{
+	if (fs_umount())
+		die("Cannot unmount %s", diskname);
+}
+
+static int create_open(const char *filename)
+{
+	int fd;
+
+	if (fs_create(filename))
+		die("Cannot create %s", filename);
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open %s", filename);
+	return fd;
+}
+
+/* Write a whole file of about %file_size bytes, @io_size bytes at a time, and
+ * return the number of nanoseconds it took until the data was on disk */
+static uint64_t write_file(int fd, char *buf, size_t io_size, int keep)
+{
+	uint64_t begin = now_ns(), t;
+
+	for (size_t off = 0; off + io_size <= file_size; off += io_size) {
+		t = now_ns();
+		if (fs_write(fd, buf, io_size) != io_size)
+			die("Short write at offset %zu", off);
+		if (keep)
+			record(t);
+	}
+	if (fs_sync())
+		die("Cannot sync %s", diskname);
+	return now_ns() - begin;
+}
+
+static void bench_seq(size_t io_size, char *buf)
+{
+	size_t bytes = file_size / io_size * io_size;
+	uint64_t elapsed, begin, t;
+	int fd;
+
+	format_and_mount();
+	fd = create_open("seq");
+	elapsed = write_file(fd, buf, io_size, 1);
+	report("seq_write", io_size, bytes, elapsed);
+
+	fs_lseek(fd, 0);
+	begin = now_ns();
+	for (size_t off = 0; off < bytes; off += io_size) {
+		t = now_ns();
+		if (fs_read(fd, buf, io_size) != io_size)
+			die("Short read at offset %zu", off);
+		record(t);
+	}
+	report("seq_read", io_size, bytes, now_ns() - begin);
+
+	fs_close(fd);
+	umount_disk();
+}
+
+static void bench_rand(size_t io_size, char *buf)
+{
+	size_t ops = file_size / io_size, *offsets;
+	uint64_t begin, t;
+	int fd;
+
+	offsets = malloc(ops * sizeof(*offsets));
+	srand(42);
+	for (size_t i = 0; i < ops; i++)
+		offsets[i] = (size_t)(rand() % ops) * io_size;
+
+	format_and_mount();
+	fd = create_open("rand");
+	write_file(fd, buf, io_size, 0);
+
+	begin = now_ns();
+	for (size_t i = 0; i < ops; i++) {
+		t = now_ns();
+		fs_lseek(fd, offsets[i]);
+		if (fs_write(fd, buf, io_size) != io_size)
+			die("Short write at offset %zu", offsets[i]);
+		record(t);
+	}
+	if (fs_sync())
+		die("Cannot sync %s", diskname);
+	report("rand_write", io_size, ops * io_size, now_ns() - begin);
+
+	begin = now_ns();
+	for (size_t i = 0; i < ops; i++) {
+		t = now_ns();
+		fs_lseek(fd, offsets[i]);
+		if (fs_read(fd, buf, io_size) != io_size)
+			die("Short read at offset %zu", offsets[i]);
+		record(t);
+	}
+	report("rand_read", io_size, ops * io_size, now_ns() - begin);
+
+	fs_close(fd);
+	umount_disk();
+	free(offsets);
+}
+
+/* Create, write and close as many small files as the root directory holds,
+ * then delete them all, several times over */
+static void bench_small_files(char *buf)
+{
+	char name[FS_FILENAME_LEN];
+	uint64_t create_ns = 0, delete_ns = 0, begin, t;
+	size_t bytes = 0;
+	int fd, size;
+
+	format_and_mount();
+	for (int round = 0; round < 16; round++) {
+		begin = now_ns();
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			t = now_ns();
+			snprintf(name, sizeof(name), "small%d", i);
+			size = 100 + i * 16;
+			fd = create_open(name);
+			if (fs_write(fd, buf, size) != size)
+				die("Cannot write %s", name);
+			fs_close(fd);
+			record(t);
+			bytes += size;
+		}
+		create_ns += now_ns() - begin;
+
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			snprintf(name, sizeof(name), "small%d", i);
+			if (fs_delete(name))
+				die("Cannot delete %s", name);
+		}
+	}
+	report("small_create", 0, bytes, create_ns);
+
+	/* deletions are timed on a round of their own */
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		snprintf(name, sizeof(name), "small%d", i);
+		fs_close(create_open(name));
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		t = now_ns();
+		snprintf(name, sizeof(name), "small%d", i);
+		if (fs_delete(name))
+			die("Cannot delete %s", name);
+		record(t);
+		delete_ns += now_ns() - t;
+	}
+	report("small_delete", 0, 0, delete_ns);
+	umount_disk();
+}
+
+static void bench_open_close(char *buf)
+{
+	uint64_t begin, t;
+	int fd;
+
+	format_and_mount();
+	fd = create_open("file");
+	fs_write(fd, buf, 64 * KIB);
+	fs_close(fd);
+
+	begin = now_ns();
+	for (int i = 0; i < 100000; i++) {
+		t = now_ns();
+		fd = fs_open("file");
+		if (fd < 0 || fs_close(fd))
+			die("Cannot open and close file");
+		record(t);
+	}
+	report("open_close", 0, 0, now_ns() - begin);
+	umount_disk();
+}
+
+static void bench_mount(void)
+{
+	uint64_t begin, t;
+
+	format_and_mount();
+	umount_disk();
+
+	begin = now_ns();
+	for (int i = 0; i < 1000; i++) {
+		t = now_ns();
+		if (fs_mount(diskname) || fs_umount())
+			die("Cannot mount and unmount %s", diskname);
+		record(t);
+	}
+	report("mount_umount", 0, 0, now_ns() - begin);
+}
+
+/* Write into a single file until the disk is full */
+static void bench_fill(char *buf)
+{
+	size_t io_size = 64 * KIB, bytes = 0;
+	uint64_t begin, t;
+	int fd, ret;
+
+	format_and_mount();
+	fd = create_open("fill");
+	begin = now_ns();
+	do {
+		t = now_ns();
+		ret = fs_write(fd, buf, io_size);
+		/* the blocks are allocated once the pending data gets flushed,
+		 * so the free space is only known for sure after a sync */
+		if (ret != io_size && fs_sync())
+			die("Cannot sync %s", diskname);
+		record(t);
+		bytes += ret;
+	} while (ret > 0);
+	fs_close(fd);
+	report("fill", io_size, bytes, now_ns() - begin);
+	umount_disk();
+}
+
+static int selected(const char *name)
+{
+	return !only || !strcmp(only, name);
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-c] [-n data_blocks] [-s file_kib] "
+		"[-F features] [-b benchmark] [-q scheduler] <diskname>\n",
+		program);
+	fprintf(stderr, "\t-c\t\toutput CSV instead of JSON\n");
+	fprintf(stderr, "\t-n\t\tdata blocks of the scratch disk (default %zu)\n",
+		data_blocks);
+	fprintf(stderr, "\t-s\t\tfile size of the read and write benchmarks "
+		"(default %zu KiB)\n", file_size / KIB);
+	fprintf(stderr, "\t-F\t\tfeatures the disk is formatted with\n");
+	fprintf(stderr, "\t-b\t\tonly run seq, rand, small, open, mount or fill\n");
+	fprintf(stderr, "\t-q\t\tI/O scheduling policy: none, fifo or sort "
+		"(default)\n");
+	fprintf(stderr, "The scratch disk <diskname> is overwritten and deleted, "
+		"it is kept in memory if its name starts with '%s', striped over "
+		"image files if it starts with '%s'\n", BLOCK_RAM_PREFIX,
+		BLOCK_STRIPE_PREFIX);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *policies[] = { "none", "fifo", "sort" };
+	char *buf;
+	int opt, policy;
+
+	while ((opt = getopt(argc, argv, "cn:s:F:b:q:")) != -1) {
+		switch (opt) {
+		case 'c':
+			csv = 1;
+			break;
+		case 'n':
+			data_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			file_size = strtoul(optarg, NULL, 0) * KIB;
+			break;
+		case 'F':
+			features = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			only = optarg;
+			break;
+		case 'q':
+			for (policy = 0; policy < ARRAY_SIZE(policies); policy++) {
+				if (!strcmp(optarg, policies[policy]))
+					break;
+			}
+			if (block_queue_set_policy(policy))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	diskname = argv[optind];
+
+	buf = malloc(io_sizes[ARRAY_SIZE(io_sizes) - 1]);
+	if (!buf)
+		die("out of memory");
+	memset(buf, 'x', io_sizes[ARRAY_SIZE(io_sizes) - 1]);
+
+	for (int i = 0; i < ARRAY_SIZE(io_sizes); i++) {
+		/* the file is written in whole I/Os */
+		if (io_sizes[i] > file_size)
+			continue;
+		if (selected("seq"))
+			bench_seq(io_sizes[i], buf);
+		if (selected("rand"))
+			bench_rand(io_sizes[i], buf);
+	}
+	if (selected("small"))
+		bench_small_files(buf);
+	if (selected("open"))
+		bench_open_close(buf);
+	if (selected("mount"))
+		bench_mount();
+	if (selected("fill"))
+		bench_fill(buf);
+	if (!csv)
+		printf("%s]\n", results ? "\n" : "[");
+
+	block_disk_remove(diskname);
+	free(buf);
+	free(lat);
+	return 0;
+}
@@ -0,0 +1,557 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <unistd.h>
+#include <vector>
+
+#include <disk.h>
+#include <fs.hpp>
+#include <fs_async.hpp>
+
+/*
+ * fs_bench_cpp - Compare the C++ interface of libfs (fs.hpp) with the raw C
+ * calls it wraps: the same sequential and random reads and writes, typed
+ * record reads, open/close loops and asynchronous reads run through both on
+ * the same scratch disk, so that any overhead of the wrapper shows up as a
+ * ratio below 1. The two sides take turns going first from one round to the
+ * next, so that neither always finds the caches warmed up by the other.
+ *
+ * The C++ rounds also count the heap allocations made by operator new, which
+ * must stay at zero on the I/O path.
+ *
+ * The results are reported as JSON (default) or CSV, like fs_bench.
+ */
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: " fmt "\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define KIB 1024
+
+/* I/O sizes of the read and write benchmarks */
+static const size_t io_sizes[] = { 512, 4 * KIB, 64 * KIB };
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+static const char *diskname;
+static size_t data_blocks = 8192;
+static size_t file_size = 8192 * KIB;
+static unsigned int features;
+static int rounds = 4;
+static int csv;
+
+static int results;
+
+/* Heap allocations made through operator new so far */
+static size_t allocations;
+
+void *operator new(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (!p)
+		throw std::bad_alloc();
+	allocations++;
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The result of one side of a benchmark, summed over the rounds */
+struct result {
+	size_t ops;
+	size_t bytes;
+	uint64_t elapsed;
+};
+
+static void report(const char *name, size_t io_size, const struct result *r,
+		   double ratio)
+{
+	double secs = r->elapsed / 1e9;
+	double mib_s = secs > 0 ? r->bytes / secs / (KIB * KIB) : 0;
+	double ops_s = secs > 0 ? r->ops / secs : 0;
+
+	if (csv) {
+		if (!results)
+			printf("name,io_size,ops,bytes,seconds,mib_per_s,"
+			       "ops_per_s,ratio_to_c\n");
+		printf("%s,%zu,%zu,%zu,%.6f,%.2f,%.1f,%.3f\n", name, io_size,
+		       r->ops, r->bytes, secs, mib_s, ops_s, ratio);
+	} else {
+		printf("%s\n  {\"name\": \"%s\", \"io_size\": %zu, \"ops\": %zu, "
+		       "\"bytes\": %zu, \"seconds\": %.6f, \"mib_per_s\": %.2f, "
+		       "\"ops_per_s\": %.1f, \"ratio_to_c\": %.3f}",
+		       results ? "," : "[", name, io_size, r->ops, r->bytes,
+		       secs, mib_s, ops_s, ratio);
+	}
+	results++;
+}
+
+/* Report both sides of a benchmark, the ratio being the one of the
+ * throughputs of the C++ calls and the C calls */
+static void report_pair(const char *name, size_t io_size,
+			const struct result *c, const struct result *cpp)
+{
+	char label[64];
+
+	snprintf(label, sizeof(label), "c_%s", name);
+	report(label, io_size, c, 1.0);
+	snprintf(label, sizeof(label), "cpp_%s", name);
+	report(label, io_size, cpp, cpp->elapsed ? (double)c->elapsed / cpp->elapsed : 0);
+}
+
+/*
+ * The benchmarks, written once with the C calls and once with the C++ ones;
+ * each side adds its operations to @r.
+ */
+
+static void seq_c(fs_t fs, std::byte *buf, size_t io_size, struct result *r)
+{
+	uint64_t begin;
+	int fd;
+
+	if (fs_create_r(fs, "seq_c"))
+		die("Cannot create seq_c");
+	fd = fs_open_r(fs, "seq_c");
+	begin = now_ns();
+	for (size_t off = 0; off + io_size <= file_size; off += io_size) {
+		if (fs_write_r(fs, fd, buf, io_size) != (int)io_size)
+			die("Short write at offset %zu", off);
+		r->ops++;
+		r->bytes += io_size;
+	}
+	fs_lseek_r(fs, fd, 0);
+	for (size_t off = 0; off + io_size <= file_size; off += io_size) {
+		if (fs_read_r(fs, fd, buf, io_size) != (int)io_size)
+			die("Short read at offset %zu", off);
+		r->ops++;
+		r->bytes += io_size;
+	}
+	r->elapsed += now_ns() - begin;
+	fs_close_r(fs, fd);
+	fs_delete_r(fs, "seq_c");
+}
+
+static void seq_cpp(libfs::Mount &mount, std::byte *buf, size_t io_size,
+		    struct result *r)
+{
+	std::span<std::byte> io(buf, io_size);
+	uint64_t begin;
+
+	mount.create("seq_cpp");
+	libfs::File file = mount.open("seq_cpp");
+	begin = now_ns();
+	for (size_t off = 0; off + io_size <= file_size; off += io_size) {
+		if (file.write(io) != io_size)
+			die("Short write at offset %zu", off);
+		r->ops++;
+		r->bytes += io_size;
+	}
+	file.seek(0);
+	for (size_t off = 0; off + io_size <= file_size; off += io_size) {
+		if (file.read(io) != io_size)
+			die("Short read at offset %zu", off);
+		r->ops++;
+		r->bytes += io_size;
+	}
+	r->elapsed += now_ns() - begin;
+	file.close();
+	mount.remove("seq_cpp");
+}
+
+/* Random reads of a file written beforehand, at the offsets given */
+static void rand_c(fs_t fs, std::byte *buf, size_t io_size,
+		   const std::vector<size_t> &offsets, struct result *r)
+{
+	uint64_t begin;
+	int fd;
+
+	fd = fs_open_r(fs, "rand");
+	begin = now_ns();
+	for (size_t off : offsets) {
+		fs_lseek_r(fs, fd, off);
+		if (fs_read_r(fs, fd, buf, io_size) != (int)io_size)
+			die("Short read at offset %zu", off);
+		r->ops++;
+		r->bytes += io_size;
+	}
+	r->elapsed += now_ns() - begin;
+	fs_close_r(fs, fd);
+}
+
+static void rand_cpp(libfs::Mount &mount, std::byte *buf, size_t io_size,
+		     const std::vector<size_t> &offsets, struct result *r)
+{
+	std::span<std::byte> io(buf, io_size);
+	libfs::File file = mount.open("rand");
+	uint64_t begin;
+
+	begin = now_ns();
+	for (size_t off : offsets) {
+		file.seek(off);
+		if (file.read(io) != io_size)
+			die("Short read at offset %zu", off);
+		r->ops++;
+		r->bytes += io_size;
+	}
+	r->elapsed += now_ns() - begin;
+}
+
+/* A record of the typed reads: 32 bytes, read 128 at a time */
+struct sample {
+	uint64_t time;
+	uint32_t id;
+	float values[5];
+};
+
+#define BATCH 128
+
+static void records_c(fs_t fs, struct result *r)
+{
+	static struct sample batch[BATCH];
+	uint64_t begin;
+	int fd, ret;
+
+	fd = fs_open_r(fs, "records");
+	begin = now_ns();
+	while ((ret = fs_read_r(fs, fd, batch, sizeof(batch))) > 0) {
+		if (ret % sizeof(struct sample))
+			die("Truncated record");
+		r->ops++;
+		r->bytes += ret;
+	}
+	r->elapsed += now_ns() - begin;
+	fs_close_r(fs, fd);
+}
+
+static void records_cpp(libfs::Mount &mount, struct result *r)
+{
+	static struct sample batch[BATCH];
+	libfs::File file = mount.open("records");
+	uint64_t begin;
+	size_t count;
+
+	begin = now_ns();
+	while ((count = file.read_records(std::span(batch))) > 0) {
+		r->ops++;
+		r->bytes += count * sizeof(struct sample);
+	}
+	r->elapsed += now_ns() - begin;
+}
+
+#define OPEN_CLOSE_OPS 100000
+
+static void open_close_c(fs_t fs, struct result *r)
+{
+	uint64_t begin = now_ns();
+	int fd;
+
+	for (int i = 0; i < OPEN_CLOSE_OPS; i++) {
+		fd = fs_open_r(fs, "records");
+		if (fd < 0 || fs_close_r(fs, fd))
+			die("Cannot open and close records");
+	}
+	r->ops += OPEN_CLOSE_OPS;
+	r->elapsed += now_ns() - begin;
+}
+
+static void open_close_cpp(libfs::Mount &mount, struct result *r)
+{
+	uint64_t begin = now_ns();
+
+	for (int i = 0; i < OPEN_CLOSE_OPS; i++)
+		mount.open("records").close();
+	r->ops += OPEN_CLOSE_OPS;
+	r->elapsed += now_ns() - begin;
+}
+
+/* Asynchronous reads of the records file, AIO_SIZE bytes at a time, with
+ * AIO_DEPTH of them in flight on as many file descriptors */
+#define AIO_SIZE (4 * KIB)
+#define AIO_DEPTH 16
+#define AIO_WORKERS 4
+
+/* Completions of the C side, shared by its requests */
+struct async_state {
+	fs_aio_queue_t queue;
+	std::atomic<size_t> ops;
+	std::atomic<int> running;
+};
+
+/* Submit the next chunk of the request from its callback, on the worker, as
+ * the coroutines of the C++ side resume there, then count itself out */
+static void async_done(struct fs_aio *req)
+{
+	struct async_state *state = (struct async_state *)req->data;
+
+	if (req->ret != AIO_SIZE)
+		die("Short read at offset %zu", req->offset);
+	state->ops++;
+	req->offset += AIO_DEPTH * AIO_SIZE;
+	if (req->offset / AIO_SIZE < file_size / AIO_SIZE) {
+		if (fs_read_async(state->queue, req))
+			die("Cannot submit a read");
+		return;
+	}
+	fs_close_r(req->fs, req->fd);
+	if (!--state->running)
+		state->running.notify_one();
+}
+
+static void async_c(fs_t fs, fs_aio_queue_t queue, std::byte *buf,
+		    struct result *r)
+{
+	static struct fs_aio reqs[AIO_DEPTH];
+	struct async_state state = { queue, 0, AIO_DEPTH };
+	uint64_t begin;
+
+	begin = now_ns();
+	for (int i = 0; i < AIO_DEPTH; i++) {
+		if ((size_t)i >= file_size / AIO_SIZE) {
+			state.running--;
+			continue;
+		}
+		reqs[i] = { fs, fs_open_r(fs, "records"), buf + i * AIO_SIZE,
+			    AIO_SIZE, (size_t)i * AIO_SIZE, async_done, &state };
+		if (fs_read_async(queue, &reqs[i]))
+			die("Cannot submit a read");
+	}
+	for (int n; (n = state.running.load()); )
+		state.running.wait(n);
+	r->elapsed += now_ns() - begin;
+	r->ops += state.ops;
+	r->bytes += state.ops * AIO_SIZE;
+}
+
+/* A coroutine that runs on its own once called */
+struct task {
+	struct promise_type {
+		task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/* Read every @step chunk from chunk @first, then count itself out of
+ * @running */
+static task read_chunks(libfs::AioQueue &queue, libfs::File file,
+			std::byte *buf, size_t first, size_t step,
+			std::atomic<size_t> &ops, std::atomic<int> &running)
+{
+	for (size_t i = first; i < file_size / AIO_SIZE; i += step) {
+		if (co_await queue.read(file, std::span(buf, AIO_SIZE), i * AIO_SIZE) != AIO_SIZE)
+			die("Short read at offset %zu", i * AIO_SIZE);
+		ops++;
+	}
+	file.close();
+	if (!--running)
+		running.notify_one();
+}
+
+static void async_cpp(libfs::Mount &mount, libfs::AioQueue &queue,
+		      std::byte *buf, struct result *r)
+{
+	std::atomic<size_t> ops = 0;
+	std::atomic<int> running = AIO_DEPTH;
+	uint64_t begin;
+
+	begin = now_ns();
+	for (int i = 0; i < AIO_DEPTH; i++)
+		read_chunks(queue, mount.open("records"), buf + i * AIO_SIZE, i,
+			    AIO_DEPTH, ops, running);
+	for (int n; (n = running.load()); )
+		running.wait(n);
+	r->elapsed += now_ns() - begin;
+	r->ops += ops;
+	r->bytes += ops * AIO_SIZE;
+}
+
+/* Run the C++ side of a benchmark, which must not allocate */
+#define RUN_CPP(name, call)						\
+do {									\
+	size_t before = allocations;					\
+	call;								\
+	if (allocations != before)					\
+		die("%s: %zu heap allocations", name,			\
+		    allocations - before);				\
+} while (0)
+
+/* Run the rounds of a benchmark, the C++ side going first every other round */
+#define RUN_ROUNDS(c_call, cpp_call)					\
+do {									\
+	for (int round = 0; round < rounds; round++) {			\
+		if (round % 2) {					\
+			cpp_call;					\
+			c_call;						\
+		} else {						\
+			c_call;						\
+			cpp_call;					\
+		}							\
+	}								\
+} while (0)
+
+/* Write a file of about %file_size bytes, @io_size bytes at a time */
+static void write_file(libfs::Mount &mount, const char *filename,
+		       std::byte *buf, size_t io_size)
+{
+	mount.create(filename);
+	libfs::File file = mount.open(filename);
+	for (size_t off = 0; off + io_size <= file_size; off += io_size) {
+		if (file.write(std::span(buf, io_size)) != io_size)
+			die("Short write at offset %zu", off);
+	}
+}
+
+static void bench(std::byte *buf)
+{
+	struct result c, cpp;
+
+	if (fs_format(diskname, data_blocks, features))
+		die("Cannot format %s", diskname);
+	libfs::Mount mount(diskname);
+	fs_t fs = mount.handle();
+
+	for (size_t io_size : io_sizes) {
+		/* the file is written in whole I/Os */
+		if (io_size > file_size)
+			continue;
+		c = cpp = {};
+		RUN_ROUNDS(seq_c(fs, buf, io_size, &c),
+			   RUN_CPP("seq", seq_cpp(mount, buf, io_size, &cpp)));
+		report_pair("seq", io_size, &c, &cpp);
+
+		std::vector<size_t> offsets(file_size / io_size);
+		srand(42);
+		for (size_t &off : offsets)
+			off = (size_t)(rand() % offsets.size()) * io_size;
+		write_file(mount, "rand", buf, io_size);
+		c = cpp = {};
+		RUN_ROUNDS(rand_c(fs, buf, io_size, offsets, &c),
+			   RUN_CPP("rand", rand_cpp(mount, buf, io_size, offsets,
+						    &cpp)));
+		report_pair("rand_read", io_size, &c, &cpp);
+		mount.remove("rand");
+	}
+
+	/* the records are written through the typed calls as well */
+	std::vector<struct sample> samples(file_size / sizeof(struct sample));
+	for (size_t i = 0; i < samples.size(); i++)
+		samples[i] = { i * 1000, (uint32_t)i, { 1, 2, 3, 4, 5 } };
+	mount.create("records");
+	{
+		libfs::File file = mount.open("records");
+		RUN_CPP("write_records", file.write_records(std::span(samples)));
+	}
+	c = cpp = {};
+	RUN_ROUNDS(records_c(fs, &c),
+		   RUN_CPP("records", records_cpp(mount, &cpp)));
+	report_pair("read_records", sizeof(struct sample) * BATCH, &c, &cpp);
+
+	c = cpp = {};
+	RUN_ROUNDS(open_close_c(fs, &c),
+		   RUN_CPP("open_close", open_close_cpp(mount, &cpp)));
+	report_pair("open_close", 0, &c, &cpp);
+
+	/* the frames of the coroutines are allocated, once per file read */
+	libfs::AioQueue queue(AIO_WORKERS);
+	c = cpp = {};
+	RUN_ROUNDS(async_c(fs, queue.get(), buf, &c),
+		   async_cpp(mount, queue, buf, &cpp));
+	report_pair("async_read", AIO_SIZE, &c, &cpp);
+	mount.umount();
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-c] [-n data_blocks] [-s file_kib] "
+		"[-F features] [-r rounds] <diskname>\n", program);
+	fprintf(stderr, "\t-c\t\toutput CSV instead of JSON\n");
+	fprintf(stderr, "\t-n\t\tdata blocks of the scratch disk (default %zu)\n",
+		data_blocks);
+	fprintf(stderr, "\t-s\t\tfile size of the read and write benchmarks "
+		"(default %zu KiB)\n", file_size / KIB);
+	fprintf(stderr, "\t-F\t\tfeatures the disk is formatted with\n");
+	fprintf(stderr, "\t-r\t\trounds of each side of a benchmark, better "
+		"even (default %d)\n", rounds);
+	fprintf(stderr, "The scratch disk <diskname> is overwritten and deleted, "
+		"it is kept in memory if its name starts with '%s'\n",
+		BLOCK_RAM_PREFIX);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	std::byte *buf;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "cn:s:F:r:")) != -1) {
+		switch (opt) {
+		case 'c':
+			csv = 1;
+			break;
+		case 'n':
+			data_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			file_size = strtoul(optarg, NULL, 0) * KIB;
+			break;
+		case 'F':
+			features = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			if (rounds < 1)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	diskname = argv[optind];
+
+	buf = (std::byte *)malloc(io_sizes[ARRAY_SIZE(io_sizes) - 1]);
+	if (!buf)
+		die("out of memory");
+	memset(buf, 'x', io_sizes[ARRAY_SIZE(io_sizes) - 1]);
+
+	try {
+		bench(buf);
+	} catch (const libfs::error &e) {
+		die("%s failed", e.what());
+	}
+	if (!csv)
+		printf("%s]\n", results ? "\n" : "[");
+
+	block_disk_remove(diskname);
+	free(buf);
+	return 0;
+}
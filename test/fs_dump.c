@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+/*
+ * fs_dump - Dump the blocks in use of a virtual disk into a compact archive.
+ *
+ * Only the metadata and the data blocks in use, by the files or by the
+ * snapshots, are read and streamed into the archive, as runs of consecutive
+ * blocks. The free blocks are left out, so the size of the archive and the cost
+ * of the dump only depend on the space in use, not on the size of the disk.
+ * The archive is written to the standard output if its name is "-", so that a
+ * disk can be cloned to another host through a pipe, and fs_restore rebuilds
+ * the disk from it.
+ */
+
+#define dump_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	dump_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define DUMP_MAGIC "ECS150DP"
+
+/* maximum number of blocks read at once */
+#define DUMP_CHUNK 256
+
+/* Archive header, followed by the runs of blocks in use, each one a struct
+ * dump_run followed by the content of its blocks, and by an empty run
+ * @block_count: the number of blocks of the disk
+ * @used: the number of blocks held by the archive
+ */
+struct dump_header {
+	char magic[8];
+	uint32_t block_count;
+	uint32_t used;
+};
+
+struct dump_run {
+	uint32_t start;
+	uint32_t length;
+};
+
+static int is_set(uint8_t *bitmap, size_t block)
+{
+	return (bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	struct dump_header header;
+	struct dump_run run;
+	uint8_t *bitmap;
+	char *buf;
+	FILE *f;
+	uint64_t begin, elapsed;
+	size_t count, len;
+	int used;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <diskname> <archive>\n", argv[0]);
+		fprintf(stderr, "The archive goes to the standard output if it "
+			"is '-'\n");
+		exit(1);
+	}
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+	begin = now_ns();
+	count = block_disk_count();
+	bitmap = malloc((count + 7) / 8);
+	buf = malloc(DUMP_CHUNK * BLOCK_SIZE);
+	if (!bitmap || !buf)
+		die("out of memory");
+	used = fs_used_blocks(bitmap);
+	if (used < 0)
+		die("Cannot find the blocks in use");
+
+	f = strcmp(argv[2], "-") ? fopen(argv[2], "w") : stdout;
+	if (!f)
+		die("Cannot create archive %s", argv[2]);
+	memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+	header.block_count = count;
+	header.used = used;
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		die("Cannot write archive");
+
+	/* each run is read with as few requests as possible */
+	for (size_t i = 0; i < count; ) {
+		if (!is_set(bitmap, i)) {
+			i++;
+			continue;
+		}
+		run.start = i;
+		run.length = 0;
+		while (i + run.length < count && is_set(bitmap, i + run.length))
+			run.length++;
+		if (fwrite(&run, sizeof(run), 1, f) != 1)
+			die("Cannot write archive");
+		for (size_t done = 0; done < run.length; done += len) {
+			len = run.length - done;
+			if (len > DUMP_CHUNK)
+				len = DUMP_CHUNK;
+			if (block_read_range(i + done, len, buf))
+				die("Cannot read block %zu", i + done);
+			if (fwrite(buf, BLOCK_SIZE, len, f) != len)
+				die("Cannot write archive");
+		}
+		i += run.length;
+	}
+	run.start = 0;
+	run.length = 0;
+	if (fwrite(&run, sizeof(run), 1, f) != 1 || fflush(f) ||
+	    (f != stdout && fclose(f)))
+		die("Cannot write archive");
+	elapsed = now_ns() - begin;
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	fprintf(stderr, "Dumped %d/%zu blocks in %.6f s (%.1f MiB/s)\n", used,
+		count, elapsed / 1e9,
+		(double)used * BLOCK_SIZE / (1024.0 * 1024.0) / (elapsed / 1e9));
+	free(bitmap);
+	free(buf);
+	return 0;
+}
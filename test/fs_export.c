@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/*
+ * fs_export - Copy files of a virtual disk into a host directory.
+ *
+ * The main thread reads the files from the virtual disk in fixed-size chunks,
+ * while a pool of writer threads writes the chunks already read to the host
+ * files. Reading the disk thus overlaps with writing the host files, and the
+ * memory used only depends on the chunk size and the number of writers, not on
+ * the size of the files.
+ *
+ * Each host file is preallocated from the size of the file on the virtual
+ * disk before its first chunk is written.
+ *
+ * The files can be exported from a snapshot of the virtual disk (-s), which
+ * gives a consistent backup of a disk that stays in use.
+ */
+
+#define export_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	export_error(__VA_ARGS__);	\
+	exit(2);					\
+} while (0)
+
+#define KIB 1024
+
+/* Chunk of a file, on its way from the virtual disk to a host file */
+struct chunk {
+	int file;
+	off_t offset;
+	size_t len;
+	char *data;
+	struct chunk *next;
+};
+
+struct export_file {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	int host_fd;
+	int failed;
+};
+
+static struct export_file *files;
+
+static size_t chunk_size = 1024 * KIB;
+
+/* Chunks not in use, and chunks read but not written yet, until all the files
+ * have been read */
+static struct chunk *free_chunks;
+static struct chunk *ready_head, *ready_tail;
+static int reading_done;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t free_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+static struct chunk *get_free(void)
+{
+	struct chunk *c;
+
+	pthread_mutex_lock(&lock);
+	while (!free_chunks)
+		pthread_cond_wait(&free_cond, &lock);
+	c = free_chunks;
+	free_chunks = c->next;
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+static void put_free(struct chunk *c)
+{
+	pthread_mutex_lock(&lock);
+	c->next = free_chunks;
+	free_chunks = c;
+	pthread_cond_signal(&free_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static struct chunk *get_ready(void)
+{
+	struct chunk *c;
+
+	pthread_mutex_lock(&lock);
+	while (!ready_head && !reading_done)
+		pthread_cond_wait(&ready_cond, &lock);
+	c = ready_head;
+	if (c) {
+		ready_head = c->next;
+		if (!ready_head)
+			ready_tail = NULL;
+	}
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+static void put_ready(struct chunk *c)
+{
+	pthread_mutex_lock(&lock);
+	c->next = NULL;
+	if (ready_tail)
+		ready_tail->next = c;
+	else
+		ready_head = c;
+	ready_tail = c;
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Write chunks to their host file, in any order */
+static void *writer(void *arg)
+{
+	struct chunk *c;
+	ssize_t ret;
+	size_t len;
+
+	while ((c = get_ready())) {
+		struct export_file *f = &files[c->file];
+
+		for (len = 0; len < c->len; len += ret) {
+			ret = pwrite(f->host_fd, c->data + len, c->len - len,
+				     c->offset + len);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret <= 0) {
+				__atomic_store_n(&f->failed, 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+		put_free(c);
+	}
+	return NULL;
+}
+
+/* Queue the chunks of file @i, read from the virtual disk */
+static void read_file(int i, const char *directory)
+{
+	struct export_file *f = &files[i];
+	char path[PATH_MAX];
+	size_t offset = 0;
+	int fd;
+
+	fd = fs_open(f->name);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open file '%s'\n", f->name);
+		f->failed = 1;
+		return;
+	}
+	f->size = fs_stat(fd);
+	snprintf(path, sizeof(path), "%s/%s", directory, f->name);
+	f->host_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f->host_fd < 0) {
+		fprintf(stderr, "Cannot create host file %s\n", path);
+		f->failed = 1;
+		fs_close(fd);
+		return;
+	}
+	if (f->size)
+		posix_fallocate(f->host_fd, 0, f->size);
+
+	while (offset < f->size) {
+		struct chunk *c = get_free();
+		int len = fs_read(fd, c->data, chunk_size);
+
+		if (len <= 0) {
+			put_free(c);
+			f->failed = 1;
+			break;
+		}
+		c->file = i;
+		c->offset = offset;
+		c->len = len;
+		put_ready(c);
+		offset += len;
+	}
+	fs_close(fd);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-c chunk] [-s snapshot] "
+		"<diskname> <directory> [<filename>...]\n", program);
+	fprintf(stderr, "\t-j\tnumber of writer threads (default: 4)\n");
+	fprintf(stderr, "\t-c\tchunk size in KiB (default: 1024)\n");
+	fprintf(stderr, "\t-s\texport from snapshot <snapshot>\n");
+	fprintf(stderr, "All the files are exported if none is given\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+	struct chunk *chunks;
+	struct stat st;
+	char (*names)[FS_FILENAME_LEN];
+	uint64_t begin, elapsed;
+	size_t total = 0;
+	int thread_count = 4, opt, file_count, failed = 0;
+	const char *directory, *snapshot = NULL;
+
+	while ((opt = getopt(argc, argv, "j:c:s:")) != -1) {
+		switch (opt) {
+		case 'j':
+			thread_count = atoi(optarg);
+			break;
+		case 'c':
+			chunk_size = strtoul(optarg, NULL, 0) * KIB;
+			break;
+		case 's':
+			snapshot = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind > argc - 2 || thread_count < 1 || !chunk_size)
+		usage(argv[0]);
+	directory = argv[optind + 1];
+	if (stat(directory, &st) || !S_ISDIR(st.st_mode))
+		die("Not a directory: %s", directory);
+
+	if (snapshot ? fs_mount_snapshot(argv[optind], snapshot) :
+	    fs_mount(argv[optind]))
+		die("Cannot mount diskname");
+
+	names = calloc(FS_FILE_MAX_COUNT, FS_FILENAME_LEN);
+	files = calloc(FS_FILE_MAX_COUNT, sizeof(*files));
+	if (!names || !files)
+		die("out of memory");
+	if (optind + 2 < argc) {
+		file_count = argc - optind - 2;
+		if (file_count > FS_FILE_MAX_COUNT)
+			die("Too many files");
+		for (int i = 0; i < file_count; i++) {
+			if (strlen(argv[optind + 2 + i]) >= FS_FILENAME_LEN)
+				die("File name too long: %s", argv[optind + 2 + i]);
+			strcpy(names[i], argv[optind + 2 + i]);
+		}
+	} else {
+		file_count = fs_list(names);
+	}
+
+	/* two chunks per writer, one being written while the other is read */
+	chunks = calloc(2 * thread_count, sizeof(*chunks));
+	if (!chunks)
+		die("out of memory");
+	for (int i = 0; i < 2 * thread_count; i++) {
+		chunks[i].data = malloc(chunk_size);
+		if (!chunks[i].data)
+			die("out of memory");
+		put_free(&chunks[i]);
+	}
+
+	begin = now_ns();
+	threads = malloc(thread_count * sizeof(*threads));
+	for (int i = 0; i < thread_count; i++)
+		pthread_create(&threads[i], NULL, writer, NULL);
+
+	/* the virtual disk is only ever accessed from this thread */
+	for (int i = 0; i < file_count; i++) {
+		strcpy(files[i].name, names[i]);
+		files[i].host_fd = -1;
+		read_file(i, directory);
+	}
+
+	pthread_mutex_lock(&lock);
+	reading_done = 1;
+	pthread_cond_broadcast(&ready_cond);
+	pthread_mutex_unlock(&lock);
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now_ns() - begin;
+
+	for (int i = 0; i < file_count; i++) {
+		struct export_file *f = &files[i];
+
+		if (f->host_fd >= 0 && close(f->host_fd))
+			f->failed = 1;
+		if (f->failed) {
+			fprintf(stderr, "Cannot export file '%s'\n", f->name);
+			failed++;
+			continue;
+		}
+		printf("Exported file '%s' (%zu bytes)\n", f->name, f->size);
+		total += f->size;
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	printf("Exported %d/%d files, %zu bytes in %.6f s (%.1f MiB/s)\n",
+	       file_count - failed, file_count, total, elapsed / 1e9,
+	       total / (1024.0 * 1024.0) / (elapsed / 1e9));
+
+	for (int i = 0; i < 2 * thread_count; i++)
+		free(chunks[i].data);
+	free(chunks);
+	free(threads);
+	free(names);
+	free(files);
+	return failed ? 1 : 0;
+}
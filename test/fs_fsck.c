@@ -0,0 +1,785 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+#include <fs_layout.h>
+
+/*
+ * fs_fsck - Check (and optionally repair) the consistency of an ECS150FS
+ * image: FAT chains or extents, cross-linked blocks, leaked blocks, fragment
+ * tails, file sizes, the blocks of the snapshots, the changed-block bitmap
+ * and the journal. The transactions committed to the journal are replayed
+ * first, as mounting the image would.
+ *
+ * Exit status: 0 if no error was found, 1 if all the errors were repaired, 4
+ * if errors were left uncorrected, 8 if the image could not be checked.
+ */
+
+#define EXIT_CLEAN	0
+#define EXIT_REPAIRED	1
+#define EXIT_UNCORRECTED 4
+#define EXIT_FAILURE_OP	8
+
+#define fsck_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fsck_error(__VA_ARGS__);	\
+	exit(EXIT_FAILURE_OP);		\
+} while (0)
+
+/* Result of walking the data blocks of a file
+ * @blocks: number of valid data blocks found
+ * @last: last valid data block
+ * @problem: whether the walk stopped on an invalid or shared block
+ * @extents: extents of the file (extent layout), EXTENT_MAX() of them
+ * @extent_count: number of valid extents
+ * @extent_block: whether the extent block was marked as used by the file
+ */
+struct file_check {
+	uint32_t blocks;
+	uint16_t last;
+	int problem;
+	struct extent *extents;
+	int extent_count;
+	int extent_block;
+};
+
+static struct superblock sb;
+/* Block size of the file system, and number of blocks of the virtual disk in
+ * each block */
+static size_t block_size;
+#define DISK_BLOCKS (block_size / BLOCK_SIZE)
+static uint16_t *fat;
+static struct rootdir root[FS_FILE_MAX_COUNT];
+static struct file_check checks[FS_FILE_MAX_COUNT];
+
+/* Data blocks referenced by files and fragment blocks holding tails */
+static uint64_t *used_map;
+static uint64_t *frag_map;
+
+/* Number of journal transactions replayed */
+static int replayed;
+
+static int repair;
+static int nthreads;
+static int next_file;
+static int errors;
+static int fixed;
+
+static int read_block(size_t block, void *buf)
+{
+	return block_read_range(block * DISK_BLOCKS, DISK_BLOCKS, buf);
+}
+
+static int write_block(size_t block, const void *buf)
+{
+	return block_write_range(block * DISK_BLOCKS, DISK_BLOCKS, buf);
+}
+
+/* Byte offset of the tail of file @i in its fragment block */
+static uint32_t frag_offset(int i)
+{
+	return (uint32_t)root[i].frag_offset * FRAG_OFFSET_UNIT(block_size);
+}
+
+static int extents_layout(void)
+{
+	return sb.features & FS_FEATURE_EXTENTS;
+}
+
+static int in_use(uint64_t *map, uint16_t block)
+{
+	return (__atomic_load_n(&map[block / 64], __ATOMIC_RELAXED) >>
+		(block % 64)) & 1;
+}
+
+/* Mark @block in @map, return whether it was already marked */
+static int mark(uint64_t *map, uint16_t block)
+{
+	uint64_t bit = 1ULL << (block % 64);
+
+	return !!(__atomic_fetch_or(&map[block / 64], bit, __ATOMIC_RELAXED)
+		  & bit);
+}
+
+static void unmark(uint64_t *map, uint16_t block)
+{
+	__atomic_fetch_and(&map[block / 64], ~(1ULL << (block % 64)),
+			   __ATOMIC_RELAXED);
+}
+
+/* Report an error, and whether it is going to be repaired */
+#define report(fix, fmt, ...)						\
+do {									\
+	__atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);		\
+	if ((fix) && repair)						\
+		__atomic_fetch_add(&fixed, 1, __ATOMIC_RELAXED);	\
+	printf(fmt "%s\n", ##__VA_ARGS__,				\
+	       ((fix) && repair) ? " (fixed)" : "");			\
+} while (0)
+
+static int valid_block(uint16_t block)
+{
+	return block && block < sb.data_amount;
+}
+
+/* Walk the FAT chain of file @i, stopping at the first invalid link or block
+ * already used by another file (or by the same file, if the chain loops) */
+static void walk_chain(int i, int fix)
+{
+	struct file_check *check = &checks[i];
+	uint16_t prev = FAT_EOC;
+	uint16_t block = root[i].first_index;
+
+	check->blocks = 0;
+	check->problem = 0;
+	while (block != FAT_EOC) {
+		if (!valid_block(block)) {
+			if (fix)
+				report(1, "file '%s': invalid data block %u after block %u",
+				       root[i].filename, block, check->blocks);
+			check->problem = 1;
+			break;
+		}
+		if (mark(used_map, block)) {
+			if (fix)
+				report(1, "file '%s': data block %u is used more than once",
+				       root[i].filename, block);
+			check->problem = 1;
+			break;
+		}
+		check->blocks++;
+		prev = block;
+		block = fat[block];
+	}
+	check->last = prev;
+
+	/* The chain is cut right before the faulty block */
+	if (fix && repair && check->problem) {
+		if (prev == FAT_EOC)
+			root[i].first_index = FAT_EOC;
+		else
+			fat[prev] = FAT_EOC;
+	}
+}
+
+/* Walk the extents of file @i, stopping at the first invalid extent or block
+ * already used by another file */
+static void walk_extents(int i, int fix)
+{
+	struct file_check *check = &checks[i];
+	int count = 0;
+
+	check->blocks = 0;
+	check->problem = 0;
+	check->last = FAT_EOC;
+	check->extent_count = 0;
+	check->extent_block = 0;
+	if (root[i].first_index == FAT_EOC)
+		return;
+
+	if (!check->extents)
+		check->extents = malloc(EXTENT_MAX(block_size) *
+					sizeof(struct extent));
+	check->extents[count].start = root[i].first_index;
+	check->extents[count].length = root[i].extent_len;
+	count++;
+	if (root[i].extent_block) {
+		uint16_t block = root[i].extent_block;
+
+		check->extent_block = valid_block(block) &&
+			!mark(used_map, block);
+		if (!check->extent_block ||
+		    read_block(sb.data_start_index + block,
+			       &check->extents[1])) {
+			if (fix)
+				report(1, "file '%s': invalid extent block %u",
+				       root[i].filename, block);
+			check->problem = 1;
+		} else {
+			while (count < EXTENT_MAX(block_size) &&
+			       check->extents[count].length)
+				count++;
+		}
+	}
+
+	for (int e = 0; e < count && !check->problem; e++) {
+		struct extent *ext = &check->extents[e];
+
+		if (!ext->length || !valid_block(ext->start) ||
+		    ext->start + ext->length > sb.data_amount) {
+			if (fix)
+				report(1, "file '%s': invalid extent %u+%u",
+				       root[i].filename, ext->start,
+				       ext->length);
+			check->problem = 1;
+			break;
+		}
+		for (int b = 0; b < ext->length; b++) {
+			if (!mark(used_map, ext->start + b))
+				continue;
+			if (fix)
+				report(1, "file '%s': data block %u is used more than once",
+				       root[i].filename, ext->start + b);
+			/* Keep the part of the extent before the block */
+			ext->length = b;
+			check->problem = 1;
+			break;
+		}
+		check->blocks += ext->length;
+		if (ext->length) {
+			check->last = ext->start + ext->length - 1;
+			check->extent_count = e + 1;
+		}
+	}
+}
+
+/* Write the (repaired) extents of file @i back */
+static void store_extents(int i)
+{
+	struct file_check *check = &checks[i];
+	struct extent *blk;
+
+	root[i].first_index = check->extent_count ?
+		check->extents[0].start : FAT_EOC;
+	root[i].extent_len = check->extent_count ?
+		check->extents[0].length : 0;
+	if (check->extent_count <= 1) {
+		/* The extent block then shows up as leaked */
+		if (check->extent_block)
+			unmark(used_map, root[i].extent_block);
+		check->extent_block = 0;
+		root[i].extent_block = 0;
+		return;
+	}
+
+	blk = calloc(1, block_size);
+	memcpy(blk, &check->extents[1],
+	       (check->extent_count - 1) * sizeof(struct extent));
+	if (write_block(sb.data_start_index + root[i].extent_block, blk))
+		fsck_error("cannot write extent block of '%s'",
+			   root[i].filename);
+	free(blk);
+}
+
+static void walk_file(int i, int fix)
+{
+	if (extents_layout())
+		walk_extents(i, fix);
+	else
+		walk_chain(i, fix);
+
+	/* Fragment blocks are shared between files */
+	if (sb.features & FS_FEATURE_FRAGMENTS && root[i].frag_index &&
+	    valid_block(root[i].frag_index))
+		mark(frag_map, root[i].frag_index);
+}
+
+static void *walk_thread(void *arg)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED)) <
+	       FS_FILE_MAX_COUNT) {
+		if (root[i].filename[0])
+			walk_file(i, 0);
+	}
+	return NULL;
+}
+
+/* Walk all the files in parallel, only to find out whether there is anything
+ * wrong: faulty files are walked again in order to be reported and repaired,
+ * so that the first file in the directory keeps a shared block */
+static int walk_files(void)
+{
+	pthread_t threads[nthreads];
+	int problem = 0;
+
+	next_file = 0;
+	for (int t = 0; t < nthreads; t++)
+		pthread_create(&threads[t], NULL, walk_thread, NULL);
+	for (int t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		problem |= root[i].filename[0] && checks[i].problem;
+	if (!problem)
+		return 0;
+
+	memset(used_map, 0, (sb.data_amount + 63) / 64 * sizeof(uint64_t));
+	memset(frag_map, 0, (sb.data_amount + 63) / 64 * sizeof(uint64_t));
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!root[i].filename[0])
+			continue;
+		walk_file(i, 1);
+		if (repair && checks[i].problem && extents_layout())
+			store_extents(i);
+	}
+	return 1;
+}
+
+/* Check the tail of file @i in its fragment block against the other tails */
+static void check_fragment(int i)
+{
+	uint32_t tail = root[i].file_size % block_size;
+	uint16_t frag = root[i].frag_index;
+
+	if (!valid_block(frag) || !tail ||
+	    frag_offset(i) % FRAG_UNIT_SIZE(block_size) ||
+	    frag_offset(i) + tail > block_size) {
+		report(1, "file '%s': invalid fragment %u+%u",
+		       root[i].filename, frag, frag_offset(i));
+		goto drop;
+	}
+	if (in_use(used_map, frag)) {
+		report(1, "file '%s': fragment block %u is also a data block",
+		       root[i].filename, frag);
+		goto drop;
+	}
+	for (int j = 0; j < i; j++) {
+		uint32_t other = root[j].file_size % block_size;
+
+		if (!root[j].filename[0] || root[j].frag_index != frag)
+			continue;
+		if (frag_offset(i) < frag_offset(j) + other &&
+		    frag_offset(j) < frag_offset(i) + tail) {
+			report(1, "file '%s': tail overlaps the tail of '%s'",
+			       root[i].filename, root[j].filename);
+			goto drop;
+		}
+	}
+	return;
+
+drop:
+	if (repair) {
+		root[i].file_size -= root[i].file_size % block_size;
+		root[i].frag_index = 0;
+		root[i].frag_offset = 0;
+	}
+}
+
+/* Check the size of file @i against its data blocks */
+static void check_size(int i)
+{
+	struct file_check *check = &checks[i];
+	uint32_t expected = (root[i].file_size + block_size - 1) / block_size;
+
+	if (sb.features & FS_FEATURE_FRAGMENTS && root[i].frag_index)
+		expected = root[i].file_size / block_size;
+
+	if (check->blocks < expected) {
+		report(1, "file '%s': size %u exceeds its %u data blocks",
+		       root[i].filename, root[i].file_size, check->blocks);
+		if (repair) {
+			root[i].file_size = check->blocks * block_size;
+			root[i].frag_index = 0;
+			root[i].frag_offset = 0;
+			}
+	} else if (check->blocks > expected) {
+		report(1, "file '%s': %u data blocks past the end of the file",
+		       root[i].filename, check->blocks - expected);
+		if (repair) {
+			/* The blocks past the end then show up as leaked */
+			if (extents_layout()) {
+				uint32_t keep = expected;
+				int e;
+
+				for (e = 0; e < check->extent_count &&
+				     keep > check->extents[e].length; e++)
+					keep -= check->extents[e].length;
+				if (!expected)
+					e = keep = 0;
+				for (int f = e; f < check->extent_count; f++) {
+					struct extent *ext = &check->extents[f];
+
+					for (int b = (f == e) ? keep : 0;
+					     b < ext->length; b++)
+						unmark(used_map, ext->start + b);
+				}
+				check->extents[e].length = keep;
+				check->extent_count = keep ? e + 1 : e;
+				for (e = 0; e < check->extent_count; e++)
+					check->last = check->extents[e].start +
+						check->extents[e].length - 1;
+				store_extents(i);
+			} else {
+				uint16_t block = root[i].first_index;
+				uint16_t next;
+
+				for (uint32_t n = 1; n < expected; n++)
+					block = fat[block];
+				next = expected ? fat[block] : block;
+				for (uint32_t n = expected; n < check->blocks;
+				     n++) {
+					unmark(used_map, next);
+					next = fat[next];
+				}
+				if (expected)
+					fat[block] = FAT_EOC;
+				else
+					root[i].first_index = FAT_EOC;
+				check->last = expected ? block : FAT_EOC;
+			}
+			check->blocks = expected;
+			}
+	}
+
+	/* On the FAT layout, a last data block whose check does not match is
+	 * left over from a deleted file, and as good as unknown */
+	if (root[i].last_index && check->blocks &&
+	    (extents_layout() || root[i].last_check ==
+	     last_index_check(root[i].first_index, root[i].last_index,
+			      check->blocks)) &&
+	    root[i].last_index != check->last) {
+		report(1, "file '%s': last data block is %u, not %u",
+		       root[i].filename, check->last, root[i].last_index);
+		if (repair) {
+			root[i].last_index = check->last;
+			if (!extents_layout())
+				root[i].last_check = last_index_check(
+					root[i].first_index, check->last,
+					check->blocks);
+		}
+	}
+}
+
+/* Thread argument for finding the leaked blocks of a range of the FAT */
+struct leak_range {
+	uint16_t start;
+	uint16_t end;
+	int leaked;
+};
+
+static void *leak_thread(void *arg)
+{
+	struct leak_range *range = arg;
+
+	for (uint16_t b = range->start; b < range->end; b++) {
+		int used = in_use(used_map, b) || in_use(frag_map, b);
+
+		if (fat[b] && !used) {
+			range->leaked++;
+			if (repair)
+				fat[b] = 0;
+		} else if (!fat[b] && used) {
+			/* Only possible with extents, where the FAT tells which
+			 * blocks are in use */
+			report(1, "data block %u is in use but marked free", b);
+			if (repair)
+				fat[b] = FAT_EOC;
+		}
+	}
+	return NULL;
+}
+
+static void check_leaks(void)
+{
+	pthread_t threads[nthreads];
+	struct leak_range ranges[nthreads];
+	int per_thread = (sb.data_amount + nthreads - 1) / nthreads;
+	int leaked = 0;
+
+	for (int t = 0; t < nthreads; t++) {
+		ranges[t].start = t * per_thread;
+		ranges[t].end = (t + 1) * per_thread < sb.data_amount ?
+			(t + 1) * per_thread : sb.data_amount;
+		if (!ranges[t].start)
+			ranges[t].start = 1;
+		ranges[t].leaked = 0;
+		if (ranges[t].start > ranges[t].end)
+			ranges[t].start = ranges[t].end;
+		pthread_create(&threads[t], NULL, leak_thread, &ranges[t]);
+	}
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], NULL);
+		leaked += ranges[t].leaked;
+	}
+	if (leaked)
+		report(1, "%d data blocks are allocated but not used", leaked);
+}
+
+/* Mark the snapshot table, and the blocks holding the copies of the root
+ * directory and of the FAT of each snapshot, which belong to no file. The data
+ * blocks kept by the snapshots alone are free in the FAT. */
+static void mark_snapshots(void)
+{
+	struct snapshot *table;
+	uint16_t b;
+
+	if (!sb.snapshot_index)
+		return;
+	table = malloc(block_size);
+	if (!valid_block(sb.snapshot_index) ||
+	    read_block(sb.data_start_index + sb.snapshot_index, table)) {
+		report(0, "snapshot table block %u is invalid",
+		       sb.snapshot_index);
+		free(table);
+		return;
+	}
+	mark(used_map, sb.snapshot_index);
+	for (int i = 0; i < FS_SNAPSHOT_MAX; i++) {
+		if (!table[i].name[0])
+			continue;
+		b = table[i].first_index;
+		for (int n = 0; n <= sb.FAT_amount; n++) {
+			if (!valid_block(b) || mark(used_map, b)) {
+				report(0, "snapshot '%.*s': broken chain at "
+				       "data block %u", FS_FILENAME_LEN,
+				       table[i].name, b);
+				break;
+			}
+			b = fat[b];
+		}
+	}
+	free(table);
+}
+
+/* Mark the blocks of the journal, which belong to no file */
+static void mark_journal(void)
+{
+	uint16_t b = sb.journal_index;
+
+	if (!(sb.features & FS_FEATURE_JOURNAL))
+		return;
+	for (int n = 0; n < sb.journal_blocks; n++) {
+		if (b != sb.journal_index + n || !valid_block(b) ||
+		    mark(used_map, b)) {
+			report(0, "journal: broken chain at data block %u", b);
+			break;
+		}
+		b = fat[b];
+	}
+}
+
+/* Mark the blocks of the changed-block bitmap, which belong to no file */
+static void mark_changed(void)
+{
+	uint16_t b = sb.changed_index;
+	int count = (sb.virtual_disk_amount + CHANGED_PER_BLOCK(block_size) -
+		     1) / CHANGED_PER_BLOCK(block_size);
+
+	if (!b)
+		return;
+	for (int n = 0; n < count; n++) {
+		if (!valid_block(b) || mark(used_map, b)) {
+			report(0, "changed-block bitmap: broken chain at data "
+			       "block %u", b);
+			break;
+		}
+		b = fat[b];
+	}
+}
+
+static void check_directory(void)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!root[i].filename[0])
+			continue;
+		if (!memchr(root[i].filename, '\0', FS_FILENAME_LEN)) {
+			report(1, "entry %d: file name is not terminated", i);
+			if (repair) {
+				root[i].filename[FS_FILENAME_LEN - 1] = '\0';
+					}
+		}
+		for (int j = 0; j < i; j++) {
+			if (!strncmp(root[i].filename, root[j].filename,
+				     FS_FILENAME_LEN))
+				report(0, "entry %d: duplicate file name '%.*s'",
+				       i, FS_FILENAME_LEN, root[i].filename);
+		}
+	}
+}
+
+/* Whether the journal holds a valid transaction numbered @seq at @h, within
+ * @size bytes */
+static int valid_transaction(struct journal_header *h, size_t size,
+			     uint32_t seq)
+{
+	struct journal_fat *f = (struct journal_fat *)(h + 1);
+	struct journal_dir *d = (struct journal_dir *)(f + h->fat_count);
+	uint32_t checksum = h->checksum;
+	int valid;
+
+	if (memcmp(h->magic, JOURNAL_MAGIC, sizeof(h->magic)) ||
+	    h->seq != seq || h->length > size - sizeof(*h) ||
+	    h->length != h->fat_count * sizeof(*f) + h->dir_count * sizeof(*d))
+		return 0;
+	h->checksum = 0;
+	valid = journal_checksum(h, sizeof(*h) + h->length) == checksum;
+	h->checksum = checksum;
+	if (!valid || h->snapshot_index >= sb.data_amount ||
+	    h->changed_index >= sb.data_amount)
+		return 0;
+	for (int i = 0; i < h->fat_count; i++) {
+		if (f[i].index >= sb.data_amount)
+			return 0;
+	}
+	for (int i = 0; i < h->dir_count; i++) {
+		if (d[i].index >= FS_FILE_MAX_COUNT)
+			return 0;
+	}
+	return 1;
+}
+
+/* Replay the transactions committed to the journal over the metadata */
+static void replay_journal(void)
+{
+	size_t size = sb.journal_blocks * block_size, offset = 0;
+	uint32_t seq = sb.journal_seq;
+	char *buf;
+
+	if (!(sb.features & FS_FEATURE_JOURNAL))
+		return;
+	if (!sb.journal_index ||
+	    sb.journal_index + sb.journal_blocks > sb.data_amount)
+		die("invalid journal");
+	buf = malloc(size);
+	if (!buf)
+		die("out of memory");
+	if (block_read_range((sb.data_start_index + sb.journal_index) *
+			     DISK_BLOCKS, sb.journal_blocks * DISK_BLOCKS, buf))
+		die("cannot read journal");
+
+	while (offset + sizeof(struct journal_header) <= size) {
+		struct journal_header *h = (struct journal_header *)(buf + offset);
+		struct journal_fat *f = (struct journal_fat *)(h + 1);
+		struct journal_dir *d = (struct journal_dir *)(f + h->fat_count);
+
+		if (!valid_transaction(h, size - offset, seq))
+			break;
+		for (int i = 0; i < h->fat_count; i++)
+			fat[f[i].index] = f[i].value;
+		for (int i = 0; i < h->dir_count; i++)
+			root[d[i].index] = d[i].entry;
+		sb.snapshot_index = h->snapshot_index;
+		sb.changed_index = h->changed_index;
+		sb.changed_epoch = h->changed_epoch;
+		offset += (sizeof(*h) + h->length + BLOCK_SIZE - 1) /
+			BLOCK_SIZE * BLOCK_SIZE;
+		seq++;
+		replayed++;
+	}
+	/* A repaired image starts over with an empty journal */
+	sb.journal_seq = seq;
+	free(buf);
+}
+
+static void load_image(const char *diskname)
+{
+	if (block_disk_open(diskname))
+		die("cannot open '%s'", diskname);
+	if (block_read(0, &sb))
+		die("cannot read super block");
+
+	/* The super block and the root directory only use the first block of
+	 * the virtual disk of theirs */
+	block_size = fs_block_size(&sb);
+	if (strncmp(sb.signature, "ECS150FS", 8) ||
+	    sb.virtual_disk_amount * DISK_BLOCKS != block_disk_count() ||
+	    sb.root_index != sb.FAT_amount + 1 ||
+	    sb.data_start_index != sb.root_index + 1 ||
+	    sb.data_amount != sb.virtual_disk_amount - sb.FAT_amount - 2 ||
+	    sb.FAT_amount != (2 * sb.data_amount + block_size - 1) / block_size)
+		die("no valid file system in '%s'", diskname);
+
+	fat = malloc(sb.FAT_amount * block_size);
+	for (int i = 0; i < sb.FAT_amount; i++) {
+		if (read_block(1 + i, fat + i * FAT_PER_BLOCK(block_size)))
+			die("cannot read FAT block %d", i);
+	}
+	if (block_read(sb.root_index * DISK_BLOCKS, root))
+		die("cannot read root directory");
+	replay_journal();
+
+	used_map = calloc((sb.data_amount + 63) / 64, sizeof(uint64_t));
+	frag_map = calloc((sb.data_amount + 63) / 64, sizeof(uint64_t));
+}
+
+static void write_image(void)
+{
+	for (int i = 0; i < sb.FAT_amount; i++) {
+		if (write_block(1 + i, fat + i * FAT_PER_BLOCK(block_size)))
+			die("cannot write FAT block %d", i);
+	}
+	if (block_write(sb.root_index * DISK_BLOCKS, root))
+		die("cannot write root directory");
+	/* The replayed transactions are now in the FAT and root directory */
+	if (replayed && block_write(0, &sb))
+		die("cannot write super block");
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-r] [-j <threads>] <diskname>\n", program);
+	fprintf(stderr, "\t-r\trepair the errors found\n");
+	fprintf(stderr, "\t-j\tnumber of checking threads\n");
+	exit(EXIT_FAILURE_OP);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int files = 0, used = 0;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "rj:")) != -1) {
+		switch (opt) {
+		case 'r':
+			repair = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	load_image(argv[optind]);
+
+	if (fat[0] != FAT_EOC) {
+		report(1, "data block 0 is not reserved");
+		if (repair)
+			fat[0] = FAT_EOC;
+	}
+	check_directory();
+	mark_snapshots();
+	mark_changed();
+	mark_journal();
+	walk_files();
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!root[i].filename[0])
+			continue;
+		files++;
+		if (root[i].frag_index && sb.features & FS_FEATURE_FRAGMENTS)
+			check_fragment(i);
+		check_size(i);
+	}
+	check_leaks();
+
+	if (repair && fixed)
+		write_image();
+	for (uint16_t b = 1; b < sb.data_amount; b++)
+		used += !!fat[b];
+	block_disk_close();
+
+	if (replayed)
+		printf("%s: replayed %d journal transactions\n", argv[optind],
+		       replayed);
+	printf("%s: %d files, %d/%d data blocks used, %d errors (%d fixed)\n",
+	       argv[optind], files, used, sb.data_amount, errors, fixed);
+
+	if (!errors)
+		return EXIT_CLEAN;
+	return errors == fixed ? EXIT_REPAIRED : EXIT_UNCORRECTED;
+}
@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/*
+ * fs_import - Copy host files into a virtual disk, under their base name.
+ *
+ * The host files are read in fixed-size chunks by a pool of reader threads,
+ * each one reading a file at a time, while the main thread writes the chunks
+ * already read to the virtual disk. Reading the host files thus overlaps with
+ * writing the disk, and the memory used only depends on the chunk size and the
+ * number of readers, not on the size of the files.
+ *
+ * Several files are imported at once, so each one is preallocated from its
+ * size on the host before its first chunk is written: it gets its data blocks
+ * in one run even though the writes of the files are interleaved.
+ */
+
+#define import_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	import_error(__VA_ARGS__);	\
+	exit(2);					\
+} while (0)
+
+#define KIB 1024
+
+/* Chunk of a host file, on its way from a reader to the virtual disk */
+struct chunk {
+	int file;
+	size_t len;
+	int last;
+	int error;
+	char *data;
+	struct chunk *next;
+};
+
+struct import_file {
+	const char *path;
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	size_t written;
+	int fd;
+	int failed;
+};
+
+static struct import_file *files;
+static int file_count;
+static int next_file;
+
+static size_t chunk_size = 1024 * KIB;
+
+/* Chunks not in use, and chunks read but not written yet, in order */
+static struct chunk *free_chunks;
+static struct chunk *ready_head, *ready_tail;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t free_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+static struct chunk *get_free(void)
+{
+	struct chunk *c;
+
+	pthread_mutex_lock(&lock);
+	while (!free_chunks)
+		pthread_cond_wait(&free_cond, &lock);
+	c = free_chunks;
+	free_chunks = c->next;
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+static void put_free(struct chunk *c)
+{
+	pthread_mutex_lock(&lock);
+	c->next = free_chunks;
+	free_chunks = c;
+	pthread_cond_signal(&free_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static struct chunk *get_ready(void)
+{
+	struct chunk *c;
+
+	pthread_mutex_lock(&lock);
+	while (!ready_head)
+		pthread_cond_wait(&ready_cond, &lock);
+	c = ready_head;
+	ready_head = c->next;
+	if (!ready_head)
+		ready_tail = NULL;
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+static void put_ready(struct chunk *c)
+{
+	pthread_mutex_lock(&lock);
+	c->next = NULL;
+	if (ready_tail)
+		ready_tail->next = c;
+	else
+		ready_head = c;
+	ready_tail = c;
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Read files one after another, and queue their chunks in order, the last
+ * chunk of a file being marked as such */
+static void *reader(void *arg)
+{
+	int i, fd, last;
+	ssize_t len;
+	struct chunk *c;
+
+	while ((i = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED)) <
+	       file_count) {
+		fd = open(files[i].path, O_RDONLY);
+		if (fd >= 0)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		do {
+			c = get_free();
+			c->file = i;
+			do {
+				len = (fd < 0) ? -1 : read(fd, c->data, chunk_size);
+			} while (len < 0 && errno == EINTR);
+			c->error = (len < 0);
+			c->len = (len > 0) ? len : 0;
+			c->last = last = (len <= 0);
+			put_ready(c);
+		} while (!last);
+		if (fd >= 0)
+			close(fd);
+	}
+	return NULL;
+}
+
+static void fail(struct import_file *f, const char *reason)
+{
+	if (!f->failed)
+		fprintf(stderr, "Cannot import '%s': %s\n", f->path, reason);
+	f->failed = 1;
+}
+
+/* Create and open the file of @f on the virtual disk, and preallocate it */
+static void open_file(struct import_file *f)
+{
+	if (fs_create(f->name)) {
+		fail(f, "cannot create file (already exists, or root directory "
+		     "full)");
+		return;
+	}
+	f->fd = fs_open(f->name);
+	if (f->fd < 0) {
+		fail(f, "cannot open file");
+		return;
+	}
+	/* without room for all of it, write as much as fits */
+	fs_preallocate(f->fd, f->size);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-c chunk] <diskname> "
+		"<host filename>...\n", program);
+	fprintf(stderr, "\t-j\tnumber of reader threads (default: 4)\n");
+	fprintf(stderr, "\t-c\tchunk size in KiB (default: 1024)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+	struct chunk *chunks;
+	struct stat st;
+	uint64_t begin, elapsed;
+	size_t total = 0;
+	int thread_count = 4, opt, done = 0, failed = 0;
+
+	while ((opt = getopt(argc, argv, "j:c:")) != -1) {
+		switch (opt) {
+		case 'j':
+			thread_count = atoi(optarg);
+			break;
+		case 'c':
+			chunk_size = strtoul(optarg, NULL, 0) * KIB;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind > argc - 2 || thread_count < 1 || !chunk_size)
+		usage(argv[0]);
+	/* each reader has a file open on the virtual disk */
+	if (thread_count > FS_OPEN_MAX_COUNT)
+		thread_count = FS_OPEN_MAX_COUNT;
+
+	file_count = argc - optind - 1;
+	files = calloc(file_count, sizeof(*files));
+	if (!files)
+		die("out of memory");
+	for (int i = 0; i < file_count; i++) {
+		struct import_file *f = &files[i];
+		char *path = strdup(argv[optind + 1 + i]);
+
+		f->path = argv[optind + 1 + i];
+		f->fd = -1;
+		if (stat(f->path, &st))
+			die("Cannot stat %s", f->path);
+		if (!S_ISREG(st.st_mode))
+			die("Not a regular file: %s", f->path);
+		if (strlen(basename(path)) >= FS_FILENAME_LEN)
+			die("File name too long: %s", f->path);
+		strcpy(f->name, basename(path));
+		free(path);
+		f->size = st.st_size;
+	}
+
+	if (fs_mount(argv[optind]))
+		die("Cannot mount diskname");
+
+	/* two chunks per reader, one being read while the other is written */
+	chunks = calloc(2 * thread_count, sizeof(*chunks));
+	if (!chunks)
+		die("out of memory");
+	for (int i = 0; i < 2 * thread_count; i++) {
+		chunks[i].data = malloc(chunk_size);
+		if (!chunks[i].data)
+			die("out of memory");
+		put_free(&chunks[i]);
+	}
+
+	begin = now_ns();
+	threads = malloc(thread_count * sizeof(*threads));
+	for (int i = 0; i < thread_count; i++)
+		pthread_create(&threads[i], NULL, reader, NULL);
+
+	/* the virtual disk is only ever accessed from this thread */
+	while (done < file_count) {
+		struct chunk *c = get_ready();
+		struct import_file *f = &files[c->file];
+
+		if (f->fd < 0 && !f->failed)
+			open_file(f);
+		if (c->error)
+			fail(f, "cannot read host file");
+		if (c->len && !f->failed) {
+			int written = fs_write(f->fd, c->data, c->len);
+
+			if (written > 0)
+				f->written += written;
+			if (written != c->len)
+				fail(f, "no space left on disk");
+		}
+		if (c->last) {
+			if (f->fd >= 0 && fs_close(f->fd))
+				fail(f, "cannot close file");
+			if (!f->failed)
+				printf("Imported file '%s' (%zu bytes)\n", f->name,
+				       f->written);
+			total += f->written;
+			failed += f->failed;
+			done++;
+		}
+		put_free(c);
+	}
+
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	elapsed = now_ns() - begin;
+	printf("Imported %d/%d files, %zu bytes in %.6f s (%.1f MiB/s)\n",
+	       file_count - failed, file_count, total, elapsed / 1e9,
+	       total / (1024.0 * 1024.0) / (elapsed / 1e9));
+
+	for (int i = 0; i < 2 * thread_count; i++)
+		free(chunks[i].data);
+	free(chunks);
+	free(threads);
+	free(files);
+	return failed ? 1 : 0;
+}
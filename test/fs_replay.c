@@ -0,0 +1,259 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_trace.h>
+
+/*
+ * fs_replay - Replay a trace recorded by fs_trace_start() (or with FS_TRACE)
+ * against a fresh virtual disk, as fast as possible or at the original pace.
+ *
+ * The disk is formatted with the geometry of the first disk the trace mounts
+ * or formats, whatever its name in the trace. Files that the trace opens
+ * without creating them first are created with the size they had, so that
+ * reads find as much data as they did. The data written is a fixed pattern.
+ *
+ * The replay is deterministic: a call that returns something else than in the
+ * trace is reported, and the exit status is 1 if there was any.
+ */
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	replay_error(__VA_ARGS__);	\
+	exit(2);					\
+} while (0)
+
+static const char *op_names[FS_OP_COUNT] = {
+	[FS_OP_FORMAT] = "format",
+	[FS_OP_MOUNT] = "mount",
+	[FS_OP_UMOUNT] = "umount",
+	[FS_OP_SYNC] = "sync",
+	[FS_OP_CREATE] = "create",
+	[FS_OP_DELETE] = "delete",
+	[FS_OP_OPEN] = "open",
+	[FS_OP_CLOSE] = "close",
+	[FS_OP_STAT] = "stat",
+	[FS_OP_LSEEK] = "lseek",
+	[FS_OP_READ] = "read",
+	[FS_OP_WRITE] = "write",
+	[FS_OP_APPEND] = "append",
+	[FS_OP_DEFRAG] = "defrag",
+	[FS_OP_PREALLOCATE] = "preallocate",
+	[FS_OP_SNAPSHOT] = "snapshot",
+	[FS_OP_SNAPSHOT_DELETE] = "snapshot_delete",
+};
+
+static char *diskname;
+static int formatted;
+static int verbose;
+
+/* File descriptors of the trace, and the ones they are replayed with */
+static int fds[FS_OPEN_MAX_COUNT];
+
+static char *buf;
+static size_t buf_size;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *get_buf(size_t size)
+{
+	if (size > buf_size) {
+		buf = realloc(buf, size);
+		if (!buf)
+			die("out of memory");
+		memset(buf + buf_size, 'r', size - buf_size);
+		buf_size = size;
+	}
+	return buf;
+}
+
+static int map_fd(int fd)
+{
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT)
+		return fd;
+	return fds[fd];
+}
+
+/* Create file @name with @size bytes, if it does not exist yet */
+static void make_file(const char *name, size_t size)
+{
+	int fd;
+
+	if (fs_create(name))
+		return;
+	fd = fs_open(name);
+	if (fd < 0)
+		die("Cannot open %s", name);
+	if (fs_write(fd, get_buf(size), size) != size)
+		die("Cannot fill %s with %zu bytes", name, size);
+	fs_close(fd);
+}
+
+/* Replay a call and return its result */
+static int replay(struct trace_record *rec, const char *name)
+{
+	int ret, fd = map_fd(rec->fd);
+
+	switch (rec->op) {
+	case FS_OP_FORMAT:
+		formatted = 1;
+		return fs_format(diskname, rec->arg, rec->arg2);
+	case FS_OP_MOUNT:
+		/* a disk that could not be mounted cannot be recreated */
+		if (rec->ret)
+			return rec->ret;
+		if (!formatted) {
+			if (fs_format(diskname, rec->arg, rec->arg2))
+				die("Cannot format %s", diskname);
+			formatted = 1;
+		}
+		return fs_mount(diskname);
+	case FS_OP_UMOUNT:
+		return fs_umount();
+	case FS_OP_SYNC:
+		return fs_sync();
+	case FS_OP_CREATE:
+		return fs_create(name);
+	case FS_OP_DELETE:
+		return fs_delete(name);
+	case FS_OP_OPEN:
+		if (rec->ret >= 0)
+			make_file(name, rec->arg);
+		ret = fs_open(name);
+		if (rec->ret >= 0 && rec->ret < FS_OPEN_MAX_COUNT)
+			fds[rec->ret] = ret;
+		return ret;
+	case FS_OP_CLOSE:
+		ret = fs_close(fd);
+		if (!ret && rec->fd >= 0 && rec->fd < FS_OPEN_MAX_COUNT)
+			fds[rec->fd] = -1;
+		return ret;
+	case FS_OP_STAT:
+		return fs_stat(fd);
+	case FS_OP_LSEEK:
+		return fs_lseek(fd, rec->arg);
+	case FS_OP_READ:
+		return fs_read(fd, get_buf(rec->arg), rec->arg);
+	case FS_OP_WRITE:
+		return fs_write(fd, get_buf(rec->arg), rec->arg);
+	case FS_OP_APPEND:
+		return fs_append(fd, get_buf(rec->arg), rec->arg);
+	case FS_OP_DEFRAG:
+		return fs_defrag(rec->arg, rec->arg2);
+	case FS_OP_PREALLOCATE:
+		return fs_preallocate(fd, rec->arg);
+	case FS_OP_SNAPSHOT:
+		return fs_snapshot(name);
+	case FS_OP_SNAPSHOT_DELETE:
+		return fs_snapshot_delete(name);
+	}
+	die("Unknown operation %d", rec->op);
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-t] [-v] <tracename> <diskname>\n", program);
+	fprintf(stderr, "\t-t\treplay at the pace of the trace\n");
+	fprintf(stderr, "\t-v\tprint every call\n");
+	fprintf(stderr, "The disk <diskname> is overwritten\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_header header;
+	struct trace_record rec;
+	char name[UINT8_MAX + 1];
+	uint64_t begin, traced = 0, elapsed, last = 0;
+	size_t calls = 0, mismatches = 0, counts[FS_OP_COUNT] = { 0 };
+	int timed = 0, opt, ret;
+	FILE *trace;
+
+	while ((opt = getopt(argc, argv, "tv")) != -1) {
+		switch (opt) {
+		case 't':
+			timed = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2)
+		usage(argv[0]);
+	diskname = argv[optind + 1];
+
+	trace = fopen(argv[optind], "rb");
+	if (!trace)
+		die("Cannot open trace %s", argv[optind]);
+	if (fread(&header, sizeof(header), 1, trace) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)))
+		die("%s is not a trace", argv[optind]);
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		fds[i] = -1;
+
+	begin = now_ns();
+	while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+		if (fread(name, 1, rec.name_len, trace) != rec.name_len)
+			die("Truncated trace");
+		name[rec.name_len] = '\0';
+		if (rec.op >= FS_OP_COUNT)
+			die("Unknown operation %d", rec.op);
+
+		/* wait for the time the call was made at */
+		if (timed) {
+			uint64_t now = now_ns() - begin;
+			if (rec.start > now) {
+				struct timespec ts = {
+					.tv_sec = (rec.start - now) / 1000000000,
+					.tv_nsec = (rec.start - now) % 1000000000,
+				};
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		ret = replay(&rec, name);
+		calls++;
+		counts[rec.op]++;
+		if (verbose)
+			printf("%s(%d, \"%s\", %lu, %u) = %d\n", op_names[rec.op],
+			       rec.fd, name, (unsigned long)rec.arg, rec.arg2,
+			       ret);
+		if (ret != rec.ret) {
+			mismatches++;
+			fprintf(stderr, "call %zu: %s(\"%s\") returned %d "
+				"instead of %d\n", calls, op_names[rec.op],
+				name, ret, rec.ret);
+		}
+		traced += rec.duration;
+		last = rec.start + rec.duration;
+	}
+	elapsed = now_ns() - begin;
+	fclose(trace);
+
+	for (int i = 0; i < FS_OP_COUNT; i++) {
+		if (counts[i])
+			printf("%s=%zu\n", op_names[i], counts[i]);
+	}
+	printf("Replayed %zu calls in %.6f s (traced: %.6f s in calls, "
+	       "%.6f s overall), %zu mismatches\n", calls, elapsed / 1e9,
+	       traced / 1e9, last / 1e9, mismatches);
+
+	free(buf);
+	return mismatches ? 1 : 0;
+}
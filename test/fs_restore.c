@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+/*
+ * fs_restore - Rebuild a virtual disk from an archive made by fs_dump.
+ *
+ * The virtual disk is created as a sparse file, and only the blocks held by
+ * the archive are written into it: the free blocks left out of the archive
+ * take no space and read as zeroes. The archive is read from the standard
+ * input if its name is "-".
+ */
+
+#define restore_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	restore_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define DUMP_MAGIC "ECS150DP"
+
+/* maximum number of blocks written at once */
+#define RESTORE_CHUNK 256
+
+/* Archive layout, see fs_dump */
+struct dump_header {
+	char magic[8];
+	uint32_t block_count;
+	uint32_t used;
+};
+
+struct dump_run {
+	uint32_t start;
+	uint32_t length;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	struct dump_header header;
+	struct dump_run run;
+	char *buf;
+	FILE *f;
+	uint64_t begin, elapsed;
+	size_t restored = 0, len;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <archive> <diskname>\n", argv[0]);
+		fprintf(stderr, "The archive comes from the standard input if "
+			"it is '-'\n");
+		exit(1);
+	}
+
+	f = strcmp(argv[1], "-") ? fopen(argv[1], "r") : stdin;
+	if (!f)
+		die("Cannot open archive %s", argv[1]);
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, DUMP_MAGIC, sizeof(header.magic)))
+		die("Not a dump archive: %s", argv[1]);
+
+	begin = now_ns();
+	if (block_disk_create(argv[2], header.block_count) ||
+	    block_disk_open(argv[2]))
+		die("Cannot create diskname");
+	buf = malloc(RESTORE_CHUNK * BLOCK_SIZE);
+	if (!buf)
+		die("out of memory");
+
+	while (1) {
+		if (fread(&run, sizeof(run), 1, f) != 1)
+			die("Truncated archive");
+		if (!run.length)
+			break;
+		if (run.start + run.length > header.block_count)
+			die("Invalid run of blocks %u to %u", run.start,
+			    run.start + run.length - 1);
+		for (size_t done = 0; done < run.length; done += len) {
+			len = run.length - done;
+			if (len > RESTORE_CHUNK)
+				len = RESTORE_CHUNK;
+			if (fread(buf, BLOCK_SIZE, len, f) != len)
+				die("Truncated archive");
+			if (block_write_range(run.start + done, len, buf))
+				die("Cannot write block %zu", run.start + done);
+		}
+		restored += run.length;
+	}
+	if (restored != header.used)
+		die("%zu blocks restored instead of %u", restored, header.used);
+	if (block_disk_close())
+		die("Cannot close diskname");
+	elapsed = now_ns() - begin;
+
+	fprintf(stderr, "Restored %zu/%u blocks in %.6f s (%.1f MiB/s)\n",
+		restored, header.block_count, elapsed / 1e9,
+		(double)restored * BLOCK_SIZE / (1024.0 * 1024.0) /
+		(elapsed / 1e9));
+	if (f != stdin)
+		fclose(f);
+	free(buf);
+	return 0;
+}
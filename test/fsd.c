@@ -0,0 +1,437 @@
+#define _GNU_SOURCE /* for accept4() */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fsd_proto.h>
+
+/*
+ * fsd - Serve a mounted file system to local clients over a Unix socket.
+ *
+ * The main thread runs an epoll event loop that accepts connections and hands
+ * the ones with pending input or output over to a pool of worker threads. A
+ * connection is armed with EPOLLONESHOT, so a single worker at a time handles
+ * it: the worker reads all the requests that arrived, runs all the complete
+ * ones as one batch, queues their responses in order and sends them, then arms
+ * the connection again. Clients can thus pipeline requests freely.
+ *
+ * The file system is mounted on a handle of its own (see fs_mount_r()), whose
+ * lock serializes the file system calls themselves; the workers overlap socket
+ * I/O and request decoding with them.
+ */
+
+#define fsd_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fsd_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Stop reading requests from a client that does not read its responses */
+#define OUTPUT_HIGH_WATER (4 * 1024 * 1024)
+
+#define READ_CHUNK (64 * 1024)
+
+#define MAX_EVENTS 64
+
+/* Client connection
+ * @sock: socket of the connection
+ * @in: received bytes not yet processed
+ * @out: responses not yet sent, from @out_off on
+ * @fds: bitmap of the file descriptors opened by the client
+ * @next: next connection in the work queue
+ */
+struct conn {
+	int sock;
+	char *in;
+	size_t in_len, in_cap;
+	char *out;
+	size_t out_len, out_off, out_cap;
+	uint32_t fds;
+	struct conn *next;
+};
+
+static int epfd;
+static volatile sig_atomic_t stopping;
+
+/* Handle of the file system served */
+static fs_t fs;
+
+/* Connections waiting for a worker */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct conn *queue_head, *queue_tail;
+static int queue_stop;
+
+static void reserve(char **buf, size_t *cap, size_t size)
+{
+	if (size <= *cap)
+		return;
+	while (*cap < size)
+		*cap = *cap ? 2 * *cap : READ_CHUNK;
+	*buf = realloc(*buf, *cap);
+	if (!*buf)
+		die("out of memory");
+}
+
+static void enqueue(struct conn *c)
+{
+	pthread_mutex_lock(&queue_lock);
+	c->next = NULL;
+	if (queue_tail)
+		queue_tail->next = c;
+	else
+		queue_head = c;
+	queue_tail = c;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+static struct conn *dequeue(void)
+{
+	struct conn *c;
+
+	pthread_mutex_lock(&queue_lock);
+	while (!queue_head && !queue_stop)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	c = queue_head;
+	if (c) {
+		queue_head = c->next;
+		if (!queue_head)
+			queue_tail = NULL;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return c;
+}
+
+/* Queue a response, whose @len bytes of payload are already in place right
+ * after the room for its header */
+static void add_response(struct conn *c, uint32_t id, int ret, size_t len)
+{
+	struct fsd_response_header header = {
+		.len = len,
+		.id = id,
+		.ret = ret,
+	};
+
+	reserve(&c->out, &c->out_cap, c->out_len + sizeof(header) + len);
+	memcpy(c->out + c->out_len, &header, sizeof(header));
+	c->out_len += sizeof(header) + len;
+}
+
+static int owns_fd(struct conn *c, int fd)
+{
+	return fd >= 0 && fd < FS_OPEN_MAX_COUNT && (c->fds & (1u << fd));
+}
+
+/* Run a request, and queue its response */
+static void run_request(struct conn *c, struct fsd_request_header *h,
+			char *payload)
+{
+	char name[FS_FILENAME_LEN + 1];
+	int ret = -1;
+
+	switch (h->op) {
+	case FS_OP_CREATE:
+	case FS_OP_DELETE:
+	case FS_OP_OPEN:
+		/* longer names are invalid anyway, and get cut to fail */
+		memset(name, 'x', sizeof(name));
+		memcpy(name, payload, h->len < sizeof(name) ? h->len : sizeof(name));
+		name[h->len < FS_FILENAME_LEN ? h->len : FS_FILENAME_LEN] = '\0';
+		if (h->op == FS_OP_CREATE)
+			ret = fs_create_r(fs, name);
+		else if (h->op == FS_OP_DELETE)
+			ret = fs_delete_r(fs, name);
+		else if ((ret = fs_open_r(fs, name)) >= 0)
+			c->fds |= 1u << ret;
+		break;
+	case FS_OP_SYNC:
+		ret = fs_sync_r(fs);
+		break;
+	case FS_OP_READ:
+		if (!owns_fd(c, h->fd) || h->arg > FSD_MAX_PAYLOAD)
+			break;
+		/* the data is read straight into the output buffer, right
+		 * after the room left for the response header */
+		reserve(&c->out, &c->out_cap, c->out_len +
+			sizeof(struct fsd_response_header) + h->arg);
+		ret = fs_read_r(fs, h->fd, c->out + c->out_len +
+			      sizeof(struct fsd_response_header), h->arg);
+		add_response(c, h->id, ret, ret > 0 ? ret : 0);
+		return;
+	default:
+		if (!owns_fd(c, h->fd))
+			break;
+		if (h->op == FS_OP_CLOSE) {
+			/* the descriptor is released even when the pending
+			 * data of the file could not be written */
+			ret = fs_close_r(fs, h->fd);
+			c->fds &= ~(1u << h->fd);
+		} else if (h->op == FS_OP_STAT) {
+			ret = fs_stat_r(fs, h->fd);
+		} else if (h->op == FS_OP_LSEEK) {
+			ret = fs_lseek_r(fs, h->fd, h->arg);
+		} else if (h->op == FS_OP_WRITE && h->arg == h->len) {
+			ret = fs_write_r(fs, h->fd, payload, h->len);
+		} else if (h->op == FS_OP_APPEND && h->arg == h->len) {
+			ret = fs_append_r(fs, h->fd, payload, h->len);
+		}
+		break;
+	}
+	add_response(c, h->id, ret, 0);
+}
+
+/* Run all the complete requests received, and return -1 on a protocol error */
+static int run_requests(struct conn *c)
+{
+	struct fsd_request_header h;
+	size_t off = 0;
+	int ret = 0;
+
+	while (c->in_len - off >= sizeof(h)) {
+		memcpy(&h, c->in + off, sizeof(h));
+		if (h.len > FSD_MAX_PAYLOAD) {
+			ret = -1;
+			break;
+		}
+		if (c->in_len - off < sizeof(h) + h.len)
+			break;
+		run_request(c, &h, c->in + off + sizeof(h));
+		off += sizeof(h) + h.len;
+	}
+
+	memmove(c->in, c->in + off, c->in_len - off);
+	c->in_len -= off;
+	return ret;
+}
+
+/* Receive what the client sent, and return -1 once it is gone */
+static int receive(struct conn *c)
+{
+	ssize_t n;
+
+	for (;;) {
+		reserve(&c->in, &c->in_cap, c->in_len + READ_CHUNK);
+		n = recv(c->sock, c->in + c->in_len, c->in_cap - c->in_len, 0);
+		if (n > 0) {
+			c->in_len += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		return -1;
+	}
+}
+
+/* Send the queued responses, and return -1 once the client is gone */
+static int flush_output(struct conn *c)
+{
+	ssize_t n;
+
+	while (c->out_off < c->out_len) {
+		n = send(c->sock, c->out + c->out_off, c->out_len - c->out_off,
+			 MSG_NOSIGNAL);
+		if (n > 0) {
+			c->out_off += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		return -1;
+	}
+	c->out_off = c->out_len = 0;
+	return 0;
+}
+
+static void close_conn(struct conn *c)
+{
+	/* the files left open by the client are closed for it */
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++) {
+		if (owns_fd(c, fd))
+			fs_close_r(fs, fd);
+	}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+	close(c->sock);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+static void handle_conn(struct conn *c)
+{
+	struct epoll_event ev = { .data.ptr = c };
+	int gone = 0;
+
+	if (flush_output(c))
+		gone = 1;
+	/* a client that does not read its responses gets no more requests
+	 * read until it does */
+	if (!gone && c->out_len - c->out_off < OUTPUT_HIGH_WATER)
+		gone = receive(c);
+	if (run_requests(c))
+		gone = 1;
+	if (flush_output(c))
+		gone = 1;
+	if (gone) {
+		close_conn(c);
+		return;
+	}
+
+	ev.events = EPOLLONESHOT;
+	if (c->out_len - c->out_off < OUTPUT_HIGH_WATER)
+		ev.events |= EPOLLIN;
+	if (c->out_off < c->out_len)
+		ev.events |= EPOLLOUT;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev))
+		close_conn(c);
+}
+
+static void *worker(void *arg)
+{
+	struct conn *c;
+
+	while ((c = dequeue()))
+		handle_conn(c);
+	return NULL;
+}
+
+static void accept_conns(int lsock)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT };
+	struct conn *c;
+	int sock;
+
+	while ((sock = accept4(lsock, NULL, NULL,
+			       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			die("out of memory");
+		c->sock = sock;
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev)) {
+			close(sock);
+			free(c);
+		}
+	}
+}
+
+static void on_signal(int sig)
+{
+	stopping = 1;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-w workers] <diskname> <sockpath>\n",
+		program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = on_signal };
+	pthread_t *threads;
+	int nworkers = 4, opt, lsock, n;
+	char *diskname, *sockpath;
+
+	while ((opt = getopt(argc, argv, "w:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nworkers = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2 || nworkers < 1)
+		usage(argv[0]);
+	diskname = argv[optind];
+	sockpath = argv[optind + 1];
+	if (strlen(sockpath) >= sizeof(addr.sun_path))
+		die("Socket path too long");
+
+	fs = fs_mount_r(diskname);
+	if (!fs)
+		die("Cannot mount %s", diskname);
+
+	lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (lsock < 0)
+		die_perror("socket");
+	strcpy(addr.sun_path, sockpath);
+	unlink(sockpath);
+	if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)))
+		die_perror("bind");
+	if (listen(lsock, SOMAXCONN))
+		die_perror("listen");
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		die_perror("epoll_create1");
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, lsock, &ev))
+		die_perror("epoll_ctl");
+
+	/* no SA_RESTART, so that epoll_wait() returns on a signal */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	threads = malloc(nworkers * sizeof(*threads));
+	for (int i = 0; i < nworkers; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+
+	while (!stopping) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR)
+			die_perror("epoll_wait");
+		for (int i = 0; i < n; i++) {
+			if (!events[i].data.ptr)
+				accept_conns(lsock);
+			else
+				enqueue(events[i].data.ptr);
+		}
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	queue_stop = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	for (int i = 0; i < nworkers; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	close(lsock);
+	unlink(sockpath);
+	/* the files still open by connected clients get closed */
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+		fs_close_r(fs, fd);
+	if (fs_umount_r(fs))
+		die("Cannot unmount %s", diskname);
+	return 0;
+}
@@ -271,6 +271,123 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_frag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename = NULL;
+	struct fs_frag_info info;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<filename>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_frag_info(filename, &info)) {
+		fs_umount();
+		die("Cannot get fragmentation of '%s'", filename ? filename : diskname);
+	}
+
+	printf("FS Frag:\n");
+	printf("files=%zu\n", info.files);
+	printf("fragmented_files=%zu\n", info.fragmented_files);
+	printf("blocks=%zu\n", info.blocks);
+	printf("extents=%zu\n", info.extents);
+	printf("free_blocks=%zu\n", info.free_blocks);
+	printf("free_extents=%zu\n", info.free_extents);
+	printf("largest_free_extent=%zu\n", info.largest_free_extent);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t max_blocks = 0;
+	int moved;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<max_blocks>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		max_blocks = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	moved = fs_defrag(max_blocks, 0);
+	if (moved < 0) {
+		fs_umount();
+		die("Cannot defragment diskname");
+	}
+	printf("Moved %d data blocks\n", moved);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_snapshot(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	char names[FS_SNAPSHOT_MAX][FS_FILENAME_LEN];
+	int count;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<snapshot name>]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (t_arg->argc > 1) {
+		if (fs_snapshot(t_arg->argv[1])) {
+			fs_umount();
+			die("Cannot take snapshot '%s'", t_arg->argv[1]);
+		}
+		printf("Took snapshot '%s'\n", t_arg->argv[1]);
+	} else {
+		count = fs_snapshot_list(names);
+		printf("FS Snapshots:\n");
+		for (int i = 0; i < count; i++)
+			printf("%s\n", names[i]);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_snaprm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(t_arg->argv[1])) {
+		fs_umount();
+		die("Cannot delete snapshot '%s'", t_arg->argv[1]);
+	}
+	printf("Deleted snapshot '%s'\n", t_arg->argv[1]);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -280,7 +397,11 @@ static struct {
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat }
+	{ "stat",	thread_fs_stat },
+	{ "frag",	thread_fs_frag },
+	{ "defrag",	thread_fs_defrag },
+	{ "snapshot",	thread_fs_snapshot },
+	{ "snaprm",	thread_fs_snaprm }
 };
 
 void usage(char *program)
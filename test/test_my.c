@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,7 +11,17 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <block_queue.h>
+#include <disk.h>
 #include <fs.h>
+#include <fs_async.h>
+#include <fs_layout.h>
+#include <fs_trace.h>
+#include <fsd_client.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define BLOCK_SIZE_TEST 4096
 
 void test_basic()
 {
@@ -167,8 +179,1524 @@ void test_max_create()
     fs_umount();
 }
 
+/* small files share fragment blocks and can still be read and rewritten */
+void test_fragments()
+{
+    char fn[16], buf[BLOCK_SIZE_TEST + 100], msg[BLOCK_SIZE_TEST + 100];
+    int fd;
+    
+    assert(fs_format("frag.fs", 100, FS_FEATURE_FRAGMENTS) == 0);
+    assert(fs_mount("frag.fs") == 0);
+    for (int i = 0; i < 10; i++){
+        sprintf(fn, "small%d", i);
+        memset(msg, 'a' + i, 100);
+        fs_create(fn);
+        fd = fs_open(fn);
+        assert(fs_write(fd, msg, 100) == 100);
+        fs_close(fd);
+    }
+    /* a tail following a whole block */
+    memset(msg, 'z', sizeof(msg));
+    fs_create("large");
+    fd = fs_open("large");
+    assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    
+    assert(fs_mount("frag.fs") == 0);
+    for (int i = 0; i < 10; i++){
+        sprintf(fn, "small%d", i);
+        memset(msg, 'a' + i, 100);
+        fd = fs_open(fn);
+        assert(fs_read(fd, buf, 100) == 100);
+        assert(memcmp(buf, msg, 100) == 0);
+        /* appending moves the tail back to a block of its own */
+        assert(fs_write(fd, msg, 100) == 100);
+        fs_lseek(fd, 0);
+        assert(fs_read(fd, buf, 200) == 200);
+        assert(memcmp(buf + 100, msg, 100) == 0);
+        fs_close(fd);
+    }
+    fs_delete("small3");
+    memset(msg, 'z', sizeof(msg));
+    fd = fs_open("large");
+    assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+    assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+}
+
+/* blocks are only allocated when the data is flushed, and never more than the
+ * disk can hold are promised to writers */
+void test_delayed_allocation()
+{
+    char msg[4 * BLOCK_SIZE_TEST], buf[4 * BLOCK_SIZE_TEST];
+    int fd1, fd2;
+    
+    assert(fs_format("delay.fs", 10, 0) == 0);
+    assert(fs_mount("delay.fs") == 0);
+    fs_create("f1");
+    fs_create("f2");
+    fd1 = fs_open("f1");
+    fd2 = fs_open("f2");
+    memset(msg, '1', sizeof(msg));
+    assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+    /* the first data block is reserved, 5 blocks are left for f2 */
+    memset(msg, '2', sizeof(msg));
+    assert(fs_write(fd2, msg, sizeof(msg)) == sizeof(msg));
+    assert(fs_write(fd2, msg, sizeof(msg)) == BLOCK_SIZE_TEST);
+    assert(fs_stat(fd2) == 5 * BLOCK_SIZE_TEST);
+    /* pending data can be read back and rewritten */
+    fs_lseek(fd2, BLOCK_SIZE_TEST);
+    assert(fs_read(fd2, buf, sizeof(buf)) == sizeof(buf));
+    assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    assert(fs_sync() == 0);
+    fs_lseek(fd1, 10);
+    assert(fs_write(fd1, "hello", 5) == 5);
+    assert(fs_close(fd1) == 0);
+    assert(fs_close(fd2) == 0);
+    assert(fs_umount() == 0);
+    
+    assert(fs_mount("delay.fs") == 0);
+    fd1 = fs_open("f1");
+    assert(fs_read(fd1, buf, sizeof(buf)) == sizeof(buf));
+    assert(memcmp(buf + 10, "hello", 5) == 0);
+    assert(buf[sizeof(buf) - 1] == '1');
+    fs_close(fd1);
+    assert(fs_umount() == 0);
+}
+
+/* fragmented files spill their extents into an extent block */
+void test_extents()
+{
+    char msg[BLOCK_SIZE_TEST], buf[BLOCK_SIZE_TEST];
+    int fd1, fd2;
+    
+    assert(fs_format("extent.fs", 200, FS_FEATURE_EXTENTS | FS_FEATURE_FRAGMENTS) == 0);
+    assert(fs_mount("extent.fs") == 0);
+    fs_create("f1");
+    fs_create("f2");
+    fd1 = fs_open("f1");
+    fd2 = fs_open("f2");
+    /* flushing after every block interleaves the blocks of both files */
+    for (int i = 0; i < 50; i++){
+        memset(msg, i, sizeof(msg));
+        assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+        assert(fs_write(fd2, msg, sizeof(msg)) == sizeof(msg));
+        fs_sync();
+    }
+    assert(fs_write(fd1, "tail", 4) == 4);
+    fs_close(fd1);
+    fs_close(fd2);
+    assert(fs_umount() == 0);
+    
+    assert(fs_mount("extent.fs") == 0);
+    fd1 = fs_open("f1");
+    for (int i = 0; i < 50; i++){
+        memset(msg, i, sizeof(msg));
+        assert(fs_read(fd1, buf, sizeof(buf)) == sizeof(buf));
+        assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    }
+    assert(fs_read(fd1, buf, sizeof(buf)) == 4);
+    assert(memcmp(buf, "tail", 4) == 0);
+    /* reading across extents */
+    fs_lseek(fd1, BLOCK_SIZE_TEST - 10);
+    assert(fs_read(fd1, buf, 20) == 20);
+    assert(buf[0] == 0 && buf[19] == 1);
+    fs_close(fd1);
+    assert(fs_delete("f2") == 0);
+    assert(fs_umount() == 0);
+}
+
+/* appending goes through the tail of the file, whatever its offset */
+void test_append()
+{
+    char msg[1000], buf[1000];
+    int fd;
+    
+    assert(fs_format("append.fs", 100, FS_FEATURE_FRAGMENTS) == 0);
+    assert(fs_mount("append.fs") == 0);
+    fs_create("log");
+    for (int i = 0; i < 100; i++){
+        memset(msg, i, sizeof(msg));
+        fd = fs_open("log");
+        assert(fs_append(fd, msg, sizeof(msg)) == sizeof(msg));
+        assert(fs_stat(fd) == (i + 1) * sizeof(msg));
+        fs_close(fd);
+        /* remounting keeps the tail of the file */
+        if (i % 10 == 0){
+            assert(fs_umount() == 0);
+            assert(fs_mount("append.fs") == 0);
+        }
+    }
+    fd = fs_open("log");
+    for (int i = 0; i < 100; i++){
+        memset(msg, i, sizeof(msg));
+        assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+        assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    }
+    assert(fs_append(33, msg, sizeof(msg)) == -1);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+}
+
+/* the tail pointer left in a root directory entry is not trusted once the
+ * reference tool reused the entry for another file */
+void test_append_reused_entry()
+{
+    char msg[3 * BLOCK_SIZE_TEST], buf[6000];
+    FILE *f;
+    int fd;
+    
+    assert(fs_format("reuse.fs", 10, 0) == 0);
+    assert(fs_mount("reuse.fs") == 0);
+    fs_create("x");
+    fd = fs_open("x");
+    memset(msg, 'x', sizeof(msg));
+    assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    
+    memset(buf, 'y', 5000);
+    f = fopen("reuse_y", "w");
+    fwrite(buf, 1, 5000, f);
+    fclose(f);
+    memset(buf, 'w', 100);
+    f = fopen("reuse_w", "w");
+    fwrite(buf, 1, 100, f);
+    fclose(f);
+    assert(system("./fs_ref.x rm reuse.fs x > /dev/null && "
+                  "./fs_ref.x add reuse.fs reuse_y > /dev/null && "
+                  "./fs_ref.x add reuse.fs reuse_w > /dev/null") == 0);
+    
+    assert(fs_mount("reuse.fs") == 0);
+    fd = fs_open("reuse_y");
+    assert(fs_append(fd, "z", 1) == 1);
+    assert(fs_lseek(fd, 0) == 0);
+    assert(fs_read(fd, buf, sizeof(buf)) == 5001);
+    assert((buf[0] == 'y') && (buf[4999] == 'y') && (buf[5000] == 'z'));
+    fs_close(fd);
+    fd = fs_open("reuse_w");
+    assert(fs_read(fd, buf, sizeof(buf)) == 100);
+    assert((buf[0] == 'w') && (buf[99] == 'w'));
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    assert(system("./fs_fsck.x reuse.fs > /dev/null") == 0);
+    unlink("reuse_y");
+    unlink("reuse_w");
+}
+
+size_t free_block_count()
+{
+    struct fs_frag_info info;
+    assert(fs_frag_info(NULL, &info) == 0);
+    return info.free_blocks;
+}
+
+/* defragmenting makes interleaved files contiguous again, a bit at a time */
+void test_defrag(const char *diskname, unsigned int features)
+{
+    char msg[BLOCK_SIZE_TEST], buf[BLOCK_SIZE_TEST];
+    struct fs_frag_info info;
+    int fd1, fd2, moved;
+    
+    assert(fs_format(diskname, 200, features) == 0);
+    assert(fs_mount(diskname) == 0);
+    fs_create("f1");
+    fs_create("f2");
+    fd1 = fs_open("f1");
+    fd2 = fs_open("f2");
+    for (int i = 0; i < 20; i++){
+        memset(msg, i, sizeof(msg));
+        assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+        assert(fs_write(fd2, msg, sizeof(msg)) == sizeof(msg));
+        fs_sync();
+    }
+    fs_close(fd2);
+    assert(fs_frag_info("f1", &info) == 0);
+    assert(info.files == 1 && info.blocks == 20 && info.extents == 20);
+    assert(fs_frag_info(NULL, &info) == 0);
+    assert(info.fragmented_files == 2 && info.extents == 40);
+    size_t free_blocks = info.free_blocks;
+    assert(fs_frag_info("none", &info) == -1);
+    
+    /* f1 stays open while it gets moved */
+    assert(fs_defrag(1, 0) == 1);
+    while ((moved = fs_defrag(7, 0)) > 0)
+        assert(moved <= 7);
+    assert(moved == 0);
+    assert(fs_frag_info(NULL, &info) == 0);
+    assert(info.fragmented_files == 0 && info.extents == 2 && info.blocks == 40);
+    /* the extent blocks are released as well */
+    assert(info.free_blocks == free_blocks + 2 * !!(features & FS_FEATURE_EXTENTS));
+    
+    fs_lseek(fd1, 0);
+    for (int i = 0; i < 20; i++){
+        memset(msg, i, sizeof(msg));
+        assert(fs_read(fd1, buf, sizeof(buf)) == sizeof(buf));
+        assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    }
+    fs_close(fd1);
+    assert(fs_umount() == 0);
+    
+    /* the new layout is on disk */
+    assert(fs_mount(diskname) == 0);
+    fd2 = fs_open("f2");
+    fs_lseek(fd2, 19 * BLOCK_SIZE_TEST);
+    assert(fs_read(fd2, buf, sizeof(buf)) == sizeof(buf));
+    assert(buf[0] == 19 && buf[BLOCK_SIZE_TEST - 1] == 19);
+    fs_close(fd2);
+    assert(fs_frag_info(NULL, &info) == 0);
+    assert(info.fragmented_files == 0);
+    assert(fs_umount() == 0);
+
+    /* defragmenting ends even when the file can only be moved back and
+     * forth between two free runs, along with its extent block */
+    assert(fs_format(diskname, 100, features) == 0);
+    assert(fs_mount(diskname) == 0);
+    fs_create("pad");
+    fs_create("f1");
+    fs_create("f2");
+    fd1 = fs_open("pad");
+    for (int i = 0; i < 10; i++)
+        assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd1);
+    fd1 = fs_open("f1");
+    for (int i = 0; i < 3; i++){
+        memset(msg, i, sizeof(msg));
+        assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+    }
+    fs_close(fd1);
+    fd2 = fs_open("f2");
+    assert(fs_write(fd2, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd2);
+    fd1 = fs_open("f1");
+    fs_lseek(fd1, 3 * BLOCK_SIZE_TEST);
+    memset(msg, 3, sizeof(msg));
+    assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd1);
+    assert(fs_delete("pad") == 0);
+    assert(fs_umount() == 0);
+    assert(fs_mount(diskname) == 0);
+    assert(fs_defrag(0, 0) >= 0);
+    fd1 = fs_open("f1");
+    for (int i = 0; i < 4; i++){
+        memset(msg, i, sizeof(msg));
+        assert(fs_read(fd1, buf, sizeof(buf)) == sizeof(buf));
+        assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    }
+    fs_close(fd1);
+    assert(fs_umount() == 0);
+    sprintf(buf, "./fs_fsck.x %s > /dev/null", diskname);
+    assert(system(buf) == 0);
+    if (!(features & FS_FEATURE_JOURNAL))
+        return;
+
+    /* the only free block that can be allocated fills the hole after the
+     * first extent, the next commit makes room for the new extent block */
+    assert(fs_format(diskname, 40, features) == 0);
+    assert(fs_mount(diskname) == 0);
+    fs_create("f1");
+    fs_create("hole");
+    fs_create("f2");
+    fs_create("freed");
+    fs_create("fill");
+    const char *order[] = {"f1", "hole", "f1", "f2", "f1", "freed"};
+    for (int i = 0; i < 6; i++){
+        fd1 = fs_open(order[i]);
+        fs_lseek(fd1, fs_stat(fd1));
+        assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+        fs_close(fd1);
+    }
+    fd1 = fs_open("fill");
+    while (fs_write(fd1, msg, sizeof(msg)) == sizeof(msg))
+        ;
+    fs_close(fd1);
+    assert(fs_delete("hole") == 0);
+    assert(fs_sync() == 0);
+    fd1 = fs_open("fill");
+    fs_lseek(fd1, fs_stat(fd1));
+    assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd1);
+    assert(fs_delete("freed") == 0);
+    assert(free_block_count() == 2);
+    assert(fs_defrag(0, 0) > 0);
+    assert(fs_frag_info("f1", &info) == 0 && info.extents < 3);
+    assert(fs_umount() == 0);
+    assert(system(buf) == 0);
+}
+
+/* preallocated blocks form one run, and the unused ones are released on close */
+void test_preallocate(const char *diskname)
+{
+    char msg[BLOCK_SIZE_TEST], buf[BLOCK_SIZE_TEST];
+    struct fs_frag_info info;
+    char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+    int fd1, fd2;
+    
+    assert(fs_format(diskname, 100, 0) == 0);
+    assert(fs_mount(diskname) == 0);
+    fs_create("f1");
+    fs_create("f2");
+    fd1 = fs_open("f1");
+    fd2 = fs_open("f2");
+    assert(fs_preallocate(fd1, 10 * BLOCK_SIZE_TEST) == 0);
+    assert(fs_preallocate(fd2, 10 * BLOCK_SIZE_TEST) == 0);
+    assert(fs_stat(fd1) == 0);
+    assert(fs_preallocate(fd1, 200 * BLOCK_SIZE_TEST) == -1);
+    for (int i = 0; i < 8; i++){
+        memset(msg, i, sizeof(msg));
+        assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+        assert(fs_write(fd2, msg, sizeof(msg)) == sizeof(msg));
+    }
+    fs_close(fd1);
+    fs_close(fd2);
+    assert(fs_frag_info(NULL, &info) == 0);
+    assert(info.fragmented_files == 0 && info.blocks == 16);
+    assert(info.free_blocks == 99 - 16);
+    assert(fs_list(names) == 2);
+    assert(strcmp(names[0], "f1") == 0 && strcmp(names[1], "f2") == 0);
+    assert(fs_umount() == 0);
+    
+    assert(fs_mount(diskname) == 0);
+    fd2 = fs_open("f2");
+    assert(fs_stat(fd2) == 8 * BLOCK_SIZE_TEST);
+    fs_lseek(fd2, 7 * BLOCK_SIZE_TEST);
+    assert(fs_read(fd2, buf, sizeof(buf)) == sizeof(buf));
+    assert(buf[0] == 7 && buf[BLOCK_SIZE_TEST - 1] == 7);
+    fs_close(fd2);
+    assert(fs_umount() == 0);
+    assert(fs_list(names) == -1);
+
+    /* with the extent layout, the unwritten blocks are released even when
+     * the pending data of another file holds all the free ones, as a single
+     * extent is left */
+    assert(fs_format(diskname, 100, FS_FEATURE_EXTENTS) == 0);
+    assert(fs_mount(diskname) == 0);
+    fs_create("f1");
+    fs_create("f2");
+    fd1 = fs_open("f1");
+    assert(fs_preallocate(fd1, 10 * BLOCK_SIZE_TEST) == 0);
+    assert(fs_write(fd1, msg, sizeof(msg)) == sizeof(msg));
+    fd2 = fs_open("f2");
+    while (fs_write(fd2, msg, sizeof(msg)) == sizeof(msg))
+        ;
+    fs_close(fd1);
+    fs_close(fd2);
+    assert(fs_frag_info(NULL, &info) == 0 && info.free_blocks == 9 + 1);
+    assert(fs_umount() == 0);
+    sprintf(buf, "./fs_fsck.x %s > /dev/null", diskname);
+    assert(system(buf) == 0);
+}
+
+/* a snapshot keeps the data as it was, and only costs its metadata */
+void test_snapshot(const char *diskname, unsigned int features)
+{
+    char msg[BLOCK_SIZE_TEST], buf[BLOCK_SIZE_TEST];
+    char names[FS_SNAPSHOT_MAX][FS_FILENAME_LEN];
+    size_t before;
+    int fd;
+    
+    assert(fs_format(diskname, 100, features) == 0);
+    assert(fs_mount(diskname) == 0);
+    fs_create("f1");
+    fs_create("t");
+    fd = fs_open("f1");
+    for (int i = 0; i < 3; i++){
+        memset(msg, 'a' + i, sizeof(msg));
+        assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+    }
+    fs_close(fd);
+    fd = fs_open("t");
+    assert(fs_write(fd, "tail", 4) == 4);
+    
+    /* the pending data of open files is part of the snapshot, which copies
+     * the root directory and the single FAT block, in a new snapshot table */
+    before = free_block_count();
+    assert(fs_snapshot("s1") == 0);
+    assert(free_block_count() == before - 3 - 1);
+    assert(fs_snapshot("s1") == -1);
+    assert(fs_snapshot("") == -1);
+    fs_close(fd);
+    
+    /* the first write to a shared block copies it, the file then needs an
+     * extent block with the extent layout */
+    before = free_block_count() - !!(features & FS_FEATURE_EXTENTS);
+    fd = fs_open("f1");
+    fs_lseek(fd, BLOCK_SIZE_TEST);
+    assert(fs_write(fd, "bbbb", 4) == 4);
+    assert(free_block_count() == before - 1);
+    fs_lseek(fd, BLOCK_SIZE_TEST + 4);
+    assert(fs_write(fd, "BBBB", 4) == 4);
+    assert(free_block_count() == before - 1);
+    fs_lseek(fd, BLOCK_SIZE_TEST);
+    assert(fs_read(fd, buf, 9) == 9);
+    assert(memcmp(buf, "bbbbBBBBb", 9) == 0);
+    fs_close(fd);
+    fd = fs_open("t");
+    assert(fs_write(fd, "TAIL", 4) == 4);
+    fs_close(fd);
+    
+    /* the blocks of a deleted file stay with the snapshot */
+    before = free_block_count();
+    assert(fs_delete("f1") == 0);
+    assert(free_block_count() == before + 1 + !!(features & FS_FEATURE_EXTENTS));
+    fs_create("f2");
+    fd = fs_open("f2");
+    assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd);
+    assert(fs_snapshot_list(names) == 1 && strcmp(names[0], "s1") == 0);
+    assert(fs_umount() == 0);
+    
+    assert(fs_mount_snapshot(diskname, "none") == -1);
+    assert(fs_mount_snapshot(diskname, "s1") == 0);
+    assert(fs_open("f2") == -1);
+    assert(fs_create("f3") == -1);
+    assert(fs_snapshot("s2") == -1);
+    fd = fs_open("f1");
+    assert(fs_stat(fd) == 3 * BLOCK_SIZE_TEST);
+    for (int i = 0; i < 3; i++){
+        memset(msg, 'a' + i, sizeof(msg));
+        assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+        assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    }
+    assert(fs_write(fd, msg, 1) == -1);
+    fs_close(fd);
+    fd = fs_open("t");
+    assert(fs_read(fd, buf, sizeof(buf)) == 4 && memcmp(buf, "tail", 4) == 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    
+    /* deleting the snapshot releases what only it kept */
+    assert(fs_mount(diskname) == 0);
+    assert(fs_open("f1") == -1);
+    fd = fs_open("t");
+    assert(fs_read(fd, buf, sizeof(buf)) == 4 && memcmp(buf, "TAIL", 4) == 0);
+    fs_close(fd);
+    before = free_block_count();
+    assert(fs_snapshot_delete("s1") == 0);
+    assert(fs_snapshot_delete("s1") == -1);
+    assert(free_block_count() > before + 3 + 1);
+    before = free_block_count();
+    assert(fs_snapshot_list(names) == 0);
+    assert(fs_umount() == 0);
+    assert(fs_mount(diskname) == 0);
+    assert(free_block_count() == before);
+    assert(fs_snapshot("s3") == 0);
+    assert(fs_umount() == 0);
+    
+    /* a mount that fails half way leaves nothing behind, here because the
+     * snapshot table points past the end of the disk */
+    struct superblock sb;
+    struct snapshot snap;
+    int disk = open(diskname, O_RDWR);
+    assert(pread(disk, &sb, sizeof(sb), 0) == sizeof(sb));
+    off_t table = (off_t)(sb.data_start_index + sb.snapshot_index) * BLOCK_SIZE_TEST;
+    assert(pread(disk, &snap, sizeof(snap), table) == sizeof(snap));
+    uint16_t first = snap.first_index;
+    snap.first_index = sb.data_amount;
+    assert(pwrite(disk, &snap, sizeof(snap), table) == sizeof(snap));
+    assert(fs_mount(diskname) == -1);
+    assert(fs_mount(diskname) == -1);
+    snap.first_index = first;
+    assert(pwrite(disk, &snap, sizeof(snap), table) == sizeof(snap));
+    close(disk);
+    assert(fs_mount(diskname) == 0);
+    assert(fs_snapshot_list(names) == 1 && strcmp(names[0], "s3") == 0);
+    assert(fs_umount() == 0);
+
+    /* a snapshot short of free blocks takes none of them, here next to a
+     * file that reserved blocks twice for its pending data */
+    assert(fs_format(diskname, 100, features) == 0);
+    assert(fs_mount(diskname) == 0);
+    assert(fs_snapshot("s1") == 0);
+    fs_create("fill");
+    fd = fs_open("fill");
+    assert(fs_write(fd, msg, 10) == 10);
+    assert(fs_write(fd, msg, sizeof(msg) - 10) == sizeof(msg) - 10);
+    assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd);
+    while (free_block_count() > 2){
+        fd = fs_open("fill");
+        fs_lseek(fd, fs_stat(fd));
+        assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+        fs_close(fd);
+    }
+    assert(free_block_count() == 2);
+    assert(fs_snapshot("s2") == 0);
+    before = free_block_count();
+    assert(fs_snapshot("s3") == -1);
+    assert(free_block_count() == before);
+    assert(fs_umount() == 0);
+    sprintf(buf, "./fs_fsck.x %s > /dev/null", diskname);
+    assert(system(buf) == 0);
+}
+
+/* reads of consecutive blocks take a single request to the disk */
+/* number of blocks set in a changed-block bitmap of @count blocks */
+int changed_count(uint8_t *bitmap, int count)
+{
+    int changed = 0;
+    for (int i = 0; i < count; i++)
+        changed += (bitmap[i / 8] >> (i % 8)) & 1;
+    return changed;
+}
+
+void test_changes(const char *diskname)
+{
+    char msg[2 * BLOCK_SIZE_TEST];
+    uint8_t bitmap[BLOCK_SIZE_TEST];
+    size_t before;
+    int fd;
+    
+    /* 100 data blocks, a FAT block, the root directory and the super block */
+    assert(fs_format(diskname, 100, 0) == 0);
+    assert(fs_mount(diskname) == 0);
+    assert(fs_changes_get(bitmap) == -1);
+    assert(fs_changes_stop() == -1);
+    assert(fs_used_blocks(bitmap) == 3 && changed_count(bitmap, 3) == 3);
+    before = free_block_count();
+    assert(fs_changes_start() == 1);
+    assert(free_block_count() == before - 1);
+    assert(fs_used_blocks(bitmap) == 3 + 1);
+    
+    /* the metadata and the bitmap count as written, along with the data */
+    assert(fs_changes_get(bitmap) == 1);
+    assert(changed_count(bitmap, 103) == 3 + 1);
+    fs_create("f1");
+    fd = fs_open("f1");
+    memset(msg, 'a', sizeof(msg));
+    assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd);
+    assert(fs_changes_get(bitmap) == 1);
+    assert(changed_count(bitmap, 103) == 3 + 1 + 2);
+    assert(fs_used_blocks(bitmap) == 3 + 1 + 2);
+    assert(fs_umount() == 0);
+    
+    assert(fs_mount(diskname) == 0);
+    assert(fs_changes_get(NULL) == 1);
+    assert(fs_changes_get(bitmap) == 1 && changed_count(bitmap, 103) == 3 + 1 + 2);
+    assert(fs_changes_start() == 2);
+    assert(fs_changes_get(bitmap) == 2 && changed_count(bitmap, 103) == 3 + 1);
+    
+    /* an epoch started after tracking stopped does not follow the last one */
+    before = free_block_count();
+    assert(fs_changes_stop() == 0);
+    assert(free_block_count() == before + 1);
+    assert(fs_changes_get(bitmap) == -1);
+    assert(fs_changes_start() == 4);
+    assert(fs_umount() == 0);
+}
+
+/* the block size is a format option, read back from the super block */
+void test_block_size(const char *diskname, size_t size, unsigned int features)
+{
+    size_t len = 3 * size + 1000;
+    char *msg = malloc(len), *buf = malloc(len);
+    int fd;
+    
+    assert(fs_format(diskname, 20, features | FS_FEATURE_BLOCK_SIZE(size)) == 0);
+    assert(block_disk_open(diskname) == 0);
+    /* 20 data blocks, 1 FAT block, the super block and the root directory */
+    assert(block_disk_count() == 23 * (size / BLOCK_SIZE_TEST));
+    assert(block_disk_close() == 0);
+    
+    assert(fs_mount(diskname) == 0);
+    for (size_t i = 0; i < len; i++)
+        msg[i] = i % 251;
+    fs_create("big");
+    fs_create("small");
+    fd = fs_open("big");
+    assert(fs_write(fd, msg, len) == len);
+    fs_close(fd);
+    fd = fs_open("small");
+    assert(fs_write(fd, "hello", 5) == 5);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    
+    assert(fs_mount(diskname) == 0);
+    fd = fs_open("big");
+    assert(fs_stat(fd) == len);
+    assert(fs_read(fd, buf, len) == len);
+    assert(memcmp(buf, msg, len) == 0);
+    /* reading across a block boundary */
+    fs_lseek(fd, size - 10);
+    assert(fs_read(fd, buf, 20) == 20);
+    assert(memcmp(buf, msg + size - 10, 20) == 0);
+    fs_close(fd);
+    fd = fs_open("small");
+    assert(fs_read(fd, buf, len) == 5);
+    assert(memcmp(buf, "hello", 5) == 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    
+    sprintf(buf, "./fs_fsck.x %s > /dev/null", diskname);
+    assert(system(buf) == 0);
+    free(msg);
+    free(buf);
+}
+
+/* the metadata committed to the journal survives a crash, and many operations
+ * share each flush of the disk */
+void test_journal(const char *diskname, unsigned int features)
+{
+    char fn[16], msg[2 * BLOCK_SIZE_TEST + 100], buf[sizeof(msg)];
+    struct fs_stats stats;
+    int fd, status;
+    pid_t pid;
+    
+    assert(fs_format(diskname, 1000, features | FS_FEATURE_JOURNAL) == 0);
+    pid = fork();
+    if (!pid){
+        assert(fs_mount(diskname) == 0);
+        fs_reset_stats();
+        for (int i = 0; i < 100; i++){
+            sprintf(fn, "f%d", i);
+            memset(msg, i, sizeof(msg));
+            assert(fs_create(fn) == 0);
+            fd = fs_open(fn);
+            assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+            assert(fs_close(fd) == 0);
+            if (i % 10 == 0)
+                assert(fs_delete(fn) == 0);
+        }
+        assert(fs_sync() == 0);
+        if (fs_get_stats(&stats) == 0){
+            assert(stats.journal_commits >= 1 && stats.journal_commits <= 3);
+            assert(stats.disk_syncs == stats.journal_commits + 2 * stats.journal_checkpoints);
+        }
+        /* the data pending in memory is left out of the committed size of
+         * its file, when enough operations commit in the meantime */
+        fd = fs_open("f1");
+        fs_lseek(fd, sizeof(msg));
+        assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+        for (int i = 0; i < 200; i++){
+            assert(fs_create("tmp") == 0);
+            assert(fs_delete("tmp") == 0);
+        }
+        /* crash without unmounting */
+        _exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    
+    sprintf(buf, "./fs_fsck.x %s > /dev/null", diskname);
+    assert(system(buf) == 0);
+    assert(fs_mount(diskname) == 0);
+    for (int i = 0; i < 100; i++){
+        sprintf(fn, "f%d", i);
+        fd = fs_open(fn);
+        if (i % 10 == 0){
+            assert(fd == -1);
+            continue;
+        }
+        memset(msg, i, sizeof(msg));
+        assert(fd >= 0);
+        /* f1 keeps the part of the data written to its last block */
+        assert(fs_stat(fd) == ((i == 1) ? 3 * BLOCK_SIZE_TEST : sizeof(msg)));
+        assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+        assert(memcmp(buf, msg, sizeof(msg)) == 0);
+        fs_close(fd);
+    }
+    assert(fs_umount() == 0);
+    sprintf(buf, "./fs_fsck.x %s > /dev/null", diskname);
+    assert(system(buf) == 0);
+}
+
+void test_ram_disk()
+{
+    char msg[BLOCK_SIZE_TEST], buf[BLOCK_SIZE_TEST];
+    int fd;
+    
+    assert(fs_mount("mem:none") == -1);
+    assert(fs_format("mem:ram", 100, 0) == 0);
+    assert(fs_mount("mem:ram") == 0);
+    /* an open RAM disk can be saved, but not replaced or freed */
+    assert(block_disk_create("mem:ram", 100) == -1);
+    assert(block_ram_disk_free("mem:ram") == -1);
+    fs_create("f1");
+    fd = fs_open("f1");
+    memset(msg, 'r', sizeof(msg));
+    assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    
+    /* the RAM disk outlives its mount, and goes to and from an image file */
+    assert(block_ram_disk_save("mem:ram", "ram.fs") == 0);
+    assert(block_ram_disk_free("mem:ram") == 0);
+    assert(block_ram_disk_free("mem:ram") == -1);
+    assert(block_ram_disk_load("mem:copy", "ram.fs") == 0);
+    assert(fs_mount("ram.fs") == 0);
+    fd = fs_open("f1");
+    assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+    assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    assert(fs_mount("mem:copy") == 0);
+    fd = fs_open("f1");
+    assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+    assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    assert(block_ram_disk_free("mem:copy") == 0);
+}
+
+/* each worker writes and reads back its own blocks of the disk, with requests
+ * that span all the members */
+void* stripe_worker(void *arg)
+{
+    char msg[10 * BLOCK_SIZE_TEST], buf[10 * BLOCK_SIZE_TEST];
+    long id = (long)arg;
+    
+    for (int i = 0; i < 50; i++){
+        memset(msg, 'a' + id + i % 10, sizeof(msg));
+        assert(block_write_range(id * 20 + 1, 10, msg) == 0);
+        assert(block_read_range(id * 20 + 1, 10, buf) == 0);
+        assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    }
+    return NULL;
+}
+
+void test_stripe()
+{
+    char msg[10 * BLOCK_SIZE_TEST], buf[10 * BLOCK_SIZE_TEST];
+    struct stat st;
+    int fd;
+    
+    /* 100 blocks in stripe units of 4 over 3 image files: 36, 32 and 32 */
+    assert(block_disk_create("stripe:4:s0.fs,s1.fs,s2.fs", 100) == 0);
+    assert(stat("s0.fs", &st) == 0 && st.st_size == 36 * BLOCK_SIZE_TEST);
+    assert(stat("s2.fs", &st) == 0 && st.st_size == 32 * BLOCK_SIZE_TEST);
+    /* blocks spanning all the members at once, from the middle of a unit */
+    assert(block_disk_open("stripe:4:s0.fs,s1.fs,s2.fs") == 0);
+    assert(block_disk_count() == 100);
+    for (size_t i = 0; i < sizeof(msg); i++)
+        msg[i] = i / BLOCK_SIZE_TEST + 'a';
+    assert(block_write_range(2, 10, msg) == 0);
+    assert(block_read_range(2, 10, buf) == 0);
+    assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    assert(block_disk_close() == 0);
+    /* block 5 is block 1 of s1.fs, block 11 is block 3 of s2.fs */
+    fd = open("s1.fs", O_RDONLY);
+    assert(pread(fd, buf, BLOCK_SIZE_TEST, BLOCK_SIZE_TEST) == BLOCK_SIZE_TEST);
+    assert(buf[0] == 'd');
+    close(fd);
+    fd = open("s2.fs", O_RDONLY);
+    assert(pread(fd, buf, BLOCK_SIZE_TEST, 3 * BLOCK_SIZE_TEST) == BLOCK_SIZE_TEST);
+    assert(buf[0] == 'j');
+    close(fd);
+    
+    /* requests from several threads at once keep to their own blocks */
+    pthread_t threads[4];
+    assert(block_disk_open("stripe:4:s0.fs,s1.fs,s2.fs") == 0);
+    for (long i = 0; i < 4; i++)
+        assert(pthread_create(&threads[i], NULL, stripe_worker, (void *)i) == 0);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    assert(block_disk_close() == 0);
+    
+    /* the sizes of the members must match the layout of the set */
+    assert(block_disk_open("stripe:4:s1.fs,s0.fs,s2.fs") == -1);
+    assert(block_disk_open("stripe:3:s0.fs,s1.fs,s2.fs") == -1);
+    assert(block_disk_open("stripe:4:s0.fs,s1.fs,none.fs") == -1);
+    
+    assert(fs_format("stripe:2:s0.fs,s1.fs,s2.fs", 100, 0) == 0);
+    assert(fs_mount("stripe:2:s0.fs,s1.fs,s2.fs") == 0);
+    fs_create("f1");
+    fd = fs_open("f1");
+    assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    assert(fs_mount("stripe:2:s0.fs,s1.fs,s2.fs") == 0);
+    fd = fs_open("f1");
+    assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+    assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    assert(block_disk_remove("stripe:2:s0.fs,s1.fs,s2.fs") == 0);
+    assert(stat("s0.fs", &st) == -1);
+}
+
+void test_mirror()
+{
+    char msg[4 * BLOCK_SIZE_TEST], buf[4 * BLOCK_SIZE_TEST];
+    struct stat st, st2;
+    int fd;
+    
+    assert(fs_format("mirror:m0.fs,m1.fs", 100, 0) == 0);
+    assert(stat("m0.fs", &st) == 0 && stat("m1.fs", &st2) == 0);
+    assert(st.st_size == st2.st_size && st.st_size > 100 * BLOCK_SIZE_TEST);
+    assert(fs_mount("mirror:m0.fs,m1.fs") == 0);
+    fs_create("f1");
+    fd = fs_open("f1");
+    memset(msg, 'm', sizeof(msg));
+    assert(fs_write(fd, msg, sizeof(msg)) == sizeof(msg));
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    /* every replica holds the whole file system */
+    assert(block_mirror_resync("mirror:m0.fs,m1.fs") == 0);
+    assert(fs_mount("mirror:m1.fs") == 0);
+    fd = fs_open("f1");
+    assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+    assert(memcmp(buf, msg, sizeof(msg)) == 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    
+    /* a lost replica leaves the mirror degraded, and is rebuilt from the
+     * blocks in use only */
+    unlink("m1.fs");
+    assert(fs_mount("mirror:m0.fs,m1.fs") == 0);
+    fs_create("f2");
+    assert(fs_umount() == 0);
+    assert(block_mirror_resync("mirror:m0.fs,m1.fs") > 0);
+    assert(block_mirror_resync("mirror:m0.fs,m1.fs") == 0);
+    assert(fs_mount("mirror:m1.fs") == 0);
+    fd = fs_open("f1");
+    assert(fs_stat(fd) == sizeof(msg));
+    fs_close(fd);
+    assert((fd = fs_open("f2")) >= 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    
+    /* a replica that missed writes stays out once back, whatever its place
+     * in the mirror, and the others bring it up to date */
+    assert(rename("m1.fs", "m1.bak") == 0);
+    assert(fs_mount("mirror:m0.fs,m1.fs") == 0);
+    fs_create("f3");
+    assert(fs_umount() == 0);
+    assert(rename("m1.bak", "m1.fs") == 0);
+    for (int i = 0; i < 2; i++){
+        assert(fs_mount(i ? "mirror:m0.fs,m1.fs" : "mirror:m1.fs,m0.fs") == 0);
+        assert((fd = fs_open("f3")) >= 0);
+        fs_close(fd);
+        assert(fs_umount() == 0);
+    }
+    assert(block_mirror_resync("mirror:m1.fs,m0.fs") > 0);
+    assert(fs_mount("mirror:m1.fs") == 0);
+    assert((fd = fs_open("f3")) >= 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    
+    /* the replicas must agree on the size of the disk */
+    assert(block_disk_create("m1.fs", 10) == 0);
+    assert(block_disk_open("mirror:m0.fs,m1.fs") == -1);
+    assert(block_disk_open("mirror:none.fs") == -1);
+    assert(block_mirror_resync("m0.fs") == -1);
+    assert(block_disk_remove("mirror:m0.fs,m1.fs") == 0);
+    assert(stat("m1.fs", &st) == -1 && stat("m1.fs.gen", &st) == -1);
+}
+
+void test_block_queue()
+{
+    char blocks[3][BLOCK_SIZE_TEST], buf[3 * BLOCK_SIZE_TEST];
+    struct fs_stats stats;
+    int fd;
+    
+    assert(block_disk_create("queue.fs", 10) == 0);
+    assert(block_disk_open("queue.fs") == 0);
+    for(int i = 0; i < 3; i++)
+        memset(blocks[i], 'a' + i, BLOCK_SIZE_TEST);
+    /* requests out of order get sorted and merged, a request overlapping a
+     * queued one dispatches the queue first */
+    block_queue_plug();
+    assert(block_queue_set_policy(BLOCK_SCHED_FIFO) == -1);
+    assert(block_queue_write(5, 1, blocks[2]) == 0);
+    assert(block_queue_write(3, 1, blocks[0]) == 0);
+    assert(block_queue_write(4, 1, blocks[1]) == 0);
+    assert(block_queue_read(3, 3, buf) == 0);
+    assert(block_queue_write(4, 1, blocks[2]) == 0);
+    assert(block_queue_unplug() == 0);
+    assert(memcmp(buf, blocks, sizeof(buf)) == 0);
+    assert(block_read(4, buf) == 0);
+    assert(memcmp(buf, blocks[2], BLOCK_SIZE_TEST) == 0);
+    /* flushing dispatches the requests, the queue staying plugged */
+    block_queue_plug();
+    assert(block_queue_write(6, 1, blocks[1]) == 0);
+    assert(block_queue_flush() == 0);
+    assert(block_read(6, buf + BLOCK_SIZE_TEST) == 0);
+    assert(memcmp(buf + BLOCK_SIZE_TEST, blocks[1], BLOCK_SIZE_TEST) == 0);
+    assert(block_queue_write(7, 1, blocks[0]) == 0);
+    assert(block_read(7, buf + BLOCK_SIZE_TEST) == 0);
+    assert(memcmp(buf + BLOCK_SIZE_TEST, blocks[0], BLOCK_SIZE_TEST) != 0);
+    assert(block_queue_unplug() == 0);
+    block_queue_plug();
+    assert(block_queue_read(9, 2, buf) == 0);
+    assert(block_queue_unplug() == -1);
+    assert(block_queue_unplug() == -1);
+    assert(block_disk_close() == 0);
+    
+    assert(fs_format("queue.fs", 100, 0) == 0);
+    assert(fs_mount("queue.fs") == 0);
+    fs_create("f1");
+    fd = fs_open("f1");
+    assert(fs_write(fd, buf, sizeof(buf)) == sizeof(buf));
+    /* the super block, the FAT and the root directory go in one request */
+    assert(fs_sync() == 0);
+    if(fs_get_stats(&stats) == 0){
+        fs_reset_stats();
+        assert(fs_sync() == 0);
+        assert(fs_get_stats(&stats) == 0);
+        assert(stats.ops[FS_OP_SYNC].io_requests == 1);
+        assert(block_queue_set_policy(BLOCK_SCHED_NONE) == 0);
+        fs_reset_stats();
+        assert(fs_sync() == 0);
+        assert(fs_get_stats(&stats) == 0);
+        assert(stats.ops[FS_OP_SYNC].io_requests == 3);
+    }
+    assert(block_queue_set_policy(BLOCK_SCHED_FIFO) == 0);
+    fs_lseek(fd, 0);
+    memset(buf, 0, sizeof(buf));
+    assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+    assert(memcmp(buf, blocks[2], BLOCK_SIZE_TEST) == 0);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    assert(block_queue_set_policy(BLOCK_SCHED_SORT) == 0);
+    assert(block_queue_set_policy(3) == -1);
+}
+
+void test_stats()
+{
+    char buf[3 * BLOCK_SIZE_TEST];
+    struct fs_stats stats;
+    int fd;
+    
+    /* libfs built without statistics */
+    if (fs_get_stats(&stats) == -1)
+        return;
+    assert(fs_format("stats.fs", 100, 0) == 0);
+    assert(fs_mount("stats.fs") == 0);
+    fs_create("f1");
+    fd = fs_open("f1");
+    memset(buf, 'a', sizeof(buf));
+    assert(fs_write(fd, buf, sizeof(buf)) == sizeof(buf));
+    fs_sync();
+    fs_lseek(fd, 0);
+    
+    fs_reset_stats();
+    assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+    assert(fs_append(fd, "x", 1) == 1);
+    assert(fs_get_stats(&stats) == 0);
+    assert(stats.ops[FS_OP_READ].calls == 1);
+    assert(stats.ops[FS_OP_READ].bytes == sizeof(buf));
+    assert(stats.ops[FS_OP_READ].block_reads == 3);
+    assert(stats.ops[FS_OP_READ].io_requests == 1);
+    /* the fs_write() done by fs_append() is not counted apart */
+    assert(stats.ops[FS_OP_APPEND].calls == 1 && stats.ops[FS_OP_APPEND].bytes == 1);
+    assert(stats.ops[FS_OP_WRITE].calls == 0);
+    
+    uint64_t latencies = 0;
+    for (int i = 0; i < FS_STATS_BUCKETS; i++)
+        latencies += stats.ops[FS_OP_READ].latency[i];
+    assert(latencies == 1);
+    
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    assert(fs_get_stats(&stats) == 0);
+    assert(stats.ops[FS_OP_CLOSE].block_writes >= 1);
+    assert(stats.ops[FS_OP_UMOUNT].calls == 1);
+}
+
+/* every call gets recorded with its arguments and result */
+void test_trace()
+{
+    struct trace_header header;
+    struct trace_record rec;
+    char name[256];
+    int ops[] = { FS_OP_FORMAT, FS_OP_MOUNT, FS_OP_CREATE, FS_OP_OPEN,
+                  FS_OP_WRITE, FS_OP_CLOSE, FS_OP_UMOUNT };
+    FILE *trace;
+    int fd;
+    
+    /* libfs built without statistics */
+    if (fs_trace_start("trace.bin") == -1)
+        return;
+    /* a second trace does not touch its file */
+    assert(fs_trace_start("trace.bin") == -1);
+    unlink("trace2.bin");
+    assert(fs_trace_start("trace2.bin") == -1);
+    assert(access("trace2.bin", F_OK) == -1);
+    assert(fs_format("trace.fs", 100, 0) == 0);
+    assert(fs_mount("trace.fs") == 0);
+    fs_create("f1");
+    fd = fs_open("f1");
+    assert(fs_write(fd, "hello", 5) == 5);
+    fs_close(fd);
+    assert(fs_umount() == 0);
+    assert(fs_trace_stop() == 0);
+    assert(fs_trace_stop() == -1);
+    
+    trace = fopen("trace.bin", "rb");
+    assert(fread(&header, sizeof(header), 1, trace) == 1);
+    assert(memcmp(header.magic, TRACE_MAGIC, 8) == 0);
+    for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++){
+        assert(fread(&rec, sizeof(rec), 1, trace) == 1);
+        assert(fread(name, 1, rec.name_len, trace) == rec.name_len);
+        name[rec.name_len] = '\0';
+        assert(rec.op == ops[i]);
+        if (rec.op == FS_OP_MOUNT)
+            assert(rec.arg == 100 && !strcmp(name, "trace.fs"));
+        if (rec.op == FS_OP_OPEN)
+            assert(rec.ret == fd && !strcmp(name, "f1"));
+        if (rec.op == FS_OP_WRITE)
+            assert(rec.fd == fd && rec.arg == 5 && rec.ret == 5);
+    }
+    assert(fread(&rec, sizeof(rec), 1, trace) == 0);
+    fclose(trace);
+}
+
+/* clients of fsd share the file system it mounted, and can pipeline requests */
+struct durable_writer {
+    int fd;
+    char c;
+};
+
+void* durable_write(void *arg)
+{
+    struct durable_writer *w = arg;
+    char buf[64];
+    
+    memset(buf, w->c, sizeof(buf));
+    for (int i = 0; i < 20; i++)
+        assert(fs_write(w->fd, buf, sizeof(buf)) == sizeof(buf));
+    return NULL;
+}
+
+void test_durability(const char *diskname, unsigned int features)
+{
+    struct durable_writer writers[4];
+    pthread_t threads[4];
+    struct fs_stats stats;
+    char buf[4 * 20 * 64];
+    int fd, status, have_stats;
+    pid_t pid;
+    
+    assert(fs_set_durability(-1, FS_DURABLE_CLOSE) == -1);
+    assert(fs_set_sync_period(0) == -1);
+    assert(fs_format(diskname, 100, features) == 0);
+    assert(fs_mount(diskname) == 0);
+    assert(fs_set_durability(-1, -1) == -1);
+    assert(fs_set_durability(-1, FS_DURABLE_WRITE + 1) == -1);
+    assert(fs_set_durability(5, FS_DURABLE_CLOSE) == -1);
+    for (int i = 0; i < 4; i++){
+        sprintf(buf, "f%d", i);
+        assert(fs_create(buf) == 0);
+    }
+    
+    /* nothing is flushed until the file system is synced */
+    have_stats = (fs_get_stats(&stats) == 0);
+    fs_reset_stats();
+    fd = fs_open("f0");
+    assert(fs_write(fd, "abc", 3) == 3);
+    assert(fs_close(fd) == 0);
+    if (have_stats && !(features & FS_FEATURE_JOURNAL)){
+        assert(fs_get_stats(&stats) == 0);
+        assert(stats.disk_syncs == 0);
+    }
+    /* a file written to is flushed when closed, only then */
+    fd = fs_open("f1");
+    assert(fs_set_durability(fd, FS_DURABLE_CLOSE) == 0);
+    assert(fs_write(fd, "abc", 3) == 3);
+    fs_reset_stats();
+    assert(fs_close(fd) == 0);
+    if (have_stats){
+        assert(fs_get_stats(&stats) == 0);
+        assert(stats.disk_syncs >= 1);
+    }
+    fd = fs_open("f1");
+    assert(fs_set_durability(fd, FS_DURABLE_CLOSE) == 0);
+    assert(fs_read(fd, buf, 3) == 3);
+    fs_reset_stats();
+    assert(fs_close(fd) == 0);
+    if (have_stats){
+        assert(fs_get_stats(&stats) == 0);
+        assert(stats.disk_syncs == 0);
+    }
+    /* a file written to is flushed within a sync period */
+    assert(fs_set_sync_period(50) == 0);
+    fd = fs_open("f2");
+    assert(fs_set_durability(fd, FS_DURABLE_PERIODIC) == 0);
+    fs_reset_stats();
+    assert(fs_write(fd, "abc", 3) == 3);
+    usleep(300 * 1000);
+    if (have_stats){
+        assert(fs_get_stats(&stats) == 0);
+        assert(stats.disk_syncs >= 1);
+    }
+    assert(fs_close(fd) == 0);
+    assert(fs_set_sync_period(1000) == 0);
+    
+    /* the writes of several threads share the flushes of the disk */
+    assert(fs_set_durability(-1, FS_DURABLE_WRITE) == 0);
+    fd = fs_open("f3");
+    fs_reset_stats();
+    for (int i = 0; i < 4; i++){
+        writers[i].fd = fd;
+        writers[i].c = 'a' + i;
+        assert(pthread_create(&threads[i], NULL, durable_write, &writers[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++)
+        assert(pthread_join(threads[i], NULL) == 0);
+    if (have_stats){
+        assert(fs_get_stats(&stats) == 0);
+        assert(stats.disk_syncs >= 1 && stats.disk_syncs <= 4 * 20 * ((features & FS_FEATURE_JOURNAL) ? 3 : 1));
+    }
+    assert(fs_stat(fd) == sizeof(buf));
+    assert(fs_close(fd) == 0);
+    
+    /* a write that returned is not lost in a crash */
+    assert(fs_umount() == 0);
+    pid = fork();
+    if (!pid){
+        assert(fs_mount(diskname) == 0);
+        assert(fs_set_durability(-1, FS_DURABLE_WRITE) == 0);
+        fd = fs_open("f0");
+        assert(fs_lseek(fd, 3) == 0);
+        assert(fs_write(fd, "def", 3) == 3);
+        _exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(fs_mount(diskname) == 0);
+    fd = fs_open("f0");
+    assert(fs_read(fd, buf, sizeof(buf)) == 6);
+    assert(memcmp(buf, "abcdef", 6) == 0);
+    assert(fs_close(fd) == 0);
+    assert(fs_umount() == 0);
+}
+
+void* handle_worker(void *arg)
+{
+    char diskname[16], buf[3 * BLOCK_SIZE_TEST], msg[sizeof(buf)];
+    int id = (int)(long)arg;
+    fs_t fs;
+    int fd;
+    
+    sprintf(diskname, "mem:handle%d", id);
+    assert(fs_format(diskname, 100, (id % 2) ? FS_FEATURE_JOURNAL : 0) == 0);
+    fs = fs_mount_r(diskname);
+    assert(fs);
+    /* some of the file systems have a flusher of their own */
+    if (id % 4 < 2)
+        assert(fs_set_durability_r(fs, -1, FS_DURABLE_CLOSE) == 0);
+    for (int i = 0; i < 20; i++){
+        sprintf(buf, "f%d", i);
+        assert(fs_create_r(fs, buf) == 0);
+        fd = fs_open_r(fs, buf);
+        memset(msg, id * 20 + i, sizeof(msg));
+        assert(fs_write_r(fs, fd, msg, sizeof(msg)) == sizeof(msg));
+        assert(fs_close_r(fs, fd) == 0);
+    }
+    assert(fs_umount_r(fs) == 0);
+    
+    fs = fs_mount_r(diskname);
+    assert(fs);
+    for (int i = 0; i < 20; i++){
+        sprintf(buf, "f%d", i);
+        fd = fs_open_r(fs, buf);
+        assert(fs_stat_r(fs, fd) == sizeof(msg));
+        assert(fs_read_r(fs, fd, buf, sizeof(buf)) == sizeof(buf));
+        memset(msg, id * 20 + i, sizeof(msg));
+        assert(memcmp(buf, msg, sizeof(msg)) == 0);
+        assert(fs_close_r(fs, fd) == 0);
+    }
+    assert(fs_umount_r(fs) == 0);
+    assert(block_ram_disk_free(diskname) == 0);
+    return NULL;
+}
+
+void test_handles()
+{
+    pthread_t threads[8];
+    fs_t fs, fs2;
+    int fd;
+    
+    assert(fs_mount_r("nodisk.fs") == NULL);
+    assert(fs_umount_r(NULL) == -1);
+    
+    /* a handle works along with the default file system */
+    assert(fs_format("mem:handles", 100, 0) == 0);
+    assert(fs_format("handles.fs", 100, 0) == 0);
+    fs = fs_mount_r("mem:handles");
+    assert(fs);
+    assert(fs_mount_r("mem:handles") == NULL);
+    assert(fs_mount("handles.fs") == 0);
+    assert(fs_create_r(fs, "f1") == 0);
+    assert(fs_create("f2") == 0);
+    fd = fs_open_r(fs, "f1");
+    assert(fd >= 0);
+    assert(fs_open("f1") == -1);
+    assert(fs_umount_r(fs) == -1);
+    assert(fs_close_r(fs, fd) == 0);
+    assert(fs_umount() == 0);
+    fs2 = fs_mount_r("handles.fs");
+    assert(fs2);
+    assert(fs_open_r(fs2, "f1") == -1);
+    assert(fs_umount_r(fs2) == 0);
+    assert(fs_umount_r(fs) == 0);
+    assert(block_ram_disk_free("mem:handles") == 0);
+    
+    /* the file systems of different threads */
+    for (long i = 0; i < 8; i++)
+        assert(pthread_create(&threads[i], NULL, handle_worker, (void *)i) == 0);
+    for (int i = 0; i < 8; i++)
+        assert(pthread_join(threads[i], NULL) == 0);
+}
+
+void test_shared(const char *diskname, unsigned int features)
+{
+    char buf[8192], data[8192];
+    char filename[16];
+    pid_t pids[4];
+    int fd, status;
+    fs_t fs;
+    
+    assert(fs_mount_shared_r("mem:shared") == NULL);
+    assert(fs_format(diskname, 200, features) == 0);
+    fs = fs_mount_shared_r(diskname);
+    assert(fs);
+    assert(fs_create_r(fs, "p") == 0);
+    fd = fs_open_r(fs, "p");
+    assert(fd >= 0);
+    memset(data, 'p', sizeof(data));
+    assert(fs_write_r(fs, fd, data, 5000) == 5000);
+    
+    /* the processes see the files of each other, and cannot delete the ones
+     * open elsewhere */
+    for (int i = 0; i < 4; i++){
+        pids[i] = fork();
+        if (pids[i])
+            continue;
+        fs_t child = fs_mount_shared_r(diskname);
+        assert(child);
+        int pfd = fs_open_r(child, "p");
+        assert(pfd >= 0);
+        assert(fs_read_r(child, pfd, buf, sizeof(buf)) == 5000);
+        assert(memcmp(buf, data, 5000) == 0);
+        assert(fs_close_r(child, pfd) == 0);
+        assert(fs_delete_r(child, "p") == -1);
+        
+        sprintf(filename, "c%d", i);
+        assert(fs_create_r(child, filename) == 0);
+        int cfd = fs_open_r(child, filename);
+        assert(cfd >= 0);
+        memset(buf, 'a' + i, sizeof(buf));
+        for (int j = 0; j < 10; j++)
+            assert(fs_append_r(child, cfd, buf, 1000 + i) == 1000 + i);
+        assert(fs_close_r(child, cfd) == 0);
+        assert(fs_umount_r(child) == 0);
+        _exit(0);
+    }
+    for (int i = 0; i < 4; i++){
+        assert(waitpid(pids[i], &status, 0) == pids[i]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    
+    for (int i = 0; i < 4; i++){
+        sprintf(filename, "c%d", i);
+        int cfd = fs_open_r(fs, filename);
+        assert(cfd >= 0);
+        assert(fs_stat_r(fs, cfd) == 10 * (1000 + i));
+        assert(fs_lseek_r(fs, cfd, 9 * (1000 + i)) == 0);
+        assert(fs_read_r(fs, cfd, buf, sizeof(buf)) == 1000 + i);
+        memset(data, 'a' + i, 1000 + i);
+        assert(memcmp(buf, data, 1000 + i) == 0);
+        assert(fs_close_r(fs, cfd) == 0);
+    }
+    assert(fs_close_r(fs, fd) == 0);
+    assert(fs_delete_r(fs, "c0") == 0);
+    assert(fs_umount_r(fs) == 0);
+    
+    /* the metadata was written back by the last process */
+    assert(fs_mount(diskname) == 0);
+    assert(fs_open("c0") == -1);
+    fd = fs_open("c3");
+    assert(fd >= 0);
+    assert(fs_stat(fd) == 10 * 1003);
+    assert(fs_close(fd) == 0);
+    assert(fs_umount() == 0);
+}
+
+/* completion callback of test_async(), counting the requests done */
+pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+int async_done;
+
+void async_callback(struct fs_aio *req)
+{
+    pthread_mutex_lock(&async_lock);
+    async_done++;
+    pthread_cond_signal(&async_cond);
+    pthread_mutex_unlock(&async_lock);
+}
+
+void test_async()
+{
+    static char data[4][8 * BLOCK_SIZE_TEST], buf[4][8 * BLOCK_SIZE_TEST];
+    struct fs_aio reqs[4][8], *done[32];
+    struct pollfd pfd;
+    fs_aio_queue_t queue;
+    int fds[4], count = 0;
+    char filename[16];
+    fs_t fs;
+    
+    assert(fs_aio_queue_new(0) == NULL);
+    assert(fs_read_async(NULL, &reqs[0][0]) == -1);
+    assert(fs_aio_reap(NULL, done, 32) == -1);
+    assert(fs_format("mem:async", 200, FS_FEATURE_JOURNAL) == 0);
+    fs = fs_mount_r("mem:async");
+    assert(fs);
+    queue = fs_aio_queue_new(3);
+    assert(queue);
+    
+    /* the writes complete through the callback, out of order across files
+     * but in order on each file descriptor */
+    for (int i = 0; i < 4; i++){
+        sprintf(filename, "a%d", i);
+        assert(fs_create_r(fs, filename) == 0);
+        fds[i] = fs_open_r(fs, filename);
+        for (int j = 0; j < 8; j++){
+            memset(data[i] + j * BLOCK_SIZE_TEST, 'a' + i * 8 + j, BLOCK_SIZE_TEST);
+            reqs[i][j] = (struct fs_aio){ .fs = fs, .fd = fds[i], .buf = data[i] + j * BLOCK_SIZE_TEST,
+                                          .count = BLOCK_SIZE_TEST, .offset = j * BLOCK_SIZE_TEST, .done = async_callback };
+            assert(fs_write_async(queue, &reqs[i][j]) == 0);
+        }
+    }
+    pthread_mutex_lock(&async_lock);
+    while (async_done < 32)
+        pthread_cond_wait(&async_cond, &async_lock);
+    pthread_mutex_unlock(&async_lock);
+    for (int i = 0; i < 4; i++){
+        assert(fs_stat_r(fs, fds[i]) == sizeof(data[i]));
+        for (int j = 0; j < 8; j++)
+            assert(reqs[i][j].ret == BLOCK_SIZE_TEST);
+    }
+    
+    /* the reads complete through the eventfd of the queue */
+    pfd.fd = fs_aio_queue_fd(queue);
+    pfd.events = POLLIN;
+    assert(poll(&pfd, 1, 0) == 0);
+    for (int i = 0; i < 4; i++){
+        for (int j = 0; j < 8; j++){
+            reqs[i][j] = (struct fs_aio){ .fs = fs, .fd = fds[i], .buf = buf[i] + j * BLOCK_SIZE_TEST,
+                                          .count = BLOCK_SIZE_TEST, .offset = j * BLOCK_SIZE_TEST };
+            assert(fs_read_async(queue, &reqs[i][j]) == 0);
+        }
+    }
+    while (count < 32){
+        assert(poll(&pfd, 1, 10000) == 1);
+        int ret = fs_aio_reap(queue, done + count, 32 - count);
+        assert(ret >= 0);
+        count += ret;
+    }
+    assert(poll(&pfd, 1, 0) == 0);
+    assert(fs_aio_reap(queue, done, 32) == 0);
+    for (int i = 0; i < 4; i++){
+        assert(memcmp(buf[i], data[i], sizeof(buf[i])) == 0);
+        for (int j = 0; j < 8; j++)
+            assert(reqs[i][j].ret == BLOCK_SIZE_TEST);
+    }
+    
+    /* the requests that fail complete all the same */
+    reqs[0][0] = (struct fs_aio){ .fs = fs, .fd = fds[0], .buf = buf[0], .count = 1, .offset = sizeof(data[0]) + 1 };
+    reqs[0][1] = (struct fs_aio){ .fs = fs, .fd = 42, .buf = buf[0], .count = 1 };
+    assert(fs_read_async(queue, &reqs[0][0]) == 0);
+    assert(fs_read_async(queue, &reqs[0][1]) == 0);
+    assert(fs_aio_queue_free(queue) == 0);
+    assert(reqs[0][0].ret == -1 && reqs[0][1].ret == -1);
+    
+    for (int i = 0; i < 4; i++)
+        assert(fs_close_r(fs, fds[i]) == 0);
+    assert(fs_umount_r(fs) == 0);
+    assert(block_ram_disk_free("mem:async") == 0);
+}
+
+void test_fsd()
+{
+    struct fsd_request reqs[4];
+    char buf[100];
+    int conn1 = -1, conn2, fd1, fd2;
+    pid_t pid;
+    
+    assert(fs_format("fsd.fs", 100, 0) == 0);
+    pid = fork();
+    if (!pid){
+        execl("./fsd.x", "fsd.x", "-w", "2", "fsd.fs", "fsd.sock", NULL);
+        exit(1);
+    }
+    for (int i = 0; i < 100 && conn1 < 0; i++){
+        usleep(10000);
+        conn1 = fsd_connect("fsd.sock");
+    }
+    assert(conn1 >= 0);
+    conn2 = fsd_connect("fsd.sock");
+    assert(conn2 >= 0);
+    
+    assert(fsd_create(conn1, "f1") == 0);
+    fd1 = fsd_open(conn1, "f1");
+    assert(fd1 >= 0);
+    reqs[0] = (struct fsd_request){ .op = FS_OP_WRITE, .fd = fd1, .buf = "hello world", .count = 11 };
+    reqs[1] = (struct fsd_request){ .op = FS_OP_STAT, .fd = fd1 };
+    reqs[2] = (struct fsd_request){ .op = FS_OP_LSEEK, .fd = fd1, .count = 6 };
+    reqs[3] = (struct fsd_request){ .op = FS_OP_READ, .fd = fd1, .buf = buf, .count = sizeof(buf) };
+    assert(fsd_submit(conn1, reqs, 4) == 0);
+    assert(reqs[0].ret == 11 && reqs[1].ret == 11 && reqs[2].ret == 0);
+    assert(reqs[3].ret == 5 && memcmp(buf, "world", 5) == 0);
+    
+    /* file descriptors belong to the connection that opened them */
+    assert(fsd_stat(conn2, fd1) == -1);
+    fd2 = fsd_open(conn2, "f1");
+    assert(fd2 >= 0 && fd2 != fd1);
+    assert(fsd_read(conn2, fd2, buf, sizeof(buf)) == 11);
+    assert(fsd_delete(conn2, "f1") == -1);
+    /* the files of a client are closed when it goes away */
+    fsd_disconnect(conn2);
+    assert(fsd_close(conn1, fd1) == 0);
+    usleep(10000);
+    assert(fsd_delete(conn1, "f1") == 0);
+    assert(fsd_create(conn1, "f2") == 0);
+    fsd_disconnect(conn1);
+    
+    kill(pid, SIGTERM);
+    assert(waitpid(pid, NULL, 0) == pid);
+    assert(fs_mount("fsd.fs") == 0);
+    assert(fs_open("f1") == -1);
+    fd1 = fs_open("f2");
+    assert(fd1 >= 0);
+    fs_close(fd1);
+    assert(fs_umount() == 0);
+}
+
 int main()
 {
+    test_fragments();
+    test_delayed_allocation();
+    test_extents();
+    test_append();
+    test_append_reused_entry();
+    test_defrag("defrag.fs", 0);
+    test_defrag("defrag_extent.fs", FS_FEATURE_EXTENTS);
+    test_defrag("defrag_journal.fs", FS_FEATURE_EXTENTS | FS_FEATURE_JOURNAL);
+    test_preallocate("preallocate.fs");
+    test_snapshot("snapshot.fs", 0);
+    test_snapshot("snapshot_extent.fs", FS_FEATURE_EXTENTS | FS_FEATURE_FRAGMENTS);
+    test_changes("changes.fs");
+    test_journal("journal.fs", 0);
+    test_journal("journal_extent.fs", FS_FEATURE_EXTENTS | FS_FEATURE_FRAGMENTS);
+    test_ram_disk();
+    test_stripe();
+    test_mirror();
+    test_block_queue();
+    test_block_size("bs64k.fs", 64 * 1024, 0);
+    test_block_size("bs1m.fs", 1024 * 1024, FS_FEATURE_FRAGMENTS | FS_FEATURE_EXTENTS);
+    test_stats();
+    test_trace();
+    test_durability("durable.fs", 0);
+    test_durability("durable_journal.fs", FS_FEATURE_JOURNAL);
+    test_fsd();
+    test_handles();
+    test_shared("shared.fs", 0);
+    test_shared("shared_journal.fs", FS_FEATURE_JOURNAL | FS_FEATURE_EXTENTS | FS_FEATURE_FRAGMENTS);
+    test_async();
     test_basic();
     test_diff_offset_read_write();
 	test_max_open();